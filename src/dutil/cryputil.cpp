@@ -17,6 +17,9 @@
 #define CrypExitOnWin32Error(e, x, s, ...) ExitOnWin32ErrorSource(DUTIL_SOURCE_CRYPUTIL, e, x, s, __VA_ARGS__)
 #define CrypExitOnGdipFailure(g, x, s, ...) ExitOnGdipFailureSource(DUTIL_SOURCE_CRYPUTIL, g, x, s, __VA_ARGS__)
 
+// Files are hashed through a mapped view of this size at a time, so any size of file can be hashed
+const SIZE_T CRYP_HASH_FILE_WINDOW = 4 * 1024 * 1024;
+
 static PFN_RTLENCRYPTMEMORY vpfnRtlEncryptMemory = NULL;
 static PFN_RTLDECRYPTMEMORY vpfnRtlDecryptMemory = NULL;
 static PFN_CRYPTPROTECTMEMORY vpfnCryptProtectMemory = NULL;
@@ -26,6 +29,57 @@ static HMODULE vhAdvApi32Dll = NULL;
 static HMODULE vhCrypt32Dll = NULL;
 static BOOL vfCrypInitialized = FALSE;
 
+// Returns the next block of data to hash, which is empty at the end of the data
+typedef HRESULT (*PFN_CRYP_HASH_NEXT_BLOCK)(
+    __in LPVOID pvContext,
+    __deref_out_bcount(*pcbBlock) const BYTE** ppbBlock,
+    __out DWORD* pcbBlock
+    );
+
+struct CRYP_HASH_FILE_MAP
+{
+    FILE_MAP* pMap;
+    DWORD64 qwOffset;
+};
+
+struct CRYP_HASH_FILE_HANDLE
+{
+    HANDLE hFile;
+    BYTE rgbBuffer[4096];
+};
+
+struct CRYP_HASH_BUFFER
+{
+    const BYTE* pbBuffer;
+    SIZE_T cbBuffer;
+};
+
+// internal function declarations
+
+static HRESULT HashBlocks(
+    __in DWORD dwProvType,
+    __in ALG_ID algid,
+    __in PFN_CRYP_HASH_NEXT_BLOCK pfnNextBlock,
+    __in LPVOID pvContext,
+    __out_bcount(cbHash) BYTE* pbHash,
+    __in DWORD cbHash
+    );
+static HRESULT NextMappedBlock(
+    __in LPVOID pvContext,
+    __deref_out_bcount(*pcbBlock) const BYTE** ppbBlock,
+    __out DWORD* pcbBlock
+    );
+static HRESULT NextReadBlock(
+    __in LPVOID pvContext,
+    __deref_out_bcount(*pcbBlock) const BYTE** ppbBlock,
+    __out DWORD* pcbBlock
+    );
+static HRESULT NextBufferBlock(
+    __in LPVOID pvContext,
+    __deref_out_bcount(*pcbBlock) const BYTE** ppbBlock,
+    __out DWORD* pcbBlock
+    );
+
 // function definitions
 
 /********************************************************************
@@ -185,20 +239,23 @@ extern "C" HRESULT DAPI CrypHashFile(
     )
 {
     HRESULT hr = S_OK;
-    HANDLE hFile = INVALID_HANDLE_VALUE;
+    FILE_MAP map = { };
+    CRYP_HASH_FILE_MAP context = { &map };
 
-    // open input file
-    hFile = ::CreateFileW(wzFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-    if (INVALID_HANDLE_VALUE == hFile)
-    {
-        CrypExitWithLastError(hr, "Failed to open input file.");
-    }
+    // map input file, which is hashed where it is mapped instead of being read into a buffer
+    hr = FileMap(wzFilePath, FALSE, CRYP_HASH_FILE_WINDOW, &map);
+    CrypExitOnFailure(hr, "Failed to open input file: %ls", wzFilePath);
 
-    hr = CrypHashFileHandle(hFile, dwProvType, algid, pbHash, cbHash, pqwBytesHashed);
+    hr = HashBlocks(dwProvType, algid, NextMappedBlock, &context, pbHash, cbHash);
     CrypExitOnFailure(hr, "Failed to hash file: %ls", wzFilePath);
 
+    if (pqwBytesHashed)
+    {
+        *pqwBytesHashed = context.qwOffset;
+    }
+
 LExit:
-    ReleaseFileHandle(hFile);
+    FileUnmap(&map);
 
     return hr;
 }
@@ -214,49 +271,11 @@ extern "C" HRESULT DAPI CrypHashFileHandle(
     )
 {
     HRESULT hr = S_OK;
-    HCRYPTPROV hProv = NULL;
-    HCRYPTHASH hHash = NULL;
-    DWORD cbRead = 0;
-    BYTE rgbBuffer[4096] = { };
+    CRYP_HASH_FILE_HANDLE context = { hFile };
     const LARGE_INTEGER liZero = { };
 
-    // get handle to the crypto provider
-    if (!::CryptAcquireContextW(&hProv, NULL, NULL, dwProvType, CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
-    {
-        CrypExitWithLastError(hr, "Failed to acquire crypto context.");
-    }
-
-    // initiate hash
-    if (!::CryptCreateHash(hProv, algid, 0, 0, &hHash))
-    {
-        CrypExitWithLastError(hr, "Failed to initiate hash.");
-    }
-
-    for (;;)
-    {
-        // read data block
-        if (!::ReadFile(hFile, rgbBuffer, sizeof(rgbBuffer), &cbRead, NULL))
-        {
-            CrypExitWithLastError(hr, "Failed to read data block.");
-        }
-
-        if (!cbRead)
-        {
-            break; // end of file
-        }
-
-        // hash data block
-        if (!::CryptHashData(hHash, rgbBuffer, cbRead, 0))
-        {
-            CrypExitWithLastError(hr, "Failed to hash data block.");
-        }
-    }
-
-    // get hash value
-    if (!::CryptGetHashParam(hHash, HP_HASHVAL, pbHash, &cbHash, 0))
-    {
-        CrypExitWithLastError(hr, "Failed to get hash value.");
-    }
+    hr = HashBlocks(dwProvType, algid, NextReadBlock, &context, pbHash, cbHash);
+    CrypExitOnFailure(hr, "Failed to hash file.");
 
     if (pqwBytesHashed)
     {
@@ -267,15 +286,6 @@ extern "C" HRESULT DAPI CrypHashFileHandle(
     }
 
 LExit:
-    if (hHash)
-    {
-        ::CryptDestroyHash(hHash);
-    }
-    if (hProv)
-    {
-        ::CryptReleaseContext(hProv, 0);
-    }
-
     return hr;
 }
 
@@ -288,44 +298,9 @@ HRESULT DAPI CrypHashBuffer(
     __in DWORD cbHash
     )
 {
-    HRESULT hr = S_OK;
-    HCRYPTPROV hProv = NULL;
-    HCRYPTHASH hHash = NULL;
-
-    // get handle to the crypto provider
-    if (!::CryptAcquireContextW(&hProv, NULL, NULL, dwProvType, CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
-    {
-        CrypExitWithLastError(hr, "Failed to acquire crypto context.");
-    }
+    CRYP_HASH_BUFFER context = { pbBuffer, cbBuffer };
 
-    // initiate hash
-    if (!::CryptCreateHash(hProv, algid, 0, 0, &hHash))
-    {
-        CrypExitWithLastError(hr, "Failed to initiate hash.");
-    }
-
-    if (!::CryptHashData(hHash, pbBuffer, static_cast<DWORD>(cbBuffer), 0))
-    {
-        CrypExitWithLastError(hr, "Failed to hash data.");
-    }
-
-    // get hash value
-    if (!::CryptGetHashParam(hHash, HP_HASHVAL, pbHash, &cbHash, 0))
-    {
-        CrypExitWithLastError(hr, "Failed to get hash value.");
-    }
-
-LExit:
-    if (hHash)
-    {
-        ::CryptDestroyHash(hHash);
-    }
-    if (hProv)
-    {
-        ::CryptReleaseContext(hProv, 0);
-    }
-
-    return hr;
+    return HashBlocks(dwProvType, algid, NextBufferBlock, &context, pbHash, cbHash);
 }
 
 HRESULT DAPI CrypEncryptMemory(
@@ -392,3 +367,144 @@ LExit:
     return hr;
 }
 
+
+// internal function definitions
+
+static HRESULT HashBlocks(
+    __in DWORD dwProvType,
+    __in ALG_ID algid,
+    __in PFN_CRYP_HASH_NEXT_BLOCK pfnNextBlock,
+    __in LPVOID pvContext,
+    __out_bcount(cbHash) BYTE* pbHash,
+    __in DWORD cbHash
+    )
+{
+    HRESULT hr = S_OK;
+    HCRYPTPROV hProv = NULL;
+    HCRYPTHASH hHash = NULL;
+    const BYTE* pbBlock = NULL;
+    DWORD cbBlock = 0;
+    BOOL fHashed = FALSE;
+
+    // get handle to the crypto provider
+    if (!::CryptAcquireContextW(&hProv, NULL, NULL, dwProvType, CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
+    {
+        CrypExitWithLastError(hr, "Failed to acquire crypto context.");
+    }
+
+    // initiate hash
+    if (!::CryptCreateHash(hProv, algid, 0, 0, &hHash))
+    {
+        CrypExitWithLastError(hr, "Failed to initiate hash.");
+    }
+
+    for (;;)
+    {
+        // get data block
+        hr = pfnNextBlock(pvContext, &pbBlock, &cbBlock);
+        CrypExitOnFailure(hr, "Failed to get data block to hash.");
+
+        if (!cbBlock)
+        {
+            break; // end of data
+        }
+
+        // hash data block, which may be a mapped view that fails to page in
+        __try
+        {
+            fHashed = ::CryptHashData(hHash, pbBlock, cbBlock, 0);
+        }
+        __except (FileMapExceptionFilter(GetExceptionInformation(), &hr))
+        {
+        }
+        CrypExitOnFailure(hr, "Failed to read data block.");
+
+        if (!fHashed)
+        {
+            CrypExitWithLastError(hr, "Failed to hash data block.");
+        }
+    }
+
+    // get hash value
+    if (!::CryptGetHashParam(hHash, HP_HASHVAL, pbHash, &cbHash, 0))
+    {
+        CrypExitWithLastError(hr, "Failed to get hash value.");
+    }
+
+LExit:
+    if (hHash)
+    {
+        ::CryptDestroyHash(hHash);
+    }
+    if (hProv)
+    {
+        ::CryptReleaseContext(hProv, 0);
+    }
+
+    return hr;
+}
+
+static HRESULT NextMappedBlock(
+    __in LPVOID pvContext,
+    __deref_out_bcount(*pcbBlock) const BYTE** ppbBlock,
+    __out DWORD* pcbBlock
+    )
+{
+    HRESULT hr = S_OK;
+    CRYP_HASH_FILE_MAP* pContext = static_cast<CRYP_HASH_FILE_MAP*>(pvContext);
+    LPBYTE pbData = NULL;
+    SIZE_T cbData = 0;
+
+    // map data block, which is no bigger than the window
+    hr = FileMapView(pContext->pMap, pContext->qwOffset, &pbData, &cbData);
+    CrypExitOnFailure(hr, "Failed to map data block at offset %llu.", pContext->qwOffset);
+
+    *ppbBlock = pbData;
+    *pcbBlock = static_cast<DWORD>(cbData);
+
+    pContext->qwOffset += cbData;
+
+LExit:
+    return hr;
+}
+
+static HRESULT NextReadBlock(
+    __in LPVOID pvContext,
+    __deref_out_bcount(*pcbBlock) const BYTE** ppbBlock,
+    __out DWORD* pcbBlock
+    )
+{
+    HRESULT hr = S_OK;
+    CRYP_HASH_FILE_HANDLE* pContext = static_cast<CRYP_HASH_FILE_HANDLE*>(pvContext);
+
+    // read data block
+    if (!::ReadFile(pContext->hFile, pContext->rgbBuffer, sizeof(pContext->rgbBuffer), pcbBlock, NULL))
+    {
+        CrypExitWithLastError(hr, "Failed to read data block.");
+    }
+
+    *ppbBlock = pContext->rgbBuffer;
+
+LExit:
+    return hr;
+}
+
+static HRESULT NextBufferBlock(
+    __in LPVOID pvContext,
+    __deref_out_bcount(*pcbBlock) const BYTE** ppbBlock,
+    __out DWORD* pcbBlock
+    )
+{
+    CRYP_HASH_BUFFER* pContext = static_cast<CRYP_HASH_BUFFER*>(pvContext);
+
+    // CryptHashData() takes a DWORD size, so a bigger buffer is hashed in pieces
+    DWORD cbBlock = (pContext->cbBuffer > DWORD_MAX) ? DWORD_MAX : static_cast<DWORD>(pContext->cbBuffer);
+
+    *ppbBlock = pContext->pbBuffer;
+    *pcbBlock = cbBlock;
+
+    pContext->pbBuffer += cbBlock;
+    pContext->cbBuffer -= cbBlock;
+
+    return S_OK;
+}
@@ -17,24 +17,30 @@
 #define DictExitOnWin32Error(e, x, s, ...) ExitOnWin32ErrorSource(DUTIL_SOURCE_DICTUTIL, e, x, s, __VA_ARGS__)
 #define DictExitOnGdipFailure(g, x, s, ...) ExitOnGdipFailureSource(DUTIL_SOURCE_DICTUTIL, g, x, s, __VA_ARGS__)
 
-// These should all be primes, and spaced reasonably apart (currently each is about 4x the last)
-const DWORD MAX_BUCKET_SIZES[] = {
-    503,
-    2017,
-    7937,
-    32779,
-    131111,
-    524341,
-    2097709,
-    8390857,
-    33563437,
-    134253719,
-    537014927,
-    2148059509
-    };
-
-// However many items are in the cab, let's keep the buckets at least 8 times that to avoid collisions
-#define MAX_BUCKETS_TO_ITEMS_RATIO 8
+// Slot counts are always a power of two, so a hash can be turned into a slot index with a mask
+#define DICT_MIN_SLOTS 64
+#define DICT_MAX_SLOTS 0x80000000
+
+// Keep at least twice as many slots as items, so linear probe sequences stay short
+#define DICT_SLOTS_TO_ITEMS_RATIO 2
+
+// With DICT_FLAG_INCREMENTAL_RESIZE, the number of old slots migrated by each add. Growing is triggered
+// after (slots / 2) adds and the next grow can't happen for another (slots / 2) adds, so anything
+// above 2 guarantees a migration finishes before the next one has to start.
+#define DICT_MIGRATE_SLOTS_PER_ADD 16
+
+// Case-insensitive keys are folded to upper-case one character at a time. ASCII is folded
+// inline, everything else goes through a table built once from LCMapStringW(LCMAP_UPPERCASE)
+// so hashing and comparing never allocates.
+enum DICT_FOLD_TABLE_STATE
+{
+    DICT_FOLD_TABLE_NONE = 0,
+    DICT_FOLD_TABLE_BUILDING = 1,
+    DICT_FOLD_TABLE_READY = 2
+};
+
+static volatile LONG vlFoldTableState = DICT_FOLD_TABLE_NONE;
+static WCHAR vrgwchFoldTable[0x10000];
 
 enum DICT_TYPE
 {
@@ -43,6 +49,32 @@ enum DICT_TYPE
     DICT_STRING_LIST = 2
 };
 
+struct DICT_SLOT
+{
+    // Full hash of the key, cached so most probes are rejected without touching the key
+    DWORD dwHash;
+
+    // Length of the key in characters, also checked before the key itself is compared
+    DWORD cchKey;
+
+    // The stored value (or offset - see TranslateValueToOffset()), NULL if the slot is empty
+    void *pvValue;
+};
+
+struct DICT_TABLE
+{
+    // Number of slots in the table (always a power of two)
+    DWORD cSlots;
+
+    // For concurrent dictionaries, the smaller table this one replaced. Readers may still be
+    // probing it, so it is only freed by DictDestroy(). All retired tables together are never
+    // larger than the current one.
+    DICT_TABLE *pRetiredTable;
+
+    // The actual stored slots, probed linearly from the slot the hash points at
+    DICT_SLOT rgSlots[1];
+};
+
 struct STRINGDICT_STRUCT
 {
     DICT_TYPE dtType;
@@ -50,21 +82,28 @@ struct STRINGDICT_STRUCT
     // Optional flags to control the behavior of the dictionary.
     DICT_FLAG dfFlags;
 
-    // Index into MAX_BUCKET_SIZES (array of primes), representing number of buckets we've allocated
-    DWORD dwBucketSizeIndex;
+    // Created by one of the DictCreate*Concurrent() functions
+    BOOL fConcurrent;
+
+    // Serializes adds to concurrent dictionaries - lookups never take it
+    CRITICAL_SECTION csAdd;
 
-    // Number of items currently stored in the dict buckets
+    // Number of items currently stored in the dict slots
     DWORD dwNumItems;
 
-    // Byte offset of key within bucket value, for collision checking - see
+    // Byte offset of key within the value, for collision checking - see
     // comments above DictCreateEmbeddedKey() implementation for further details
     size_t cByteOffset;
 
-    // The actual stored buckets
-    void **ppvBuckets;
+    // The current table. Concurrent dictionaries only ever swap in a completely filled table, so
+    // lookups read this pointer once and then work with a consistent table.
+    DICT_TABLE * volatile pTable;
 
-    // The actual stored items in the order they were added (used for auto freeing or enumerating)
-    void **ppvItemList;
+    // While an incremental resize is in progress, the table from before the dictionary grew.
+    // Nothing is added to it anymore, each add copies a few more of its slots into pTable, and
+    // lookups fall back to it. Freed once dwMigrateIndex reaches its slot count.
+    DICT_TABLE *pOldTable;
+    DWORD dwMigrateIndex;
 
     // Pointer to the array of items, so the caller is free to resize the array of values out from under us without harm
     void **ppvValueArray;
@@ -72,43 +111,75 @@ struct STRINGDICT_STRUCT
 
 const int STRINGDICT_HANDLE_BYTES = sizeof(STRINGDICT_STRUCT);
 
+static HRESULT CreateDictionary(
+    __out_bcount(STRINGDICT_HANDLE_BYTES) STRINGDICT_HANDLE* psdHandle,
+    __in DICT_TYPE dtType,
+    __in BOOL fConcurrent,
+    __in DWORD dwNumExpectedItems,
+    __in_opt void **ppvArray,
+    __in size_t cByteOffset,
+    __in DICT_FLAG dfFlags
+    );
 static HRESULT StringHash(
     __in const STRINGDICT_STRUCT *psd,
-    __in DWORD dwNumBuckets,
     __in_z LPCWSTR pszString,
-    __out DWORD *pdwHash
+    __out DWORD *pdwHash,
+    __out DWORD *pcchString
     );
 static BOOL IsMatchExact(
     __in const STRINGDICT_STRUCT *psd,
-    __in DWORD dwMatchIndex,
-    __in_z LPCWSTR wzOriginalString
+    __in const DICT_SLOT *pSlot,
+    __in DWORD dwHash,
+    __in_ecount(cchString) LPCWSTR wzOriginalString,
+    __in DWORD cchString
+    );
+static HRESULT EnsureFoldTable();
+static HRESULT BuildFoldTable();
+static WCHAR FoldChar(
+    __in WCHAR wch
     );
 static HRESULT GetValue(
     __in const STRINGDICT_STRUCT *psd,
     __in_z LPCWSTR pszString,
     __out_opt void **ppvValue
     );
-static HRESULT GetInsertIndex(
-    __in const STRINGDICT_STRUCT *psd,
-    __in DWORD dwBucketCount,
-    __in void **ppvBuckets,
-    __in_z LPCWSTR pszString,
-    __out DWORD *pdwOutput
+static HRESULT AddItem(
+    __in STRINGDICT_STRUCT *psd,
+    __in DWORD dwHash,
+    __in DWORD cchKey,
+    __in void *pvValue
     );
-static HRESULT GetIndex(
+static DWORD GetInsertIndex(
+    __in const DICT_TABLE *pTable,
+    __in DWORD dwHash
+    );
+static const DICT_SLOT * FindSlot(
     __in const STRINGDICT_STRUCT *psd,
-    __in_z LPCWSTR pszString,
-    __out DWORD *pdwOutput
+    __in const DICT_TABLE *pTable,
+    __in DWORD dwHash,
+    __in_ecount(cchString) LPCWSTR wzString,
+    __in DWORD cchString
     );
 static LPCWSTR GetKey(
     __in const STRINGDICT_STRUCT *psd,
     __in void *pvValue
     );
+static HRESULT AllocateTable(
+    __in DWORD cSlots,
+    __out DICT_TABLE **ppTable
+    );
+static HRESULT EnsureDictionarySize(
+    __inout STRINGDICT_STRUCT *psd
+    );
 static HRESULT GrowDictionary(
     __inout STRINGDICT_STRUCT *psd
     );
+static void MigrateSlots(
+    __inout STRINGDICT_STRUCT *psd,
+    __in DWORD cMaxSlots
+    );
 // These 2 helper functions allow us to safely handle dictutil consumers resizing
-// the value array by storing "offsets" instead of raw void *'s in our buckets.
+// the value array by storing "offsets" instead of raw void *'s in our slots.
 static void * TranslateOffsetToValue(
     __in const STRINGDICT_STRUCT *psd,
     __in void *pvValue
@@ -135,41 +206,7 @@ extern "C" HRESULT DAPI DictCreateWithEmbeddedKey(
     __in DICT_FLAG dfFlags
     )
 {
-    HRESULT hr = S_OK;
-
-    DictExitOnNull(psdHandle, hr, E_INVALIDARG, "Handle not specified while creating dict");
-
-    // Allocate the handle
-    *psdHandle = static_cast<STRINGDICT_HANDLE>(MemAlloc(sizeof(STRINGDICT_STRUCT), FALSE));
-    DictExitOnNull(*psdHandle, hr, E_OUTOFMEMORY, "Failed to allocate dictionary object");
-
-    STRINGDICT_STRUCT *psd = static_cast<STRINGDICT_STRUCT *>(*psdHandle);
-
-    // Fill out the new handle's values
-    psd->dtType = DICT_EMBEDDED_KEY;
-    psd->dfFlags = dfFlags;
-    psd->cByteOffset = cByteOffset;
-    psd->dwBucketSizeIndex = 0;
-    psd->dwNumItems = 0;
-    psd->ppvItemList = NULL;
-    psd->ppvValueArray = ppvArray;
-
-    // Make psd->dwBucketSizeIndex point to the appropriate spot in the prime
-    // array based on expected number of items and items to buckets ratio
-    // Careful: the "-1" in "countof(MAX_BUCKET_SIZES)-1" ensures we don't end
-    // this loop past the end of the array!
-    while (psd->dwBucketSizeIndex < (countof(MAX_BUCKET_SIZES)-1) &&
-           MAX_BUCKET_SIZES[psd->dwBucketSizeIndex] < dwNumExpectedItems * MAX_BUCKETS_TO_ITEMS_RATIO)
-    {
-        ++psd->dwBucketSizeIndex;
-    }
-
-    // Finally, allocate our initial buckets
-    psd->ppvBuckets = static_cast<void**>(MemAlloc(sizeof(void *) * MAX_BUCKET_SIZES[psd->dwBucketSizeIndex], TRUE));
-    DictExitOnNull(psd->ppvBuckets, hr, E_OUTOFMEMORY, "Failed to allocate buckets for dictionary");
-
-LExit:
-    return hr;
+    return CreateDictionary(psdHandle, DICT_EMBEDDED_KEY, FALSE, dwNumExpectedItems, ppvArray, cByteOffset, dfFlags);
 }
 
 // The dict will store a set of keys, with no values associated with them. Use DictAddKey() and DictKeyExists() with this dictionary type.
@@ -179,41 +216,33 @@ extern "C" HRESULT DAPI DictCreateStringList(
     __in DICT_FLAG dfFlags
     )
 {
-    HRESULT hr = S_OK;
-
-    DictExitOnNull(psdHandle, hr, E_INVALIDARG, "Handle not specified while creating dict");
-
-    // Allocate the handle
-    *psdHandle = static_cast<STRINGDICT_HANDLE>(MemAlloc(sizeof(STRINGDICT_STRUCT), FALSE));
-    DictExitOnNull(*psdHandle, hr, E_OUTOFMEMORY, "Failed to allocate dictionary object");
-
-    STRINGDICT_STRUCT *psd = static_cast<STRINGDICT_STRUCT *>(*psdHandle);
-
-    // Fill out the new handle's values
-    psd->dtType = DICT_STRING_LIST;
-    psd->dfFlags = dfFlags;
-    psd->cByteOffset = 0;
-    psd->dwBucketSizeIndex = 0;
-    psd->dwNumItems = 0;
-    psd->ppvItemList = NULL;
-    psd->ppvValueArray = NULL;
-
-    // Make psd->dwBucketSizeIndex point to the appropriate spot in the prime
-    // array based on expected number of items and items to buckets ratio
-    // Careful: the "-1" in "countof(MAX_BUCKET_SIZES)-1" ensures we don't end
-    // this loop past the end of the array!
-    while (psd->dwBucketSizeIndex < (countof(MAX_BUCKET_SIZES)-1) &&
-           MAX_BUCKET_SIZES[psd->dwBucketSizeIndex] < dwNumExpectedItems * MAX_BUCKETS_TO_ITEMS_RATIO)
-    {
-        ++psd->dwBucketSizeIndex;
-    }
+    return CreateDictionary(psdHandle, DICT_STRING_LIST, FALSE, dwNumExpectedItems, NULL, 0, dfFlags);
+}
 
-    // Finally, allocate our initial buckets
-    psd->ppvBuckets = static_cast<void**>(MemAlloc(sizeof(void *) * MAX_BUCKET_SIZES[psd->dwBucketSizeIndex], TRUE));
-    DictExitOnNull(psd->ppvBuckets, hr, E_OUTOFMEMORY, "Failed to allocate buckets for dictionary");
+// Concurrent dictionaries can be read from any number of threads while another thread adds to
+// them. Lookups take no locks and never wait, adds are serialized internally. The key or value
+// passed to an add must not change afterwards. Incremental resize isn't supported, a concurrent
+// dictionary always grows all at once (blocking only other adds) so readers never see a partial table.
+//
+// Use DictAddValue() and DictGetValue() with this dictionary type.
+extern "C" HRESULT DAPI DictCreateWithEmbeddedKeyConcurrent(
+    __out_bcount(STRINGDICT_HANDLE_BYTES) STRINGDICT_HANDLE* psdHandle,
+    __in DWORD dwNumExpectedItems,
+    __in size_t cByteOffset,
+    __in DICT_FLAG dfFlags
+    )
+{
+    return CreateDictionary(psdHandle, DICT_EMBEDDED_KEY, TRUE, dwNumExpectedItems, NULL, cByteOffset, dfFlags);
+}
 
-LExit:
-    return hr;
+// Use DictAddKey() and DictKeyExists() with this dictionary type.
+extern "C" HRESULT DAPI DictCreateStringListConcurrent(
+    __out_bcount(STRINGDICT_HANDLE_BYTES) STRINGDICT_HANDLE* psdHandle,
+    __in DWORD dwNumExpectedItems,
+    __in DICT_FLAG dfFlags
+    )
+{
+    return CreateDictionary(psdHandle, DICT_STRING_LIST, TRUE, dwNumExpectedItems, NULL, 0, dfFlags);
 }
 
 extern "C" HRESULT DAPI DictCreateStringListFromArray(
@@ -278,82 +307,57 @@ LExit:
     return hr;
 }
 
-// Todo: Dict should resize itself when (number of items) exceeds (number of buckets / MAX_BUCKETS_TO_ITEMS_RATIO)
 extern "C" HRESULT DAPI DictAddKey(
     __in_bcount(STRINGDICT_HANDLE_BYTES) STRINGDICT_HANDLE sdHandle,
     __in_z LPCWSTR pszString
     )
 {
     HRESULT hr = S_OK;
-    DWORD dwIndex = 0;
+    DWORD dwHash = 0;
+    DWORD cchKey = 0;
+    LPWSTR sczKey = NULL;
     STRINGDICT_STRUCT *psd = static_cast<STRINGDICT_STRUCT *>(sdHandle);
 
     DictExitOnNull(sdHandle, hr, E_INVALIDARG, "Handle not specified while adding value to dict");
     DictExitOnNull(pszString, hr, E_INVALIDARG, "String not specified while adding value to dict");
 
-    if (psd->dwBucketSizeIndex >= countof(MAX_BUCKET_SIZES))
-    {
-        hr = E_INVALIDARG;
-        DictExitOnFailure(hr, "Invalid dictionary - bucket size index is out of range");
-    }
-
     if (DICT_STRING_LIST != psd->dtType)
     {
         hr = E_INVALIDARG;
         DictExitOnFailure(hr, "Tried to add key without value to wrong dictionary type! This dictionary type is: %d", psd->dtType);
     }
 
-    if ((psd->dwNumItems + 1) >= MAX_BUCKET_SIZES[psd->dwBucketSizeIndex] / MAX_BUCKETS_TO_ITEMS_RATIO)
-    {
-        hr = GrowDictionary(psd);
-        if (HRESULT_FROM_WIN32(ERROR_DATABASE_FULL) == hr)
-        {
-            // If we fail to proactively grow the dictionary, don't fail unless the dictionary is completely full
-            if (psd->dwNumItems < MAX_BUCKET_SIZES[psd->dwBucketSizeIndex])
-            {
-                hr = S_OK;
-            }
-        }
-        DictExitOnFailure(hr, "Failed to grow dictionary");
-    }
-
-    hr = GetInsertIndex(psd, MAX_BUCKET_SIZES[psd->dwBucketSizeIndex], psd->ppvBuckets, pszString, &dwIndex);
-    DictExitOnFailure(hr, "Failed to get index to insert into");
-
-    hr = MemEnsureArraySize(reinterpret_cast<void **>(&(psd->ppvItemList)), psd->dwNumItems + 1, sizeof(void *), 1000);
-    DictExitOnFailure(hr, "Failed to resize list of items in dictionary");
-    ++psd->dwNumItems;
+    hr = StringHash(psd, pszString, &dwHash, &cchKey);
+    DictExitOnFailure(hr, "Failed to hash the string.");
 
-    hr = StrAllocString(reinterpret_cast<LPWSTR *>(&(psd->ppvBuckets[dwIndex])), pszString, 0);
+    hr = StrAllocString(&sczKey, pszString, cchKey);
     DictExitOnFailure(hr, "Failed to allocate copy of string");
 
-    psd->ppvItemList[psd->dwNumItems-1] = psd->ppvBuckets[dwIndex];
+    hr = AddItem(psd, dwHash, cchKey, sczKey);
+    DictExitOnFailure(hr, "Failed to add item '%ls' to dict table", pszString);
+
+    sczKey = NULL;
 
 LExit:
+    ReleaseStr(sczKey);
+
     return hr;
 }
 
-// Todo: Dict should resize itself when (number of items) exceeds (number of buckets / MAX_BUCKETS_TO_ITEMS_RATIO)
 extern "C" HRESULT DAPI DictAddValue(
     __in_bcount(STRINGDICT_HANDLE_BYTES) STRINGDICT_HANDLE sdHandle,
     __in void *pvValue
     )
 {
     HRESULT hr = S_OK;
-    void *pvOffset = NULL;
     LPCWSTR wzKey = NULL;
-    DWORD dwIndex = 0;
+    DWORD dwHash = 0;
+    DWORD cchKey = 0;
     STRINGDICT_STRUCT *psd = static_cast<STRINGDICT_STRUCT *>(sdHandle);
 
     DictExitOnNull(sdHandle, hr, E_INVALIDARG, "Handle not specified while adding value to dict");
     DictExitOnNull(pvValue, hr, E_INVALIDARG, "Value not specified while adding value to dict");
 
-    if (psd->dwBucketSizeIndex >= countof(MAX_BUCKET_SIZES))
-    {
-        hr = E_INVALIDARG;
-        DictExitOnFailure(hr, "Invalid dictionary - bucket size index is out of range");
-    }
-
     if (DICT_EMBEDDED_KEY != psd->dtType)
     {
         hr = E_INVALIDARG;
@@ -363,30 +367,11 @@ extern "C" HRESULT DAPI DictAddValue(
     wzKey = GetKey(psd, pvValue);
     DictExitOnNull(wzKey, hr, E_INVALIDARG, "String not specified while adding value to dict");
 
-    if ((psd->dwNumItems + 1) >= MAX_BUCKET_SIZES[psd->dwBucketSizeIndex] / MAX_BUCKETS_TO_ITEMS_RATIO)
-    {
-        hr = GrowDictionary(psd);
-        if (HRESULT_FROM_WIN32(ERROR_DATABASE_FULL) == hr && psd->dwNumItems + 1 )
-        {
-            // If we fail to proactively grow the dictionary, don't fail unless the dictionary is completely full
-            if (psd->dwNumItems < MAX_BUCKET_SIZES[psd->dwBucketSizeIndex])
-            {
-                hr = S_OK;
-            }
-        }
-        DictExitOnFailure(hr, "Failed to grow dictionary");
-    }
-
-    hr = GetInsertIndex(psd, MAX_BUCKET_SIZES[psd->dwBucketSizeIndex], psd->ppvBuckets, wzKey, &dwIndex);
-    DictExitOnFailure(hr, "Failed to get index to insert into");
-
-    hr = MemEnsureArraySize(reinterpret_cast<void **>(&(psd->ppvItemList)), psd->dwNumItems + 1, sizeof(void *), 1000);
-    DictExitOnFailure(hr, "Failed to resize list of items in dictionary");
-    ++psd->dwNumItems;
+    hr = StringHash(psd, wzKey, &dwHash, &cchKey);
+    DictExitOnFailure(hr, "Failed to hash the string.");
 
-    pvOffset = TranslateValueToOffset(psd, pvValue);
-    psd->ppvBuckets[dwIndex] = pvOffset;
-    psd->ppvItemList[psd->dwNumItems-1] = pvOffset;
+    hr = AddItem(psd, dwHash, cchKey, TranslateValueToOffset(psd, pvValue));
+    DictExitOnFailure(hr, "Failed to add item '%ls' to dict table", wzKey);
 
 LExit:
     return hr;
@@ -451,79 +436,248 @@ extern "C" void DAPI DictDestroy(
     )
 {
     DWORD i;
+    DICT_TABLE *pRetiredTable = NULL;
 
     STRINGDICT_STRUCT *psd = static_cast<STRINGDICT_STRUCT *>(sdHandle);
 
-    if (DICT_STRING_LIST == psd->dtType)
+    if (DICT_STRING_LIST == psd->dtType && psd->pTable)
     {
-        for (i = 0; i < psd->dwNumItems; ++i)
+        for (i = 0; i < psd->pTable->cSlots; ++i)
         {
-            ReleaseStr(reinterpret_cast<LPWSTR>(psd->ppvItemList[i]));
+            ReleaseStr(reinterpret_cast<LPWSTR>(psd->pTable->rgSlots[i].pvValue));
         }
+
+        // Old slots before the migrate index were copied into the current table, so they were freed above
+        for (i = psd->dwMigrateIndex; psd->pOldTable && i < psd->pOldTable->cSlots; ++i)
+        {
+            ReleaseStr(reinterpret_cast<LPWSTR>(psd->pOldTable->rgSlots[i].pvValue));
+        }
+    }
+
+    // Everything in a retired table was copied into the current table, so only the tables themselves are freed
+    pRetiredTable = psd->pTable ? psd->pTable->pRetiredTable : NULL;
+    while (pRetiredTable)
+    {
+        DICT_TABLE *pNextRetiredTable = pRetiredTable->pRetiredTable;
+
+        MemFree(pRetiredTable);
+        pRetiredTable = pNextRetiredTable;
+    }
+
+    if (psd->fConcurrent)
+    {
+        ::DeleteCriticalSection(&psd->csAdd);
     }
 
-    ReleaseMem(psd->ppvItemList);
-    ReleaseMem(psd->ppvBuckets);
+    ReleaseMem(psd->pOldTable);
+    ReleaseMem(psd->pTable);
     ReleaseMem(psd);
 }
 
+static HRESULT CreateDictionary(
+    __out_bcount(STRINGDICT_HANDLE_BYTES) STRINGDICT_HANDLE* psdHandle,
+    __in DICT_TYPE dtType,
+    __in BOOL fConcurrent,
+    __in DWORD dwNumExpectedItems,
+    __in_opt void **ppvArray,
+    __in size_t cByteOffset,
+    __in DICT_FLAG dfFlags
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cSlots = DICT_MIN_SLOTS;
+    STRINGDICT_STRUCT *psd = NULL;
+
+    DictExitOnNull(psdHandle, hr, E_INVALIDARG, "Handle not specified while creating dict");
+
+    if (fConcurrent && (DICT_FLAG_INCREMENTAL_RESIZE & dfFlags))
+    {
+        hr = E_INVALIDARG;
+        DictExitOnRootFailure(hr, "Concurrent dictionaries do not support incremental resize");
+    }
+
+    // Allocate the handle
+    psd = static_cast<STRINGDICT_STRUCT *>(MemAllocSource(DUTIL_SOURCE_DICTUTIL, sizeof(STRINGDICT_STRUCT), TRUE));
+    DictExitOnNull(psd, hr, E_OUTOFMEMORY, "Failed to allocate dictionary object");
+
+    // Fill out the new handle's values
+    psd->dtType = dtType;
+    psd->dfFlags = dfFlags;
+    psd->cByteOffset = cByteOffset;
+    psd->dwNumItems = 0;
+    psd->ppvValueArray = ppvArray;
+
+    if (fConcurrent)
+    {
+        ::InitializeCriticalSection(&psd->csAdd);
+        psd->fConcurrent = TRUE;
+    }
+
+    // Size the table based on expected number of items and slots to items ratio
+    while (cSlots < DICT_MAX_SLOTS && cSlots < static_cast<DWORD64>(dwNumExpectedItems) * DICT_SLOTS_TO_ITEMS_RATIO)
+    {
+        cSlots <<= 1;
+    }
+
+    // Finally, allocate our initial table
+    hr = AllocateTable(cSlots, const_cast<DICT_TABLE **>(&psd->pTable));
+    DictExitOnFailure(hr, "Failed to allocate table for dictionary");
+
+    *psdHandle = psd;
+    psd = NULL;
+
+LExit:
+    ReleaseDict(psd);
+
+    return hr;
+}
+
 static HRESULT StringHash(
     __in const STRINGDICT_STRUCT *psd,
-    __in DWORD dwNumBuckets,
     __in_z LPCWSTR pszString,
-    __out DWORD *pdwHash
+    __out DWORD *pdwHash,
+    __out DWORD *pcchString
     )
 {
     HRESULT hr = S_OK;
-    LPCWSTR wzKey = NULL;
-    LPWSTR sczNewKey = NULL;
+    LPCWSTR wz = NULL;
+    WCHAR wch = 0;
+    BOOL fFoldTableReady = FALSE;
     DWORD result = 0;
 
     if (DICT_FLAG_CASEINSENSITIVE & psd->dfFlags)
     {
-        hr = StrAllocStringToUpperInvariant(&sczNewKey, pszString, 0);
-        DictExitOnFailure(hr, "Failed to convert the string to upper-case.");
+        for (wz = pszString; *wz; ++wz)
+        {
+            wch = *wz;
+            if (0x80 <= wch && !fFoldTableReady)
+            {
+                hr = EnsureFoldTable();
+                DictExitOnFailure(hr, "Failed to build the case folding table.");
 
-        wzKey = sczNewKey;
+                fFoldTableReady = TRUE;
+            }
+
+            result = ~(FoldChar(wch) * 509) + result * 65599;
+        }
     }
     else
     {
-        wzKey = pszString;
+        for (wz = pszString; *wz; ++wz)
+        {
+            result = ~(*wz * 509) + result * 65599;
+        }
     }
 
-    while (*wzKey)
-    {
-        result = ~(*wzKey++ * 509) + result * 65599;
-    }
+    // Mix the bits so the low bits used to pick a slot depend on every character
+    result ^= result >> 16;
+    result *= 0x85EBCA6B;
+    result ^= result >> 13;
+    result *= 0xC2B2AE35;
+    result ^= result >> 16;
 
-    *pdwHash = result % dwNumBuckets;
+    *pdwHash = result;
+    *pcchString = static_cast<DWORD>(wz - pszString);
 
 LExit:
-    ReleaseStr(sczNewKey);
-
     return hr;
 }
 
 static BOOL IsMatchExact(
     __in const STRINGDICT_STRUCT *psd,
-    __in DWORD dwMatchIndex,
-    __in_z LPCWSTR wzOriginalString
+    __in const DICT_SLOT *pSlot,
+    __in DWORD dwHash,
+    __in_ecount(cchString) LPCWSTR wzOriginalString,
+    __in DWORD cchString
     )
 {
-    LPCWSTR wzMatchString = GetKey(psd, TranslateOffsetToValue(psd, psd->ppvBuckets[dwMatchIndex]));
-    DWORD dwFlags = 0;
+    if (pSlot->dwHash != dwHash || pSlot->cchKey != cchString)
+    {
+        return FALSE;
+    }
+
+    LPCWSTR wzMatchString = GetKey(psd, TranslateOffsetToValue(psd, pSlot->pvValue));
 
     if (DICT_FLAG_CASEINSENSITIVE & psd->dfFlags)
     {
-        dwFlags |= NORM_IGNORECASE;
+        // Any non-ASCII key was hashed before it got here, so the fold table is ready.
+        for (DWORD i = 0; i < cchString; ++i)
+        {
+            if (wzOriginalString[i] != wzMatchString[i] && FoldChar(wzOriginalString[i]) != FoldChar(wzMatchString[i]))
+            {
+                return FALSE;
+            }
+        }
+
+        return TRUE;
     }
 
-    if (CSTR_EQUAL == ::CompareStringW(LOCALE_INVARIANT, dwFlags, wzOriginalString, -1, wzMatchString, -1))
+    return 0 == memcmp(wzOriginalString, wzMatchString, cchString * sizeof(WCHAR));
+}
+
+static HRESULT EnsureFoldTable()
+{
+    HRESULT hr = S_OK;
+    LONG lState = DICT_FOLD_TABLE_NONE;
+
+    for (;;)
     {
-        return TRUE;
+        lState = ::InterlockedCompareExchange(&vlFoldTableState, DICT_FOLD_TABLE_BUILDING, DICT_FOLD_TABLE_NONE);
+        if (DICT_FOLD_TABLE_READY == lState)
+        {
+            break;
+        }
+        else if (DICT_FOLD_TABLE_NONE == lState)
+        {
+            hr = BuildFoldTable();
+            ::InterlockedExchange(&vlFoldTableState, SUCCEEDED(hr) ? DICT_FOLD_TABLE_READY : DICT_FOLD_TABLE_NONE);
+            DictExitOnFailure(hr, "Failed to build the case folding table.");
+
+            break;
+        }
+
+        // Another thread is building the table, it only takes a single LCMapStringW call.
+        ::Sleep(0);
+    }
+
+LExit:
+    return hr;
+}
+
+static HRESULT BuildFoldTable()
+{
+    HRESULT hr = S_OK;
+
+    for (DWORD i = 0; i < countof(vrgwchFoldTable); ++i)
+    {
+        vrgwchFoldTable[i] = static_cast<WCHAR>(i);
+    }
+
+    // Surrogates are left alone, they only have meaning as pairs.
+    if (0 == ::LCMapStringW(LOCALE_INVARIANT, LCMAP_UPPERCASE, vrgwchFoldTable + 0x80, 0xD800 - 0x80, vrgwchFoldTable + 0x80, 0xD800 - 0x80))
+    {
+        DictExitWithLastError(hr, "Failed to upper-case the characters below the surrogate range.");
+    }
+
+    if (0 == ::LCMapStringW(LOCALE_INVARIANT, LCMAP_UPPERCASE, vrgwchFoldTable + 0xE000, 0x10000 - 0xE000, vrgwchFoldTable + 0xE000, 0x10000 - 0xE000))
+    {
+        DictExitWithLastError(hr, "Failed to upper-case the characters above the surrogate range.");
     }
 
-    return FALSE;
+LExit:
+    return hr;
+}
+
+static WCHAR FoldChar(
+    __in WCHAR wch
+    )
+{
+    if (0x80 > wch)
+    {
+        return (L'a' <= wch && L'z' >= wch) ? static_cast<WCHAR>(wch - (L'a' - L'A')) : wch;
+    }
+
+    return vrgwchFoldTable[wch];
 }
 
 static HRESULT GetValue(
@@ -533,46 +687,32 @@ static HRESULT GetValue(
     )
 {
     HRESULT hr = S_OK;
-    DWORD dwOriginalIndexCandidate = 0;
-    void *pvCandidateValue = NULL;
-    DWORD dwIndex = 0;
+    DWORD dwHash = 0;
+    DWORD cchString = 0;
+    const DICT_SLOT *pSlot = NULL;
 
     DictExitOnNull(psd, hr, E_INVALIDARG, "Handle not specified while searching dict");
     DictExitOnNull(pszString, hr, E_INVALIDARG, "String not specified while searching dict");
 
-    if (psd->dwBucketSizeIndex >= countof(MAX_BUCKET_SIZES))
-    {
-        hr = E_INVALIDARG;
-        DictExitOnFailure(hr, "Invalid dictionary - bucket size index is out of range");
-    }
-
-    hr = StringHash(psd, MAX_BUCKET_SIZES[psd->dwBucketSizeIndex], pszString, &dwOriginalIndexCandidate);
+    hr = StringHash(psd, pszString, &dwHash, &cchString);
     DictExitOnFailure(hr, "Failed to hash the string.");
 
-    DWORD dwIndexCandidate = dwOriginalIndexCandidate;
-
-    pvCandidateValue = TranslateOffsetToValue(psd, psd->ppvBuckets[dwIndexCandidate]);
+    pSlot = FindSlot(psd, static_cast<const DICT_TABLE *>(::ReadPointerAcquire(reinterpret_cast<PVOID const volatile *>(&psd->pTable))), dwHash, pszString, cchString);
 
-    // If no match exists in the dict
-    if (NULL == pvCandidateValue)
+    // Items that haven't been migrated yet are still only in the old table
+    if (!pSlot && psd->pOldTable)
     {
-        if (NULL != ppvValue)
-        {
-            *ppvValue = NULL;
-        }
-        ExitFunction1(hr = E_NOTFOUND);
+        pSlot = FindSlot(psd, psd->pOldTable, dwHash, pszString, cchString);
     }
 
-    hr = GetIndex(psd, pszString, &dwIndex);
-    if (E_NOTFOUND == hr)
+    if (!pSlot)
     {
-        ExitFunction();
+        ExitFunction1(hr = E_NOTFOUND);
     }
-    DictExitOnFailure(hr, "Failed to find index to get");
 
     if (NULL != ppvValue)
     {
-        *ppvValue = TranslateOffsetToValue(psd, psd->ppvBuckets[dwIndex]);
+        *ppvValue = TranslateOffsetToValue(psd, pSlot->pvValue);
     }
 
 LExit:
@@ -584,98 +724,93 @@ LExit:
     return hr;
 }
 
-static HRESULT GetInsertIndex(
-    __in const STRINGDICT_STRUCT *psd,
-    __in DWORD dwBucketCount,
-    __in void **ppvBuckets,
-    __in_z LPCWSTR pszString,
-    __out DWORD *pdwOutput
+static HRESULT AddItem(
+    __in STRINGDICT_STRUCT *psd,
+    __in DWORD dwHash,
+    __in DWORD cchKey,
+    __in void *pvValue
     )
 {
     HRESULT hr = S_OK;
-    DWORD dwOriginalIndexCandidate = 0;
-
-    hr = StringHash(psd, dwBucketCount, pszString, &dwOriginalIndexCandidate);
-    DictExitOnFailure(hr, "Failed to hash the string.");
-
-    DWORD dwIndexCandidate = dwOriginalIndexCandidate;
+    BOOL fLocked = FALSE;
+    DICT_SLOT *pSlot = NULL;
 
-    // If we collide, keep iterating forward from our intended position, even wrapping around to zero, until we find an empty bucket
-#pragma prefast(push)
-#pragma prefast(disable:26007)
-    while (NULL != ppvBuckets[dwIndexCandidate])
-#pragma prefast(pop)
+    if (psd->fConcurrent)
     {
-        ++dwIndexCandidate;
+        ::EnterCriticalSection(&psd->csAdd);
+        fLocked = TRUE;
+    }
 
-        // If we got to the end of the array, wrap around to zero index
-        if (dwIndexCandidate >= dwBucketCount)
-        {
-            dwIndexCandidate = 0;
-        }
+    hr = EnsureDictionarySize(psd);
+    DictExitOnFailure(hr, "Failed to make room in the dictionary");
 
-        // If we wrapped all the way back around to our original index, the dict is full - throw an error
-        if (dwIndexCandidate == dwOriginalIndexCandidate)
-        {
-            // The dict table is full - this error seems to be a reasonably close match 
-            hr = HRESULT_FROM_WIN32(ERROR_DATABASE_FULL);
-            DictExitOnRootFailure(hr, "Failed to add item '%ls' to dict table because dict table is full of items", pszString);
-        }
-    }
+    pSlot = psd->pTable->rgSlots + GetInsertIndex(psd->pTable, dwHash);
+    pSlot->dwHash = dwHash;
+    pSlot->cchKey = cchKey;
 
-    *pdwOutput = dwIndexCandidate;
+    // Filling in the value makes the slot visible to concurrent lookups, so it goes last
+    ::WritePointerRelease(&pSlot->pvValue, pvValue);
+
+    ++psd->dwNumItems;
 
 LExit:
+    if (fLocked)
+    {
+        ::LeaveCriticalSection(&psd->csAdd);
+    }
+
     return hr;
 }
 
-static HRESULT GetIndex(
-    __in const STRINGDICT_STRUCT *psd,
-    __in_z LPCWSTR pszString,
-    __out DWORD *pdwOutput
+static DWORD GetInsertIndex(
+    __in const DICT_TABLE *pTable,
+    __in DWORD dwHash
     )
 {
-    HRESULT hr = S_OK;
-    DWORD dwOriginalIndexCandidate = 0;
+    const DWORD dwMask = pTable->cSlots - 1;
+    DWORD dwIndexCandidate = dwHash & dwMask;
 
-    if (psd->dwBucketSizeIndex >= countof(MAX_BUCKET_SIZES))
+    // If we collide, keep iterating forward from our intended position, wrapping around to zero, until we find an empty slot.
+    // EnsureDictionarySize() always leaves at least one slot empty, so this terminates.
+#pragma prefast(push)
+#pragma prefast(disable:26007)
+    while (NULL != pTable->rgSlots[dwIndexCandidate].pvValue)
+#pragma prefast(pop)
     {
-        hr = E_INVALIDARG;
-        DictExitOnFailure(hr, "Invalid dictionary - bucket size index is out of range");
+        dwIndexCandidate = (dwIndexCandidate + 1) & dwMask;
     }
 
-    hr = StringHash(psd, MAX_BUCKET_SIZES[psd->dwBucketSizeIndex], pszString, &dwOriginalIndexCandidate);
-    DictExitOnFailure(hr, "Failed to hash the string.");
+    return dwIndexCandidate;
+}
 
-    DWORD dwIndexCandidate = dwOriginalIndexCandidate;
+static const DICT_SLOT * FindSlot(
+    __in const STRINGDICT_STRUCT *psd,
+    __in const DICT_TABLE *pTable,
+    __in DWORD dwHash,
+    __in_ecount(cchString) LPCWSTR wzString,
+    __in DWORD cchString
+    )
+{
+    const DWORD dwMask = pTable->cSlots - 1;
+    const DICT_SLOT *pSlot = NULL;
 
-    while (!IsMatchExact(psd, dwIndexCandidate, pszString))
+    // Walk the probe sequence until we hit an empty slot - there is always at least one. The value is read
+    // first, with acquire semantics, so the rest of a slot that a concurrent add just filled in is visible.
+    for (DWORD dwIndexCandidate = dwHash & dwMask; ; dwIndexCandidate = (dwIndexCandidate + 1) & dwMask)
     {
-        ++dwIndexCandidate;
+        pSlot = pTable->rgSlots + dwIndexCandidate;
 
-        // If we got to the end of the array, wrap around to zero index
-        if (dwIndexCandidate >= MAX_BUCKET_SIZES[psd->dwBucketSizeIndex])
+        if (NULL == ::ReadPointerAcquire(&pSlot->pvValue))
         {
-            dwIndexCandidate = 0;
+            break;
         }
-
-        // If no match exists in the dict
-        if (NULL == psd->ppvBuckets[dwIndexCandidate])
+        else if (IsMatchExact(psd, pSlot, dwHash, wzString, cchString))
         {
-            ExitFunction1(hr = E_NOTFOUND);
-        }
-
-        // If we wrapped all the way back around to our original index, the dict is full and we found nothing, so return as such
-        if (dwIndexCandidate == dwOriginalIndexCandidate)
-        {
-            ExitFunction1(hr = E_NOTFOUND);
+            return pSlot;
         }
     }
 
-    *pdwOutput = dwIndexCandidate;
-
-LExit:
-    return hr;
+    return NULL;
 }
 
 static LPCWSTR GetKey(
@@ -700,52 +835,149 @@ static LPCWSTR GetKey(
     }
 }
 
+static HRESULT AllocateTable(
+    __in DWORD cSlots,
+    __out DICT_TABLE **ppTable
+    )
+{
+    HRESULT hr = S_OK;
+    size_t cbAllocSize = 0;
+
+    hr = ::SizeTMult(sizeof(DICT_SLOT), cSlots - 1, &cbAllocSize);
+    DictExitOnFailure(hr, "Overflow while calculating allocation size for dictionary table");
+
+    hr = ::SizeTAdd(sizeof(DICT_TABLE), cbAllocSize, &cbAllocSize);
+    DictExitOnFailure(hr, "Overflow while calculating allocation size for dictionary table");
+
+    *ppTable = static_cast<DICT_TABLE *>(MemAllocSource(DUTIL_SOURCE_DICTUTIL, cbAllocSize, TRUE));
+    DictExitOnNull(*ppTable, hr, E_OUTOFMEMORY, "Failed to allocate %u slots for dictionary", cSlots);
+
+    (*ppTable)->cSlots = cSlots;
+
+LExit:
+    return hr;
+}
+
+static HRESULT EnsureDictionarySize(
+    __inout STRINGDICT_STRUCT *psd
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (psd->pOldTable)
+    {
+        MigrateSlots(psd, DICT_MIGRATE_SLOTS_PER_ADD);
+    }
+
+    if (static_cast<DWORD64>(psd->dwNumItems + 1) * DICT_SLOTS_TO_ITEMS_RATIO > psd->pTable->cSlots)
+    {
+        hr = GrowDictionary(psd);
+        if (HRESULT_FROM_WIN32(ERROR_DATABASE_FULL) == hr)
+        {
+            // If we fail to proactively grow the dictionary, don't fail unless the dictionary is
+            // completely full (one slot must always stay empty to terminate probing)
+            if (psd->dwNumItems + 1 < psd->pTable->cSlots)
+            {
+                hr = S_OK;
+            }
+        }
+        DictExitOnFailure(hr, "Failed to grow dictionary");
+    }
+
+LExit:
+    return hr;
+}
+
 static HRESULT GrowDictionary(
     __inout STRINGDICT_STRUCT *psd
     )
 {
     HRESULT hr = S_OK;
     DWORD dwInsertIndex = 0;
-    LPCWSTR wzKey = NULL;
-    DWORD dwNewBucketSizeIndex = 0;
-    size_t cbAllocSize = 0;
-    void **ppvNewBuckets = NULL;
-
-    dwNewBucketSizeIndex = psd->dwBucketSizeIndex + 1;
+    DICT_TABLE *pNewTable = NULL;
 
-    if (dwNewBucketSizeIndex >= countof(MAX_BUCKET_SIZES))
+    if (DICT_MAX_SLOTS <= psd->pTable->cSlots)
     {
         ExitFunction1(hr = HRESULT_FROM_WIN32(ERROR_DATABASE_FULL));
     }
 
-    hr = ::SizeTMult(sizeof(void *), MAX_BUCKET_SIZES[dwNewBucketSizeIndex], &cbAllocSize);
-    DictExitOnFailure(hr, "Overflow while calculating allocation size to grow dictionary");
+    hr = AllocateTable(psd->pTable->cSlots << 1, &pNewTable);
+    DictExitOnFailure(hr, "Failed to allocate table while growing dictionary");
 
-    ppvNewBuckets = static_cast<void**>(MemAlloc(cbAllocSize, TRUE));
-    DictExitOnNull(ppvNewBuckets, hr, E_OUTOFMEMORY, "Failed to allocate %u buckets while growing dictionary", MAX_BUCKET_SIZES[dwNewBucketSizeIndex]);
-
-    for (DWORD i = 0; i < psd->dwNumItems; ++i)
+    if (psd->fConcurrent)
     {
-        wzKey = GetKey(psd, TranslateOffsetToValue(psd, psd->ppvItemList[i]));
-        DictExitOnNull(wzKey, hr, E_INVALIDARG, "String not specified in existing dict value");
+        // Fill the new table completely before lookups can see it, and keep the old one around
+        // for any lookups that are still probing it. The hashes are cached in the slots, so this
+        // never needs to look at the keys.
+        for (DWORD i = 0; i < psd->pTable->cSlots; ++i)
+        {
+            const DICT_SLOT *pSlot = psd->pTable->rgSlots + i;
 
-        hr = GetInsertIndex(psd, MAX_BUCKET_SIZES[dwNewBucketSizeIndex], ppvNewBuckets, wzKey, &dwInsertIndex);
-        DictExitOnFailure(hr, "Failed to get index to insert into");
+            if (NULL != pSlot->pvValue)
+            {
+                dwInsertIndex = GetInsertIndex(pNewTable, pSlot->dwHash);
+                pNewTable->rgSlots[dwInsertIndex] = *pSlot;
+            }
+        }
 
-        ppvNewBuckets[dwInsertIndex] = psd->ppvItemList[i];
+        pNewTable->pRetiredTable = psd->pTable;
+        ::WritePointerRelease(reinterpret_cast<PVOID volatile *>(&psd->pTable), pNewTable);
+        pNewTable = NULL;
+
+        ExitFunction();
     }
 
-    psd->dwBucketSizeIndex = dwNewBucketSizeIndex;
-    ReleaseMem(psd->ppvBuckets);
-    psd->ppvBuckets = ppvNewBuckets;
-    ppvNewBuckets = NULL;
+    // Only one old table is kept, so finish any previous migration first
+    if (psd->pOldTable)
+    {
+        MigrateSlots(psd, psd->pOldTable->cSlots);
+    }
+
+    psd->pOldTable = psd->pTable;
+    psd->dwMigrateIndex = 0;
+    psd->pTable = pNewTable;
+    pNewTable = NULL;
+
+    if (!(DICT_FLAG_INCREMENTAL_RESIZE & psd->dfFlags))
+    {
+        MigrateSlots(psd, psd->pOldTable->cSlots);
+    }
 
 LExit:
-    ReleaseMem(ppvNewBuckets);
+    ReleaseMem(pNewTable);
 
     return hr;
 }
 
+static void MigrateSlots(
+    __inout STRINGDICT_STRUCT *psd,
+    __in DWORD cMaxSlots
+    )
+{
+    DWORD dwInsertIndex = 0;
+    const DWORD cOldSlots = psd->pOldTable->cSlots;
+    const DWORD dwEndIndex = cOldSlots - psd->dwMigrateIndex > cMaxSlots ? psd->dwMigrateIndex + cMaxSlots : cOldSlots;
+
+    // The hashes are cached in the slots, so migrating never needs to look at the keys. The old
+    // slots are left intact so lookups that fall back to them still see complete probe sequences.
+    for (; psd->dwMigrateIndex < dwEndIndex; ++psd->dwMigrateIndex)
+    {
+        const DICT_SLOT *pSlot = psd->pOldTable->rgSlots + psd->dwMigrateIndex;
+
+        if (NULL != pSlot->pvValue)
+        {
+            dwInsertIndex = GetInsertIndex(psd->pTable, pSlot->dwHash);
+            psd->pTable->rgSlots[dwInsertIndex] = *pSlot;
+        }
+    }
+
+    if (psd->dwMigrateIndex == cOldSlots)
+    {
+        ReleaseNullMem(psd->pOldTable);
+        psd->dwMigrateIndex = 0;
+    }
+}
+
 static void * TranslateOffsetToValue(
     __in const STRINGDICT_STRUCT *psd,
     __in void *pvValue
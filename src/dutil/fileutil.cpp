@@ -25,6 +25,28 @@ const BYTE UTF16BOM[] = {0xFF, 0xFE};
 const LPCWSTR REGISTRY_PENDING_FILE_RENAME_KEY = L"SYSTEM\\CurrentControlSet\\Control\\Session Manager";
 const LPCWSTR REGISTRY_PENDING_FILE_RENAME_VALUE = L"PendingFileRenameOperations";
 
+// Largest single ReadFile() issued when reading a file into memory, big enough to keep the read-ahead busy
+// without asking a network redirector for one huge transfer
+const DWORD FILE_READ_CHUNK_SIZE = 8 * 1024 * 1024;
+// First buffer size for pipes and devices, which have no size to allocate for up front
+const DWORD FILE_READ_UNKNOWN_SIZE_INITIAL = 64 * 1024;
+
+// Forward declarations.
+static HRESULT ReadChunks(
+    __in HANDLE hFile,
+    __out_bcount_part(cbBuffer, *pcbRead) LPBYTE pbBuffer,
+    __in DWORD cbBuffer,
+    __out DWORD* pcbRead
+    );
+static HRESULT StringFromFileData(
+    __in_z LPCWSTR wzFile,
+    __in_bcount(cbFullFileBuffer) const BYTE* pbFullFileBuffer,
+    __in SIZE_T cbFullFileBuffer,
+    __inout LPWSTR* psczFileText,
+    __out LPWSTR* psczString,
+    __out_opt FILE_ENCODING* pfeEncoding
+    );
+
 /*******************************************************************
  FileFromPath -  returns a pointer to the file part of the path
 
@@ -880,8 +902,13 @@ extern "C" HRESULT DAPI FileReadPartialEx(
     UINT er = ERROR_SUCCESS;
     HANDLE hFile = INVALID_HANDLE_VALUE;
     LARGE_INTEGER liFileSize = { };
+    BOOL fKnownSize = FALSE;
     DWORD cbData = 0;
+    DWORD cbTotalRead = 0;
+    DWORD cbRead = 0;
+    BYTE bExtra = 0;
     BYTE* pbData = NULL;
+    LPVOID pv = NULL;
 
     FileExitOnNull(pcbDest, hr, E_INVALIDARG, "Invalid argument pcbDest");
     FileExitOnNull(ppbDest, hr, E_INVALIDARG, "Invalid argument ppbDest");
@@ -899,14 +926,17 @@ extern "C" HRESULT DAPI FileReadPartialEx(
         FileExitOnWin32Error(er, hr, "Failed to open file: %ls", wzSrcPath);
     }
 
-    if (!::GetFileSizeEx(hFile, &liFileSize))
+    // Only files on disk have a size, pipes and devices are read until they end
+    fKnownSize = (FILE_TYPE_DISK == ::GetFileType(hFile));
+
+    if (fKnownSize && !::GetFileSizeEx(hFile, &liFileSize))
     {
         FileExitWithLastError(hr, "Failed to get size of file: %ls", wzSrcPath);
     }
 
     if (fSeek)
     {
-        if (cbStartPosition > liFileSize.QuadPart)
+        if (fKnownSize && cbStartPosition > liFileSize.QuadPart)
         {
             hr = E_INVALIDARG;
             FileExitOnFailure(hr, "Start position %d bigger than file '%ls' size %llu", cbStartPosition, wzSrcPath, liFileSize.QuadPart);
@@ -923,20 +953,26 @@ extern "C" HRESULT DAPI FileReadPartialEx(
         cbStartPosition = 0;
     }
 
-    if (fPartialOK)
+    if (!fKnownSize)
     {
-        cbData = cbMaxRead;
+        cbData = min(cbMaxRead, FILE_READ_UNKNOWN_SIZE_INITIAL);
     }
-    else
+    else if (cbMaxRead < liFileSize.QuadPart - cbStartPosition)
     {
-        cbData = liFileSize.LowPart - cbStartPosition; // should only need the low part because we cap at DWORD
-        if (cbMaxRead < liFileSize.QuadPart - cbStartPosition)
+        if (!fPartialOK)
         {
             hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
             FileExitOnRootFailure(hr, "Failed to load file: %ls, too large.", wzSrcPath);
         }
+
+        cbData = cbMaxRead;
+    }
+    else
+    {
+        cbData = liFileSize.LowPart - cbStartPosition; // should only need the low part because we cap at DWORD
     }
 
+    // The buffer is sized for everything that will be read, so it's only allocated once and never zeroed
     if (*ppbDest)
     {
         if (0 == cbData)
@@ -946,9 +982,11 @@ extern "C" HRESULT DAPI FileReadPartialEx(
             ExitFunction1(hr = S_OK);
         }
 
-        LPVOID pv = MemReAlloc(*ppbDest, cbData, TRUE);
+        pv = MemReAlloc(*ppbDest, cbData, FALSE);
         FileExitOnNull(pv, hr, E_OUTOFMEMORY, "Failed to re-allocate memory to read in file: %ls", wzSrcPath);
 
+        // The old buffer is gone, so don't leave the caller pointing at it if the read fails
+        *ppbDest = NULL;
         pbData = static_cast<BYTE*>(pv);
     }
     else
@@ -959,35 +997,62 @@ extern "C" HRESULT DAPI FileReadPartialEx(
             ExitFunction1(hr = S_OK);
         }
 
-        pbData = static_cast<BYTE*>(MemAlloc(cbData, TRUE));
+        pbData = static_cast<BYTE*>(MemAlloc(cbData, FALSE));
         FileExitOnNull(pbData, hr, E_OUTOFMEMORY, "Failed to allocate memory to read in file: %ls", wzSrcPath);
     }
 
-    DWORD cbTotalRead = 0;
-    DWORD cbRead = 0;
-    do
-    {
-        DWORD cbRemaining = 0;
-        hr = ::ULongSub(cbData, cbTotalRead, &cbRemaining);
-        FileExitOnFailure(hr, "Underflow calculating remaining buffer size.");
+    hr = ReadChunks(hFile, pbData, cbData, &cbTotalRead);
+    FileExitOnFailure(hr, "Failed to read from file: %ls", wzSrcPath);
 
-        if (!::ReadFile(hFile, pbData + cbTotalRead, cbRemaining, &cbRead, NULL))
+    if (fKnownSize)
+    {
+        if (cbTotalRead != cbData)
         {
-            FileExitWithLastError(hr, "Failed to read from file: %ls", wzSrcPath);
+            hr = E_UNEXPECTED;
+            FileExitOnFailure(hr, "Failed to completely read file: %ls", wzSrcPath);
         }
+    }
+    else
+    {
+        // A full buffer may not be the end, so keep doubling it until the stream ends or the limit is reached
+        while (cbTotalRead == cbData && cbData < cbMaxRead)
+        {
+            cbData = (cbMaxRead - cbData < cbData) ? cbMaxRead : cbData * 2;
 
-        cbTotalRead += cbRead;
-    } while (cbRead);
+            pv = MemReAlloc(pbData, cbData, FALSE);
+            FileExitOnNull(pv, hr, E_OUTOFMEMORY, "Failed to grow memory to read in file: %ls", wzSrcPath);
 
-    if (cbTotalRead != cbData)
-    {
-        hr = E_UNEXPECTED;
-        FileExitOnFailure(hr, "Failed to completely read file: %ls", wzSrcPath);
+            pbData = static_cast<BYTE*>(pv);
+
+            hr = ReadChunks(hFile, pbData + cbTotalRead, cbData - cbTotalRead, &cbRead);
+            FileExitOnFailure(hr, "Failed to read from file: %ls", wzSrcPath);
+
+            cbTotalRead += cbRead;
+        }
+
+        // Filling the limit exactly is only too large if there's more after it
+        if (cbTotalRead == cbMaxRead && !fPartialOK)
+        {
+            hr = ReadChunks(hFile, &bExtra, sizeof(bExtra), &cbRead);
+            FileExitOnFailure(hr, "Failed to read from file: %ls", wzSrcPath);
+
+            if (cbRead)
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+                FileExitOnRootFailure(hr, "Failed to load file: %ls, too large.", wzSrcPath);
+            }
+        }
+
+        if (0 == cbTotalRead)
+        {
+            *pcbDest = 0;
+            ExitFunction1(hr = S_OK);
+        }
     }
 
     *ppbDest = pbData;
     pbData = NULL;
-    *pcbDest = cbData;
+    *pcbDest = cbTotalRead;
 
 LExit:
     ReleaseMem(pbData);
@@ -997,6 +1062,215 @@ LExit:
 }
 
 
+/*******************************************************************
+ FileMap - map a file into memory instead of reading it
+
+ A zero window size maps the whole file in one view. Otherwise at most
+ that much of the file is in view at a time, moved with FileMapView(),
+ so files larger than the address space can be mapped.
+********************************************************************/
+extern "C" HRESULT DAPI FileMap(
+    __in_z LPCWSTR wzPath,
+    __in BOOL fWritable,
+    __in SIZE_T cbWindow,
+    __out FILE_MAP* pMap
+    )
+{
+    HRESULT hr = S_OK;
+    UINT er = ERROR_SUCCESS;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    LARGE_INTEGER liFileSize = { };
+    SYSTEM_INFO si = { };
+    SIZE_T cbGranularity = 0;
+    LPBYTE pbData = NULL;
+    SIZE_T cbData = 0;
+
+    memset(pMap, 0, sizeof(FILE_MAP));
+
+    FileExitOnNull(wzPath, hr, E_INVALIDARG, "Invalid argument wzPath");
+    FileExitOnNull(*wzPath, hr, E_INVALIDARG, "*wzPath is null");
+
+    hFile = ::CreateFileW(wzPath, fWritable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, fWritable ? FILE_SHARE_READ : FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == hFile)
+    {
+        er = ::GetLastError();
+        if (E_FILENOTFOUND == HRESULT_FROM_WIN32(er))
+        {
+            ExitFunction1(hr = E_FILENOTFOUND);
+        }
+        FileExitOnWin32Error(er, hr, "Failed to open file: %ls", wzPath);
+    }
+
+    if (!::GetFileSizeEx(hFile, &liFileSize))
+    {
+        FileExitWithLastError(hr, "Failed to get size of file: %ls", wzPath);
+    }
+
+    if (cbWindow)
+    {
+        // Views start on the allocation granularity, so the window is rounded up to a multiple of it
+        ::GetSystemInfo(&si);
+        cbGranularity = si.dwAllocationGranularity;
+
+        hr = ::SizeTAdd(cbWindow, cbGranularity - 1, &cbWindow);
+        FileExitOnFailure(hr, "Window size too large to map file: %ls", wzPath);
+
+        cbWindow -= cbWindow % cbGranularity;
+    }
+    else if (static_cast<DWORD64>(liFileSize.QuadPart) > static_cast<SIZE_T>(-1))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+        FileExitOnRootFailure(hr, "Failed to map file: %ls, too large for a single view.", wzPath);
+    }
+
+    pMap->hFile = hFile;
+    hFile = INVALID_HANDLE_VALUE;
+    pMap->fWritable = fWritable;
+    pMap->cbFile = liFileSize.QuadPart;
+    pMap->cbWindow = cbWindow;
+
+    // Empty files cannot be mapped, their view just stays empty
+    if (pMap->cbFile)
+    {
+        // CreateFileMapping() returns NULL on failure, not INVALID_HANDLE_VALUE
+        pMap->hMapping = ::CreateFileMappingW(pMap->hFile, NULL, fWritable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+        FileExitOnNullWithLastError(pMap->hMapping, hr, "Failed to create mapping of file: %ls", wzPath);
+
+        hr = FileMapView(pMap, 0, &pbData, &cbData);
+        FileExitOnFailure(hr, "Failed to map view of file: %ls", wzPath);
+    }
+
+LExit:
+    ReleaseFile(hFile);
+
+    if (FAILED(hr))
+    {
+        FileUnmap(pMap);
+    }
+
+    return hr;
+}
+
+/*******************************************************************
+ FileMapView - move the view of a mapped file to include an offset
+
+ Returns the mapped data from the offset to the end of the view, which
+ is empty at the end of the file. The view is only moved when the offset
+ is outside of it.
+********************************************************************/
+extern "C" HRESULT DAPI FileMapView(
+    __in FILE_MAP* pMap,
+    __in DWORD64 qwOffset,
+    __deref_out_bcount(*pcbData) LPBYTE* ppbData,
+    __out SIZE_T* pcbData
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD64 qwViewOffset = 0;
+    DWORD64 cbView = 0;
+
+    if (qwOffset > pMap->cbFile)
+    {
+        hr = E_INVALIDARG;
+        FileExitOnFailure(hr, "Offset %llu is past the end of the mapped file, size %llu", qwOffset, pMap->cbFile);
+    }
+    else if (qwOffset == pMap->cbFile)
+    {
+        *ppbData = NULL;
+        *pcbData = 0;
+        ExitFunction1(hr = S_OK);
+    }
+
+    if (!pMap->pbView || qwOffset < pMap->qwViewOffset || pMap->qwViewOffset + pMap->cbView <= qwOffset)
+    {
+        if (pMap->cbWindow)
+        {
+            // The window is a multiple of the allocation granularity, so this is a valid view offset
+            qwViewOffset = qwOffset - qwOffset % pMap->cbWindow;
+            cbView = pMap->cbFile - qwViewOffset;
+            if (cbView > pMap->cbWindow)
+            {
+                cbView = pMap->cbWindow;
+            }
+        }
+        else
+        {
+            cbView = pMap->cbFile;
+        }
+
+        if (pMap->pbView)
+        {
+            ::UnmapViewOfFile(pMap->pbView);
+            pMap->pbView = NULL;
+            pMap->cbView = 0;
+        }
+
+        pMap->pbView = static_cast<LPBYTE>(::MapViewOfFile(pMap->hMapping, pMap->fWritable ? FILE_MAP_WRITE : FILE_MAP_READ, static_cast<DWORD>(qwViewOffset >> 32), static_cast<DWORD>(qwViewOffset), static_cast<SIZE_T>(cbView)));
+        FileExitOnNullWithLastError(pMap->pbView, hr, "Failed to map view of file at offset %llu", qwViewOffset);
+
+        pMap->cbView = static_cast<SIZE_T>(cbView);
+        pMap->qwViewOffset = qwViewOffset;
+    }
+
+    *ppbData = pMap->pbView + (qwOffset - pMap->qwViewOffset);
+    *pcbData = pMap->cbView - static_cast<SIZE_T>(qwOffset - pMap->qwViewOffset);
+
+LExit:
+    return hr;
+}
+
+/*******************************************************************
+ FileUnmap - release a file mapped with FileMap()
+
+ Changes made through a writable view are written back to the file.
+********************************************************************/
+extern "C" void DAPI FileUnmap(
+    __in FILE_MAP* pMap
+    )
+{
+    if (pMap->pbView)
+    {
+        ::UnmapViewOfFile(pMap->pbView);
+    }
+
+    ReleaseHandle(pMap->hMapping);
+    ReleaseHandle(pMap->hFile);
+
+    memset(pMap, 0, sizeof(FILE_MAP));
+}
+
+/*******************************************************************
+ FileMapExceptionFilter - handle the exception raised when a mapped
+                          view cannot be read from or written to the
+                          file, by returning its error in phr
+
+********************************************************************/
+extern "C" int DAPI FileMapExceptionFilter(
+    __in EXCEPTION_POINTERS* pExceptionPointers,
+    __out HRESULT* phr
+    )
+{
+    const EXCEPTION_RECORD* pRecord = pExceptionPointers->ExceptionRecord;
+
+    if (EXCEPTION_IN_PAGE_ERROR != pRecord->ExceptionCode)
+    {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    // The third parameter is the status of the I/O that failed
+    if (3 <= pRecord->NumberParameters)
+    {
+        *phr = HRESULT_FROM_NT(static_cast<LONG>(pRecord->ExceptionInformation[2]));
+    }
+    else
+    {
+        *phr = HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+    }
+
+    return EXCEPTION_EXECUTE_HANDLER;
+}
+
+
 /*******************************************************************
  FileWrite - write a file from memory
 
@@ -1822,94 +2096,31 @@ extern "C" HRESULT DAPI FileToString(
     )
 {
     HRESULT hr = S_OK;
-    BYTE *pbFullFileBuffer = NULL;
-    SIZE_T cbFullFileBuffer = 0;
-    BOOL fNullCharFound = FALSE;
+    FILE_MAP map = { };
     LPWSTR sczFileText = NULL;
 
-    // Check if the file is ANSI
-    hr = FileRead(&pbFullFileBuffer, &cbFullFileBuffer, wzFile);
+    // The contents are converted straight out of the mapped file rather than read into a copy first
+    hr = FileMap(wzFile, FALSE, 0, &map);
     FileExitOnFailure(hr, "Failed to read file: %ls", wzFile);
 
-    if (0 == cbFullFileBuffer)
+    if (0xFFFFFFFF < map.cbFile)
     {
-        *psczString = NULL;
-        ExitFunction1(hr = S_OK);
+        hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        FileExitOnRootFailure(hr, "Failed to convert file to string: %ls, too large.", wzFile);
     }
 
-    // UTF-8 BOM
-    if (cbFullFileBuffer > sizeof(UTF8BOM) && 0 == memcmp(pbFullFileBuffer, UTF8BOM, sizeof(UTF8BOM)))
+    __try
     {
-        if (pfeEncoding)
-        {
-            *pfeEncoding = FILE_ENCODING_UTF8_WITH_BOM;
-        }
-
-        hr = StrAllocStringAnsi(&sczFileText, reinterpret_cast<LPCSTR>(pbFullFileBuffer + 3), cbFullFileBuffer - 3, CP_UTF8);
-        FileExitOnFailure(hr, "Failed to convert file %ls from UTF-8 as its BOM indicated", wzFile);
-
-        *psczString = sczFileText;
-        sczFileText = NULL;
+        hr = StringFromFileData(wzFile, map.pbView, map.cbView, &sczFileText, psczString, pfeEncoding);
     }
-    // UTF-16 BOM, little endian (windows regular UTF-16)
-    else if (cbFullFileBuffer > sizeof(UTF16BOM) && 0 == memcmp(pbFullFileBuffer, UTF16BOM, sizeof(UTF16BOM)))
+    __except (FileMapExceptionFilter(GetExceptionInformation(), &hr))
     {
-        if (pfeEncoding)
-        {
-            *pfeEncoding = FILE_ENCODING_UTF16_WITH_BOM;
-        }
-
-        hr = StrAllocString(psczString, reinterpret_cast<LPWSTR>(pbFullFileBuffer + 2), (cbFullFileBuffer - 2) / sizeof(WCHAR));
-        FileExitOnFailure(hr, "Failed to allocate copy of string");
-    }
-    // No BOM, let's try to detect
-    else
-    {
-        for (DWORD i = 0; i < cbFullFileBuffer; ++i)
-        {
-            if (pbFullFileBuffer[i] == '\0')
-            {
-                fNullCharFound = TRUE;
-                break;
-            }
-        }
-
-        if (!fNullCharFound)
-        {
-            if (pfeEncoding)
-            {
-                *pfeEncoding = FILE_ENCODING_UTF8;
-            }
-
-            hr = StrAllocStringAnsi(&sczFileText, reinterpret_cast<LPCSTR>(pbFullFileBuffer), cbFullFileBuffer, CP_UTF8);
-            if (FAILED(hr))
-            {
-                if (E_OUTOFMEMORY == hr)
-                {
-                    FileExitOnFailure(hr, "Failed to convert file %ls from UTF-8", wzFile);
-                }
-            }
-            else
-            {
-                *psczString = sczFileText;
-                sczFileText = NULL;
-            }
-        }
-        else if (NULL == *psczString)
-        {
-            if (pfeEncoding)
-            {
-                *pfeEncoding = FILE_ENCODING_UTF16;
-            }
-
-            hr = StrAllocString(psczString, reinterpret_cast<LPWSTR>(pbFullFileBuffer), cbFullFileBuffer / sizeof(WCHAR));
-            FileExitOnFailure(hr, "Failed to allocate copy of string");
-        }
     }
+    FileExitOnFailure(hr, "Failed to convert file to string: %ls", wzFile);
 
 LExit:
     ReleaseStr(sczFileText);
-    ReleaseMem(pbFullFileBuffer);
+    FileUnmap(&map);
 
     return hr;
 }
@@ -1981,3 +2192,150 @@ LExit:
 
     return hr;
 }
+
+
+/*******************************************************************
+ ReadChunks - read until the buffer is full or the file ends, a large
+              sequential read at a time
+
+********************************************************************/
+static HRESULT ReadChunks(
+    __in HANDLE hFile,
+    __out_bcount_part(cbBuffer, *pcbRead) LPBYTE pbBuffer,
+    __in DWORD cbBuffer,
+    __out DWORD* pcbRead
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cbTotalRead = 0;
+    DWORD cbRead = 0;
+    DWORD er = ERROR_SUCCESS;
+
+    while (cbTotalRead < cbBuffer)
+    {
+        if (!::ReadFile(hFile, pbBuffer + cbTotalRead, min(cbBuffer - cbTotalRead, FILE_READ_CHUNK_SIZE), &cbRead, NULL))
+        {
+            er = ::GetLastError();
+
+            // The write end of a pipe closing is how a pipe ends
+            if (ERROR_BROKEN_PIPE == er)
+            {
+                break;
+            }
+
+            FileExitOnWin32Error(er, hr, "Failed to read from file.");
+        }
+
+        if (!cbRead)
+        {
+            break; // end of file
+        }
+
+        cbTotalRead += cbRead;
+    }
+
+    *pcbRead = cbTotalRead;
+
+LExit:
+    return hr;
+}
+
+
+/*******************************************************************
+ StringFromFileData - convert the contents of a file to a string in
+                      the encoding they appear to be in
+
+ Text converted from UTF-8 is built in psczFileText, which the caller
+ frees, so nothing leaks if reading the data raises an exception.
+********************************************************************/
+static HRESULT StringFromFileData(
+    __in_z LPCWSTR wzFile,
+    __in_bcount(cbFullFileBuffer) const BYTE* pbFullFileBuffer,
+    __in SIZE_T cbFullFileBuffer,
+    __inout LPWSTR* psczFileText,
+    __out LPWSTR* psczString,
+    __out_opt FILE_ENCODING* pfeEncoding
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fNullCharFound = FALSE;
+
+    if (0 == cbFullFileBuffer)
+    {
+        *psczString = NULL;
+        ExitFunction1(hr = S_OK);
+    }
+
+    // UTF-8 BOM
+    if (cbFullFileBuffer > sizeof(UTF8BOM) && 0 == memcmp(pbFullFileBuffer, UTF8BOM, sizeof(UTF8BOM)))
+    {
+        if (pfeEncoding)
+        {
+            *pfeEncoding = FILE_ENCODING_UTF8_WITH_BOM;
+        }
+
+        hr = StrAllocStringAnsi(psczFileText, reinterpret_cast<LPCSTR>(pbFullFileBuffer + 3), cbFullFileBuffer - 3, CP_UTF8);
+        FileExitOnFailure(hr, "Failed to convert file %ls from UTF-8 as its BOM indicated", wzFile);
+
+        *psczString = *psczFileText;
+        *psczFileText = NULL;
+    }
+    // UTF-16 BOM, little endian (windows regular UTF-16)
+    else if (cbFullFileBuffer > sizeof(UTF16BOM) && 0 == memcmp(pbFullFileBuffer, UTF16BOM, sizeof(UTF16BOM)))
+    {
+        if (pfeEncoding)
+        {
+            *pfeEncoding = FILE_ENCODING_UTF16_WITH_BOM;
+        }
+
+        hr = StrAllocString(psczString, reinterpret_cast<LPCWSTR>(pbFullFileBuffer + 2), (cbFullFileBuffer - 2) / sizeof(WCHAR));
+        FileExitOnFailure(hr, "Failed to allocate copy of string");
+    }
+    // No BOM, let's try to detect
+    else
+    {
+        for (SIZE_T i = 0; i < cbFullFileBuffer; ++i)
+        {
+            if (pbFullFileBuffer[i] == '\0')
+            {
+                fNullCharFound = TRUE;
+                break;
+            }
+        }
+
+        if (!fNullCharFound)
+        {
+            if (pfeEncoding)
+            {
+                *pfeEncoding = FILE_ENCODING_UTF8;
+            }
+
+            hr = StrAllocStringAnsi(psczFileText, reinterpret_cast<LPCSTR>(pbFullFileBuffer), cbFullFileBuffer, CP_UTF8);
+            if (FAILED(hr))
+            {
+                if (E_OUTOFMEMORY == hr)
+                {
+                    FileExitOnFailure(hr, "Failed to convert file %ls from UTF-8", wzFile);
+                }
+            }
+            else
+            {
+                *psczString = *psczFileText;
+                *psczFileText = NULL;
+            }
+        }
+        else if (NULL == *psczString)
+        {
+            if (pfeEncoding)
+            {
+                *pfeEncoding = FILE_ENCODING_UTF16;
+            }
+
+            hr = StrAllocString(psczString, reinterpret_cast<LPCWSTR>(pbFullFileBuffer), cbFullFileBuffer / sizeof(WCHAR));
+            FileExitOnFailure(hr, "Failed to allocate copy of string");
+        }
+    }
+
+LExit:
+    return hr;
+}
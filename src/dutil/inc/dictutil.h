@@ -17,7 +17,10 @@ extern const int STRINGDICT_HANDLE_BYTES;
 typedef enum DICT_FLAG
 {
     DICT_FLAG_NONE = 0,
-    DICT_FLAG_CASEINSENSITIVE = 1
+    DICT_FLAG_CASEINSENSITIVE = 1,
+    // Grow the dictionary a few slots at a time during later adds, instead of all at once
+    // when it fills up. Keeps the cost of every DictAddKey()/DictAddValue() call bounded.
+    DICT_FLAG_INCREMENTAL_RESIZE = 2
 } DICT_FLAG;
 
 HRESULT DAPI DictCreateWithEmbeddedKey(
@@ -32,6 +35,17 @@ HRESULT DAPI DictCreateStringList(
     __in DWORD dwNumExpectedItems,
     __in DICT_FLAG dfFlags
     );
+HRESULT DAPI DictCreateWithEmbeddedKeyConcurrent(
+    __out_bcount(STRINGDICT_HANDLE_BYTES) STRINGDICT_HANDLE* psdHandle,
+    __in DWORD dwNumExpectedItems,
+    __in size_t cByteOffset,
+    __in DICT_FLAG dfFlags
+    );
+HRESULT DAPI DictCreateStringListConcurrent(
+    __out_bcount(STRINGDICT_HANDLE_BYTES) STRINGDICT_HANDLE* psdHandle,
+    __in DWORD dwNumExpectedItems,
+    __in DICT_FLAG dfFlags
+    );
 HRESULT DAPI DictCreateStringListFromArray(
     __out_bcount(STRINGDICT_HANDLE_BYTES) STRINGDICT_HANDLE* psdHandle,
     __in_ecount(cStringArray) const LPCWSTR* rgwzStringArray,
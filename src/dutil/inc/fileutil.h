@@ -33,6 +33,23 @@ typedef enum FILE_ENCODING
     FILE_ENCODING_UTF16_WITH_BOM,
 } FILE_ENCODING;
 
+// A file mapped with FileMap(). The view covers the whole file unless a window size was given, in
+// which case it covers at most that many bytes starting qwViewOffset bytes into the file. Reading or
+// writing the view raises EXCEPTION_IN_PAGE_ERROR if the file cannot be, so access it inside
+// __try/__except (FileMapExceptionFilter(GetExceptionInformation(), &hr)).
+typedef struct _FILE_MAP
+{
+    HANDLE hFile;
+    HANDLE hMapping;
+    BOOL fWritable;
+    DWORD64 cbFile;
+    SIZE_T cbWindow;
+
+    LPBYTE pbView;
+    SIZE_T cbView;
+    DWORD64 qwViewOffset;
+} FILE_MAP;
+
 
 LPWSTR DAPI FileFromPath(
     __in_z LPCWSTR wzPath
@@ -130,6 +147,25 @@ HRESULT DAPI FileReadPartialEx(
     __in BOOL fPartialOK,
     __in DWORD dwShareMode
     );
+HRESULT DAPI FileMap(
+    __in_z LPCWSTR wzPath,
+    __in BOOL fWritable,
+    __in SIZE_T cbWindow,
+    __out FILE_MAP* pMap
+    );
+HRESULT DAPI FileMapView(
+    __in FILE_MAP* pMap,
+    __in DWORD64 qwOffset,
+    __deref_out_bcount(*pcbData) LPBYTE* ppbData,
+    __out SIZE_T* pcbData
+    );
+void DAPI FileUnmap(
+    __in FILE_MAP* pMap
+    );
+int DAPI FileMapExceptionFilter(
+    __in EXCEPTION_POINTERS* pExceptionPointers,
+    __out HRESULT* phr
+    );
 HRESULT DAPI FileWrite(
     __in_z LPCWSTR pwzFileName,
     __in DWORD dwFlagsAndAttributes,
@@ -6,6 +6,18 @@
 extern "C" {
 #endif
 
+#define ReleaseJsonDom(h) if (h) { JsonDomDestroy(h); }
+#define ReleaseNullJsonDom(h) if (h) { JsonDomDestroy(h); h = NULL; }
+
+typedef void* JSON_DOM_HANDLE;
+
+// Receives output from a streaming writer each time its buffer fills and when it is flushed.
+typedef HRESULT (CALLBACK *PFN_JSON_WRITE_CALLBACK)(
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in SIZE_T cbData,
+    __in_opt LPVOID pvContext
+    );
+
 typedef enum JSON_TOKEN
 {
     JSON_TOKEN_NONE,
@@ -19,24 +31,114 @@ typedef enum JSON_TOKEN
     JSON_TOKEN_VALUE,
 } JSON_TOKEN;
 
+typedef enum JSON_READER_FLAG
+{
+    JSON_READER_FLAG_NONE = 0,
+    // The reader does not take its critical section on each call. Use when a reader is only
+    // accessed from one thread at a time; readers share no state so separate documents can
+    // still be parsed on many threads at once.
+    JSON_READER_FLAG_UNSYNCHRONIZED = 1,
+} JSON_READER_FLAG;
+
+typedef enum JSON_WRITER_FLAG
+{
+    JSON_WRITER_FLAG_NONE = 0,
+    // Write UTF-8 to sczJsonUtf8 rather than UTF-16 to sczJson.
+    JSON_WRITER_FLAG_UTF8 = 1,
+} JSON_WRITER_FLAG;
+
+typedef enum JSON_VALUE_TYPE
+{
+    JSON_VALUE_TYPE_NONE,
+    JSON_VALUE_TYPE_NULL,
+    JSON_VALUE_TYPE_BOOL,
+    JSON_VALUE_TYPE_INTEGER,
+    JSON_VALUE_TYPE_DOUBLE,
+    JSON_VALUE_TYPE_STRING,
+    JSON_VALUE_TYPE_ARRAY,  // JSON_NODE only
+    JSON_VALUE_TYPE_OBJECT, // JSON_NODE only
+} JSON_VALUE_TYPE;
+
 typedef struct _JSON_VALUE
 {
+    JSON_VALUE_TYPE type;
+
+    BOOL fValue;      // JSON_VALUE_TYPE_BOOL
+    LONGLONG llValue; // JSON_VALUE_TYPE_INTEGER, numbers without fraction or exponent that fit
+    double dValue;    // JSON_VALUE_TYPE_DOUBLE, also set for JSON_VALUE_TYPE_INTEGER
+
+    // JSON_VALUE_TYPE_STRING, unescaped in place so it points into the reader's buffer and
+    // is only valid until the reader is uninitialized. Strings may contain embedded nulls
+    // (\u0000), so use cchValue rather than the null terminator when that matters.
+    // Readers created with JsonInitializeReaderUtf8() set szValue (cchValue is then in bytes)
+    // instead of wzValue; JsonAllocValueString() returns either as a wide string.
+    LPCWSTR wzValue;
+    LPCSTR szValue;
+    SIZE_T cchValue;
 } JSON_VALUE;
 
+// JsonReadNext() returns JSON_TOKEN_OBJECT_START, JSON_TOKEN_OBJECT_KEY (with the key in the
+// value), JSON_TOKEN_OBJECT_END, JSON_TOKEN_ARRAY_START, JSON_TOKEN_ARRAY_END and JSON_TOKEN_VALUE
+// for strings, numbers, true, false and null. It returns E_NOMOREITEMS once the whole document
+// has been read and E_INVALIDDATA for malformed JSON.
 typedef struct _JSON_READER
 {
     CRITICAL_SECTION cs;
+    BOOL fSynchronized;
     LPWSTR sczJson;
+    LPSTR sczJsonUtf8; // set instead of sczJson for UTF-8 readers
 
     LPWSTR pwz;
-    JSON_TOKEN token;
+    LPSTR psz;
+    JSON_TOKEN token; // last token read
+
+    JSON_TOKEN* rgTokenStack; // what is expected next in each open array or object, the document itself is first
+    DWORD cTokens;
+    DWORD dwDepth; // number of arrays and objects currently open
 } JSON_READER;
 
+// A DOM is a tape of nodes in document order, so the children of an array or object follow it
+// directly and each node records where its descendants end. Keys and strings are copied into an
+// arena, so JsonDomDestroy() releases the whole document with two frees.
+typedef struct _JSON_NODE
+{
+    JSON_VALUE_TYPE type;
+    DWORD iParent; // tape index of the containing array or object, zero for the root
+    DWORD iNext;   // tape index after this node's descendants, which is its next sibling if it has one
+    union
+    {
+        DWORD cChildren; // JSON_VALUE_TYPE_ARRAY and JSON_VALUE_TYPE_OBJECT
+        DWORD cchValue;  // JSON_VALUE_TYPE_STRING, which may contain embedded nulls
+    };
+
+    LPCWSTR wzKey; // member name when the parent is an object, otherwise NULL
+    union
+    {
+        BOOL fValue;      // JSON_VALUE_TYPE_BOOL
+        LONGLONG llValue; // JSON_VALUE_TYPE_INTEGER
+        double dValue;    // JSON_VALUE_TYPE_DOUBLE
+        LPCWSTR wzValue;  // JSON_VALUE_TYPE_STRING
+    };
+} JSON_NODE;
+
 typedef struct _JSON_WRITER
 {
     CRITICAL_SECTION cs;
     LPWSTR sczJson;
 
+    BOOL fUtf8;
+    LPSTR sczJsonUtf8; // written instead of sczJson when fUtf8 is set
+    DWORD cchJsonUtf8;
+
+    // Streaming writers collect output in a fixed size buffer and pass it to pfnWrite whenever
+    // it fills, so sczJson and sczJsonUtf8 stay NULL. The output is UTF-16 unless fUtf8 is set.
+    // Call JsonFlushWriter() after the last value; uninitializing discards anything buffered.
+    PFN_JSON_WRITE_CALLBACK pfnWrite;
+    LPVOID pvWriteContext;
+    LPBYTE pbBuffer;
+    SIZE_T cbBuffer;
+    SIZE_T cbBuffered;
+
     JSON_TOKEN* rgTokenStack;
     DWORD cTokens;
     DWORD cMaxTokens;
@@ -48,6 +150,19 @@ DAPI_(HRESULT) JsonInitializeReader(
     __in JSON_READER* pReader
     );
 
+DAPI_(HRESULT) JsonInitializeReaderEx(
+    __in_z LPCWSTR wzJson,
+    __in JSON_READER_FLAG jrfFlags,
+    __in JSON_READER* pReader
+    );
+
+DAPI_(HRESULT) JsonInitializeReaderUtf8(
+    __in_bcount(cbJson) LPCSTR szJson,
+    __in SIZE_T cbJson,
+    __in JSON_READER_FLAG jrfFlags,
+    __in JSON_READER* pReader
+    );
+
 DAPI_(void) JsonUninitializeReader(
     __in JSON_READER* pReader
     );
@@ -60,13 +175,83 @@ DAPI_(HRESULT) JsonReadNext(
 
 DAPI_(HRESULT) JsonReadValue(
     __in JSON_READER* pReader,
-    __in JSON_VALUE* pValue
+    __out JSON_VALUE* pValue
+    );
+
+DAPI_(HRESULT) JsonAllocValueString(
+    __deref_out_z LPWSTR* psczValue,
+    __in const JSON_VALUE* pValue
+    );
+
+DAPI_(HRESULT) JsonDomCreate(
+    __in JSON_READER* pReader,
+    __out JSON_DOM_HANDLE* phDom
+    );
+
+DAPI_(HRESULT) JsonDomParse(
+    __in_z LPCWSTR wzJson,
+    __out JSON_DOM_HANDLE* phDom
+    );
+
+DAPI_(HRESULT) JsonDomParseUtf8(
+    __in_bcount(cbJson) LPCSTR szJson,
+    __in SIZE_T cbJson,
+    __out JSON_DOM_HANDLE* phDom
+    );
+
+DAPI_(void) JsonDomDestroy(
+    __in JSON_DOM_HANDLE hDom
+    );
+
+DAPI_(const JSON_NODE*) JsonDomGetRoot(
+    __in JSON_DOM_HANDLE hDom
+    );
+
+DAPI_(const JSON_NODE*) JsonDomGetFirstChild(
+    __in JSON_DOM_HANDLE hDom,
+    __in const JSON_NODE* pNode
+    );
+
+DAPI_(const JSON_NODE*) JsonDomGetNextSibling(
+    __in JSON_DOM_HANDLE hDom,
+    __in const JSON_NODE* pNode
+    );
+
+DAPI_(HRESULT) JsonDomQuery(
+    __in JSON_DOM_HANDLE hDom,
+    __in_opt const JSON_NODE* pNode,
+    __in_z LPCWSTR wzPointer,
+    __out const JSON_NODE** ppNode
     );
 
 DAPI_(HRESULT) JsonInitializeWriter(
     __in JSON_WRITER* pWriter
     );
 
+DAPI_(HRESULT) JsonInitializeWriterEx(
+    __in JSON_WRITER* pWriter,
+    __in JSON_WRITER_FLAG jwfFlags
+    );
+
+DAPI_(HRESULT) JsonInitializeStreamWriter(
+    __in JSON_WRITER* pWriter,
+    __in JSON_WRITER_FLAG jwfFlags,
+    __in SIZE_T cbBuffer,
+    __in PFN_JSON_WRITE_CALLBACK pfnWrite,
+    __in_opt LPVOID pvContext
+    );
+
+DAPI_(HRESULT) JsonInitializeFileWriter(
+    __in JSON_WRITER* pWriter,
+    __in JSON_WRITER_FLAG jwfFlags,
+    __in SIZE_T cbBuffer,
+    __in HANDLE hFile
+    );
+
+DAPI_(HRESULT) JsonFlushWriter(
+    __in JSON_WRITER* pWriter
+    );
+
 DAPI_(void) JsonUninitializeWriter(
     __in JSON_WRITER* pWriter
     );
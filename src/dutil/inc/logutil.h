@@ -17,9 +17,91 @@ typedef HRESULT (DAPI *PFN_LOGSTRINGWORKRAW)(
     __in_opt LPVOID pvContext
     );
 
+// Called before a rotated log is created again, a failure is handled as if it could not be.
+typedef HRESULT (DAPI *PFN_LOGROTATIONOPEN)(
+    __in_z LPCWSTR wzLogPath,
+    __in_opt LPVOID pvContext
+    );
+
 // enums
+typedef enum LOG_ASYNC_POLICY
+{
+    // Loggers wait for the writer thread when the queue is full.
+    LOG_ASYNC_POLICY_BLOCK,
+    // Lines that do not fit in the queue are dropped, counted in the log, and return S_FALSE.
+    // Error lines and lines that define a binary log template or module wait for room instead.
+    LOG_ASYNC_POLICY_DROP,
+} LOG_ASYNC_POLICY;
+
+typedef enum LOG_FORMAT
+{
+    LOG_FORMAT_TEXT,
+    // Records as described by the LOG_BINARY_* structs below, read back with LogDecodeBinary().
+    LOG_FORMAT_BINARY,
+} LOG_FORMAT;
+
+typedef enum LOG_BINARY_RECORD_TYPE
+{
+    // Starts each log opened with LogOpen(), forgetting all earlier template and module ids.
+    LOG_BINARY_RECORD_TYPE_SESSION = 1,
+    // Defines a template id, followed by the printf format as UTF-8.
+    LOG_BINARY_RECORD_TYPE_TEMPLATE,
+    // Defines a module id, followed by the path of the module as UTF-8.
+    LOG_BINARY_RECORD_TYPE_MODULE,
+    // A logged line, followed by its arguments.
+    LOG_BINARY_RECORD_TYPE_LINE,
+    // Text written with LogStringWorkRaw() or by logutil itself, as UTF-8.
+    LOG_BINARY_RECORD_TYPE_TEXT,
+} LOG_BINARY_RECORD_TYPE;
+
+// Each argument is this type as a byte followed by its value. Strings are a DWORD count of bytes
+// followed by that much UTF-8.
+typedef enum LOG_BINARY_ARG_TYPE
+{
+    LOG_BINARY_ARG_TYPE_INT32 = 1,
+    LOG_BINARY_ARG_TYPE_INT64,
+    LOG_BINARY_ARG_TYPE_DOUBLE,
+    LOG_BINARY_ARG_TYPE_STRING,
+} LOG_BINARY_ARG_TYPE;
+
+typedef enum LOG_BINARY_LINE_FLAG
+{
+    LOG_BINARY_LINE_FLAG_NONE = 0,
+    // Logged as a full line, with the usual prefix and line ending.
+    LOG_BINARY_LINE_FLAG_NEWLINE = 1,
+} LOG_BINARY_LINE_FLAG;
+
+const DWORD LOG_BINARY_MAGIC = 0x474C5544; // "DULG"
+const WORD LOG_BINARY_VERSION = 1;
 
 // structs
+#pragma pack(push, 1)
+// Every record starts with this header, followed by cbData bytes.
+typedef struct _LOG_BINARY_RECORD
+{
+    BYTE bType;
+    DWORD cbData;
+} LOG_BINARY_RECORD;
+
+typedef struct _LOG_BINARY_SESSION
+{
+    DWORD dwMagic;
+    WORD wVersion;
+    DWORD dwProcessId;
+    LONGLONG llLocalTimeBias; // added to line times to get the writer's local time
+} LOG_BINARY_SESSION;
+
+typedef struct _LOG_BINARY_LINE
+{
+    ULONGLONG ullTime; // UTC, as a FILETIME
+    DWORD dwThreadId;
+    BYTE bLevel; // REPORT_LEVEL
+    BYTE bFlags; // LOG_BINARY_LINE_FLAG
+    DWORD dwLogId;
+    DWORD dwModuleId; // zero when the line did not come from a message table
+    DWORD dwTemplateId; // zero when the line was formatted as it was logged, in a single string argument
+} LOG_BINARY_LINE;
+#pragma pack(pop)
 
 // functions
 BOOL DAPI IsLogInitialized();
@@ -61,6 +143,50 @@ void DAPI LogUninitialize(
 
 BOOL DAPI LogIsOpen();
 
+HRESULT DAPI LogEnableAsync(
+    __in DWORD cbQueue,
+    __in LOG_ASYNC_POLICY policy
+    );
+
+void DAPI LogDisableAsync();
+
+HRESULT DAPI LogFlush();
+
+HRESULT DAPI LogEnableRotation(
+    __in DWORD64 cbMaxSize,
+    __in DWORD dwMaxAgeSeconds,
+    __in DWORD cKeep,
+    __in BOOL fCompress
+    );
+
+void DAPI LogDisableRotation();
+
+void DAPI LogSetRotationOpenCallback(
+    __in_opt PFN_LOGROTATIONOPEN pfnOpen,
+    __in_opt LPVOID pvContext
+    );
+
+HRESULT DAPI LogSetFormat(
+    __in LOG_FORMAT format
+    );
+
+HRESULT DAPI LogSetPreInitLimit(
+    __in DWORD cbLimit
+    );
+
+HRESULT DAPI LogDecodeBinary(
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in SIZE_T cbData,
+    __in PFN_LOGSTRINGWORKRAW pfnWrite,
+    __in_opt LPVOID pvContext
+    );
+
+HRESULT DAPI LogDecodeBinaryFile(
+    __in_z LPCWSTR wzPath,
+    __in PFN_LOGSTRINGWORKRAW pfnWrite,
+    __in_opt LPVOID pvContext
+    );
+
 HRESULT DAPI LogSetSpecialParams(
     __in_z_opt LPCWSTR wzSpecialBeginLine,
     __in_z_opt LPCWSTR wzSpecialAfterTimeStamp,
@@ -182,6 +308,10 @@ HRESULT DAPI LogHeader();
 
 HRESULT DAPI LogFooter();
 
+HRESULT DAPI LogMemoryTelemetry(
+    __in REPORT_LEVEL rl
+    );
+
 HRESULT LogStringWorkRaw(
     __in_z LPCSTR szLogData
     );
@@ -8,10 +8,76 @@ extern "C" {
 
 #define ReleaseMem(p) if (p) { MemFree(p); }
 #define ReleaseNullMem(p) if (p) { MemFree(p); p = NULL; }
+#define ReleaseMemArena(h) if (h) { MemArenaDestroy(h); }
+#define ReleaseNullMemArena(h) if (h) { MemArenaDestroy(h); h = NULL; }
+
+typedef void* MEM_ARENA_HANDLE;
+
+// Number of size classes tracked by memory telemetry: class 0 counts allocations up to 16 bytes,
+// each following class doubles the limit and the last class counts everything bigger.
+#define MEM_TELEMETRY_SIZE_CLASSES 16
+
+typedef LPVOID (DAPI *PFN_MEMALLOC)(
+    __in_opt LPVOID pvContext,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    );
+typedef LPVOID (DAPI *PFN_MEMREALLOC)(
+    __in_opt LPVOID pvContext,
+    __in LPVOID pv,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    );
+typedef HRESULT (DAPI *PFN_MEMFREE)(
+    __in_opt LPVOID pvContext,
+    __in LPVOID pv
+    );
+typedef SIZE_T (DAPI *PFN_MEMSIZE)(
+    __in_opt LPVOID pvContext,
+    __in LPCVOID pv
+    );
+
+typedef struct _MEM_ALLOCATOR
+{
+    PFN_MEMALLOC pfnAlloc;
+    PFN_MEMREALLOC pfnReAlloc;
+    PFN_MEMFREE pfnFree;
+    PFN_MEMSIZE pfnSize;
+    LPVOID pvContext;
+} MEM_ALLOCATOR;
+
+typedef struct _MEM_SOURCE_TELEMETRY
+{
+    DWORD64 cAllocations;
+    DWORD64 cReAllocations;
+    DWORD64 cbAllocated;
+    DWORD64 rgcSizeClasses[MEM_TELEMETRY_SIZE_CLASSES];
+} MEM_SOURCE_TELEMETRY;
+
+typedef struct _MEM_TELEMETRY
+{
+    DWORD64 cFrees;
+    LONG64 cbLive;
+    LONG64 cbPeak;
+} MEM_TELEMETRY;
 
 HRESULT DAPI MemInitialize();
 void DAPI MemUninitialize();
 
+HRESULT DAPI MemSetAllocator(
+    __in_opt const MEM_ALLOCATOR* pAllocator
+    );
+void DAPI MemTelemetryEnable(
+    __in BOOL fEnable
+    );
+HRESULT DAPI MemGetSourceTelemetry(
+    __in UINT source,
+    __out MEM_SOURCE_TELEMETRY* pTelemetry
+    );
+void DAPI MemGetTelemetry(
+    __out MEM_TELEMETRY* pTelemetry
+    );
+
 LPVOID DAPI MemAlloc(
     __in SIZE_T cbSize,
     __in BOOL fZero
@@ -21,6 +87,17 @@ LPVOID DAPI MemReAlloc(
     __in SIZE_T cbSize,
     __in BOOL fZero
     );
+LPVOID DAPI MemAllocSource(
+    __in UINT source,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    );
+LPVOID DAPI MemReAllocSource(
+    __in UINT source,
+    __in LPVOID pv,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    );
 HRESULT DAPI MemReAllocSecure(
     __in LPVOID pv,
     __in SIZE_T cbSize,
@@ -74,6 +151,22 @@ SIZE_T DAPI MemSize(
     __in LPCVOID pv
     );
 
+HRESULT DAPI MemArenaCreate(
+    __in SIZE_T cbBlock,
+    __out MEM_ARENA_HANDLE* phArena
+    );
+LPVOID DAPI MemArenaAlloc(
+    __in MEM_ARENA_HANDLE hArena,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    );
+void DAPI MemArenaReset(
+    __in MEM_ARENA_HANDLE hArena
+    );
+void DAPI MemArenaDestroy(
+    __in MEM_ARENA_HANDLE hArena
+    );
+
 #ifdef __cplusplus
 }
 #endif
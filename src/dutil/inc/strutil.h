@@ -17,6 +17,34 @@ extern "C" {
 #define DeclareConstBSTR(bstr_const, wz) const WCHAR bstr_const[] = { 0x00, 0x00, sizeof(wz)-sizeof(WCHAR), 0x00, wz }
 #define UseConstBSTR(bstr_const) const_cast<BSTR>(bstr_const + 4)
 
+// Builds a string by appending to it, tracking the length and capacity so appends never have to
+// measure the string. Zero-initialize (or call StrBuilderInitialize()) before use, then call
+// StrBuilderDetach() to take the string and/or StrBuilderUninitialize() to free it.
+typedef struct _STR_BUILDER
+{
+    LPWSTR sczString;   // always null terminated once anything is allocated
+    SIZE_T cch;         // length of the string, not counting the null terminator
+    SIZE_T cchCapacity; // characters allocated for sczString, including the null terminator
+} STR_BUILDER;
+
+// A view of characters in someone else's buffer. It is not necessarily null terminated, so
+// always use the length. Views are only valid as long as the buffer they point into.
+typedef struct _STR_VIEW
+{
+    LPCWSTR wz;
+    SIZE_T cch;
+} STR_VIEW;
+
+// Splits a buffer into STR_VIEW tokens without allocating or modifying it. Initialize with
+// StrTokenizerInitialize() or StrTokenizerInitializeMultiSz(), then call StrTokenizerNext().
+typedef struct _STR_TOKENIZER
+{
+    LPCWSTR wzNext;       // start of the next token
+    LPCWSTR wzEnd;        // one past the last character to tokenize
+    LPCWSTR wzDelimiters; // any of these characters ends a token, NULL splits on null characters
+    BOOL fSkipEmpty;      // skip empty tokens between adjacent delimiters like wcstok_s()
+} STR_TOKENIZER;
+
 HRESULT DAPI StrAlloc(
     __deref_out_ecount_part(cch, 0) LPWSTR* ppwz,
     __in SIZE_T cch
@@ -304,6 +332,75 @@ HRESULT DAPI StrSplitAllocArray(
     __in_z LPCWSTR wzDelim
     );
 
+void DAPI StrTokenizerInitialize(
+    __out STR_TOKENIZER* pTokenizer,
+    __in_ecount(cchSource) LPCWSTR wzSource,
+    __in SIZE_T cchSource,
+    __in_z LPCWSTR wzDelimiters,
+    __in BOOL fSkipEmpty
+    );
+HRESULT DAPI StrTokenizerInitializeMultiSz(
+    __out STR_TOKENIZER* pTokenizer,
+    __in __nullnullterminated LPCWSTR pwzMultiSz,
+    __in SIZE_T cchMultiSz
+    );
+BOOL DAPI StrTokenizerNext(
+    __inout STR_TOKENIZER* pTokenizer,
+    __out STR_VIEW* pToken
+    );
+void DAPI StrViewTrimWhitespace(
+    __inout STR_VIEW* pView
+    );
+HRESULT DAPI StrViewCompare(
+    __in const STR_VIEW* pView1,
+    __in const STR_VIEW* pView2,
+    __in DWORD dwCompareFlags,
+    __out int* pnResult
+    );
+HRESULT DAPI StrAllocStringView(
+    __deref_out_z LPWSTR* ppwz,
+    __in const STR_VIEW* pView
+    );
+HRESULT DAPI StrAllocConcatView(
+    __deref_out_z LPWSTR* ppwz,
+    __in const STR_VIEW* pView
+    );
+
+HRESULT DAPI StrBuilderInitialize(
+    __out STR_BUILDER* pBuilder,
+    __in SIZE_T cchReserve
+    );
+void DAPI StrBuilderUninitialize(
+    __in STR_BUILDER* pBuilder
+    );
+HRESULT DAPI StrBuilderAppend(
+    __in STR_BUILDER* pBuilder,
+    __in_z LPCWSTR wzSource
+    );
+HRESULT DAPI StrBuilderAppendN(
+    __in STR_BUILDER* pBuilder,
+    __in_ecount(cchSource) LPCWSTR wzSource,
+    __in SIZE_T cchSource
+    );
+HRESULT DAPI StrBuilderAppendChar(
+    __in STR_BUILDER* pBuilder,
+    __in WCHAR wch
+    );
+HRESULT __cdecl StrBuilderAppendFormatted(
+    __in STR_BUILDER* pBuilder,
+    __in __format_string LPCWSTR wzFormat,
+    ...
+    );
+HRESULT DAPI StrBuilderAppendFormattedArgs(
+    __in STR_BUILDER* pBuilder,
+    __in __format_string LPCWSTR wzFormat,
+    __in va_list args
+    );
+HRESULT DAPI StrBuilderDetach(
+    __in STR_BUILDER* pBuilder,
+    __deref_out_z LPWSTR* psczString
+    );
+
 HRESULT DAPI StrSecureZeroString(
     __in LPWSTR pwz
     );
@@ -18,6 +18,20 @@
 #define IniExitOnGdipFailure(g, x, s, ...) ExitOnGdipFailureSource(DUTIL_SOURCE_INIUTIL, g, x, s, __VA_ARGS__)
 
 const LPCWSTR wzSectionSeparator = L"\\";
+const DWORD INI_VALUE_INDEX_MIN_SLOTS = 64;
+const SIZE_T INI_WRITE_BUFFER_SIZE = 64 * 1024;
+const BYTE rgbUtf8Bom[] = { 0xEF, 0xBB, 0xBF };
+const BYTE rgbUtf16Bom[] = { 0xFF, 0xFE };
+
+// A run of lines in the parsed file: the lines before the first section, then each section from its
+// open tag up to the next one. Regions nothing was set in are written back as the bytes they were read
+// from, so only the sections that changed are regenerated.
+struct INI_REGION
+{
+    DWORD dwFirstLine;
+    DWORD cbOffset; // from the start of the text, past any byte order mark
+    BOOL fDirty;
+};
 
 struct INI_STRUCT
 {
@@ -37,15 +51,72 @@ struct INI_STRUCT
     INI_VALUE *rgivValues;
     DWORD cValues;
 
+    // Open addressing hash of value names, each slot holding the index of a value plus one so zero
+    // is empty. Only the first value with a name is indexed, the one a linear search would find.
+    DWORD *rgdwValueIndex;
+    DWORD cValueIndexSlots;
+
     LPWSTR *rgsczLines;
     DWORD cLines;
 
+    INI_REGION *rgRegions;
+    DWORD cRegions;
+    DWORD cbRegionsEnd; // where the parsed text stopped, the end of the last region
+
+    // Regions are only copied while the file still has the size and write time it was parsed with
+    DWORD cbSource;
+    FILETIME ftSourceWrite;
+
     FILE_ENCODING feEncoding;
     BOOL fModified;
 };
 
 const int INI_HANDLE_BYTES = sizeof(INI_STRUCT);
 
+enum INI_MARKER
+{
+    INI_MARKER_COMMENT_LINE_PREFIX,
+    INI_MARKER_OPEN_TAG_PREFIX,
+    INI_MARKER_OPEN_TAG_POSTFIX,
+    INI_MARKER_VALUE_PREFIX,
+    INI_MARKER_VALUE_SEPARATOR,
+    INI_MARKER_COUNT,
+};
+
+// The style strings of an INI_STRUCT in the encoding of the file being parsed, so its lines can be
+// matched where they are mapped. A marker that is not part of the style is NULL.
+template<typename T> struct INI_MARKERS
+{
+    const T *rgpchMarkers[INI_MARKER_COUNT];
+    SIZE_T rgcchMarkers[INI_MARKER_COUNT];
+
+    const T **rgpchValueSeparatorExceptions;
+    SIZE_T *rgcchValueSeparatorExceptions;
+    DWORD cValueSeparatorExceptions;
+};
+
+// Strings ParseLines() copies out of the mapped file. The caller owns them, so they are freed even when
+// reading the file raises an exception in the middle of a line.
+struct INI_PARSE_STRINGS
+{
+    LPWSTR sczSectionPrefix;
+    LPWSTR sczName;
+    LPWSTR sczValue;
+};
+
+// Output of IniWriteFile() in the encoding being written, collected in a fixed size buffer and
+// written to the file whenever it fills.
+struct INI_WRITER
+{
+    HANDLE hFile;
+    FILE_ENCODING feEncoding;
+    LPBYTE pbBuffer;
+    SIZE_T cbBuffer;
+    SIZE_T cbBuffered;
+
+    LPCWSTR wzPendingEndline; // finishes copied text that ended in the middle of a line, before anything more is written
+};
+
 static HRESULT GetSectionPrefixFromName(
     __in_z LPCWSTR wzName,
     __deref_inout_z LPWSTR* psczOutput
@@ -53,6 +124,167 @@ static HRESULT GetSectionPrefixFromName(
 static void UninitializeIniValue(
     INI_VALUE *pivValue
     );
+static DWORD HashValueName(
+    __in_z LPCWSTR wzName
+    );
+static DWORD FindValue(
+    __in INI_STRUCT *pi,
+    __in_z LPCWSTR wzName
+    );
+static HRESULT AddValueToIndex(
+    __in INI_STRUCT *pi,
+    __in DWORD iValue
+    );
+static void InsertIntoValueIndex(
+    __in INI_STRUCT *pi,
+    __in DWORD iValue
+    );
+static HRESULT RebuildValueIndex(
+    __in INI_STRUCT *pi
+    );
+static HRESULT AddRegion(
+    __in INI_STRUCT *pi,
+    __in DWORD dwFirstLine,
+    __in DWORD cbOffset
+    );
+static void MarkRegionDirty(
+    __in INI_STRUCT *pi,
+    __in DWORD dwLineNumber
+    );
+static HRESULT ParseSource(
+    __in INI_STRUCT *pi,
+    __in_bcount(cbFile) const BYTE *pbFile,
+    __in SIZE_T cbFile,
+    __in INI_MARKERS<WCHAR> *pMarkers,
+    __in INI_MARKERS<CHAR> *pMarkersUtf8,
+    __in INI_PARSE_STRINGS *pStrings
+    );
+static HRESULT MapSource(
+    __in INI_STRUCT *pi,
+    __out FILE_MAP *pMap
+    );
+static HRESULT CopyRegion(
+    __in INI_WRITER *pWriter,
+    __in_bcount(cbRegion) const BYTE *pbRegion,
+    __in SIZE_T cbRegion
+    );
+static HRESULT WriteLines(
+    __in INI_STRUCT *pi,
+    __in INI_WRITER *pWriter,
+    __in DWORD dwLineEnd,
+    __inout DWORD *piValue,
+    __inout DWORD *piLine,
+    __deref_inout_z_opt LPWSTR *psczCurrentSectionPrefix
+    );
+static HRESULT CreateTempFile(
+    __in_z LPCWSTR wzPath,
+    __deref_out_z LPWSTR *psczTempPath,
+    __out HANDLE *phFile
+    );
+static HRESULT InitializeWriter(
+    __in INI_WRITER *pWriter,
+    __in HANDLE hFile,
+    __in FILE_ENCODING feEncoding,
+    __out DWORD *pcbBom
+    );
+static void UninitializeWriter(
+    __in INI_WRITER *pWriter
+    );
+static HRESULT WriteBytes(
+    __in INI_WRITER *pWriter,
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in SIZE_T cbData
+    );
+static HRESULT WriteString(
+    __in INI_WRITER *pWriter,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch
+    );
+static HRESULT FlushWriter(
+    __in INI_WRITER *pWriter
+    );
+template<typename T> static HRESULT InitializeMarkers(
+    __in INI_STRUCT *pi,
+    __out INI_MARKERS<T> *pMarkers
+    );
+template<typename T> static void UninitializeMarkers(
+    __in INI_MARKERS<T> *pMarkers
+    );
+static HRESULT AllocMarker(
+    __in_z LPCWSTR wzStyle,
+    __out LPCWSTR *pwzMarker,
+    __out SIZE_T *pcchMarker
+    );
+static HRESULT AllocMarker(
+    __in_z LPCWSTR wzStyle,
+    __out LPCSTR *pszMarker,
+    __out SIZE_T *pcchMarker
+    );
+static void FreeMarker(
+    __in_opt LPCWSTR wzMarker
+    );
+static void FreeMarker(
+    __in_opt LPCSTR szMarker
+    );
+template<typename T> static HRESULT ParseLines(
+    __in INI_STRUCT *pi,
+    __in const INI_MARKERS<T> *pMarkers,
+    __in INI_PARSE_STRINGS *pStrings,
+    __in_ecount(cchContents) const T *pchContents,
+    __in SIZE_T cchContents
+    );
+template<typename T> static const T *ScanLine(
+    __in const INI_MARKERS<T> *pMarkers,
+    __in const T *pchLine,
+    __in const T *pchEnd,
+    __out_ecount(INI_MARKER_COUNT) const T **rgpchFound
+    );
+template<typename T> static BOOL IsMarkerAt(
+    __in const T *pch,
+    __in const T *pchEnd,
+    __in_ecount(cchMarker) const T *pchMarker,
+    __in SIZE_T cchMarker
+    );
+template<typename T> static void TrimSpan(
+    __inout const T **ppch,
+    __inout SIZE_T *pcch
+    );
+static BOOL IsWithinFirstCharacter(
+    __in LPCWSTR wzLine,
+    __in LPCWSTR wzLineEnd,
+    __in LPCWSTR wz
+    );
+static BOOL IsWithinFirstCharacter(
+    __in LPCSTR szLine,
+    __in LPCSTR szLineEnd,
+    __in LPCSTR sz
+    );
+static LPCWSTR SkipCodeUnits(
+    __in LPCWSTR wz,
+    __in LPCWSTR wzEnd,
+    __in_ecount(cchUnits) LPCWSTR wzUnits,
+    __in SIZE_T cchUnits
+    );
+static LPCSTR SkipCodeUnits(
+    __in LPCSTR sz,
+    __in LPCSTR szEnd,
+    __in_ecount(cchUnits) LPCSTR szUnits,
+    __in SIZE_T cchUnits
+    );
+static SIZE_T Utf8SequenceLength(
+    __in LPCSTR sz,
+    __in LPCSTR szEnd
+    );
+static HRESULT AllocSpan(
+    __deref_out_z LPWSTR *psczDest,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch
+    );
+static HRESULT AllocSpan(
+    __deref_out_z LPWSTR *psczDest,
+    __in_ecount(cch) LPCSTR sz,
+    __in SIZE_T cch
+    );
 
 extern "C" HRESULT DAPI IniInitialize(
     __out_bcount(INI_HANDLE_BYTES) INI_HANDLE* piHandle
@@ -92,8 +324,10 @@ extern "C" void DAPI IniUninitialize(
         UninitializeIniValue(pi->rgivValues + i);
     }
     ReleaseMem(pi->rgivValues);
+    ReleaseMem(pi->rgdwValueIndex);
 
     ReleaseStrArray(pi->rgsczLines, pi->cLines);
+    ReleaseMem(pi->rgRegions);
 
     ReleaseMem(pi);
 }
@@ -218,194 +452,55 @@ extern "C" HRESULT DAPI IniParse(
     )
 {
     HRESULT hr = S_OK;
-    DWORD dwValuePrefixLength = 0;
-    DWORD dwValueSeparatorExceptionLength = 0;
-    LPWSTR sczContents = NULL;
-    LPWSTR sczCurrentSection = NULL;
-    LPWSTR sczName = NULL;
-    LPWSTR sczNameTrimmed = NULL;
-    LPWSTR sczValue = NULL;
-    LPWSTR sczValueTrimmed = NULL;
-    LPWSTR wzOpenTagPrefix = NULL;
-    LPWSTR wzOpenTagPostfix = NULL;
-    LPWSTR wzValuePrefix = NULL;
-    LPWSTR wzValueNameStart = NULL;
-    LPWSTR wzValueSeparator = NULL;
-    LPWSTR wzCommentLinePrefix = NULL;
-    LPWSTR wzValueBegin = NULL;
-    LPCWSTR wzTemp = NULL;
+    FILE_MAP map = { };
+    INI_MARKERS<WCHAR> markers = { };
+    INI_MARKERS<CHAR> markersUtf8 = { };
+    INI_PARSE_STRINGS strings = { };
 
     INI_STRUCT *pi = static_cast<INI_STRUCT *>(piHandle);
 
-    BOOL fSections = (NULL != pi->sczOpenTagPrefix) && (NULL != pi->sczOpenTagPostfix);
-    BOOL fValuePrefix = (NULL != pi->sczValuePrefix);
-
     hr = StrAllocString(&pi->sczPath, wzPath, 0);
     IniExitOnFailure(hr, "Failed to copy path to ini struct: %ls", wzPath);
 
-    hr = FileToString(pi->sczPath, &sczContents, &pi->feEncoding);
-    IniExitOnFailure(hr, "Failed to convert file to string: %ls", pi->sczPath);
+    hr = FileMap(pi->sczPath, FALSE, 0, &map);
+    IniExitOnFailure(hr, "Failed to open INI file: %ls", pi->sczPath);
 
-    if (pfeEncodingFound)
+    if (0xFFFFFFFF < map.cbFile)
     {
-        *pfeEncodingFound = pi->feEncoding;
+        hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        IniExitOnRootFailure(hr, "Failed to load INI file: %ls, too large.", pi->sczPath);
     }
 
-    if (!sczContents || !*sczContents)
+    if (!::GetFileTime(map.hFile, NULL, NULL, &pi->ftSourceWrite))
     {
-        // Empty string, nothing to parse
-        ExitFunction1(hr = S_OK);
+        IniExitWithLastError(hr, "Failed to get write time of INI file: %ls", pi->sczPath);
     }
 
-    dwValuePrefixLength = lstrlenW(pi->sczValuePrefix);
-    hr = StrSplitAllocArray(&pi->rgsczLines, reinterpret_cast<UINT *>(&pi->cLines), sczContents, L"\n");
-    IniExitOnFailure(hr, "Failed to split INI file into lines");
+    pi->cbSource = static_cast<DWORD>(map.cbView);
 
-    for (DWORD i = 0; i < pi->cLines; ++i)
+    // Reading the mapped lines raises an exception if the file can't be read
+    __try
     {
-        if (!*pi->rgsczLines[i] || '\r' == *pi->rgsczLines[i])
-        {
-            continue;
-        }
-
-        if (pi->sczCommentLinePrefix)
-        {
-            wzCommentLinePrefix = wcsstr(pi->rgsczLines[i], pi->sczCommentLinePrefix);
-
-            if (wzCommentLinePrefix && wzCommentLinePrefix <= pi->rgsczLines[i] + 1)
-            {
-                continue;
-            }
-        }
-
-        if (pi->sczOpenTagPrefix)
-        {
-            wzOpenTagPrefix = wcsstr(pi->rgsczLines[i], pi->sczOpenTagPrefix);
-            if (wzOpenTagPrefix)
-            {
-                // If there is an open tag prefix but there is anything but whitespace before it, then it's NOT an open tag prefix
-                // This is important, for example, to support values with names like "Array[0]=blah" in INI format
-                for (wzTemp = pi->rgsczLines[i]; wzTemp < wzOpenTagPrefix; ++wzTemp)
-                {
-                    if (*wzTemp != L' ' && *wzTemp != L'\t')
-                    {
-                        wzOpenTagPrefix = NULL;
-                        break;
-                    }
-                }
-            }
-        }
-
-        if (pi->sczOpenTagPostfix)
-        {
-            wzOpenTagPostfix = wcsstr(pi->rgsczLines[i], pi->sczOpenTagPostfix);
-        }
-
-        if (pi->sczValuePrefix)
-        {
-            wzValuePrefix = wcsstr(pi->rgsczLines[i], pi->sczValuePrefix);
-            if (wzValuePrefix != NULL)
-            {
-                wzValueNameStart = wzValuePrefix + dwValuePrefixLength;
-            }
-        }
-        else
-        {
-            wzValueNameStart = pi->rgsczLines[i];
-        }
-
-        if (pi->sczValueSeparator && NULL != wzValueNameStart && *wzValueNameStart != L'\0')
-        {
-            dwValueSeparatorExceptionLength = 0;
-            for (DWORD j = 0; j < pi->cValueSeparatorExceptions; ++j)
-            {
-                if (pi->rgsczLines[i] == wcsstr(pi->rgsczLines[i], pi->rgsczValueSeparatorExceptions[j]))
-                {
-                    dwValueSeparatorExceptionLength = lstrlenW(pi->rgsczValueSeparatorExceptions[j]);
-                    break;
-                }
-            }
-
-            wzValueSeparator = wcsstr(wzValueNameStart + dwValueSeparatorExceptionLength, pi->sczValueSeparator);
-        }
-
-        // Don't keep the endline
-        if (pi->rgsczLines[i][lstrlenW(pi->rgsczLines[i])-1] == L'\r')
-        {
-            pi->rgsczLines[i][lstrlenW(pi->rgsczLines[i])-1] = L'\0';
-        }
-
-        if (fSections && wzOpenTagPrefix && wzOpenTagPostfix && wzOpenTagPrefix < wzOpenTagPostfix && (NULL == wzCommentLinePrefix || wzOpenTagPrefix < wzCommentLinePrefix))
-        {
-            // There is an section starting here, let's keep track of it and move on
-            hr = StrAllocString(&sczCurrentSection, wzOpenTagPrefix + lstrlenW(pi->sczOpenTagPrefix), wzOpenTagPostfix - (wzOpenTagPrefix + lstrlenW(pi->sczOpenTagPrefix)));
-            IniExitOnFailure(hr, "Failed to record section name for line: %ls of INI file: %ls", pi->rgsczLines[i], pi->sczPath);
-
-            // Sections will be calculated dynamically after any set operations, so don't include this in the list of lines to remember for output
-            ReleaseNullStr(pi->rgsczLines[i]);
-        }
-        else if (wzValueSeparator && (NULL == wzCommentLinePrefix || wzValueSeparator < wzCommentLinePrefix)
-            && (!fValuePrefix || wzValuePrefix))
-        {
-            if (fValuePrefix)
-            {
-                wzValueBegin = wzValuePrefix + lstrlenW(pi->sczValuePrefix);
-            }
-            else
-            {
-                wzValueBegin = pi->rgsczLines[i];
-            }
-
-            hr = MemEnsureArraySize(reinterpret_cast<void **>(&pi->rgivValues), pi->cValues + 1, sizeof(INI_VALUE), 100);
-            IniExitOnFailure(hr, "Failed to increase array size for value array");
-
-            if (sczCurrentSection)
-            {
-                hr = StrAllocString(&sczName, sczCurrentSection, 0);
-                IniExitOnFailure(hr, "Failed to copy current section name");
-
-                hr = StrAllocConcat(&sczName, wzSectionSeparator, 0);
-                IniExitOnFailure(hr, "Failed to copy current section name");
-            }
-
-            hr = StrAllocConcat(&sczName, wzValueBegin, wzValueSeparator - wzValueBegin);
-            IniExitOnFailure(hr, "Failed to copy name");
-
-            hr = StrAllocString(&sczValue, wzValueSeparator + lstrlenW(pi->sczValueSeparator), 0);
-            IniExitOnFailure(hr, "Failed to copy value");
-
-            hr = StrTrimWhitespace(&sczNameTrimmed, sczName);
-            IniExitOnFailure(hr, "Failed to trim whitespace from name");
-
-            hr = StrTrimWhitespace(&sczValueTrimmed, sczValue);
-            IniExitOnFailure(hr, "Failed to trim whitespace from value");
-
-            pi->rgivValues[pi->cValues].wzName = const_cast<LPCWSTR>(sczNameTrimmed);
-            sczNameTrimmed = NULL;
-            pi->rgivValues[pi->cValues].wzValue = const_cast<LPCWSTR>(sczValueTrimmed);
-            sczValueTrimmed = NULL;
-            pi->rgivValues[pi->cValues].dwLineNumber = i + 1;
-
-            ++pi->cValues;
-
-            // Values will be calculated dynamically after any set operations, so don't include this in the list of lines to remember for output
-            ReleaseNullStr(pi->rgsczLines[i]);
-        }
-        else
-        {
-            // Must be a comment, so ignore it and keep it in the list to output
-        }
+        hr = ParseSource(pi, map.pbView, map.cbView, &markers, &markersUtf8, &strings);
+    }
+    __except (FileMapExceptionFilter(GetExceptionInformation(), &hr))
+    {
+    }
 
-        ReleaseNullStr(sczName);
+    if (pfeEncodingFound)
+    {
+        *pfeEncodingFound = pi->feEncoding;
     }
 
+    IniExitOnFailure(hr, "Failed to parse INI file: %ls", pi->sczPath);
+
 LExit:
-    ReleaseStr(sczCurrentSection);
-    ReleaseStr(sczContents);
-    ReleaseStr(sczName);
-    ReleaseStr(sczNameTrimmed);
-    ReleaseStr(sczValue);
-    ReleaseStr(sczValueTrimmed);
+    ReleaseStr(strings.sczSectionPrefix);
+    ReleaseStr(strings.sczName);
+    ReleaseStr(strings.sczValue);
+    UninitializeMarkers(&markersUtf8);
+    UninitializeMarkers(&markers);
+    FileUnmap(&map);
 
     return hr;
 }
@@ -436,14 +531,11 @@ extern "C" HRESULT DAPI IniGetValue(
 
     INI_STRUCT *pi = static_cast<INI_STRUCT *>(piHandle);
     INI_VALUE *pValue = NULL;
+    DWORD iValue = FindValue(pi, wzValueName);
 
-    for (DWORD i = 0; i < pi->cValues; ++i)
+    if (DWORD_MAX != iValue)
     {
-        if (CSTR_EQUAL == ::CompareStringW(LOCALE_INVARIANT, 0, pi->rgivValues[i].wzName, -1, wzValueName, -1))
-        {
-            pValue = pi->rgivValues + i;
-            break;
-        }
+        pValue = pi->rgivValues + iValue;
     }
 
     if (NULL == pValue)
@@ -478,14 +570,11 @@ extern "C" HRESULT DAPI IniSetValue(
 
     INI_STRUCT *pi = static_cast<INI_STRUCT *>(piHandle);
     INI_VALUE *pValue = NULL;
+    DWORD iValue = FindValue(pi, wzValueName);
 
-    for (DWORD i = 0; i < pi->cValues; ++i)
+    if (DWORD_MAX != iValue)
     {
-        if (CSTR_EQUAL == ::CompareStringW(LOCALE_INVARIANT, 0, pi->rgivValues[i].wzName, -1, wzValueName, -1))
-        {
-            pValue = pi->rgivValues + i;
-            break;
-        }
+        pValue = pi->rgivValues + iValue;
     }
 
     // We're killing the value
@@ -494,6 +583,8 @@ extern "C" HRESULT DAPI IniSetValue(
         if (pValue && pValue->wzValue)
         {
             pi->fModified = TRUE;
+            MarkRegionDirty(pi, pValue->dwLineNumber);
+
             sczValue = const_cast<LPWSTR>(pValue->wzValue);
             pValue->wzValue = NULL;
             ReleaseNullStr(sczValue);
@@ -508,6 +599,8 @@ extern "C" HRESULT DAPI IniSetValue(
             if (CSTR_EQUAL != ::CompareStringW(LOCALE_INVARIANT, 0, pValue->wzValue, -1, wzValue, -1))
             {
                 pi->fModified = TRUE;
+                MarkRegionDirty(pi, pValue->dwLineNumber);
+
                 hr = StrAllocString(const_cast<LPWSTR *>(&pValue->wzValue), wzValue, 0);
                 IniExitOnFailure(hr, "Failed to update value INI value named: %ls", wzValueName);
             }
@@ -573,11 +666,22 @@ extern "C" HRESULT DAPI IniSetValue(
             pi->rgivValues[dwInsertIndex].wzValue = const_cast<LPCWSTR>(sczValue);
             sczValue = NULL;
 
+            // Take the line of the value it was put in front of so it is written in the same region.
+            // Values added to the end have no line and are written after every region.
+            pi->rgivValues[dwInsertIndex].dwLineNumber = (dwInsertIndex < pi->cValues) ? pi->rgivValues[dwInsertIndex + 1].dwLineNumber : 0;
+            MarkRegionDirty(pi, pi->rgivValues[dwInsertIndex].dwLineNumber);
+
             ++pi->cValues;
+
+            InsertIntoValueIndex(pi, dwInsertIndex);
+
+            hr = AddValueToIndex(pi, dwInsertIndex);
+            IniExitOnFailure(hr, "Failed to index value");
         }
     }
 
 LExit:
+    ReleaseStr(sczSectionPrefix);
     ReleaseStr(sczName);
     ReleaseStr(sczValue);
 
@@ -592,10 +696,16 @@ extern "C" HRESULT DAPI IniWriteFile(
 {
     HRESULT hr = S_OK;
     LPWSTR sczCurrentSectionPrefix = NULL;
-    LPWSTR sczNewSectionPrefix = NULL;
-    LPWSTR sczContents = NULL;
-    LPCWSTR wzName = NULL;
-    DWORD dwLineArrayIndex = 1;
+    LPWSTR sczTempPath = NULL;
+    HANDLE hTempFile = INVALID_HANDLE_VALUE;
+    FILE_MAP source = { };
+    const BYTE *pbSource = NULL;
+    INI_WRITER writer = { };
+    DWORD cbBom = 0;
+    DWORD iValue = 0;
+    DWORD iLine = 0;
+    DWORD dwRegionEnd = 0;
+    DWORD cbRegionEnd = 0;
     FILE_ENCODING feEncoding;
 
     INI_STRUCT *pi = static_cast<INI_STRUCT *>(piHandle);
@@ -623,117 +733,110 @@ extern "C" HRESULT DAPI IniWriteFile(
         ExitFunction1(hr = E_NOTFOUND);
     }
 
-    BOOL fSections = (pi->sczOpenTagPrefix) && (pi->sczOpenTagPostfix);
-
-    hr = StrAllocString(&sczContents, L"", 0);
-    IniExitOnFailure(hr, "Failed to begin contents string as empty string");
-
-    // Insert any beginning lines we didn't understand like comments
-    if (0 < pi->cLines)
+    // If no path was specified, use the path to the file we parsed
+    if (NULL == wzPath)
     {
-        while (pi->rgsczLines[dwLineArrayIndex])
-        {
-            hr = StrAllocConcat(&sczContents, pi->rgsczLines[dwLineArrayIndex], 0);
-            IniExitOnFailure(hr, "Failed to add previous line to ini output buffer in-memory");
+        wzPath = pi->sczPath;
+    }
 
-            hr = StrAllocConcat(&sczContents, L"\r\n", 2);
-            IniExitOnFailure(hr, "Failed to add endline to ini output buffer in-memory");
+    // Unmodified regions can only be copied when they are already in the encoding being written. A file
+    // too short for its byte order mark to be detected is regenerated, since copying the mark would add it.
+    if (pi->cRegions && feEncoding == pi->feEncoding && sizeof(rgbUtf8Bom) < pi->cbSource)
+    {
+        hr = MapSource(pi, &source);
+        IniExitOnFailure(hr, "Failed to map INI file: %ls", pi->sczPath);
 
-            ++dwLineArrayIndex;
-        }
+        pbSource = source.pbView;
     }
 
-    for (DWORD i = 0; i < pi->cValues; ++i)
+    // Everything goes to a file next to the target first, so the target is replaced in one move
+    hr = CreateTempFile(wzPath, &sczTempPath, &hTempFile);
+    IniExitOnFailure(hr, "Failed to create temporary file to write INI file: %ls", wzPath);
+
+    hr = InitializeWriter(&writer, hTempFile, feEncoding, &cbBom);
+    IniExitOnFailure(hr, "Failed to begin writing INI file: %ls", sczTempPath);
+
+    for (DWORD i = 0; i < pi->cRegions; ++i)
     {
-        // Skip if this value was killed off
-        if (NULL == pi->rgivValues[i].wzValue)
+        if (i + 1 < pi->cRegions)
         {
-            continue;
+            dwRegionEnd = pi->rgRegions[i + 1].dwFirstLine;
+            cbRegionEnd = pi->rgRegions[i + 1].cbOffset;
         }
-
-        // Now generate any lines for the current value like value line and maybe also a new section line before it
-
-        // First see if we need to write a section line
-        hr = GetSectionPrefixFromName(pi->rgivValues[i].wzName, &sczNewSectionPrefix);
-        IniExitOnFailure(hr, "Failed to get section prefix from name: %ls", pi->rgivValues[i].wzName);
-
-        // If the new section prefix is different, write a section out for it
-        if (fSections && sczNewSectionPrefix && (NULL == sczCurrentSectionPrefix || CSTR_EQUAL != ::CompareStringW(LOCALE_INVARIANT, 0, sczNewSectionPrefix, -1, sczCurrentSectionPrefix, -1)))
+        else
         {
-            hr = StrAllocConcat(&sczContents, pi->sczOpenTagPrefix, 0);
-            IniExitOnFailure(hr, "Failed to concat open tag prefix to string");
-
-            // Exclude section separator (i.e. backslash) from new section prefix
-            hr = StrAllocConcat(&sczContents, sczNewSectionPrefix, lstrlenW(sczNewSectionPrefix)-lstrlenW(wzSectionSeparator));
-            IniExitOnFailure(hr, "Failed to concat section name to string");
-
-            hr = StrAllocConcat(&sczContents, pi->sczOpenTagPostfix, 0);
-            IniExitOnFailure(hr, "Failed to concat open tag postfix to string");
-
-            hr = StrAllocConcat(&sczContents, L"\r\n", 2);
-            IniExitOnFailure(hr, "Failed to add endline to ini output buffer in-memory");
-            
-            ReleaseNullStr(sczCurrentSectionPrefix);
-            sczCurrentSectionPrefix = sczNewSectionPrefix;
-            sczNewSectionPrefix = NULL;
+            dwRegionEnd = pi->cLines + 1;
+            cbRegionEnd = pi->cbRegionsEnd;
         }
 
-        // Inserting lines we read before the current value if appropriate
-        while (pi->rgivValues[i].dwLineNumber > dwLineArrayIndex)
+        if (pbSource && !pi->rgRegions[i].fDirty)
         {
-            // Skip any lines were purposely forgot
-            if (NULL == pi->rgsczLines[dwLineArrayIndex])
+            // Reading the mapped source raises an exception if the file can't be read. Nothing under here
+            // allocates, so unwinding past it leaks nothing.
+            __try
+            {
+                hr = CopyRegion(&writer, pbSource + cbBom + pi->rgRegions[i].cbOffset, cbRegionEnd - pi->rgRegions[i].cbOffset);
+            }
+            __except (FileMapExceptionFilter(GetExceptionInformation(), &hr))
             {
-                ++dwLineArrayIndex;
-                continue;
             }
+            IniExitOnFailure(hr, "Failed to copy unmodified lines to INI file: %ls", sczTempPath);
 
-            hr = StrAllocConcat(&sczContents, pi->rgsczLines[dwLineArrayIndex++], 0);
-            IniExitOnFailure(hr, "Failed to add previous line to ini output buffer in-memory");
+            while (iValue < pi->cValues && pi->rgivValues[iValue].dwLineNumber && pi->rgivValues[iValue].dwLineNumber < dwRegionEnd)
+            {
+                ++iValue;
+            }
 
-            hr = StrAllocConcat(&sczContents, L"\r\n", 2);
-            IniExitOnFailure(hr, "Failed to add endline to ini output buffer in-memory");
+            iLine = dwRegionEnd - 1;
         }
-
-        wzName = pi->rgivValues[i].wzName;
-        if (fSections)
+        else
         {
-            wzName += lstrlenW(sczCurrentSectionPrefix);
-        }
+            // Every region after the first starts with its own open tag
+            ReleaseNullStr(sczCurrentSectionPrefix);
 
-        // OK, now just write the name/value pair, if it isn't deleted
-        if (pi->sczValuePrefix)
-        {
-            hr = StrAllocConcat(&sczContents, pi->sczValuePrefix, 0);
-            IniExitOnFailure(hr, "Failed to concat value prefix to ini output buffer");
+            hr = WriteLines(pi, &writer, dwRegionEnd, &iValue, &iLine, &sczCurrentSectionPrefix);
+            IniExitOnFailure(hr, "Failed to write modified lines to INI file: %ls", sczTempPath);
         }
+    }
 
-        hr = StrAllocConcat(&sczContents, wzName, 0);
-        IniExitOnFailure(hr, "Failed to concat value name to ini output buffer");
+    // Then the values that were added to new sections, or everything if nothing was parsed
+    ReleaseNullStr(sczCurrentSectionPrefix);
 
-        hr = StrAllocConcat(&sczContents, pi->sczValueSeparator, 0);
-        IniExitOnFailure(hr, "Failed to concat value separator to ini output buffer");
+    hr = WriteLines(pi, &writer, DWORD_MAX, &iValue, &iLine, &sczCurrentSectionPrefix);
+    IniExitOnFailure(hr, "Failed to write new lines to INI file: %ls", sczTempPath);
 
-        hr = StrAllocConcat(&sczContents, pi->rgivValues[i].wzValue, 0);
-        IniExitOnFailure(hr, "Failed to concat value to ini output buffer");
+    hr = FlushWriter(&writer);
+    IniExitOnFailure(hr, "Failed to write INI contents out to file: %ls", sczTempPath);
 
-        hr = StrAllocConcat(&sczContents, L"\r\n", 2);
-        IniExitOnFailure(hr, "Failed to add endline to ini output buffer in-memory");
-    }
+    // The source may be the target, so let go of it before it is replaced
+    FileUnmap(&source);
+    pbSource = NULL;
+    ReleaseFile(hTempFile);
 
-    // If no path was specified, use the path to the file we parsed
-    if (NULL == wzPath)
+    hr = FileEnsureMove(sczTempPath, wzPath, TRUE, FALSE);
+    IniExitOnFailure(hr, "Failed to move INI contents to file: %ls", wzPath);
+
+    ReleaseNullStr(sczTempPath);
+
+    // Once the parsed file is overwritten its regions no longer describe it
+    if (pi->sczPath && CSTR_EQUAL == ::CompareStringW(LOCALE_INVARIANT, NORM_IGNORECASE, wzPath, -1, pi->sczPath, -1))
     {
-        wzPath = pi->sczPath;
+        ReleaseNullMem(pi->rgRegions);
+        pi->cRegions = 0;
     }
 
-    hr = FileFromString(wzPath, 0, sczContents, feEncoding);
-    IniExitOnFailure(hr, "Failed to write INI contents out to file: %ls", wzPath);
-
 LExit:
-    ReleaseStr(sczContents);
+    UninitializeWriter(&writer);
+    FileUnmap(&source);
+    ReleaseFile(hTempFile);
+
+    if (sczTempPath)
+    {
+        FileEnsureDelete(sczTempPath);
+    }
+
+    ReleaseStr(sczTempPath);
     ReleaseStr(sczCurrentSectionPrefix);
-    ReleaseStr(sczNewSectionPrefix);
 
     return hr;
 }
@@ -766,3 +869,1165 @@ static HRESULT GetSectionPrefixFromName(
 LExit:
     return hr;
 }
+
+static DWORD HashValueName(
+    __in_z LPCWSTR wzName
+    )
+{
+    DWORD dwHash = 2166136261;
+
+    for (LPCWSTR wz = wzName; *wz; ++wz)
+    {
+        dwHash = (dwHash ^ *wz) * 16777619;
+    }
+
+    return dwHash;
+}
+
+// Returns the index of the first value with the name, or DWORD_MAX when there is none.
+static DWORD FindValue(
+    __in INI_STRUCT *pi,
+    __in_z LPCWSTR wzName
+    )
+{
+    DWORD iSlot = 0;
+    DWORD dwSlot = 0;
+
+    if (!wzName || !pi->cValues)
+    {
+        return DWORD_MAX;
+    }
+
+    // The index is dropped when it could not be grown, so build it again or search without it.
+    if (!pi->rgdwValueIndex && FAILED(RebuildValueIndex(pi)))
+    {
+        for (DWORD i = 0; i < pi->cValues; ++i)
+        {
+            if (0 == wcscmp(pi->rgivValues[i].wzName, wzName))
+            {
+                return i;
+            }
+        }
+
+        return DWORD_MAX;
+    }
+
+    for (iSlot = HashValueName(wzName) & (pi->cValueIndexSlots - 1); 0 != (dwSlot = pi->rgdwValueIndex[iSlot]); iSlot = (iSlot + 1) & (pi->cValueIndexSlots - 1))
+    {
+        if (0 == wcscmp(pi->rgivValues[dwSlot - 1].wzName, wzName))
+        {
+            return dwSlot - 1;
+        }
+    }
+
+    return DWORD_MAX;
+}
+
+static HRESULT AddValueToIndex(
+    __in INI_STRUCT *pi,
+    __in DWORD iValue
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD iSlot = 0;
+    DWORD dwSlot = 0;
+    LPCWSTR wzName = pi->rgivValues[iValue].wzName;
+
+    // Keep the table at most half full, which also rebuilds it with every value when it was dropped.
+    if (pi->cValueIndexSlots / 2 < pi->cValues)
+    {
+        hr = RebuildValueIndex(pi);
+        IniExitOnFailure(hr, "Failed to grow INI value index");
+
+        ExitFunction();
+    }
+
+    for (iSlot = HashValueName(wzName) & (pi->cValueIndexSlots - 1); 0 != (dwSlot = pi->rgdwValueIndex[iSlot]); iSlot = (iSlot + 1) & (pi->cValueIndexSlots - 1))
+    {
+        if (0 == wcscmp(pi->rgivValues[dwSlot - 1].wzName, wzName))
+        {
+            // A linear search finds whichever value comes first.
+            if (iValue < dwSlot - 1)
+            {
+                pi->rgdwValueIndex[iSlot] = iValue + 1;
+            }
+
+            ExitFunction();
+        }
+    }
+
+    pi->rgdwValueIndex[iSlot] = iValue + 1;
+
+LExit:
+    return hr;
+}
+
+// Values after one inserted into the middle of the array each moved up a slot.
+static void InsertIntoValueIndex(
+    __in INI_STRUCT *pi,
+    __in DWORD iValue
+    )
+{
+    for (DWORD i = 0; i < pi->cValueIndexSlots; ++i)
+    {
+        if (iValue < pi->rgdwValueIndex[i])
+        {
+            ++pi->rgdwValueIndex[i];
+        }
+    }
+}
+
+static HRESULT RebuildValueIndex(
+    __in INI_STRUCT *pi
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cSlots = INI_VALUE_INDEX_MIN_SLOTS;
+
+    while (cSlots / 2 < pi->cValues)
+    {
+        cSlots <<= 1;
+    }
+
+    ReleaseNullMem(pi->rgdwValueIndex);
+    pi->cValueIndexSlots = 0;
+
+    pi->rgdwValueIndex = static_cast<DWORD *>(MemAlloc(sizeof(DWORD) * cSlots, TRUE));
+    IniExitOnNull(pi->rgdwValueIndex, hr, E_OUTOFMEMORY, "Failed to allocate INI value index");
+
+    pi->cValueIndexSlots = cSlots;
+
+    for (DWORD i = 0; i < pi->cValues; ++i)
+    {
+        hr = AddValueToIndex(pi, i);
+        IniExitOnFailure(hr, "Failed to index INI value");
+    }
+
+LExit:
+    return hr;
+}
+
+static HRESULT AddRegion(
+    __in INI_STRUCT *pi,
+    __in DWORD dwFirstLine,
+    __in DWORD cbOffset
+    )
+{
+    HRESULT hr = S_OK;
+
+    hr = MemEnsureArraySize(reinterpret_cast<void **>(&pi->rgRegions), pi->cRegions + 1, sizeof(INI_REGION), 100);
+    IniExitOnFailure(hr, "Failed to increase array size for regions");
+
+    pi->rgRegions[pi->cRegions].dwFirstLine = dwFirstLine;
+    pi->rgRegions[pi->cRegions].cbOffset = cbOffset;
+    pi->rgRegions[pi->cRegions].fDirty = FALSE;
+    ++pi->cRegions;
+
+LExit:
+    return hr;
+}
+
+// Marks the region with the line as one to regenerate. Values without a line aren't in any region.
+static void MarkRegionDirty(
+    __in INI_STRUCT *pi,
+    __in DWORD dwLineNumber
+    )
+{
+    DWORD iLow = 0;
+    DWORD iHigh = pi->cRegions;
+    DWORD iMiddle = 0;
+
+    if (!dwLineNumber || !pi->cRegions)
+    {
+        return;
+    }
+
+    // Find the last region starting at or before the line. An empty region shares its first line with
+    // the one after it, which is the one the line is in.
+    while (iLow + 1 < iHigh)
+    {
+        iMiddle = iLow + (iHigh - iLow) / 2;
+        if (pi->rgRegions[iMiddle].dwFirstLine <= dwLineNumber)
+        {
+            iLow = iMiddle;
+        }
+        else
+        {
+            iHigh = iMiddle;
+        }
+    }
+
+    pi->rgRegions[iLow].fDirty = TRUE;
+}
+
+// Detects the encoding of a mapped INI file and parses its lines where they are mapped, in the encoding
+// FileToString() would have detected.
+static HRESULT ParseSource(
+    __in INI_STRUCT *pi,
+    __in_bcount(cbFile) const BYTE *pbFile,
+    __in SIZE_T cbFile,
+    __in INI_MARKERS<WCHAR> *pMarkers,
+    __in INI_MARKERS<CHAR> *pMarkersUtf8,
+    __in INI_PARSE_STRINGS *pStrings
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (!cbFile)
+    {
+        // Empty file, nothing to parse
+        ExitFunction1(hr = S_OK);
+    }
+
+    if (3 < cbFile && 0xEF == pbFile[0] && 0xBB == pbFile[1] && 0xBF == pbFile[2])
+    {
+        pi->feEncoding = FILE_ENCODING_UTF8_WITH_BOM;
+    }
+    else if (2 < cbFile && 0xFF == pbFile[0] && 0xFE == pbFile[1])
+    {
+        pi->feEncoding = FILE_ENCODING_UTF16_WITH_BOM;
+    }
+    else
+    {
+        pi->feEncoding = (NULL != memchr(pbFile, 0, cbFile)) ? FILE_ENCODING_UTF16 : FILE_ENCODING_UTF8;
+    }
+
+    switch (pi->feEncoding)
+    {
+    case FILE_ENCODING_UTF8_WITH_BOM: __fallthrough;
+    case FILE_ENCODING_UTF8:
+        hr = InitializeMarkers(pi, pMarkersUtf8);
+        IniExitOnFailure(hr, "Failed to convert INI style to UTF-8");
+
+        if (FILE_ENCODING_UTF8_WITH_BOM == pi->feEncoding)
+        {
+            hr = ParseLines(pi, pMarkersUtf8, pStrings, reinterpret_cast<LPCSTR>(pbFile + 3), cbFile - 3);
+        }
+        else
+        {
+            hr = ParseLines(pi, pMarkersUtf8, pStrings, reinterpret_cast<LPCSTR>(pbFile), cbFile);
+        }
+        break;
+
+    default:
+        hr = InitializeMarkers(pi, pMarkers);
+        IniExitOnFailure(hr, "Failed to prepare INI style");
+
+        if (FILE_ENCODING_UTF16_WITH_BOM == pi->feEncoding)
+        {
+            hr = ParseLines(pi, pMarkers, pStrings, reinterpret_cast<LPCWSTR>(pbFile + 2), (cbFile - 2) / sizeof(WCHAR));
+        }
+        else
+        {
+            hr = ParseLines(pi, pMarkers, pStrings, reinterpret_cast<LPCWSTR>(pbFile), cbFile / sizeof(WCHAR));
+        }
+        break;
+    }
+    IniExitOnFailure(hr, "Failed to parse INI lines");
+
+LExit:
+    return hr;
+}
+
+// Maps the file the handle was parsed from so regions can be copied from it, returning S_FALSE with
+// nothing mapped when it can't be opened anymore or has been written since.
+static HRESULT MapSource(
+    __in INI_STRUCT *pi,
+    __out FILE_MAP *pMap
+    )
+{
+    HRESULT hr = S_OK;
+    FILETIME ftWrite = { };
+
+    hr = FileMap(pi->sczPath, FALSE, 0, pMap);
+    if (FAILED(hr))
+    {
+        ExitFunction1(hr = S_FALSE);
+    }
+
+    if (!::GetFileTime(pMap->hFile, NULL, NULL, &ftWrite))
+    {
+        IniExitWithLastError(hr, "Failed to get write time of INI file: %ls", pi->sczPath);
+    }
+
+    if (pi->cbSource != pMap->cbFile || 0 != ::CompareFileTime(&pi->ftSourceWrite, &ftWrite))
+    {
+        FileUnmap(pMap);
+        ExitFunction1(hr = S_FALSE);
+    }
+
+LExit:
+    if (FAILED(hr))
+    {
+        FileUnmap(pMap);
+    }
+
+    return hr;
+}
+
+// Copies an unmodified region of the source as it is, noting whether it ends in the middle of a line.
+static HRESULT CopyRegion(
+    __in INI_WRITER *pWriter,
+    __in_bcount(cbRegion) const BYTE *pbRegion,
+    __in SIZE_T cbRegion
+    )
+{
+    HRESULT hr = S_OK;
+    const BYTE *pbRegionEnd = pbRegion + cbRegion;
+    WCHAR wchLast = L'\0';
+
+    hr = WriteBytes(pWriter, pbRegion, cbRegion);
+    IniExitOnFailure(hr, "Failed to copy unmodified lines");
+
+    // Only the last line of the file can be missing its endline, or half of it
+    if (cbRegion)
+    {
+        if (FILE_ENCODING_UTF16 == pWriter->feEncoding || FILE_ENCODING_UTF16_WITH_BOM == pWriter->feEncoding)
+        {
+            wchLast = static_cast<WCHAR>(pbRegionEnd[-2] | (pbRegionEnd[-1] << 8));
+        }
+        else
+        {
+            wchLast = pbRegionEnd[-1];
+        }
+
+        pWriter->wzPendingEndline = (L'\n' == wchLast) ? NULL : (L'\r' == wchLast) ? L"\n" : L"\r\n";
+    }
+
+LExit:
+    return hr;
+}
+
+// Writes the values up to the region ending at dwLineEnd, each after the lines that were read before it,
+// then the rest of the region's lines. DWORD_MAX writes everything left, including values added at the end.
+static HRESULT WriteLines(
+    __in INI_STRUCT *pi,
+    __in INI_WRITER *pWriter,
+    __in DWORD dwLineEnd,
+    __inout DWORD *piValue,
+    __inout DWORD *piLine,
+    __deref_inout_z_opt LPWSTR *psczCurrentSectionPrefix
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczNewSectionPrefix = NULL;
+    DWORD cchSectionPrefix = 0;
+    LPCWSTR wzName = NULL;
+    const INI_VALUE *pValue = NULL;
+
+    BOOL fSections = (pi->sczOpenTagPrefix) && (pi->sczOpenTagPostfix);
+
+    for (; *piValue < pi->cValues; ++*piValue)
+    {
+        pValue = pi->rgivValues + *piValue;
+
+        if (DWORD_MAX != dwLineEnd && (0 == pValue->dwLineNumber || dwLineEnd <= pValue->dwLineNumber))
+        {
+            break;
+        }
+
+        // Skip if this value was killed off
+        if (NULL == pValue->wzValue)
+        {
+            continue;
+        }
+
+        // Now generate any lines for the current value like value line and maybe also a new section line before it
+
+        // First see if we need to write a section line
+        hr = GetSectionPrefixFromName(pValue->wzName, &sczNewSectionPrefix);
+        IniExitOnFailure(hr, "Failed to get section prefix from name: %ls", pValue->wzName);
+
+        cchSectionPrefix = lstrlenW(sczNewSectionPrefix);
+
+        // If the new section prefix is different, write a section out for it
+        if (fSections && sczNewSectionPrefix && (NULL == *psczCurrentSectionPrefix || CSTR_EQUAL != ::CompareStringW(LOCALE_INVARIANT, 0, sczNewSectionPrefix, -1, *psczCurrentSectionPrefix, -1)))
+        {
+            hr = WriteString(pWriter, pi->sczOpenTagPrefix, lstrlenW(pi->sczOpenTagPrefix));
+            IniExitOnFailure(hr, "Failed to write open tag prefix");
+
+            // Exclude section separator (i.e. backslash) from new section prefix
+            hr = WriteString(pWriter, sczNewSectionPrefix, lstrlenW(sczNewSectionPrefix) - lstrlenW(wzSectionSeparator));
+            IniExitOnFailure(hr, "Failed to write section name");
+
+            hr = WriteString(pWriter, pi->sczOpenTagPostfix, lstrlenW(pi->sczOpenTagPostfix));
+            IniExitOnFailure(hr, "Failed to write open tag postfix");
+
+            hr = WriteString(pWriter, L"\r\n", 2);
+            IniExitOnFailure(hr, "Failed to write endline");
+
+            ReleaseNullStr(*psczCurrentSectionPrefix);
+            *psczCurrentSectionPrefix = sczNewSectionPrefix;
+            sczNewSectionPrefix = NULL;
+        }
+
+        // Inserting lines we read before the current value if appropriate, which is all of them for a value added at the end
+        for (; *piLine < pi->cLines && (0 == pValue->dwLineNumber || *piLine + 1 < pValue->dwLineNumber); ++*piLine)
+        {
+            // Skip any lines were purposely forgot
+            if (pi->rgsczLines[*piLine])
+            {
+                hr = WriteString(pWriter, pi->rgsczLines[*piLine], lstrlenW(pi->rgsczLines[*piLine]));
+                IniExitOnFailure(hr, "Failed to write previous line");
+
+                hr = WriteString(pWriter, L"\r\n", 2);
+                IniExitOnFailure(hr, "Failed to write endline");
+            }
+        }
+
+        // Only the value's own section is left out of its name, a value without one is written whole
+        wzName = pValue->wzName;
+        if (fSections)
+        {
+            wzName += cchSectionPrefix;
+        }
+
+        // OK, now just write the name/value pair
+        if (pi->sczValuePrefix)
+        {
+            hr = WriteString(pWriter, pi->sczValuePrefix, lstrlenW(pi->sczValuePrefix));
+            IniExitOnFailure(hr, "Failed to write value prefix");
+        }
+
+        hr = WriteString(pWriter, wzName, lstrlenW(wzName));
+        IniExitOnFailure(hr, "Failed to write value name");
+
+        hr = WriteString(pWriter, pi->sczValueSeparator, lstrlenW(pi->sczValueSeparator));
+        IniExitOnFailure(hr, "Failed to write value separator");
+
+        hr = WriteString(pWriter, pValue->wzValue, lstrlenW(pValue->wzValue));
+        IniExitOnFailure(hr, "Failed to write value");
+
+        hr = WriteString(pWriter, L"\r\n", 2);
+        IniExitOnFailure(hr, "Failed to write endline");
+    }
+
+    // Lines after the last value still belong to the region
+    for (; *piLine < pi->cLines && *piLine + 1 < dwLineEnd; ++*piLine)
+    {
+        if (pi->rgsczLines[*piLine])
+        {
+            hr = WriteString(pWriter, pi->rgsczLines[*piLine], lstrlenW(pi->rgsczLines[*piLine]));
+            IniExitOnFailure(hr, "Failed to write following line");
+
+            hr = WriteString(pWriter, L"\r\n", 2);
+            IniExitOnFailure(hr, "Failed to write endline");
+        }
+    }
+
+LExit:
+    ReleaseStr(sczNewSectionPrefix);
+
+    return hr;
+}
+
+// Creates a file that doesn't exist yet next to the path, so moving it there replaces the file in one step.
+// The path is only returned along with the file, so a caller never deletes a name another writer created.
+static HRESULT CreateTempFile(
+    __in_z LPCWSTR wzPath,
+    __deref_out_z LPWSTR *psczTempPath,
+    __out HANDLE *phFile
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczTempPath = NULL;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+
+    for (DWORD i = 0; i < 1000 && INVALID_HANDLE_VALUE == hFile; ++i)
+    {
+        hr = StrAllocFormatted(&sczTempPath, L"%ls.%03u.tmp", wzPath, i);
+        IniExitOnFailure(hr, "Failed to allocate temporary path for INI file: %ls", wzPath);
+
+        hFile = ::CreateFileW(sczTempPath, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (INVALID_HANDLE_VALUE == hFile)
+        {
+            // if the file already exists, just try again
+            hr = HRESULT_FROM_WIN32(::GetLastError());
+            if (HRESULT_FROM_WIN32(ERROR_FILE_EXISTS) == hr)
+            {
+                continue;
+            }
+            IniExitOnFailure(hr, "Failed to create temporary file: %ls", sczTempPath);
+        }
+    }
+    IniExitOnFailure(hr, "Failed to find an unused temporary path for INI file: %ls", wzPath);
+
+    *psczTempPath = sczTempPath;
+    sczTempPath = NULL;
+
+    *phFile = hFile;
+    hFile = INVALID_HANDLE_VALUE;
+
+LExit:
+    ReleaseFile(hFile);
+    ReleaseStr(sczTempPath);
+
+    return hr;
+}
+
+static HRESULT InitializeWriter(
+    __in INI_WRITER *pWriter,
+    __in HANDLE hFile,
+    __in FILE_ENCODING feEncoding,
+    __out DWORD *pcbBom
+    )
+{
+    HRESULT hr = S_OK;
+
+    pWriter->hFile = hFile;
+    pWriter->feEncoding = feEncoding;
+    pWriter->cbBuffer = INI_WRITE_BUFFER_SIZE;
+    pWriter->pbBuffer = static_cast<LPBYTE>(MemAlloc(pWriter->cbBuffer, FALSE));
+    IniExitOnNull(pWriter->pbBuffer, hr, E_OUTOFMEMORY, "Failed to allocate INI write buffer");
+
+    switch (feEncoding)
+    {
+    case FILE_ENCODING_UTF8_WITH_BOM:
+        *pcbBom = sizeof(rgbUtf8Bom);
+        hr = WriteBytes(pWriter, rgbUtf8Bom, sizeof(rgbUtf8Bom));
+        break;
+    case FILE_ENCODING_UTF16_WITH_BOM:
+        *pcbBom = sizeof(rgbUtf16Bom);
+        hr = WriteBytes(pWriter, rgbUtf16Bom, sizeof(rgbUtf16Bom));
+        break;
+    default:
+        *pcbBom = 0;
+        break;
+    }
+    IniExitOnFailure(hr, "Failed to write byte order mark");
+
+LExit:
+    return hr;
+}
+
+static void UninitializeWriter(
+    __in INI_WRITER *pWriter
+    )
+{
+    ReleaseMem(pWriter->pbBuffer);
+    memset(pWriter, 0, sizeof(INI_WRITER));
+}
+
+static HRESULT WriteBytes(
+    __in INI_WRITER *pWriter,
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in SIZE_T cbData
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (pWriter->cbBuffer - pWriter->cbBuffered < cbData)
+    {
+        hr = FlushWriter(pWriter);
+        IniExitOnFailure(hr, "Failed to flush INI write buffer");
+    }
+
+    // Anything that would fill the buffer by itself, like an unmodified region, goes straight to the file.
+    if (pWriter->cbBuffer <= cbData)
+    {
+        hr = FileWriteHandle(pWriter->hFile, pbData, cbData);
+        IniExitOnFailure(hr, "Failed to write to INI file");
+    }
+    else
+    {
+        memcpy(pWriter->pbBuffer + pWriter->cbBuffered, pbData, cbData);
+        pWriter->cbBuffered += cbData;
+    }
+
+LExit:
+    return hr;
+}
+
+static HRESULT WriteString(
+    __in INI_WRITER *pWriter,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch
+    )
+{
+    HRESULT hr = S_OK;
+    LPCWSTR wzEndline = NULL;
+    LPBYTE pbUtf8 = NULL;
+    int cb = 0;
+
+    if (!cch)
+    {
+        ExitFunction();
+    }
+
+    if (pWriter->wzPendingEndline)
+    {
+        wzEndline = pWriter->wzPendingEndline;
+        pWriter->wzPendingEndline = NULL;
+
+        hr = WriteString(pWriter, wzEndline, lstrlenW(wzEndline));
+        IniExitOnFailure(hr, "Failed to end copied line");
+    }
+
+    if (FILE_ENCODING_UTF8 != pWriter->feEncoding && FILE_ENCODING_UTF8_WITH_BOM != pWriter->feEncoding)
+    {
+        hr = WriteBytes(pWriter, reinterpret_cast<LPCBYTE>(wz), cch * sizeof(WCHAR));
+        IniExitOnFailure(hr, "Failed to write UTF-16 string");
+
+        ExitFunction();
+    }
+
+    // Every UTF-16 code unit is at most three bytes of UTF-8, so convert straight into the buffer when it fits.
+    if (pWriter->cbBuffer - pWriter->cbBuffered < cch * 3)
+    {
+        hr = FlushWriter(pWriter);
+        IniExitOnFailure(hr, "Failed to flush INI write buffer");
+    }
+
+    if (pWriter->cbBuffer < cch * 3)
+    {
+        cb = ::WideCharToMultiByte(CP_UTF8, 0, wz, static_cast<int>(cch), NULL, 0, NULL, NULL);
+        if (!cb)
+        {
+            IniExitWithLastError(hr, "Failed to get size of string as UTF-8");
+        }
+
+        pbUtf8 = static_cast<LPBYTE>(MemAlloc(cb, FALSE));
+        IniExitOnNull(pbUtf8, hr, E_OUTOFMEMORY, "Failed to allocate UTF-8 string");
+
+        if (!::WideCharToMultiByte(CP_UTF8, 0, wz, static_cast<int>(cch), reinterpret_cast<LPSTR>(pbUtf8), cb, NULL, NULL))
+        {
+            IniExitWithLastError(hr, "Failed to convert string to UTF-8");
+        }
+
+        hr = WriteBytes(pWriter, pbUtf8, cb);
+        IniExitOnFailure(hr, "Failed to write UTF-8 string");
+    }
+    else
+    {
+        cb = ::WideCharToMultiByte(CP_UTF8, 0, wz, static_cast<int>(cch), reinterpret_cast<LPSTR>(pWriter->pbBuffer + pWriter->cbBuffered), static_cast<int>(pWriter->cbBuffer - pWriter->cbBuffered), NULL, NULL);
+        if (!cb)
+        {
+            IniExitWithLastError(hr, "Failed to convert string to UTF-8");
+        }
+
+        pWriter->cbBuffered += cb;
+    }
+
+LExit:
+    ReleaseMem(pbUtf8);
+
+    return hr;
+}
+
+static HRESULT FlushWriter(
+    __in INI_WRITER *pWriter
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (pWriter->cbBuffered)
+    {
+        hr = FileWriteHandle(pWriter->hFile, pWriter->pbBuffer, pWriter->cbBuffered);
+        IniExitOnFailure(hr, "Failed to write to INI file");
+
+        pWriter->cbBuffered = 0;
+    }
+
+LExit:
+    return hr;
+}
+
+template<typename T> static HRESULT InitializeMarkers(
+    __in INI_STRUCT *pi,
+    __out INI_MARKERS<T> *pMarkers
+    )
+{
+    HRESULT hr = S_OK;
+    LPCWSTR rgwzStyle[INI_MARKER_COUNT] = { };
+
+    rgwzStyle[INI_MARKER_COMMENT_LINE_PREFIX] = pi->sczCommentLinePrefix;
+    rgwzStyle[INI_MARKER_OPEN_TAG_PREFIX] = pi->sczOpenTagPrefix;
+    rgwzStyle[INI_MARKER_OPEN_TAG_POSTFIX] = pi->sczOpenTagPostfix;
+    rgwzStyle[INI_MARKER_VALUE_PREFIX] = pi->sczValuePrefix;
+    rgwzStyle[INI_MARKER_VALUE_SEPARATOR] = pi->sczValueSeparator;
+
+    for (DWORD i = 0; i < INI_MARKER_COUNT; ++i)
+    {
+        if (rgwzStyle[i])
+        {
+            hr = AllocMarker(rgwzStyle[i], pMarkers->rgpchMarkers + i, pMarkers->rgcchMarkers + i);
+            IniExitOnFailure(hr, "Failed to prepare INI style: %ls", rgwzStyle[i]);
+        }
+    }
+
+    if (pi->cValueSeparatorExceptions)
+    {
+        pMarkers->rgpchValueSeparatorExceptions = static_cast<const T **>(MemAlloc(sizeof(const T *) * pi->cValueSeparatorExceptions, TRUE));
+        IniExitOnNull(pMarkers->rgpchValueSeparatorExceptions, hr, E_OUTOFMEMORY, "Failed to allocate value separator exceptions");
+
+        pMarkers->rgcchValueSeparatorExceptions = static_cast<SIZE_T *>(MemAlloc(sizeof(SIZE_T) * pi->cValueSeparatorExceptions, TRUE));
+        IniExitOnNull(pMarkers->rgcchValueSeparatorExceptions, hr, E_OUTOFMEMORY, "Failed to allocate value separator exception lengths");
+
+        for (DWORD i = 0; i < pi->cValueSeparatorExceptions; ++i)
+        {
+            hr = AllocMarker(pi->rgsczValueSeparatorExceptions[i], pMarkers->rgpchValueSeparatorExceptions + i, pMarkers->rgcchValueSeparatorExceptions + i);
+            IniExitOnFailure(hr, "Failed to prepare value separator exception: %ls", pi->rgsczValueSeparatorExceptions[i]);
+
+            ++pMarkers->cValueSeparatorExceptions;
+        }
+    }
+
+LExit:
+    return hr;
+}
+
+template<typename T> static void UninitializeMarkers(
+    __in INI_MARKERS<T> *pMarkers
+    )
+{
+    for (DWORD i = 0; i < INI_MARKER_COUNT; ++i)
+    {
+        FreeMarker(pMarkers->rgpchMarkers[i]);
+    }
+
+    for (DWORD i = 0; i < pMarkers->cValueSeparatorExceptions; ++i)
+    {
+        FreeMarker(pMarkers->rgpchValueSeparatorExceptions[i]);
+    }
+
+    ReleaseMem(pMarkers->rgpchValueSeparatorExceptions);
+    ReleaseMem(pMarkers->rgcchValueSeparatorExceptions);
+}
+
+// UTF-16 files are matched against the style strings themselves.
+static HRESULT AllocMarker(
+    __in_z LPCWSTR wzStyle,
+    __out LPCWSTR *pwzMarker,
+    __out SIZE_T *pcchMarker
+    )
+{
+    *pwzMarker = wzStyle;
+    *pcchMarker = lstrlenW(wzStyle);
+
+    return S_OK;
+}
+
+static HRESULT AllocMarker(
+    __in_z LPCWSTR wzStyle,
+    __out LPCSTR *pszMarker,
+    __out SIZE_T *pcchMarker
+    )
+{
+    HRESULT hr = S_OK;
+    LPSTR szMarker = NULL;
+
+    hr = StrAnsiAllocString(&szMarker, wzStyle, 0, CP_UTF8);
+    IniExitOnFailure(hr, "Failed to convert INI style to UTF-8: %ls", wzStyle);
+
+    *pcchMarker = lstrlenA(szMarker);
+    *pszMarker = szMarker;
+    szMarker = NULL;
+
+LExit:
+    ReleaseStr(szMarker);
+
+    return hr;
+}
+
+static void FreeMarker(
+    __in_opt LPCWSTR /*wzMarker*/
+    )
+{
+}
+
+static void FreeMarker(
+    __in_opt LPCSTR szMarker
+    )
+{
+    ReleaseStr(const_cast<LPSTR>(szMarker));
+}
+
+// Parses the lines of the file in one pass over the mapped text, copying out only the names, values
+// and lines that are kept.
+template<typename T> static HRESULT ParseLines(
+    __in INI_STRUCT *pi,
+    __in const INI_MARKERS<T> *pMarkers,
+    __in INI_PARSE_STRINGS *pStrings,
+    __in_ecount(cchContents) const T *pchContents,
+    __in SIZE_T cchContents
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD i = 0;
+    const T *pchEnd = pchContents + cchContents;
+    const T *pchLine = pchContents;
+    const T *pchLineEnd = NULL;
+    const T *pchContentEnd = NULL;
+    const T *rgpchFound[INI_MARKER_COUNT] = { };
+    const T *pchCommentLinePrefix = NULL;
+    const T *pchOpenTagPrefix = NULL;
+    const T *pchOpenTagPostfix = NULL;
+    const T *pchValuePrefix = NULL;
+    const T *pchValueSeparator = NULL;
+    const T *pchValueBegin = NULL;
+    const T *pchName = NULL;
+    const T *pchValue = NULL;
+    SIZE_T cchName = 0;
+    SIZE_T cchValue = 0;
+
+    BOOL fSections = (NULL != pi->sczOpenTagPrefix) && (NULL != pi->sczOpenTagPostfix);
+    BOOL fValuePrefix = (NULL != pi->sczValuePrefix);
+
+    hr = AddRegion(pi, pi->cLines + 1, 0);
+    IniExitOnFailure(hr, "Failed to begin first region of INI file: %ls", pi->sczPath);
+
+    // Like the string the file used to be read into, the text ends at the first null character
+    while (pchLine < pchEnd && '\0' != *pchLine)
+    {
+        // Empty lines are skipped entirely
+        if ('\n' == *pchLine)
+        {
+            ++pchLine;
+            continue;
+        }
+
+        hr = MemEnsureArraySize(reinterpret_cast<void **>(&pi->rgsczLines), pi->cLines + 1, sizeof(LPWSTR), 100);
+        IniExitOnFailure(hr, "Failed to increase array size for lines");
+
+        i = pi->cLines;
+        pi->rgsczLines[i] = NULL;
+        ++pi->cLines;
+
+        pchLineEnd = ScanLine(pMarkers, pchLine, pchEnd, rgpchFound);
+        pchCommentLinePrefix = rgpchFound[INI_MARKER_COMMENT_LINE_PREFIX];
+        pchOpenTagPrefix = rgpchFound[INI_MARKER_OPEN_TAG_PREFIX];
+        pchOpenTagPostfix = rgpchFound[INI_MARKER_OPEN_TAG_POSTFIX];
+        pchValuePrefix = rgpchFound[INI_MARKER_VALUE_PREFIX];
+        pchValueSeparator = rgpchFound[INI_MARKER_VALUE_SEPARATOR];
+
+        // Don't keep the endline
+        pchContentEnd = ('\r' == pchLineEnd[-1]) ? pchLineEnd - 1 : pchLineEnd;
+
+        if ('\r' == *pchLine || (pchCommentLinePrefix && IsWithinFirstCharacter(pchLine, pchLineEnd, pchCommentLinePrefix)))
+        {
+            // Blank lines and comments are kept as they were read, endline and all
+            hr = AllocSpan(&pi->rgsczLines[i], pchLine, pchLineEnd - pchLine);
+            IniExitOnFailure(hr, "Failed to copy line %u of INI file: %ls", i + 1, pi->sczPath);
+
+            pchLine = pchLineEnd;
+            continue;
+        }
+
+        // If there is an open tag prefix but there is anything but whitespace before it, then it's NOT an open tag prefix
+        // This is important, for example, to support values with names like "Array[0]=blah" in INI format
+        for (const T *pch = pchLine; pchOpenTagPrefix && pch < pchOpenTagPrefix; ++pch)
+        {
+            if (' ' != *pch && '\t' != *pch)
+            {
+                pchOpenTagPrefix = NULL;
+            }
+        }
+
+        if (fSections && pchOpenTagPrefix && pchOpenTagPostfix && pchOpenTagPrefix < pchOpenTagPostfix && (NULL == pchCommentLinePrefix || pchOpenTagPrefix < pchCommentLinePrefix))
+        {
+            // There is an section starting here, let's keep track of it and move on. Names are trimmed as a
+            // whole, so the only whitespace trimmed from the section is in front of it.
+            pchName = pchOpenTagPrefix + pMarkers->rgcchMarkers[INI_MARKER_OPEN_TAG_PREFIX];
+            while (pchName < pchOpenTagPostfix && (' ' == *pchName || '\t' == *pchName))
+            {
+                ++pchName;
+            }
+            cchName = (pchName < pchOpenTagPostfix) ? pchOpenTagPostfix - pchName : 0;
+
+            hr = AllocSpan(&pStrings->sczSectionPrefix, pchName, cchName);
+            IniExitOnFailure(hr, "Failed to record section name for line %u of INI file: %ls", i + 1, pi->sczPath);
+
+            hr = StrAllocConcat(&pStrings->sczSectionPrefix, wzSectionSeparator, 0);
+            IniExitOnFailure(hr, "Failed to record section name for line %u of INI file: %ls", i + 1, pi->sczPath);
+
+            hr = AddRegion(pi, i + 1, static_cast<DWORD>((pchLine - pchContents) * sizeof(T)));
+            IniExitOnFailure(hr, "Failed to record region for line %u of INI file: %ls", i + 1, pi->sczPath);
+
+            // Sections will be calculated dynamically after any set operations, so don't include this in the list of lines to remember for output
+        }
+        else if (pchValueSeparator && (NULL == pchCommentLinePrefix || pchValueSeparator < pchCommentLinePrefix)
+            && (!fValuePrefix || pchValuePrefix))
+        {
+            if (fValuePrefix)
+            {
+                pchValueBegin = pchValuePrefix + pMarkers->rgcchMarkers[INI_MARKER_VALUE_PREFIX];
+            }
+            else
+            {
+                pchValueBegin = pchLine;
+            }
+
+            hr = MemEnsureArraySize(reinterpret_cast<void **>(&pi->rgivValues), pi->cValues + 1, sizeof(INI_VALUE), 100);
+            IniExitOnFailure(hr, "Failed to increase array size for value array");
+
+            pchName = pchValueBegin;
+            cchName = pchValueSeparator - pchValueBegin;
+            TrimSpan(&pchName, &cchName);
+
+            // The separator stops the trim, so whitespace in front of the name is kept after it
+            if (pStrings->sczSectionPrefix && cchName)
+            {
+                cchName += pchName - pchValueBegin;
+                pchName = pchValueBegin;
+            }
+
+            pchValue = pchValueSeparator + pMarkers->rgcchMarkers[INI_MARKER_VALUE_SEPARATOR];
+            cchValue = (pchValue < pchContentEnd) ? pchContentEnd - pchValue : 0;
+            TrimSpan(&pchValue, &cchValue);
+
+            hr = AllocSpan(&pStrings->sczName, pchName, cchName);
+            IniExitOnFailure(hr, "Failed to copy name");
+
+            if (pStrings->sczSectionPrefix)
+            {
+                hr = StrAllocPrefix(&pStrings->sczName, pStrings->sczSectionPrefix, 0);
+                IniExitOnFailure(hr, "Failed to copy current section name");
+            }
+
+            hr = AllocSpan(&pStrings->sczValue, pchValue, cchValue);
+            IniExitOnFailure(hr, "Failed to copy value");
+
+            pi->rgivValues[pi->cValues].wzName = const_cast<LPCWSTR>(pStrings->sczName);
+            pStrings->sczName = NULL;
+            pi->rgivValues[pi->cValues].wzValue = const_cast<LPCWSTR>(pStrings->sczValue);
+            pStrings->sczValue = NULL;
+            pi->rgivValues[pi->cValues].dwLineNumber = i + 1;
+
+            ++pi->cValues;
+
+            hr = AddValueToIndex(pi, pi->cValues - 1);
+            IniExitOnFailure(hr, "Failed to index value");
+
+            // Values will be calculated dynamically after any set operations, so don't include this in the list of lines to remember for output
+        }
+        else
+        {
+            // Must be a comment, so ignore it and keep it in the list to output
+            hr = AllocSpan(&pi->rgsczLines[i], pchLine, pchContentEnd - pchLine);
+            IniExitOnFailure(hr, "Failed to copy line %u of INI file: %ls", i + 1, pi->sczPath);
+        }
+
+        pchLine = pchLineEnd;
+    }
+
+    pi->cbRegionsEnd = static_cast<DWORD>((pchLine - pchContents) * sizeof(T));
+
+LExit:
+    return hr;
+}
+
+// Finds the first place each marker starts in a line, looking at every character once, and returns
+// the end of the line. The value separator is only looked for once the value name has started, past
+// any separator exception the line starts with.
+template<typename T> static const T *ScanLine(
+    __in const INI_MARKERS<T> *pMarkers,
+    __in const T *pchLine,
+    __in const T *pchEnd,
+    __out_ecount(INI_MARKER_COUNT) const T **rgpchFound
+    )
+{
+    const T *pch = pchLine;
+    const T *pchSeparatorSearch = NULL;
+    const T *pchException = NULL;
+    SIZE_T cchException = 0;
+
+    for (DWORD i = 0; i < INI_MARKER_COUNT; ++i)
+    {
+        rgpchFound[i] = NULL;
+    }
+
+    for (DWORD i = 0; i < pMarkers->cValueSeparatorExceptions; ++i)
+    {
+        if (IsMarkerAt(pchLine, pchEnd, pMarkers->rgpchValueSeparatorExceptions[i], pMarkers->rgcchValueSeparatorExceptions[i]))
+        {
+            pchException = pMarkers->rgpchValueSeparatorExceptions[i];
+            cchException = pMarkers->rgcchValueSeparatorExceptions[i];
+            break;
+        }
+    }
+
+    if (!pMarkers->rgpchMarkers[INI_MARKER_VALUE_PREFIX])
+    {
+        pchSeparatorSearch = pchLine + cchException;
+    }
+
+    for (; pch < pchEnd && '\n' != *pch && '\0' != *pch; ++pch)
+    {
+        for (DWORD i = 0; i < INI_MARKER_VALUE_SEPARATOR; ++i)
+        {
+            if (!rgpchFound[i] && pMarkers->rgpchMarkers[i] && IsMarkerAt(pch, pchEnd, pMarkers->rgpchMarkers[i], pMarkers->rgcchMarkers[i]))
+            {
+                rgpchFound[i] = pch;
+
+                if (INI_MARKER_VALUE_PREFIX == i)
+                {
+                    pchSeparatorSearch = SkipCodeUnits(pch + pMarkers->rgcchMarkers[i], pchEnd, pchException, cchException);
+                }
+            }
+        }
+
+        if (!rgpchFound[INI_MARKER_VALUE_SEPARATOR] && pchSeparatorSearch && pchSeparatorSearch <= pch && pMarkers->rgpchMarkers[INI_MARKER_VALUE_SEPARATOR]
+            && IsMarkerAt(pch, pchEnd, pMarkers->rgpchMarkers[INI_MARKER_VALUE_SEPARATOR], pMarkers->rgcchMarkers[INI_MARKER_VALUE_SEPARATOR]))
+        {
+            rgpchFound[INI_MARKER_VALUE_SEPARATOR] = pch;
+        }
+    }
+
+    return pch;
+}
+
+// A marker never matches across the end of a line.
+template<typename T> static BOOL IsMarkerAt(
+    __in const T *pch,
+    __in const T *pchEnd,
+    __in_ecount(cchMarker) const T *pchMarker,
+    __in SIZE_T cchMarker
+    )
+{
+    if (static_cast<SIZE_T>(pchEnd - pch) < cchMarker)
+    {
+        return FALSE;
+    }
+
+    for (SIZE_T i = 0; i < cchMarker; ++i)
+    {
+        if (pch[i] != pchMarker[i] || '\n' == pch[i])
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Trims the same spaces and tabs StrViewTrimWhitespace() does.
+template<typename T> static void TrimSpan(
+    __inout const T **ppch,
+    __inout SIZE_T *pcch
+    )
+{
+    while (*pcch && (' ' == **ppch || '\t' == **ppch))
+    {
+        ++*ppch;
+        --*pcch;
+    }
+
+    while (*pcch && (' ' == (*ppch)[*pcch - 1] || '\t' == (*ppch)[*pcch - 1]))
+    {
+        --*pcch;
+    }
+}
+
+// A comment line prefix counts when it starts the line or follows its first character.
+static BOOL IsWithinFirstCharacter(
+    __in LPCWSTR wzLine,
+    __in LPCWSTR /*wzLineEnd*/,
+    __in LPCWSTR wz
+    )
+{
+    return wz <= wzLine + 1;
+}
+
+// The first character is measured in UTF-16 code units, so one that needs a surrogate pair leaves
+// only the start of the line.
+static BOOL IsWithinFirstCharacter(
+    __in LPCSTR szLine,
+    __in LPCSTR szLineEnd,
+    __in LPCSTR sz
+    )
+{
+    SIZE_T cbFirst = Utf8SequenceLength(szLine, szLineEnd);
+
+    return sz == szLine || (4 != cbFirst && sz == szLine + cbFirst);
+}
+
+// The value separator exception is skipped where the value name starts, which is only where the
+// exception matched when there is no value prefix, so it is skipped by its length in UTF-16 code units.
+static LPCWSTR SkipCodeUnits(
+    __in LPCWSTR wz,
+    __in LPCWSTR /*wzEnd*/,
+    __in_ecount(cchUnits) LPCWSTR /*wzUnits*/,
+    __in SIZE_T cchUnits
+    )
+{
+    return wz + cchUnits;
+}
+
+static LPCSTR SkipCodeUnits(
+    __in LPCSTR sz,
+    __in LPCSTR szEnd,
+    __in_ecount(cchUnits) LPCSTR szUnits,
+    __in SIZE_T cchUnits
+    )
+{
+    SIZE_T cUnits = 0;
+    SIZE_T cb = 0;
+
+    for (SIZE_T i = 0; i < cchUnits; i += cb)
+    {
+        cb = Utf8SequenceLength(szUnits + i, szUnits + cchUnits);
+        cUnits += (4 == cb) ? 2 : 1;
+    }
+
+    while (cUnits && sz < szEnd)
+    {
+        cb = Utf8SequenceLength(sz, szEnd);
+        cUnits -= (4 == cb && 1 < cUnits) ? 2 : 1;
+        sz += cb;
+    }
+
+    return sz;
+}
+
+// Returns the length of the UTF-8 sequence starting a span. Bytes that are not a complete sequence
+// are converted to a replacement character each, so they count as one.
+static SIZE_T Utf8SequenceLength(
+    __in LPCSTR sz,
+    __in LPCSTR szEnd
+    )
+{
+    BYTE bLead = static_cast<BYTE>(*sz);
+    SIZE_T cb = 1;
+
+    if (0xC0 <= bLead && bLead < 0xE0)
+    {
+        cb = 2;
+    }
+    else if (0xE0 <= bLead && bLead < 0xF0)
+    {
+        cb = 3;
+    }
+    else if (0xF0 <= bLead && bLead < 0xF5)
+    {
+        cb = 4;
+    }
+
+    for (SIZE_T i = 1; i < cb; ++i)
+    {
+        if (sz + i >= szEnd || 0x80 != (static_cast<BYTE>(sz[i]) & 0xC0))
+        {
+            return 1;
+        }
+    }
+
+    return cb;
+}
+
+// A span isn't null terminated, so an empty one can't be left for the copy to measure.
+static HRESULT AllocSpan(
+    __deref_out_z LPWSTR *psczDest,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch
+    )
+{
+    return StrAllocString(psczDest, cch ? wz : L"", cch);
+}
+
+static HRESULT AllocSpan(
+    __deref_out_z LPWSTR *psczDest,
+    __in_ecount(cch) LPCSTR sz,
+    __in SIZE_T cch
+    )
+{
+    return cch ? StrAllocStringAnsi(psczDest, sz, cch, CP_UTF8) : StrAllocString(psczDest, L"", 0);
+}
@@ -2,6 +2,10 @@
 
 #include "precomp.h"
 
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define JSON_SCAN_SSE2
+#endif
 
 // Exit macros
 #define JsonExitOnLastError(x, s, ...) ExitOnLastErrorSource(DUTIL_SOURCE_JSONUTIL, x, s, __VA_ARGS__)
@@ -18,8 +22,170 @@
 #define JsonExitOnGdipFailure(g, x, s, ...) ExitOnGdipFailureSource(DUTIL_SOURCE_JSONUTIL, g, x, s, __VA_ARGS__)
 
 const DWORD JSON_STACK_INCREMENT = 5;
+const DWORD JSON_MAX_DEPTH = 1024;
+const DWORD JSON_UTF8_INCREMENT = 256;
+const DWORD JSON_DOM_NODE_INCREMENT = 64;
+const SIZE_T JSON_DOM_ARENA_BLOCK_SIZE = 64 * 1024;
+const SIZE_T JSON_STREAM_BUFFER_SIZE = 64 * 1024;
+
+// Powers of ten that doubles represent exactly, so short numbers convert without rounding twice.
+static const double JSON_EXACT_POWERS_OF_TEN[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Locale for numbers the fast path cannot convert, created on first use.
+static _locale_t vpJsonNumberLocale = NULL;
+
+// JSON_DOM_HANDLE points at this, which is allocated from its own arena along with every string
+// in the document.
+struct JSON_DOM
+{
+    MEM_ARENA_HANDLE hArena;
+    JSON_NODE* rgNodes;
+    DWORD cNodes;
+};
 
 // Prototypes
+static HRESULT InitializeReader(
+    __in JSON_READER* pReader,
+    __in JSON_READER_FLAG jrfFlags
+    );
+template<typename T> static HRESULT ReadToken(
+    __in JSON_READER* pReader,
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_TOKEN* pToken,
+    __out JSON_VALUE* pValue
+    );
+template<typename T> static HRESULT ReadNextValue(
+    __in JSON_READER* pReader,
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_TOKEN* pToken,
+    __out JSON_VALUE* pValue
+    );
+template<typename T> static HRESULT ReadObjectKey(
+    __in JSON_READER* pReader,
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_TOKEN* pToken,
+    __out JSON_VALUE* pValue
+    );
+template<typename T> static HRESULT ReadContainerEnd(
+    __in JSON_READER* pReader,
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_TOKEN* pToken
+    );
+template<typename T> static HRESULT ReadString(
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_VALUE* pValue
+    );
+template<typename T> static HRESULT ReadNumber(
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_VALUE* pValue
+    );
+template<typename T> static HRESULT ReadLiteral(
+    __in const T* pchJson,
+    __inout T** ppch,
+    __in_z LPCWSTR wzLiteral,
+    __in JSON_VALUE_TYPE type,
+    __out JSON_VALUE* pValue
+    );
+template<typename T> static HRESULT ReadHexCharacter(
+    __in const T* pchJson,
+    __in_z const T* pch,
+    __out WCHAR* pwch
+    );
+template<typename T> static T* SkipWhitespace(
+    __in_z T* pch
+    );
+template<typename T> static T* ScanString(
+    __in_z T* pch
+    );
+static LPWSTR WriteCodePoint(
+    __in LPWSTR pwz,
+    __in DWORD dwCodePoint
+    );
+static LPBYTE WriteCodePoint(
+    __in LPBYTE pb,
+    __in DWORD dwCodePoint
+    );
+static void SetStringValue(
+    __in JSON_VALUE* pValue,
+    __in LPCWSTR wzValue,
+    __in SIZE_T cchValue
+    );
+static void SetStringValue(
+    __in JSON_VALUE* pValue,
+    __in const BYTE* pbValue,
+    __in SIZE_T cbValue
+    );
+static HRESULT GetNumberLocale(
+    __out _locale_t* ppLocale
+    );
+static HRESULT ConvertDouble(
+    __in_z LPCWSTR wzNumber,
+    __out double* pdValue
+    );
+static HRESULT ConvertDouble(
+    __in_z const BYTE* pbNumber,
+    __out double* pdValue
+    );
+#ifdef JSON_SCAN_SSE2
+static LPWSTR ScanStringSse2(
+    __in_z LPWSTR wz
+    );
+static LPBYTE ScanStringSse2(
+    __in_z LPBYTE pb
+    );
+#endif
+static HRESULT ParseDom(
+    __in JSON_READER* pReader,
+    __out JSON_DOM_HANDLE* phDom
+    );
+static HRESULT SetDomValue(
+    __in MEM_ARENA_HANDLE hArena,
+    __in const JSON_VALUE* pValue,
+    __in JSON_NODE* pNode
+    );
+static HRESULT CopyDomString(
+    __in MEM_ARENA_HANDLE hArena,
+    __in const JSON_VALUE* pValue,
+    __out LPCWSTR* pwzCopy,
+    __out_opt DWORD* pcchCopy
+    );
+static BOOL IsPointerTokenMatch(
+    __in_z LPCWSTR wzKey,
+    __in LPCWSTR wzToken,
+    __in LPCWSTR wzTokenEnd
+    );
+static BOOL ParsePointerIndex(
+    __in LPCWSTR wzToken,
+    __in LPCWSTR wzTokenEnd,
+    __out DWORD* pdwIndex
+    );
+static HRESULT AppendJson(
+    __in JSON_WRITER* pWriter,
+    __in_z LPCWSTR wzJson
+    );
+static HRESULT AppendStream(
+    __in JSON_WRITER* pWriter,
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in SIZE_T cbData
+    );
+static HRESULT FlushStream(
+    __in JSON_WRITER* pWriter
+    );
+static HRESULT CALLBACK WriteFileCallback(
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in SIZE_T cbData,
+    __in_opt LPVOID pvContext
+    );
 static HRESULT DoStart(
     __in JSON_WRITER* pWriter,
     __in JSON_TOKEN tokenStart,
@@ -52,11 +218,21 @@ DAPI_(HRESULT) JsonInitializeReader(
     __in_z LPCWSTR wzJson,
     __in JSON_READER* pReader
     )
+{
+    return JsonInitializeReaderEx(wzJson, JSON_READER_FLAG_NONE, pReader);
+}
+
+
+DAPI_(HRESULT) JsonInitializeReaderEx(
+    __in_z LPCWSTR wzJson,
+    __in JSON_READER_FLAG jrfFlags,
+    __in JSON_READER* pReader
+    )
 {
     HRESULT hr = S_OK;
 
-    memset(pReader, 0, sizeof(JSON_READER));
-    ::InitializeCriticalSection(&pReader->cs);
+    hr = InitializeReader(pReader, jrfFlags);
+    JsonExitOnFailure(hr, "Failed to initialize JSON reader.");
 
     hr = StrAllocString(&pReader->sczJson, wzJson, 0);
     JsonExitOnFailure(hr, "Failed to allocate json string.");
@@ -68,291 +244,1560 @@ LExit:
 }
 
 
+DAPI_(HRESULT) JsonInitializeReaderUtf8(
+    __in_bcount(cbJson) LPCSTR szJson,
+    __in SIZE_T cbJson,
+    __in JSON_READER_FLAG jrfFlags,
+    __in JSON_READER* pReader
+    )
+{
+    HRESULT hr = S_OK;
+
+    hr = InitializeReader(pReader, jrfFlags);
+    JsonExitOnFailure(hr, "Failed to initialize JSON reader.");
+
+    // Skip the byte order mark.
+    if (3 <= cbJson && 0xEF == static_cast<BYTE>(szJson[0]) && 0xBB == static_cast<BYTE>(szJson[1]) && 0xBF == static_cast<BYTE>(szJson[2]))
+    {
+        szJson += 3;
+        cbJson -= 3;
+    }
+
+    // Copy rather than transcode; the buffer is null terminated and strings are unescaped in it.
+    pReader->sczJsonUtf8 = static_cast<LPSTR>(MemAlloc(cbJson + 1, FALSE));
+    JsonExitOnNull(pReader->sczJsonUtf8, hr, E_OUTOFMEMORY, "Failed to allocate UTF-8 JSON buffer.");
+
+    memcpy(pReader->sczJsonUtf8, szJson, cbJson);
+    pReader->sczJsonUtf8[cbJson] = '\0';
+
+    pReader->psz = pReader->sczJsonUtf8;
+
+LExit:
+    return hr;
+}
+
+
 DAPI_(void) JsonUninitializeReader(
     __in JSON_READER* pReader
     )
 {
+    ReleaseMem(pReader->rgTokenStack);
     ReleaseStr(pReader->sczJson);
+    ReleaseMem(pReader->sczJsonUtf8);
+
+    if (pReader->fSynchronized)
+    {
+        ::DeleteCriticalSection(&pReader->cs);
+    }
 
-    ::DeleteCriticalSection(&pReader->cs);
     memset(pReader, 0, sizeof(JSON_READER));
 }
 
 
-static HRESULT NextToken(
+DAPI_(HRESULT) JsonReadNext(
     __in JSON_READER* pReader,
-    __out JSON_TOKEN* pToken
+    __out JSON_TOKEN* pToken,
+    __out JSON_VALUE* pValue
     )
 {
     HRESULT hr = S_OK;
 
-    // Skip whitespace.
-    while (L' ' == *pReader->pwz ||
-        L'\t' == *pReader->pwz ||
-        L'\r' == *pReader->pwz ||
-        L'\n' == *pReader->pwz ||
-        L',' == *pReader->pwz)
+    if (pReader->fSynchronized)
     {
-        ++pReader->pwz;
+        ::EnterCriticalSection(&pReader->cs);
     }
 
-    switch (*pReader->pwz)
-    {
-    case L'{':
-        *pToken = JSON_TOKEN_OBJECT_START;
-        break;
-
-    case L':': // begin object value
-        *pToken = JSON_TOKEN_OBJECT_VALUE;
-        break;
-
-    case L'}': // end object
-        *pToken = JSON_TOKEN_OBJECT_END;
-        break;
-
-    case L'[': // begin array
-        *pToken = JSON_TOKEN_ARRAY_START;
-        break;
+    *pToken = JSON_TOKEN_NONE;
+    memset(pValue, 0, sizeof(JSON_VALUE));
 
-    case L']': // end array
-        *pToken = JSON_TOKEN_ARRAY_END;
-        break;
+    if (!pReader->cTokens)
+    {
+        hr = E_INVALIDSTATE;
+        JsonExitOnRootFailure(hr, "JSON reader is not initialized.");
+    }
 
-    case L'"': // string
-        *pToken = JSON_TOKEN_OBJECT_START == *pToken ? JSON_TOKEN_VALUE : JSON_TOKEN_OBJECT_KEY;
-        break;
+    if (pReader->sczJsonUtf8)
+    {
+        hr = ReadToken(pReader, reinterpret_cast<const BYTE*>(pReader->sczJsonUtf8), reinterpret_cast<LPBYTE*>(&pReader->psz), pToken, pValue);
+    }
+    else
+    {
+        hr = ReadToken(pReader, pReader->sczJson, &pReader->pwz, pToken, pValue);
+    }
 
-    case L't': // true
-    case L'f': // false
-    case L'n': // null
-    case L'-': // number
-    case L'0':
-    case L'1':
-    case L'2':
-    case L'3':
-    case L'4':
-    case L'5':
-    case L'6':
-    case L'7':
-    case L'8':
-    case L'9':
-        *pToken = JSON_TOKEN_VALUE;
-        break;
+    if (E_NOMOREITEMS == hr)
+    {
+        ExitFunction();
+    }
+    JsonExitOnFailure(hr, "Failed to read next JSON token.");
 
-    case L'\0':
-        hr = E_NOMOREITEMS;
-        break;
+    pReader->token = *pToken;
 
-    default:
-        hr = E_INVALIDSTATE;
+LExit:
+    if (pReader->fSynchronized)
+    {
+        ::LeaveCriticalSection(&pReader->cs);
     }
 
     return hr;
 }
 
 
-DAPI_(HRESULT) JsonReadNext(
+DAPI_(HRESULT) JsonReadValue(
     __in JSON_READER* pReader,
-    __out JSON_TOKEN* pToken,
     __out JSON_VALUE* pValue
     )
 {
     HRESULT hr = S_OK;
-    //WCHAR wz;
-    //JSON_TOKEN token = JSON_TOKEN_NONE;
-
-    ::EnterCriticalSection(&pReader->cs);
+    JSON_TOKEN token = JSON_TOKEN_NONE;
 
-    hr = NextToken(pReader, pToken);
+    hr = JsonReadNext(pReader, &token, pValue);
     if (E_NOMOREITEMS == hr)
     {
         ExitFunction();
     }
-    JsonExitOnFailure(hr, "Failed to get next token.");
+    JsonExitOnFailure(hr, "Failed to read JSON value.");
 
-    if (JSON_TOKEN_VALUE == *pToken)
-    {
-        hr = JsonReadValue(pReader, pValue);
-    }
-    else
+    if (JSON_TOKEN_VALUE != token)
     {
-        ++pReader->pwz;
+        hr = E_UNEXPECTED;
+        JsonExitOnRootFailure(hr, "Expected a JSON string, number or literal but found token: %d", token);
     }
 
 LExit:
-    ::LeaveCriticalSection(&pReader->cs);
     return hr;
 }
 
 
-DAPI_(HRESULT) JsonReadValue(
-    __in JSON_READER* /*pReader*/,
-    __in JSON_VALUE* /*pValue*/
+DAPI_(HRESULT) JsonAllocValueString(
+    __deref_out_z LPWSTR* psczValue,
+    __in const JSON_VALUE* pValue
     )
 {
     HRESULT hr = S_OK;
+    int cch = 0;
+
+    if (JSON_VALUE_TYPE_STRING != pValue->type)
+    {
+        hr = E_INVALIDARG;
+        JsonExitOnRootFailure(hr, "JSON value is not a string: %d", pValue->type);
+    }
+
+    if (pValue->wzValue)
+    {
+        hr = StrAllocString(psczValue, pValue->wzValue, pValue->cchValue);
+        JsonExitOnFailure(hr, "Failed to copy JSON string value.");
+    }
+    else if (!pValue->cchValue)
+    {
+        hr = StrAllocString(psczValue, L"", 0);
+        JsonExitOnFailure(hr, "Failed to copy empty JSON string value.");
+    }
+    else
+    {
+        if (INT_MAX < pValue->cchValue)
+        {
+            hr = E_INVALIDARG;
+            JsonExitOnRootFailure(hr, "JSON string value is too long to convert.");
+        }
+
+        // Transcoding happens here, only for values the caller asks for.
+        cch = ::MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, pValue->szValue, static_cast<int>(pValue->cchValue), NULL, 0);
+        if (!cch)
+        {
+            JsonExitWithLastError(hr, "Failed to get length of UTF-8 JSON string value.");
+        }
+
+        hr = StrAlloc(psczValue, cch + 1);
+        JsonExitOnFailure(hr, "Failed to allocate JSON string value.");
+
+        if (!::MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, pValue->szValue, static_cast<int>(pValue->cchValue), *psczValue, cch))
+        {
+            JsonExitWithLastError(hr, "Failed to convert UTF-8 JSON string value.");
+        }
+
+        (*psczValue)[cch] = L'\0';
+    }
 
-//LExit:
+LExit:
     return hr;
 }
 
 
-DAPI_(HRESULT) JsonInitializeWriter(
-    __in JSON_WRITER* pWriter
+DAPI_(HRESULT) JsonDomCreate(
+    __in JSON_READER* pReader,
+    __out JSON_DOM_HANDLE* phDom
     )
 {
-    memset(pWriter, 0, sizeof(JSON_WRITER));
-    ::InitializeCriticalSection(&pWriter->cs);
+    HRESULT hr = S_OK;
+    MEM_ARENA_HANDLE hArena = NULL;
+    JSON_DOM* pDom = NULL;
+    JSON_NODE* rgNodes = NULL;
+    JSON_NODE* pNode = NULL;
+    DWORD cNodes = 0;
+    DWORD* rgiOpen = NULL;
+    DWORD cOpen = 0;
+    JSON_TOKEN token = JSON_TOKEN_NONE;
+    JSON_VALUE value = { };
+    LPCWSTR wzKey = NULL;
+    SIZE_T cbNodes = 0;
 
-    return S_OK;
-}
+    hr = MemArenaCreate(JSON_DOM_ARENA_BLOCK_SIZE, &hArena);
+    JsonExitOnFailure(hr, "Failed to create JSON DOM arena.");
 
+    // Read one complete value: the whole document for a new reader, or the next value when the
+    // caller has already streamed part of the document.
+    do
+    {
+        hr = JsonReadNext(pReader, &token, &value);
+        if (E_NOMOREITEMS == hr && !cNodes)
+        {
+            ExitFunction();
+        }
+        JsonExitOnFailure(hr, "Failed to read JSON for DOM.");
 
-DAPI_(void) JsonUninitializeWriter(
-    __in JSON_WRITER* pWriter
-    )
-{
-    ReleaseMem(pWriter->rgTokenStack);
-    ReleaseStr(pWriter->sczJson);
+        switch (token)
+        {
+        case JSON_TOKEN_OBJECT_KEY:
+            hr = CopyDomString(hArena, &value, &wzKey, NULL);
+            JsonExitOnFailure(hr, "Failed to copy JSON object key.");
+            break;
 
-    ::DeleteCriticalSection(&pWriter->cs);
-    memset(pWriter, 0, sizeof(JSON_WRITER));
+        case JSON_TOKEN_ARRAY_START: __fallthrough;
+        case JSON_TOKEN_OBJECT_START: __fallthrough;
+        case JSON_TOKEN_VALUE:
+            hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&rgNodes), cNodes + 1, sizeof(JSON_NODE), JSON_DOM_NODE_INCREMENT);
+            JsonExitOnFailure(hr, "Failed to grow JSON DOM nodes.");
+
+            pNode = rgNodes + cNodes;
+            memset(pNode, 0, sizeof(JSON_NODE));
+
+            pNode->iParent = cOpen ? rgiOpen[cOpen - 1] : 0;
+            pNode->iNext = cNodes + 1;
+            pNode->wzKey = wzKey;
+            wzKey = NULL;
+
+            if (cOpen)
+            {
+                ++rgNodes[pNode->iParent].cChildren;
+            }
+
+            if (JSON_TOKEN_VALUE == token)
+            {
+                hr = SetDomValue(hArena, &value, pNode);
+                JsonExitOnFailure(hr, "Failed to set JSON DOM value.");
+            }
+            else
+            {
+                pNode->type = (JSON_TOKEN_ARRAY_START == token) ? JSON_VALUE_TYPE_ARRAY : JSON_VALUE_TYPE_OBJECT;
+
+                hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&rgiOpen), cOpen + 1, sizeof(DWORD), JSON_STACK_INCREMENT);
+                JsonExitOnFailure(hr, "Failed to grow JSON DOM container stack.");
+
+                rgiOpen[cOpen] = cNodes;
+                ++cOpen;
+            }
+
+            ++cNodes;
+            break;
+
+        case JSON_TOKEN_ARRAY_END: __fallthrough;
+        case JSON_TOKEN_OBJECT_END:
+            if (!cOpen)
+            {
+                hr = E_UNEXPECTED;
+                JsonExitOnRootFailure(hr, "JSON reader is not positioned at a value.");
+            }
+
+            // The container's descendants end here, which is where its next sibling starts.
+            --cOpen;
+            rgNodes[rgiOpen[cOpen]].iNext = cNodes;
+            break;
+        }
+    } while (cOpen || !cNodes);
+
+    pDom = static_cast<JSON_DOM*>(MemArenaAlloc(hArena, sizeof(JSON_DOM), TRUE));
+    JsonExitOnNull(pDom, hr, E_OUTOFMEMORY, "Failed to allocate JSON DOM.");
+
+    // Give back the slack from growing the nodes.
+    hr = ::SIZETMult(cNodes, sizeof(JSON_NODE), &cbNodes);
+    JsonExitOnFailure(hr, "JSON DOM is too large.");
+
+    pDom->rgNodes = static_cast<JSON_NODE*>(MemReAlloc(rgNodes, cbNodes, FALSE));
+    JsonExitOnNull(pDom->rgNodes, hr, E_OUTOFMEMORY, "Failed to trim JSON DOM nodes.");
+    rgNodes = NULL;
+
+    pDom->cNodes = cNodes;
+    pDom->hArena = hArena;
+    hArena = NULL;
+
+    *phDom = pDom;
+
+LExit:
+    ReleaseMem(rgiOpen);
+    ReleaseMem(rgNodes);
+    ReleaseMemArena(hArena);
+
+    return hr;
 }
 
 
-DAPI_(HRESULT) JsonWriteBool(
-    __in JSON_WRITER* pWriter,
-    __in BOOL fValue
+DAPI_(HRESULT) JsonDomParse(
+    __in_z LPCWSTR wzJson,
+    __out JSON_DOM_HANDLE* phDom
     )
 {
     HRESULT hr = S_OK;
-    LPWSTR sczValue = NULL;
+    JSON_READER reader = { };
 
-    hr = StrAllocString(&sczValue, fValue ? L"true" : L"false", 0);
-    JsonExitOnFailure(hr, "Failed to convert boolean to string.");
+    hr = JsonInitializeReaderEx(wzJson, JSON_READER_FLAG_UNSYNCHRONIZED, &reader);
+    JsonExitOnFailure(hr, "Failed to initialize JSON reader for DOM.");
 
-    hr = DoValue(pWriter, sczValue);
-    JsonExitOnFailure(hr, "Failed to add boolean to JSON.");
+    hr = ParseDom(&reader, phDom);
 
 LExit:
-    ReleaseStr(sczValue);
+    JsonUninitializeReader(&reader);
+
     return hr;
 }
 
 
-DAPI_(HRESULT) JsonWriteNumber(
-    __in JSON_WRITER* pWriter,
-    __in DWORD dwValue
+DAPI_(HRESULT) JsonDomParseUtf8(
+    __in_bcount(cbJson) LPCSTR szJson,
+    __in SIZE_T cbJson,
+    __out JSON_DOM_HANDLE* phDom
     )
 {
     HRESULT hr = S_OK;
-    LPWSTR sczValue = NULL;
+    JSON_READER reader = { };
 
-    hr = StrAllocFormatted(&sczValue, L"%u", dwValue);
-    JsonExitOnFailure(hr, "Failed to convert number to string.");
+    hr = JsonInitializeReaderUtf8(szJson, cbJson, JSON_READER_FLAG_UNSYNCHRONIZED, &reader);
+    JsonExitOnFailure(hr, "Failed to initialize UTF-8 JSON reader for DOM.");
 
-    hr = DoValue(pWriter, sczValue);
-    JsonExitOnFailure(hr, "Failed to add number to JSON.");
+    hr = ParseDom(&reader, phDom);
 
 LExit:
-    ReleaseStr(sczValue);
+    JsonUninitializeReader(&reader);
+
     return hr;
 }
 
 
-DAPI_(HRESULT) JsonWriteString(
-    __in JSON_WRITER* pWriter,
-    __in_z LPCWSTR wzValue
+DAPI_(void) JsonDomDestroy(
+    __in JSON_DOM_HANDLE hDom
+    )
+{
+    JSON_DOM* pDom = static_cast<JSON_DOM*>(hDom);
+
+    ReleaseMem(pDom->rgNodes);
+
+    // The DOM itself is in the arena, so this goes last.
+    MemArenaDestroy(pDom->hArena);
+}
+
+
+DAPI_(const JSON_NODE*) JsonDomGetRoot(
+    __in JSON_DOM_HANDLE hDom
+    )
+{
+    JSON_DOM* pDom = static_cast<JSON_DOM*>(hDom);
+
+    return pDom->rgNodes;
+}
+
+
+DAPI_(const JSON_NODE*) JsonDomGetFirstChild(
+    __in JSON_DOM_HANDLE /*hDom*/,
+    __in const JSON_NODE* pNode
+    )
+{
+    // Children directly follow their container on the tape.
+    if ((JSON_VALUE_TYPE_ARRAY == pNode->type || JSON_VALUE_TYPE_OBJECT == pNode->type) && pNode->cChildren)
+    {
+        return pNode + 1;
+    }
+
+    return NULL;
+}
+
+
+DAPI_(const JSON_NODE*) JsonDomGetNextSibling(
+    __in JSON_DOM_HANDLE hDom,
+    __in const JSON_NODE* pNode
+    )
+{
+    JSON_DOM* pDom = static_cast<JSON_DOM*>(hDom);
+    const JSON_NODE* pParent = pDom->rgNodes + pNode->iParent;
+
+    if (pNode == pDom->rgNodes || pNode->iNext >= pParent->iNext)
+    {
+        return NULL;
+    }
+
+    return pDom->rgNodes + pNode->iNext;
+}
+
+
+DAPI_(HRESULT) JsonDomQuery(
+    __in JSON_DOM_HANDLE hDom,
+    __in_opt const JSON_NODE* pNode,
+    __in_z LPCWSTR wzPointer,
+    __out const JSON_NODE** ppNode
     )
 {
     HRESULT hr = S_OK;
-    LPWSTR sczJsonString = NULL;
+    JSON_DOM* pDom = static_cast<JSON_DOM*>(hDom);
+    const JSON_NODE* pCurrent = pNode ? pNode : pDom->rgNodes;
+    const JSON_NODE* pChild = NULL;
+    LPCWSTR wzToken = wzPointer;
+    LPCWSTR wzTokenEnd = NULL;
+    DWORD dwIndex = 0;
+
+    // RFC 6901: each reference token follows a '/', with '~0' and '~1' escaping '~' and '/'.
+    if (L'\0' != *wzPointer && L'/' != *wzPointer)
+    {
+        hr = E_INVALIDARG;
+        JsonExitOnRootFailure(hr, "JSON pointer must start with '/': %ls", wzPointer);
+    }
 
-    hr = SerializeJsonString(&sczJsonString, wzValue);
-    JsonExitOnFailure(hr, "Failed to allocate string JSON.");
+    for (LPCWSTR wz = wzPointer; *wz; ++wz)
+    {
+        if (L'~' == *wz && L'0' != wz[1] && L'1' != wz[1])
+        {
+            hr = E_INVALIDARG;
+            JsonExitOnRootFailure(hr, "Invalid escape in JSON pointer: %ls", wzPointer);
+        }
+    }
+
+    while (*wzToken)
+    {
+        ++wzToken;
+
+        wzTokenEnd = wzToken;
+        while (*wzTokenEnd && L'/' != *wzTokenEnd)
+        {
+            ++wzTokenEnd;
+        }
+
+        pChild = JsonDomGetFirstChild(hDom, pCurrent);
+        if (JSON_VALUE_TYPE_OBJECT == pCurrent->type)
+        {
+            while (pChild && !IsPointerTokenMatch(pChild->wzKey, wzToken, wzTokenEnd))
+            {
+                pChild = JsonDomGetNextSibling(hDom, pChild);
+            }
+        }
+        else if (JSON_VALUE_TYPE_ARRAY == pCurrent->type && ParsePointerIndex(wzToken, wzTokenEnd, &dwIndex) && dwIndex < pCurrent->cChildren)
+        {
+            // Each step skips a whole element, however large.
+            for (DWORD i = 0; i < dwIndex; ++i)
+            {
+                pChild = pDom->rgNodes + pChild->iNext;
+            }
+        }
+        else
+        {
+            pChild = NULL;
+        }
+
+        if (!pChild)
+        {
+            ExitFunction1(hr = E_NOTFOUND);
+        }
+
+        pCurrent = pChild;
+        wzToken = wzTokenEnd;
+    }
+
+    *ppNode = pCurrent;
+
+LExit:
+    return hr;
+}
+
+
+DAPI_(HRESULT) JsonInitializeWriter(
+    __in JSON_WRITER* pWriter
+    )
+{
+    return JsonInitializeWriterEx(pWriter, JSON_WRITER_FLAG_NONE);
+}
+
+
+DAPI_(HRESULT) JsonInitializeWriterEx(
+    __in JSON_WRITER* pWriter,
+    __in JSON_WRITER_FLAG jwfFlags
+    )
+{
+    memset(pWriter, 0, sizeof(JSON_WRITER));
+    ::InitializeCriticalSection(&pWriter->cs);
+
+    pWriter->fUtf8 = (JSON_WRITER_FLAG_UTF8 & jwfFlags) ? TRUE : FALSE;
+
+    return S_OK;
+}
+
+
+DAPI_(HRESULT) JsonInitializeStreamWriter(
+    __in JSON_WRITER* pWriter,
+    __in JSON_WRITER_FLAG jwfFlags,
+    __in SIZE_T cbBuffer,
+    __in PFN_JSON_WRITE_CALLBACK pfnWrite,
+    __in_opt LPVOID pvContext
+    )
+{
+    HRESULT hr = S_OK;
+
+    hr = JsonInitializeWriterEx(pWriter, jwfFlags);
+    JsonExitOnFailure(hr, "Failed to initialize JSON writer.");
+
+    pWriter->cbBuffer = cbBuffer ? cbBuffer : JSON_STREAM_BUFFER_SIZE;
+    pWriter->pbBuffer = static_cast<LPBYTE>(MemAlloc(pWriter->cbBuffer, FALSE));
+    JsonExitOnNull(pWriter->pbBuffer, hr, E_OUTOFMEMORY, "Failed to allocate JSON stream buffer.");
+
+    pWriter->pfnWrite = pfnWrite;
+    pWriter->pvWriteContext = pvContext;
+
+LExit:
+    if (FAILED(hr))
+    {
+        JsonUninitializeWriter(pWriter);
+    }
+
+    return hr;
+}
+
+
+DAPI_(HRESULT) JsonInitializeFileWriter(
+    __in JSON_WRITER* pWriter,
+    __in JSON_WRITER_FLAG jwfFlags,
+    __in SIZE_T cbBuffer,
+    __in HANDLE hFile
+    )
+{
+    return JsonInitializeStreamWriter(pWriter, jwfFlags, cbBuffer, WriteFileCallback, hFile);
+}
+
+
+DAPI_(HRESULT) JsonFlushWriter(
+    __in JSON_WRITER* pWriter
+    )
+{
+    HRESULT hr = S_OK;
+
+    ::EnterCriticalSection(&pWriter->cs);
+
+    if (pWriter->pfnWrite)
+    {
+        hr = FlushStream(pWriter);
+        JsonExitOnFailure(hr, "Failed to flush JSON writer.");
+    }
+
+LExit:
+    ::LeaveCriticalSection(&pWriter->cs);
+    return hr;
+}
+
+
+DAPI_(void) JsonUninitializeWriter(
+    __in JSON_WRITER* pWriter
+    )
+{
+    ReleaseMem(pWriter->pbBuffer);
+    ReleaseMem(pWriter->rgTokenStack);
+    ReleaseStr(pWriter->sczJson);
+    ReleaseMem(pWriter->sczJsonUtf8);
+
+    ::DeleteCriticalSection(&pWriter->cs);
+    memset(pWriter, 0, sizeof(JSON_WRITER));
+}
+
+
+DAPI_(HRESULT) JsonWriteBool(
+    __in JSON_WRITER* pWriter,
+    __in BOOL fValue
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczValue = NULL;
+
+    hr = StrAllocString(&sczValue, fValue ? L"true" : L"false", 0);
+    JsonExitOnFailure(hr, "Failed to convert boolean to string.");
+
+    hr = DoValue(pWriter, sczValue);
+    JsonExitOnFailure(hr, "Failed to add boolean to JSON.");
+
+LExit:
+    ReleaseStr(sczValue);
+    return hr;
+}
+
+
+DAPI_(HRESULT) JsonWriteNumber(
+    __in JSON_WRITER* pWriter,
+    __in DWORD dwValue
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczValue = NULL;
+
+    hr = StrAllocFormatted(&sczValue, L"%u", dwValue);
+    JsonExitOnFailure(hr, "Failed to convert number to string.");
+
+    hr = DoValue(pWriter, sczValue);
+    JsonExitOnFailure(hr, "Failed to add number to JSON.");
+
+LExit:
+    ReleaseStr(sczValue);
+    return hr;
+}
+
+
+DAPI_(HRESULT) JsonWriteString(
+    __in JSON_WRITER* pWriter,
+    __in_z LPCWSTR wzValue
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczJsonString = NULL;
+
+    hr = SerializeJsonString(&sczJsonString, wzValue);
+    JsonExitOnFailure(hr, "Failed to allocate string JSON.");
+
+    hr = DoValue(pWriter, sczJsonString);
+    JsonExitOnFailure(hr, "Failed to add string to JSON.");
+
+LExit:
+    ReleaseStr(sczJsonString);
+    return hr;
+}
+
+
+DAPI_(HRESULT) JsonWriteArrayStart(
+    __in JSON_WRITER* pWriter
+    )
+{
+    HRESULT hr = S_OK;
+
+    hr = DoStart(pWriter, JSON_TOKEN_ARRAY_START, L"[");
+    JsonExitOnFailure(hr, "Failed to start JSON array.");
+
+LExit:
+    return hr;
+}
+
+
+DAPI_(HRESULT) JsonWriteArrayEnd(
+    __in JSON_WRITER* pWriter
+    )
+{
+    HRESULT hr = S_OK;
+
+    hr = DoEnd(pWriter, JSON_TOKEN_ARRAY_END, L"]");
+    JsonExitOnFailure(hr, "Failed to end JSON array.");
+
+LExit:
+    return hr;
+}
+
+
+DAPI_(HRESULT) JsonWriteObjectStart(
+    __in JSON_WRITER* pWriter
+    )
+{
+    HRESULT hr = S_OK;
+
+    hr = DoStart(pWriter, JSON_TOKEN_OBJECT_START, L"{");
+    JsonExitOnFailure(hr, "Failed to start JSON object.");
+
+LExit:
+    return hr;
+}
+
+
+DAPI_(HRESULT) JsonWriteObjectKey(
+    __in JSON_WRITER* pWriter,
+    __in_z LPCWSTR wzKey
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR sczObjectKey = NULL;
+
+    hr = StrAllocFormatted(&sczObjectKey, L"\"%ls\":", wzKey);
+    JsonExitOnFailure(hr, "Failed to allocate JSON object key.");
+
+    hr = DoKey(pWriter, sczObjectKey);
+    JsonExitOnFailure(hr, "Failed to add object key to JSON.");
+
+LExit:
+    ReleaseStr(sczObjectKey);
+    return hr;
+}
+
+
+DAPI_(HRESULT) JsonWriteObjectEnd(
+    __in JSON_WRITER* pWriter
+    )
+{
+    HRESULT hr = S_OK;
+
+    hr = DoEnd(pWriter, JSON_TOKEN_OBJECT_END, L"}");
+    JsonExitOnFailure(hr, "Failed to end JSON object.");
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT InitializeReader(
+    __in JSON_READER* pReader,
+    __in JSON_READER_FLAG jrfFlags
+    )
+{
+    HRESULT hr = S_OK;
+
+    memset(pReader, 0, sizeof(JSON_READER));
+
+    if (!(JSON_READER_FLAG_UNSYNCHRONIZED & jrfFlags))
+    {
+        ::InitializeCriticalSection(&pReader->cs);
+        pReader->fSynchronized = TRUE;
+    }
+
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pReader->rgTokenStack), 1, sizeof(JSON_TOKEN), JSON_STACK_INCREMENT);
+    JsonExitOnFailure(hr, "Failed to allocate JSON reader token stack.");
+
+    // The document itself expects a single value.
+    pReader->rgTokenStack[0] = JSON_TOKEN_NONE;
+    pReader->cTokens = 1;
+
+LExit:
+    return hr;
+}
+
+
+template<typename T> static HRESULT ReadToken(
+    __in JSON_READER* pReader,
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_TOKEN* pToken,
+    __out JSON_VALUE* pValue
+    )
+{
+    HRESULT hr = S_OK;
+    JSON_TOKEN state = pReader->rgTokenStack[pReader->cTokens - 1];
+
+    *ppch = SkipWhitespace(*ppch);
+
+    switch (state)
+    {
+    case JSON_TOKEN_NONE: // the document's value
+    case JSON_TOKEN_OBJECT_KEY: // the value after a key
+        hr = ReadNextValue(pReader, pchJson, ppch, pToken, pValue);
+        break;
+
+    case JSON_TOKEN_VALUE: // the document's value has been read
+        if (L'\0' != **ppch)
+        {
+            hr = E_INVALIDDATA;
+            JsonExitOnRootFailure(hr, "Unexpected data after the JSON document at offset: %u", static_cast<DWORD>(*ppch - pchJson));
+        }
+
+        ExitFunction1(hr = E_NOMOREITEMS);
+
+    case JSON_TOKEN_ARRAY_START:
+        hr = (L']' == **ppch) ? ReadContainerEnd(pReader, pchJson, ppch, pToken) : ReadNextValue(pReader, pchJson, ppch, pToken, pValue);
+        break;
+
+    case JSON_TOKEN_OBJECT_START:
+        hr = (L'}' == **ppch) ? ReadContainerEnd(pReader, pchJson, ppch, pToken) : ReadObjectKey(pReader, pchJson, ppch, pToken, pValue);
+        break;
+
+    case JSON_TOKEN_ARRAY_VALUE:
+    case JSON_TOKEN_OBJECT_VALUE:
+        if (L']' == **ppch || L'}' == **ppch)
+        {
+            hr = ReadContainerEnd(pReader, pchJson, ppch, pToken);
+        }
+        else if (L',' == **ppch)
+        {
+            *ppch = SkipWhitespace(*ppch + 1);
+
+            hr = (JSON_TOKEN_ARRAY_VALUE == state) ? ReadNextValue(pReader, pchJson, ppch, pToken, pValue) : ReadObjectKey(pReader, pchJson, ppch, pToken, pValue);
+        }
+        else
+        {
+            hr = E_INVALIDDATA;
+            JsonExitOnRootFailure(hr, "Expected ',' or the end of the %ls at offset: %u", (JSON_TOKEN_ARRAY_VALUE == state) ? L"array" : L"object", static_cast<DWORD>(*ppch - pchJson));
+        }
+        break;
+
+    default:
+        hr = E_INVALIDSTATE;
+        JsonExitOnRootFailure(hr, "JSON reader is in an unexpected state: %d", state);
+    }
+
+LExit:
+    return hr;
+}
+
+
+template<typename T> static HRESULT ReadNextValue(
+    __in JSON_READER* pReader,
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_TOKEN* pToken,
+    __out JSON_VALUE* pValue
+    )
+{
+    HRESULT hr = S_OK;
+    JSON_TOKEN* pState = pReader->rgTokenStack + pReader->cTokens - 1;
+
+    // Once this value is read the parent moves past it.
+    switch (*pState)
+    {
+    case JSON_TOKEN_NONE:
+        *pState = JSON_TOKEN_VALUE;
+        break;
+
+    case JSON_TOKEN_ARRAY_START: __fallthrough;
+    case JSON_TOKEN_ARRAY_VALUE:
+        *pState = JSON_TOKEN_ARRAY_VALUE;
+        break;
+
+    case JSON_TOKEN_OBJECT_KEY:
+        *pState = JSON_TOKEN_OBJECT_VALUE;
+        break;
+    }
+
+    switch (**ppch)
+    {
+    case L'{': __fallthrough;
+    case L'[':
+        if (JSON_MAX_DEPTH <= pReader->dwDepth)
+        {
+            hr = E_INVALIDDATA;
+            JsonExitOnRootFailure(hr, "JSON is nested more than %u levels deep at offset: %u", JSON_MAX_DEPTH, static_cast<DWORD>(*ppch - pchJson));
+        }
+
+        hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pReader->rgTokenStack), pReader->cTokens + 1, sizeof(JSON_TOKEN), JSON_STACK_INCREMENT);
+        JsonExitOnFailure(hr, "Failed to grow JSON reader token stack.");
+
+        *pToken = (L'{' == **ppch) ? JSON_TOKEN_OBJECT_START : JSON_TOKEN_ARRAY_START;
+        pReader->rgTokenStack[pReader->cTokens] = *pToken;
+        ++pReader->cTokens;
+        ++pReader->dwDepth;
+        ++*ppch;
+        break;
+
+    case L'"':
+        hr = ReadString(pchJson, ppch, pValue);
+        JsonExitOnFailure(hr, "Failed to read JSON string value.");
+
+        *pToken = JSON_TOKEN_VALUE;
+        break;
+
+    case L't':
+        hr = ReadLiteral(pchJson, ppch, L"true", JSON_VALUE_TYPE_BOOL, pValue);
+        JsonExitOnFailure(hr, "Failed to read JSON true.");
+
+        pValue->fValue = TRUE;
+        *pToken = JSON_TOKEN_VALUE;
+        break;
+
+    case L'f':
+        hr = ReadLiteral(pchJson, ppch, L"false", JSON_VALUE_TYPE_BOOL, pValue);
+        JsonExitOnFailure(hr, "Failed to read JSON false.");
+
+        *pToken = JSON_TOKEN_VALUE;
+        break;
+
+    case L'n':
+        hr = ReadLiteral(pchJson, ppch, L"null", JSON_VALUE_TYPE_NULL, pValue);
+        JsonExitOnFailure(hr, "Failed to read JSON null.");
+
+        *pToken = JSON_TOKEN_VALUE;
+        break;
+
+    case L'-': __fallthrough;
+    case L'0': case L'1': case L'2': case L'3': case L'4':
+    case L'5': case L'6': case L'7': case L'8': case L'9':
+        hr = ReadNumber(pchJson, ppch, pValue);
+        JsonExitOnFailure(hr, "Failed to read JSON number.");
+
+        *pToken = JSON_TOKEN_VALUE;
+        break;
+
+    case L'\0':
+        hr = E_INVALIDDATA;
+        JsonExitOnRootFailure(hr, "Unexpected end of JSON while expecting a value.");
+
+    default:
+        hr = E_INVALIDDATA;
+        JsonExitOnRootFailure(hr, "Expected a JSON value at offset: %u", static_cast<DWORD>(*ppch - pchJson));
+    }
+
+LExit:
+    return hr;
+}
+
+
+template<typename T> static HRESULT ReadObjectKey(
+    __in JSON_READER* pReader,
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_TOKEN* pToken,
+    __out JSON_VALUE* pValue
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (L'"' != **ppch)
+    {
+        hr = E_INVALIDDATA;
+        JsonExitOnRootFailure(hr, "Expected a JSON object key at offset: %u", static_cast<DWORD>(*ppch - pchJson));
+    }
+
+    hr = ReadString(pchJson, ppch, pValue);
+    JsonExitOnFailure(hr, "Failed to read JSON object key.");
+
+    *ppch = SkipWhitespace(*ppch);
+
+    if (L':' != **ppch)
+    {
+        hr = E_INVALIDDATA;
+        JsonExitOnRootFailure(hr, "Expected ':' after JSON object key at offset: %u", static_cast<DWORD>(*ppch - pchJson));
+    }
+
+    ++*ppch;
+
+    pReader->rgTokenStack[pReader->cTokens - 1] = JSON_TOKEN_OBJECT_KEY;
+    *pToken = JSON_TOKEN_OBJECT_KEY;
+
+LExit:
+    return hr;
+}
+
+
+template<typename T> static HRESULT ReadContainerEnd(
+    __in JSON_READER* pReader,
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_TOKEN* pToken
+    )
+{
+    HRESULT hr = S_OK;
+    JSON_TOKEN state = pReader->rgTokenStack[pReader->cTokens - 1];
+    BOOL fArray = (JSON_TOKEN_ARRAY_START == state || JSON_TOKEN_ARRAY_VALUE == state);
+
+    if ((fArray ? L']' : L'}') != **ppch)
+    {
+        hr = E_INVALIDDATA;
+        JsonExitOnRootFailure(hr, "Mismatched end of JSON %ls at offset: %u", fArray ? L"array" : L"object", static_cast<DWORD>(*ppch - pchJson));
+    }
+
+    --pReader->cTokens;
+    --pReader->dwDepth;
+    ++*ppch;
+
+    *pToken = fArray ? JSON_TOKEN_ARRAY_END : JSON_TOKEN_OBJECT_END;
+
+LExit:
+    return hr;
+}
+
+
+template<typename T> static HRESULT ReadString(
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_VALUE* pValue
+    )
+{
+    HRESULT hr = S_OK;
+    T* pchStart = *ppch + 1;
+    T* pchRead = pchStart;
+    T* pchWrite = pchStart;
+    T* pchSpecial = NULL;
+    DWORD dwCodePoint = 0;
+    WCHAR wch = L'\0';
+    WCHAR wchLow = L'\0';
+
+    // Unescape in place: an escape is never shorter than the code units it decodes to, so the
+    // write position never passes the read position.
+    for (;;)
+    {
+        pchSpecial = ScanString(pchRead);
+        if (pchWrite != pchRead)
+        {
+            memmove(pchWrite, pchRead, (pchSpecial - pchRead) * sizeof(T));
+        }
+
+        pchWrite += pchSpecial - pchRead;
+        pchRead = pchSpecial;
+
+        if (L'"' == *pchRead)
+        {
+            break;
+        }
+        else if (L'\\' != *pchRead)
+        {
+            hr = E_INVALIDDATA;
+            JsonExitOnRootFailure(hr, "%ls in JSON string at offset: %u", (L'\0' == *pchRead) ? L"Unexpected end of data" : L"Unescaped control character", static_cast<DWORD>(pchRead - pchJson));
+        }
+
+        ++pchRead;
+        switch (*pchRead)
+        {
+        case L'"': __fallthrough;
+        case L'\\': __fallthrough;
+        case L'/':
+            dwCodePoint = *pchRead;
+            break;
+
+        case L'b':
+            dwCodePoint = L'\b';
+            break;
+
+        case L'f':
+            dwCodePoint = L'\f';
+            break;
+
+        case L'n':
+            dwCodePoint = L'\n';
+            break;
+
+        case L'r':
+            dwCodePoint = L'\r';
+            break;
+
+        case L't':
+            dwCodePoint = L'\t';
+            break;
+
+        case L'u':
+            hr = ReadHexCharacter(pchJson, pchRead + 1, &wch);
+            JsonExitOnFailure(hr, "Failed to read JSON unicode escape.");
+
+            pchRead += 4;
+            dwCodePoint = wch;
+
+            // Surrogates must come as a properly ordered escaped pair.
+            if (IS_HIGH_SURROGATE(wch))
+            {
+                if (L'\\' != pchRead[1] || L'u' != pchRead[2])
+                {
+                    hr = E_INVALIDDATA;
+                    JsonExitOnRootFailure(hr, "Unpaired high surrogate in JSON string at offset: %u", static_cast<DWORD>(pchRead - pchJson));
+                }
+
+                hr = ReadHexCharacter(pchJson, pchRead + 3, &wchLow);
+                JsonExitOnFailure(hr, "Failed to read JSON unicode escape.");
+
+                if (!IS_LOW_SURROGATE(wchLow))
+                {
+                    hr = E_INVALIDDATA;
+                    JsonExitOnRootFailure(hr, "Unpaired high surrogate in JSON string at offset: %u", static_cast<DWORD>(pchRead - pchJson));
+                }
+
+                dwCodePoint = 0x10000 + ((wch - 0xD800) << 10) + (wchLow - 0xDC00);
+                pchRead += 6;
+            }
+            else if (IS_LOW_SURROGATE(wch))
+            {
+                hr = E_INVALIDDATA;
+                JsonExitOnRootFailure(hr, "Unpaired low surrogate in JSON string at offset: %u", static_cast<DWORD>(pchRead - pchJson));
+            }
+            break;
+
+        default:
+            hr = E_INVALIDDATA;
+            JsonExitOnRootFailure(hr, "Invalid escape in JSON string at offset: %u", static_cast<DWORD>(pchRead - pchJson));
+        }
+
+        pchWrite = WriteCodePoint(pchWrite, dwCodePoint);
+        ++pchRead;
+    }
+
+    // Terminate the value where it ends, which may be over the closing quote itself.
+    *pchWrite = L'\0';
+    *ppch = pchRead + 1;
+
+    SetStringValue(pValue, pchStart, pchWrite - pchStart);
+
+LExit:
+    return hr;
+}
+
+
+template<typename T> static HRESULT ReadNumber(
+    __in const T* pchJson,
+    __inout T** ppch,
+    __out JSON_VALUE* pValue
+    )
+{
+    HRESULT hr = S_OK;
+    const T* pchStart = *ppch;
+    const T* pch = pchStart;
+    BOOL fNegative = FALSE;
+    BOOL fInteger = TRUE;
+    BOOL fExact = TRUE;
+    ULONGLONG ullMantissa = 0;
+    int nExponent = 0;
+    int nExplicitExponent = 0;
+    BOOL fNegativeExponent = FALSE;
+
+    // Grammar: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+    if (L'-' == *pch)
+    {
+        fNegative = TRUE;
+        ++pch;
+    }
+
+    if (L'0' == *pch)
+    {
+        ++pch;
+    }
+    else if (L'1' <= *pch && L'9' >= *pch)
+    {
+        do
+        {
+            if (ullMantissa <= (ULONGLONG_MAX - 9) / 10)
+            {
+                ullMantissa = ullMantissa * 10 + (*pch - L'0');
+            }
+            else
+            {
+                fExact = FALSE;
+            }
+
+            ++pch;
+        } while (L'0' <= *pch && L'9' >= *pch);
+    }
+    else
+    {
+        hr = E_INVALIDDATA;
+        JsonExitOnRootFailure(hr, "Expected a digit in JSON number at offset: %u", static_cast<DWORD>(pch - pchJson));
+    }
+
+    if (L'.' == *pch)
+    {
+        fInteger = FALSE;
+        ++pch;
+
+        if (L'0' > *pch || L'9' < *pch)
+        {
+            hr = E_INVALIDDATA;
+            JsonExitOnRootFailure(hr, "Expected a digit after the decimal point in JSON number at offset: %u", static_cast<DWORD>(pch - pchJson));
+        }
+
+        do
+        {
+            if (ullMantissa <= (ULONGLONG_MAX - 9) / 10)
+            {
+                ullMantissa = ullMantissa * 10 + (*pch - L'0');
+                --nExponent;
+            }
+            else
+            {
+                fExact = FALSE;
+            }
+
+            ++pch;
+        } while (L'0' <= *pch && L'9' >= *pch);
+    }
+
+    if (L'e' == *pch || L'E' == *pch)
+    {
+        fInteger = FALSE;
+        ++pch;
+
+        if (L'-' == *pch || L'+' == *pch)
+        {
+            fNegativeExponent = (L'-' == *pch);
+            ++pch;
+        }
+
+        if (L'0' > *pch || L'9' < *pch)
+        {
+            hr = E_INVALIDDATA;
+            JsonExitOnRootFailure(hr, "Expected a digit in the exponent of JSON number at offset: %u", static_cast<DWORD>(pch - pchJson));
+        }
+
+        do
+        {
+            // Anything this large is out of range for a double anyway.
+            if (nExplicitExponent < 100000)
+            {
+                nExplicitExponent = nExplicitExponent * 10 + (*pch - L'0');
+            }
+
+            ++pch;
+        } while (L'0' <= *pch && L'9' >= *pch);
+
+        nExponent += fNegativeExponent ? -nExplicitExponent : nExplicitExponent;
+    }
+
+    *ppch = const_cast<T*>(pch);
+
+    if (fInteger && fExact && ullMantissa <= static_cast<ULONGLONG>(LONGLONG_MAX) + (fNegative ? 1 : 0))
+    {
+        pValue->type = JSON_VALUE_TYPE_INTEGER;
+        pValue->llValue = fNegative ? static_cast<LONGLONG>(0 - ullMantissa) : static_cast<LONGLONG>(ullMantissa);
+        pValue->dValue = static_cast<double>(pValue->llValue);
+    }
+    else
+    {
+        pValue->type = JSON_VALUE_TYPE_DOUBLE;
+
+        // Both the mantissa and the power of ten are exact doubles so a single operation rounds correctly.
+        if (fExact && ullMantissa <= (1ULL << 53) && -22 <= nExponent && 22 >= nExponent)
+        {
+            pValue->dValue = static_cast<double>(ullMantissa);
+            pValue->dValue = (0 > nExponent) ? pValue->dValue / JSON_EXACT_POWERS_OF_TEN[-nExponent] : pValue->dValue * JSON_EXACT_POWERS_OF_TEN[nExponent];
+
+            if (fNegative)
+            {
+                pValue->dValue = -pValue->dValue;
+            }
+        }
+        else
+        {
+            hr = ConvertDouble(pchStart, &pValue->dValue);
+            JsonExitOnFailure(hr, "Failed to convert JSON number.");
+        }
+    }
+
+LExit:
+    return hr;
+}
+
+
+template<typename T> static HRESULT ReadLiteral(
+    __in const T* pchJson,
+    __inout T** ppch,
+    __in_z LPCWSTR wzLiteral,
+    __in JSON_VALUE_TYPE type,
+    __out JSON_VALUE* pValue
+    )
+{
+    HRESULT hr = S_OK;
+    SIZE_T i = 0;
+
+    // Stops at the first mismatch, so never reads past the terminator.
+    for (; wzLiteral[i]; ++i)
+    {
+        if (wzLiteral[i] != (*ppch)[i])
+        {
+            hr = E_INVALIDDATA;
+            JsonExitOnRootFailure(hr, "Expected JSON literal '%ls' at offset: %u", wzLiteral, static_cast<DWORD>(*ppch - pchJson));
+        }
+    }
+
+    *ppch += i;
+    pValue->type = type;
+
+LExit:
+    return hr;
+}
+
+
+template<typename T> static HRESULT ReadHexCharacter(
+    __in const T* pchJson,
+    __in_z const T* pch,
+    __out WCHAR* pwch
+    )
+{
+    HRESULT hr = S_OK;
+    WCHAR wch = L'\0';
+
+    // Stop at the first non-hex digit so a short escape never reads past the terminator.
+    for (DWORD i = 0; i < 4; ++i)
+    {
+        wch <<= 4;
+
+        if (L'0' <= pch[i] && L'9' >= pch[i])
+        {
+            wch |= pch[i] - L'0';
+        }
+        else if (L'a' <= pch[i] && L'f' >= pch[i])
+        {
+            wch |= pch[i] - L'a' + 10;
+        }
+        else if (L'A' <= pch[i] && L'F' >= pch[i])
+        {
+            wch |= pch[i] - L'A' + 10;
+        }
+        else
+        {
+            hr = E_INVALIDDATA;
+            JsonExitOnRootFailure(hr, "Invalid hex digit in JSON unicode escape at offset: %u", static_cast<DWORD>(pch + i - pchJson));
+        }
+    }
+
+    *pwch = wch;
+
+LExit:
+    return hr;
+}
+
+
+template<typename T> static T* SkipWhitespace(
+    __in_z T* pch
+    )
+{
+    while (L' ' == *pch || L'\t' == *pch || L'\r' == *pch || L'\n' == *pch)
+    {
+        ++pch;
+    }
+
+    return pch;
+}
+
+
+static LPWSTR WriteCodePoint(
+    __in LPWSTR pwz,
+    __in DWORD dwCodePoint
+    )
+{
+    if (0x10000 <= dwCodePoint)
+    {
+        dwCodePoint -= 0x10000;
+        *pwz++ = static_cast<WCHAR>(0xD800 + (dwCodePoint >> 10));
+        *pwz++ = static_cast<WCHAR>(0xDC00 + (dwCodePoint & 0x3FF));
+    }
+    else
+    {
+        *pwz++ = static_cast<WCHAR>(dwCodePoint);
+    }
+
+    return pwz;
+}
+
+
+static LPBYTE WriteCodePoint(
+    __in LPBYTE pb,
+    __in DWORD dwCodePoint
+    )
+{
+    if (0x80 > dwCodePoint)
+    {
+        *pb++ = static_cast<BYTE>(dwCodePoint);
+    }
+    else if (0x800 > dwCodePoint)
+    {
+        *pb++ = static_cast<BYTE>(0xC0 | (dwCodePoint >> 6));
+        *pb++ = static_cast<BYTE>(0x80 | (dwCodePoint & 0x3F));
+    }
+    else if (0x10000 > dwCodePoint)
+    {
+        *pb++ = static_cast<BYTE>(0xE0 | (dwCodePoint >> 12));
+        *pb++ = static_cast<BYTE>(0x80 | ((dwCodePoint >> 6) & 0x3F));
+        *pb++ = static_cast<BYTE>(0x80 | (dwCodePoint & 0x3F));
+    }
+    else
+    {
+        *pb++ = static_cast<BYTE>(0xF0 | (dwCodePoint >> 18));
+        *pb++ = static_cast<BYTE>(0x80 | ((dwCodePoint >> 12) & 0x3F));
+        *pb++ = static_cast<BYTE>(0x80 | ((dwCodePoint >> 6) & 0x3F));
+        *pb++ = static_cast<BYTE>(0x80 | (dwCodePoint & 0x3F));
+    }
+
+    return pb;
+}
+
+
+static void SetStringValue(
+    __in JSON_VALUE* pValue,
+    __in LPCWSTR wzValue,
+    __in SIZE_T cchValue
+    )
+{
+    pValue->type = JSON_VALUE_TYPE_STRING;
+    pValue->wzValue = wzValue;
+    pValue->cchValue = cchValue;
+}
+
+
+static void SetStringValue(
+    __in JSON_VALUE* pValue,
+    __in const BYTE* pbValue,
+    __in SIZE_T cbValue
+    )
+{
+    pValue->type = JSON_VALUE_TYPE_STRING;
+    pValue->szValue = reinterpret_cast<LPCSTR>(pbValue);
+    pValue->cchValue = cbValue;
+}
+
+
+static HRESULT GetNumberLocale(
+    __out _locale_t* ppLocale
+    )
+{
+    HRESULT hr = S_OK;
+    _locale_t pLocale = static_cast<_locale_t>(::ReadPointerAcquire(reinterpret_cast<PVOID const volatile *>(&vpJsonNumberLocale)));
+    _locale_t pExisting = NULL;
+
+    // JSON numbers always use '.' regardless of the process locale.
+    if (!pLocale)
+    {
+        pLocale = ::_create_locale(LC_NUMERIC, "C");
+        JsonExitOnNull(pLocale, hr, E_OUTOFMEMORY, "Failed to create locale for JSON numbers.");
+
+        pExisting = static_cast<_locale_t>(::InterlockedCompareExchangePointer(reinterpret_cast<PVOID volatile *>(&vpJsonNumberLocale), pLocale, NULL));
+        if (pExisting)
+        {
+            ::_free_locale(pLocale);
+            pLocale = pExisting;
+        }
+    }
 
-    hr = DoValue(pWriter, sczJsonString);
-    JsonExitOnFailure(hr, "Failed to add string to JSON.");
+    *ppLocale = pLocale;
 
 LExit:
-    ReleaseStr(sczJsonString);
     return hr;
 }
 
 
-DAPI_(HRESULT) JsonWriteArrayStart(
-    __in JSON_WRITER* pWriter
+static HRESULT ConvertDouble(
+    __in_z LPCWSTR wzNumber,
+    __out double* pdValue
     )
 {
     HRESULT hr = S_OK;
+    _locale_t pLocale = NULL;
 
-    hr = DoStart(pWriter, JSON_TOKEN_ARRAY_START, L"[");
-    JsonExitOnFailure(hr, "Failed to start JSON array.");
+    hr = GetNumberLocale(&pLocale);
+    JsonExitOnFailure(hr, "Failed to get locale for JSON numbers.");
+
+    *pdValue = ::_wcstod_l(wzNumber, NULL, pLocale);
 
 LExit:
     return hr;
 }
 
 
-DAPI_(HRESULT) JsonWriteArrayEnd(
-    __in JSON_WRITER* pWriter
+static HRESULT ConvertDouble(
+    __in_z const BYTE* pbNumber,
+    __out double* pdValue
     )
 {
     HRESULT hr = S_OK;
+    _locale_t pLocale = NULL;
 
-    hr = DoEnd(pWriter, JSON_TOKEN_ARRAY_END, L"]");
-    JsonExitOnFailure(hr, "Failed to end JSON array.");
+    hr = GetNumberLocale(&pLocale);
+    JsonExitOnFailure(hr, "Failed to get locale for JSON numbers.");
+
+    *pdValue = ::_strtod_l(reinterpret_cast<LPCSTR>(pbNumber), NULL, pLocale);
 
 LExit:
     return hr;
 }
 
 
-DAPI_(HRESULT) JsonWriteObjectStart(
-    __in JSON_WRITER* pWriter
+#ifdef JSON_SCAN_SSE2
+// Returns the first '"', '\\' or control character (including the terminator).
+static LPWSTR ScanStringSse2(
+    __in_z LPWSTR wz
     )
 {
-    HRESULT hr = S_OK;
+    const __m128i vQuote = _mm_set1_epi16(L'"');
+    const __m128i vBackslash = _mm_set1_epi16(L'\\');
+    const __m128i vSpace = _mm_set1_epi16(L' ');
+    const __m128i vZero = _mm_setzero_si128();
+    DWORD dwMask = 0;
+    DWORD dwIndex = 0;
+
+    // Step to a 16 byte boundary so aligned loads never touch a page past the terminator.
+    while (reinterpret_cast<DWORD_PTR>(wz) & 15)
+    {
+        if (L'"' == *wz || L'\\' == *wz || L' ' > *wz)
+        {
+            return wz;
+        }
 
-    hr = DoStart(pWriter, JSON_TOKEN_OBJECT_START, L"{");
-    JsonExitOnFailure(hr, "Failed to start JSON object.");
+        ++wz;
+    }
 
-LExit:
-    return hr;
+    for (;;)
+    {
+        __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(wz));
+        __m128i vSpecial = _mm_or_si128(_mm_cmpeq_epi16(v, vQuote), _mm_cmpeq_epi16(v, vBackslash));
+
+        // Saturating ' ' - ch is non-zero only for control characters.
+        vSpecial = _mm_or_si128(vSpecial, _mm_xor_si128(_mm_cmpeq_epi16(_mm_subs_epu16(vSpace, v), vZero), _mm_cmpeq_epi16(vZero, vZero)));
+
+        dwMask = static_cast<DWORD>(_mm_movemask_epi8(vSpecial));
+        if (dwMask)
+        {
+            _BitScanForward(&dwIndex, dwMask);
+            return wz + dwIndex / sizeof(WCHAR);
+        }
+
+        wz += sizeof(__m128i) / sizeof(WCHAR);
+    }
 }
 
 
-DAPI_(HRESULT) JsonWriteObjectKey(
-    __in JSON_WRITER* pWriter,
-    __in_z LPCWSTR wzKey
+static LPBYTE ScanStringSse2(
+    __in_z LPBYTE pb
     )
 {
-    HRESULT hr = S_OK;
-    LPWSTR sczObjectKey = NULL;
+    const __m128i vQuote = _mm_set1_epi8('"');
+    const __m128i vBackslash = _mm_set1_epi8('\\');
+    const __m128i vSpace = _mm_set1_epi8(' ');
+    const __m128i vZero = _mm_setzero_si128();
+    DWORD dwMask = 0;
+    DWORD dwIndex = 0;
+
+    while (reinterpret_cast<DWORD_PTR>(pb) & 15)
+    {
+        if ('"' == *pb || '\\' == *pb || ' ' > *pb)
+        {
+            return pb;
+        }
 
-    hr = StrAllocFormatted(&sczObjectKey, L"\"%ls\":", wzKey);
-    JsonExitOnFailure(hr, "Failed to allocate JSON object key.");
+        ++pb;
+    }
 
-    hr = DoKey(pWriter, sczObjectKey);
-    JsonExitOnFailure(hr, "Failed to add object key to JSON.");
+    for (;;)
+    {
+        __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(pb));
+        __m128i vSpecial = _mm_or_si128(_mm_cmpeq_epi8(v, vQuote), _mm_cmpeq_epi8(v, vBackslash));
 
-LExit:
-    ReleaseStr(sczObjectKey);
-    return hr;
+        // Bytes of multi-byte UTF-8 sequences are all above ' ' so only control characters saturate.
+        vSpecial = _mm_or_si128(vSpecial, _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(vSpace, v), vZero), _mm_cmpeq_epi8(vZero, vZero)));
+
+        dwMask = static_cast<DWORD>(_mm_movemask_epi8(vSpecial));
+        if (dwMask)
+        {
+            _BitScanForward(&dwIndex, dwMask);
+            return pb + dwIndex;
+        }
+
+        pb += sizeof(__m128i);
+    }
 }
+#endif
 
 
-DAPI_(HRESULT) JsonWriteObjectEnd(
-    __in JSON_WRITER* pWriter
+template<typename T> static T* ScanString(
+    __in_z T* pch
     )
 {
-    HRESULT hr = S_OK;
+#ifdef JSON_SCAN_SSE2
+    if (::IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE))
+    {
+        return ScanStringSse2(pch);
+    }
+#endif
 
-    hr = DoEnd(pWriter, JSON_TOKEN_OBJECT_END, L"}");
-    JsonExitOnFailure(hr, "Failed to end JSON object.");
+    while (L'"' != *pch && L'\\' != *pch && L' ' <= *pch)
+    {
+        ++pch;
+    }
 
-LExit:
-    return hr;
+    return pch;
 }
 
 
@@ -400,11 +1845,11 @@ static HRESULT DoStart(
 
     if (fNeedComma)
     {
-        hr = StrAllocConcat(&pWriter->sczJson, L",", 0);
+        hr = AppendJson(pWriter, L",");
         JsonExitOnFailure(hr, "Failed to add comma for start array or object to JSON.");
     }
 
-    hr = StrAllocConcat(&pWriter->sczJson, wzStartString, 0);
+    hr = AppendJson(pWriter, wzStartString);
     JsonExitOnFailure(hr, "Failed to start JSON array or object.");
 
     pWriter->rgTokenStack[pWriter->cTokens - 1] = token;
@@ -446,7 +1891,7 @@ static HRESULT DoEnd(
         }
     }
 
-    hr = StrAllocConcat(&pWriter->sczJson, wzEndString, 0);
+    hr = AppendJson(pWriter, wzEndString);
     JsonExitOnFailure(hr, "Failed to end JSON array or object.");
 
     --pWriter->cTokens;
@@ -491,11 +1936,11 @@ static HRESULT DoKey(
 
     if (fNeedComma)
     {
-        hr = StrAllocConcat(&pWriter->sczJson, L",", 0);
+        hr = AppendJson(pWriter, L",");
         JsonExitOnFailure(hr, "Failed to add comma for key to JSON.");
     }
 
-    hr = StrAllocConcat(&pWriter->sczJson, wzKey, 0);
+    hr = AppendJson(pWriter, wzKey);
     JsonExitOnFailure(hr, "Failed to add key to JSON.");
 
     pWriter->rgTokenStack[pWriter->cTokens - 1] = token;
@@ -547,18 +1992,18 @@ static HRESULT DoValue(
 
     if (fNeedComma)
     {
-        hr = StrAllocConcat(&pWriter->sczJson, L",", 0);
+        hr = AppendJson(pWriter, L",");
         JsonExitOnFailure(hr, "Failed to add comma for value to JSON.");
     }
 
     if (wzValue)
     {
-        hr = StrAllocConcat(&pWriter->sczJson, wzValue, 0);
+        hr = AppendJson(pWriter, wzValue);
         JsonExitOnFailure(hr, "Failed to add value to JSON.");
     }
     else
     {
-        hr = StrAllocConcat(&pWriter->sczJson, L"null", 0);
+        hr = AppendJson(pWriter, L"null");
         JsonExitOnFailure(hr, "Failed to add null value to JSON.");
     }
 
@@ -570,6 +2015,341 @@ LExit:
 }
 
 
+static HRESULT ParseDom(
+    __in JSON_READER* pReader,
+    __out JSON_DOM_HANDLE* phDom
+    )
+{
+    HRESULT hr = S_OK;
+    JSON_DOM_HANDLE hDom = NULL;
+    JSON_TOKEN token = JSON_TOKEN_NONE;
+    JSON_VALUE value = { };
+
+    hr = JsonDomCreate(pReader, &hDom);
+    JsonExitOnFailure(hr, "Failed to create JSON DOM.");
+
+    // Nothing may follow the document's value.
+    hr = JsonReadNext(pReader, &token, &value);
+    if (E_NOMOREITEMS == hr)
+    {
+        hr = S_OK;
+    }
+    JsonExitOnFailure(hr, "Failed to read the end of the JSON document.");
+
+    *phDom = hDom;
+    hDom = NULL;
+
+LExit:
+    ReleaseJsonDom(hDom);
+
+    return hr;
+}
+
+
+static HRESULT SetDomValue(
+    __in MEM_ARENA_HANDLE hArena,
+    __in const JSON_VALUE* pValue,
+    __in JSON_NODE* pNode
+    )
+{
+    HRESULT hr = S_OK;
+
+    pNode->type = pValue->type;
+
+    switch (pValue->type)
+    {
+    case JSON_VALUE_TYPE_BOOL:
+        pNode->fValue = pValue->fValue;
+        break;
+
+    case JSON_VALUE_TYPE_INTEGER:
+        pNode->llValue = pValue->llValue;
+        break;
+
+    case JSON_VALUE_TYPE_DOUBLE:
+        pNode->dValue = pValue->dValue;
+        break;
+
+    case JSON_VALUE_TYPE_STRING:
+        hr = CopyDomString(hArena, pValue, &pNode->wzValue, &pNode->cchValue);
+        JsonExitOnFailure(hr, "Failed to copy JSON string value.");
+        break;
+    }
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT CopyDomString(
+    __in MEM_ARENA_HANDLE hArena,
+    __in const JSON_VALUE* pValue,
+    __out LPCWSTR* pwzCopy,
+    __out_opt DWORD* pcchCopy
+    )
+{
+    HRESULT hr = S_OK;
+    LPWSTR wzCopy = NULL;
+    int cch = static_cast<int>(pValue->cchValue);
+
+    if (INT_MAX <= pValue->cchValue)
+    {
+        hr = E_INVALIDARG;
+        JsonExitOnRootFailure(hr, "JSON string is too long for the DOM.");
+    }
+
+    if (!pValue->wzValue && cch)
+    {
+        cch = ::MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, pValue->szValue, cch, NULL, 0);
+        if (!cch)
+        {
+            JsonExitWithLastError(hr, "Failed to get length of UTF-8 JSON string.");
+        }
+    }
+
+    wzCopy = static_cast<LPWSTR>(MemArenaAlloc(hArena, (cch + 1) * sizeof(WCHAR), FALSE));
+    JsonExitOnNull(wzCopy, hr, E_OUTOFMEMORY, "Failed to allocate JSON string in DOM.");
+
+    if (pValue->wzValue)
+    {
+        memcpy(wzCopy, pValue->wzValue, cch * sizeof(WCHAR));
+    }
+    else if (cch && !::MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, pValue->szValue, static_cast<int>(pValue->cchValue), wzCopy, cch))
+    {
+        JsonExitWithLastError(hr, "Failed to convert UTF-8 JSON string.");
+    }
+
+    wzCopy[cch] = L'\0';
+
+    *pwzCopy = wzCopy;
+    if (pcchCopy)
+    {
+        *pcchCopy = cch;
+    }
+
+LExit:
+    return hr;
+}
+
+
+static BOOL IsPointerTokenMatch(
+    __in_z LPCWSTR wzKey,
+    __in LPCWSTR wzToken,
+    __in LPCWSTR wzTokenEnd
+    )
+{
+    WCHAR wch = L'\0';
+
+    for (LPCWSTR wz = wzToken; wz < wzTokenEnd; ++wz, ++wzKey)
+    {
+        wch = *wz;
+        if (L'~' == wch)
+        {
+            ++wz;
+            wch = (L'0' == *wz) ? L'~' : L'/';
+        }
+
+        if (wch != *wzKey)
+        {
+            return FALSE;
+        }
+    }
+
+    return L'\0' == *wzKey;
+}
+
+
+static BOOL ParsePointerIndex(
+    __in LPCWSTR wzToken,
+    __in LPCWSTR wzTokenEnd,
+    __out DWORD* pdwIndex
+    )
+{
+    DWORD dwIndex = 0;
+
+    // Decimal without leading zeros; '-' (past the end) never refers to an existing element.
+    if (wzToken == wzTokenEnd || (L'0' == *wzToken && 1 < wzTokenEnd - wzToken))
+    {
+        return FALSE;
+    }
+
+    for (LPCWSTR wz = wzToken; wz < wzTokenEnd; ++wz)
+    {
+        if (L'0' > *wz || L'9' < *wz || (DWORD_MAX - 9) / 10 < dwIndex)
+        {
+            return FALSE;
+        }
+
+        dwIndex = dwIndex * 10 + (*wz - L'0');
+    }
+
+    *pdwIndex = dwIndex;
+    return TRUE;
+}
+
+
+static HRESULT AppendJson(
+    __in JSON_WRITER* pWriter,
+    __in_z LPCWSTR wzJson
+    )
+{
+    HRESULT hr = S_OK;
+    int cchJson = 0;
+    int cchUtf8 = 0;
+    LPSTR pchUtf8 = NULL;
+    LPSTR sczUtf8 = NULL;
+
+    if (!pWriter->fUtf8 && !pWriter->pfnWrite)
+    {
+        hr = StrAllocConcat(&pWriter->sczJson, wzJson, 0);
+        JsonExitOnFailure(hr, "Failed to append to JSON.");
+
+        ExitFunction();
+    }
+
+    cchJson = lstrlenW(wzJson);
+    if (!cchJson)
+    {
+        ExitFunction();
+    }
+
+    if (!pWriter->fUtf8)
+    {
+        hr = AppendStream(pWriter, reinterpret_cast<LPCBYTE>(wzJson), cchJson * sizeof(WCHAR));
+        JsonExitOnFailure(hr, "Failed to stream JSON.");
+
+        ExitFunction();
+    }
+
+    cchUtf8 = ::WideCharToMultiByte(CP_UTF8, 0, wzJson, cchJson, NULL, 0, NULL, NULL);
+    if (!cchUtf8)
+    {
+        JsonExitWithLastError(hr, "Failed to get length of UTF-8 JSON.");
+    }
+
+    if (pWriter->pfnWrite)
+    {
+        // Encode straight into the stream buffer unless the piece is larger than the whole buffer.
+        if (pWriter->cbBuffer - pWriter->cbBuffered < static_cast<SIZE_T>(cchUtf8))
+        {
+            hr = FlushStream(pWriter);
+            JsonExitOnFailure(hr, "Failed to flush JSON stream.");
+        }
+
+        if (pWriter->cbBuffer < static_cast<SIZE_T>(cchUtf8))
+        {
+            sczUtf8 = static_cast<LPSTR>(MemAlloc(cchUtf8, FALSE));
+            JsonExitOnNull(sczUtf8, hr, E_OUTOFMEMORY, "Failed to allocate UTF-8 JSON.");
+
+            pchUtf8 = sczUtf8;
+        }
+        else
+        {
+            pchUtf8 = reinterpret_cast<LPSTR>(pWriter->pbBuffer + pWriter->cbBuffered);
+        }
+    }
+    else
+    {
+        // Encode straight onto the end of the buffer, which grows geometrically.
+        hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pWriter->sczJsonUtf8), pWriter->cchJsonUtf8 + cchUtf8 + 1, sizeof(CHAR), JSON_UTF8_INCREMENT);
+        JsonExitOnFailure(hr, "Failed to grow UTF-8 JSON buffer.");
+
+        pchUtf8 = pWriter->sczJsonUtf8 + pWriter->cchJsonUtf8;
+    }
+
+    if (!::WideCharToMultiByte(CP_UTF8, 0, wzJson, cchJson, pchUtf8, cchUtf8, NULL, NULL))
+    {
+        JsonExitWithLastError(hr, "Failed to convert JSON to UTF-8.");
+    }
+
+    if (sczUtf8)
+    {
+        hr = AppendStream(pWriter, reinterpret_cast<LPCBYTE>(sczUtf8), cchUtf8);
+        JsonExitOnFailure(hr, "Failed to stream UTF-8 JSON.");
+    }
+    else if (pWriter->pfnWrite)
+    {
+        pWriter->cbBuffered += cchUtf8;
+    }
+    else
+    {
+        pWriter->cchJsonUtf8 += cchUtf8;
+        pWriter->sczJsonUtf8[pWriter->cchJsonUtf8] = '\0';
+    }
+
+LExit:
+    ReleaseMem(sczUtf8);
+
+    return hr;
+}
+
+
+static HRESULT AppendStream(
+    __in JSON_WRITER* pWriter,
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in SIZE_T cbData
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (pWriter->cbBuffer - pWriter->cbBuffered < cbData)
+    {
+        hr = FlushStream(pWriter);
+        JsonExitOnFailure(hr, "Failed to flush JSON stream.");
+    }
+
+    // Anything that would fill the buffer by itself goes straight to the callback.
+    if (pWriter->cbBuffer <= cbData)
+    {
+        hr = pWriter->pfnWrite(pbData, cbData, pWriter->pvWriteContext);
+        JsonExitOnFailure(hr, "Failed to write JSON stream.");
+    }
+    else
+    {
+        memcpy(pWriter->pbBuffer + pWriter->cbBuffered, pbData, cbData);
+        pWriter->cbBuffered += cbData;
+    }
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT FlushStream(
+    __in JSON_WRITER* pWriter
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (pWriter->cbBuffered)
+    {
+        hr = pWriter->pfnWrite(pWriter->pbBuffer, pWriter->cbBuffered, pWriter->pvWriteContext);
+        JsonExitOnFailure(hr, "Failed to write JSON stream.");
+
+        pWriter->cbBuffered = 0;
+    }
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT CALLBACK WriteFileCallback(
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in SIZE_T cbData,
+    __in_opt LPVOID pvContext
+    )
+{
+    HRESULT hr = S_OK;
+
+    hr = FileWriteHandle(static_cast<HANDLE>(pvContext), pbData, cbData);
+    JsonExitOnFailure(hr, "Failed to write JSON to file.");
+
+LExit:
+    return hr;
+}
+
+
 static HRESULT EnsureTokenStack(
     __in JSON_WRITER* pWriter
     )
@@ -22,7 +22,6 @@ static HMODULE LogUtil_hModule = NULL;
 static BOOL LogUtil_fDisabled = FALSE;
 static HANDLE LogUtil_hLog = INVALID_HANDLE_VALUE;
 static LPWSTR LogUtil_sczLogPath = NULL;
-static LPSTR LogUtil_sczPreInitBuffer = NULL;
 static REPORT_LEVEL LogUtil_rlCurrent = REPORT_STANDARD;
 static CRITICAL_SECTION LogUtil_csLog = { };
 static BOOL LogUtil_fInitializedCriticalSection = FALSE;
@@ -39,6 +38,198 @@ static LPCSTR LOGUTIL_VERBOSE = "verbose";
 static LPCSTR LOGUTIL_DEBUG = "debug";
 static LPCSTR LOGUTIL_NONE = "none";
 
+const DWORD LOGUTIL_PREINIT_DEFAULT_LIMIT = 1024 * 1024;
+const DWORD LOGUTIL_PREINIT_CHUNK_SIZE = 16 * 1024;
+
+// Data logged before LogOpen() is kept in chunks, oldest first. Each write stays within one chunk,
+// so once the limit is reached the oldest chunks are dropped whole without splitting a line.
+struct LOGUTIL_PREINIT_CHUNK
+{
+    LOGUTIL_PREINIT_CHUNK* pNext;
+    DWORD cbAllocated;
+    DWORD cbData;
+    // followed by the data
+};
+
+static LOGUTIL_PREINIT_CHUNK* LogUtil_pPreInitHead = NULL;
+static LOGUTIL_PREINIT_CHUNK* LogUtil_pPreInitTail = NULL;
+static DWORD LogUtil_cbPreInit = 0; // allocated by all chunks
+static DWORD LogUtil_cbPreInitLimit = LOGUTIL_PREINIT_DEFAULT_LIMIT;
+static DWORD LogUtil_cPreInitDroppedLines = 0;
+
+const DWORD LOGUTIL_ASYNC_DEFAULT_QUEUE_SIZE = 1024 * 1024;
+const DWORD LOGUTIL_ASYNC_MIN_QUEUE_SIZE = 4 * 1024;
+const DWORD LOGUTIL_ASYNC_MAX_QUEUE_SIZE = 256 * 1024 * 1024;
+const DWORD LOGUTIL_ASYNC_INTERVAL_MS = 50;
+const DWORD LOGUTIL_ASYNC_WAIT_MS = 10;
+
+enum LOGUTIL_ASYNC_RECORD_STATE
+{
+    LOGUTIL_ASYNC_RECORD_STATE_EMPTY, // reserved but not yet written, or never used
+    LOGUTIL_ASYNC_RECORD_STATE_DATA,
+    LOGUTIL_ASYNC_RECORD_STATE_PADDING, // skips the end of the ring so records never wrap
+};
+
+// Each queued line is a header followed by its UTF-8 text, padded to a multiple of the header.
+struct LOGUTIL_ASYNC_RECORD
+{
+    volatile LONG lState; // set last by the producer and cleared by the writer thread
+    DWORD cbData;
+};
+
+// Producers reserve space by advancing dwHead with a compare-exchange and publish each record by
+// setting its state, so logging takes no lock. Only the writer thread reads records and advances
+// dwTail. Positions wrap at 32 bits, which works because the ring size is a power of two.
+struct LOGUTIL_ASYNC
+{
+    LPBYTE pbRing;
+    DWORD cbRing;
+    LOG_ASYNC_POLICY policy;
+
+    volatile LONG dwHead;
+    volatile LONG dwTail;
+    volatile LONG cDropped;
+    volatile BOOL fStop;
+
+    HANDLE hThread;
+    HANDLE hWakeEvent;    // auto-reset, wakes the writer thread early
+    HANDLE hDrainedEvent; // manual-reset, set each time the writer thread has drained the ring
+
+    LPSTR pchBatch; // writer thread only, half the ring so any record fits
+};
+
+static LOGUTIL_ASYNC* volatile LogUtil_pAsync = NULL;
+static DWORD LogUtil_dwDirectThreadId = 0; // logs straight to the file while it holds LogUtil_csLog
+
+const DWORD LOGUTIL_ROTATION_SEQUENCE_LIMIT = 10000;
+
+// A segment moved out of the way by rotation, waiting for the rotation thread.
+struct LOGUTIL_ROTATED_SEGMENT
+{
+    LPWSTR sczSegment;
+    LPWSTR sczLogPath; // the log the segment came from, since LogRename() can move the log
+    DWORD cKeep;
+    BOOL fCompress;
+};
+
+// The policy and the size and age of the current file are only used while holding LogUtil_csLog,
+// so whichever thread writes past a limit swaps the file. Compressing and pruning old segments is
+// left to the rotation thread so that thread does not wait on it.
+struct LOGUTIL_ROTATION
+{
+    DWORD64 cbMaxSize;
+    DWORD dwMaxAgeSeconds;
+    DWORD cKeep;
+    BOOL fCompress;
+
+    DWORD64 cbLog;
+    ULONGLONG ullStarted; // tick count when the current file was started
+    DWORD dwSequence;
+    BOOL fLost; // the log could not be created again after rotating, so writes keep trying
+
+    HANDLE hThread;
+    HANDLE hWorkEvent; // auto-reset, set when segments are pending or the thread should stop
+    volatile BOOL fStop;
+
+    CRITICAL_SECTION csPending;
+    LOGUTIL_ROTATED_SEGMENT* rgPending;
+    DWORD cPending;
+};
+
+static LOGUTIL_ROTATION* LogUtil_pRotation = NULL;
+static PFN_LOGROTATIONOPEN LogUtil_pfnRotationOpen = NULL;
+static LPVOID LogUtil_pvRotationOpenContext = NULL;
+
+const DWORD LOGUTIL_LINE_BUFFER_INCREMENT = 256;
+
+// Each thread keeps the buffers it formats lines in, so once they have grown to fit, logging a
+// line does not allocate.
+struct LOGUTIL_LINE_BUFFERS
+{
+    LPWSTR pwzFormat; // the caller's format converted to a wide string
+    STR_BUILDER line;
+    LPSTR pszUtf8;
+    LPBYTE pbRecord; // binary records for the line
+    DWORD cbRecord;
+    LPWSTR pwzArg; // a string argument converted to a wide string
+    BOOL fInUse;
+};
+
+static DWORD LogUtil_dwFlsIndex = FLS_OUT_OF_INDEXES;
+
+// Templates and modules are each given an id the first time they are logged, and the record
+// defining the id is written ahead of the first line that uses it in every log.
+struct LOGUTIL_BINARY_ID
+{
+    LPWSTR sczKey; // the format string, or the path of the module
+    HMODULE hModule;
+    DWORD dwId;
+    BOOL fText; // the format has a conversion that is not encoded, so lines are formatted as text
+    volatile LONG fWritten; // set once the record defining the id is queued or written in the current log
+};
+
+static LOG_FORMAT LogUtil_format = LOG_FORMAT_TEXT;
+static CRITICAL_SECTION LogUtil_csBinary = { }; // serializes adding ids, lookups of templates take no lock
+static STRINGDICT_HANDLE LogUtil_sdBinaryTemplates = NULL;
+static LOGUTIL_BINARY_ID** LogUtil_rgpBinaryTemplates = NULL;
+static DWORD LogUtil_cBinaryTemplates = 0;
+static LOGUTIL_BINARY_ID** LogUtil_rgpBinaryModules = NULL;
+static DWORD LogUtil_cBinaryModules = 0;
+static DWORD LogUtil_dwBinaryLastId = 0;
+
+const DWORD LOGUTIL_BINARY_MAX_ID = 0x100000;
+const DWORD LOGUTIL_FORMAT_MAX_FLAGS = 8;
+const DWORD LOGUTIL_FORMAT_MAX_WIDTH = 99999;
+
+enum LOGUTIL_FORMAT_ARG
+{
+    LOGUTIL_FORMAT_ARG_NONE, // "%%"
+    LOGUTIL_FORMAT_ARG_INTEGER,
+    LOGUTIL_FORMAT_ARG_CHARACTER,
+    LOGUTIL_FORMAT_ARG_FLOAT,
+    LOGUTIL_FORMAT_ARG_STRING,
+};
+
+enum LOGUTIL_FORMAT_LENGTH
+{
+    LOGUTIL_FORMAT_LENGTH_DEFAULT,
+    LOGUTIL_FORMAT_LENGTH_CHAR,     // hh
+    LOGUTIL_FORMAT_LENGTH_SHORT,    // h
+    LOGUTIL_FORMAT_LENGTH_LONG,     // l, w, I32
+    LOGUTIL_FORMAT_LENGTH_LONGLONG, // ll, I64, j
+    LOGUTIL_FORMAT_LENGTH_SIZE,     // I, z, t
+    LOGUTIL_FORMAT_LENGTH_DOUBLE,   // L
+};
+
+// One printf conversion, as interpreted by the wide printf functions lines are formatted with.
+struct LOGUTIL_FORMAT_SPEC
+{
+    DWORD cch; // from the '%' through the conversion character
+    LPCWSTR wzFlags;
+    DWORD cchFlags;
+    BOOL fWidth;
+    BOOL fWidthStar;
+    DWORD dwWidth;
+    BOOL fPrecision;
+    BOOL fPrecisionStar;
+    DWORD dwPrecision;
+    LOGUTIL_FORMAT_LENGTH length;
+    LOGUTIL_FORMAT_ARG arg;
+    BOOL fSigned;
+    BOOL fWide;
+    WCHAR wchConversion;
+};
+
+struct LOGUTIL_BINARY_DECODER
+{
+    BOOL fSession;
+    DWORD dwProcessId;
+    LONGLONG llLocalTimeBias;
+    LPWSTR* rgsczTemplates; // indexed by id
+    DWORD cTemplates;
+    LOGUTIL_LINE_BUFFERS buffers;
+};
+
 // prototypes
 static HRESULT LogIdWork(
     __in REPORT_LEVEL rl,
@@ -49,6 +240,8 @@ static HRESULT LogIdWork(
     );
 static HRESULT LogStringWorkArgs(
     __in REPORT_LEVEL rl,
+    __in BOOL fError,
+    __in HRESULT hrError,
     __in_z __format_string LPCSTR szFormat,
     __in va_list args,
     __in BOOL fLOGUTIL_NEWLINE
@@ -56,10 +249,257 @@ static HRESULT LogStringWorkArgs(
 static HRESULT LogStringWork(
     __in REPORT_LEVEL rl,
     __in DWORD dwLogId,
+    __in_opt HMODULE hModule,
     __in_z LPCWSTR sczString,
     __in BOOL fLOGUTIL_NEWLINE
     );
 
+static HRESULT LogAppendLinePrefix(
+    __in STR_BUILDER* pLine,
+    __in REPORT_LEVEL rl,
+    __in DWORD dwLogId
+    );
+static HRESULT LogFormatLinePrefix(
+    __in STR_BUILDER* pLine,
+    __in REPORT_LEVEL rl,
+    __in DWORD dwLogId,
+    __in DWORD dwProcessId,
+    __in DWORD dwThreadId,
+    __in const SYSTEMTIME* pst
+    );
+static HRESULT LogWriteLine(
+    __in REPORT_LEVEL rl,
+    __in LOGUTIL_LINE_BUFFERS* pBuffers
+    );
+static HRESULT LogLineToUtf8(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __out DWORD* pcbUtf8
+    );
+static HRESULT LogWriteBytes(
+    __in REPORT_LEVEL rl,
+    __in_bcount(cbData) LPCSTR pchData,
+    __in DWORD cbData,
+    __in BOOL fNeverDrop
+    );
+static LOGUTIL_LINE_BUFFERS* LogAcquireLineBuffers(
+    __in LOGUTIL_LINE_BUFFERS* pLocalBuffers
+    );
+static void LogReleaseLineBuffers(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in LOGUTIL_LINE_BUFFERS* pLocalBuffers
+    );
+static void WINAPI LogFreeLineBuffers(
+    __in_opt LPVOID pvBuffers
+    );
+static HRESULT LogAsyncEnqueue(
+    __in LOGUTIL_ASYNC* pAsync,
+    __in_bcount(cbLogData) LPCSTR pchLogData,
+    __in DWORD cbLogData,
+    __in BOOL fNeverDrop
+    );
+static DWORD WINAPI LogAsyncWriterThread(
+    __in LPVOID pvContext
+    );
+static HRESULT LogAsyncDrain(
+    __in LOGUTIL_ASYNC* pAsync
+    );
+static HRESULT LogAsyncWriteBatch(
+    __in LOGUTIL_ASYNC* pAsync,
+    __in DWORD cbBatch
+    );
+static HRESULT LogWriteData(
+    __in_bcount(cbLogData) LPCSTR pchLogData,
+    __in DWORD cbLogData
+    );
+static HRESULT LogWriteFileData(
+    __in_bcount(cbLogData) LPCSTR pchLogData,
+    __in DWORD cbLogData
+    );
+static void LogAsyncFree(
+    __in LOGUTIL_ASYNC* pAsync
+    );
+static HRESULT LogPreInitAppend(
+    __in_bcount(cbLogData) LPCSTR pchLogData,
+    __in DWORD cbLogData
+    );
+static DWORD LogPreInitCountLines(
+    __in_bcount(cbData) LPCSTR pchData,
+    __in DWORD cbData
+    );
+static HRESULT LogPreInitFlush();
+static void LogPreInitFree();
+static void LogRotationReset(
+    __in LOGUTIL_ROTATION* pRotation
+    );
+static BOOL LogRotationDue(
+    __in LOGUTIL_ROTATION* pRotation
+    );
+static HRESULT LogRotate(
+    __in LOGUTIL_ROTATION* pRotation
+    );
+static HRESULT LogRotationOpenLog();
+static BOOL LogBinaryFormatting();
+static HRESULT LogRotationStartLog(
+    __in LOGUTIL_ROTATION* pRotation
+    );
+static HRESULT LogRotationRecover(
+    __in LOGUTIL_ROTATION* pRotation
+    );
+static HRESULT LogRotationSegmentPath(
+    __in_z LPCWSTR wzLogPath,
+    __in DWORD dwSequence,
+    __deref_out_z LPWSTR* psczSegment
+    );
+static HRESULT LogRotationQueueSegment(
+    __in LOGUTIL_ROTATION* pRotation,
+    __in_z LPCWSTR wzSegment
+    );
+static DWORD WINAPI LogRotationThread(
+    __in LPVOID pvContext
+    );
+static HRESULT LogRotationFinishSegment(
+    __in LOGUTIL_ROTATED_SEGMENT* pSegment
+    );
+static HRESULT LogRotationPrune(
+    __in_z LPCWSTR wzLogPath,
+    __in DWORD cKeep
+    );
+static BOOL LogRotationIsSegment(
+    __in_z LPCWSTR wzFile,
+    __in_ecount(cchStem) LPCWSTR wzStem,
+    __in DWORD cchStem,
+    __in_z LPCWSTR wzExtension
+    );
+static __callback int __cdecl LogRotationCompareSegments(
+    void* pvContext,
+    const void* pvLeft,
+    const void* pvRight
+    );
+static void LogRotationFreeSegments(
+    __in_ecount_opt(cSegments) LOGUTIL_ROTATED_SEGMENT* rgSegments,
+    __in DWORD cSegments
+    );
+static void LogRotationFree(
+    __in LOGUTIL_ROTATION* pRotation
+    );
+static HRESULT LogBinaryWriteSession();
+static HRESULT LogBinaryWriteIds();
+static void LogBinaryResetIds();
+static void LogBinaryFreeIds();
+static HRESULT LogBinaryGetTemplate(
+    __in_z LPCWSTR wzFormat,
+    __out LOGUTIL_BINARY_ID** ppTemplate
+    );
+static HRESULT LogBinaryGetModule(
+    __in HMODULE hModule,
+    __out LOGUTIL_BINARY_ID** ppModule
+    );
+static HRESULT LogBinaryStringWorkArgs(
+    __in REPORT_LEVEL rl,
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in va_list args,
+    __in BOOL fLOGUTIL_NEWLINE
+    );
+static HRESULT LogBinaryStringWork(
+    __in REPORT_LEVEL rl,
+    __in DWORD dwLogId,
+    __in_opt HMODULE hModule,
+    __in_z LPCWSTR wzString,
+    __in BOOL fLOGUTIL_NEWLINE,
+    __in LOGUTIL_LINE_BUFFERS* pBuffers
+    );
+static HRESULT LogBinaryWriteRecords(
+    __in REPORT_LEVEL rl,
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in DWORD iLine,
+    __in_opt LOGUTIL_BINARY_ID* pDefinedId
+    );
+static HRESULT LogBinaryAppend(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in_bcount(cbData) const void* pvData,
+    __in DWORD cbData
+    );
+static HRESULT LogBinaryAppendValue(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in LOG_BINARY_ARG_TYPE type,
+    __in_bcount(cbValue) const void* pvValue,
+    __in DWORD cbValue
+    );
+static HRESULT LogBinaryBeginRecord(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in LOG_BINARY_RECORD_TYPE type,
+    __out DWORD* piRecord
+    );
+static void LogBinaryEndRecord(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in DWORD iRecord
+    );
+static HRESULT LogBinaryAppendIdRecord(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in LOG_BINARY_RECORD_TYPE type,
+    __in LOGUTIL_BINARY_ID* pId
+    );
+static HRESULT LogBinaryBeginLine(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in REPORT_LEVEL rl,
+    __in DWORD dwLogId,
+    __in DWORD dwModuleId,
+    __in DWORD dwTemplateId,
+    __in BOOL fLOGUTIL_NEWLINE,
+    __out DWORD* piLine
+    );
+static HRESULT LogBinaryAppendUtf8(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch,
+    __out DWORD* pcbUtf8
+    );
+static HRESULT LogBinaryAppendString(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch
+    );
+static HRESULT LogBinaryAppendArgs(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in_z LPCWSTR wzFormat,
+    __in va_list args
+    );
+static HRESULT LogParseFormatSpec(
+    __in_z LPCWSTR wzSpec,
+    __out LOGUTIL_FORMAT_SPEC* pSpec
+    );
+static HRESULT LogBinaryDecodeRecord(
+    __in LOGUTIL_BINARY_DECODER* pDecoder,
+    __in LOG_BINARY_RECORD_TYPE type,
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in DWORD cbData,
+    __in PFN_LOGSTRINGWORKRAW pfnWrite,
+    __in_opt LPVOID pvContext
+    );
+static HRESULT LogBinaryDecodeLine(
+    __in LOGUTIL_BINARY_DECODER* pDecoder,
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in DWORD cbData
+    );
+static HRESULT LogBinaryRenderTemplate(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in_z LPCWSTR wzTemplate,
+    __inout LPCBYTE* ppbArgs,
+    __inout DWORD* pcbArgs
+    );
+static HRESULT LogBinaryReadArg(
+    __inout LPCBYTE* ppbArgs,
+    __inout DWORD* pcbArgs,
+    __in LOG_BINARY_ARG_TYPE type,
+    __out_bcount(cbValue) void* pvValue,
+    __in DWORD cbValue
+    );
+static HRESULT LogBinaryReadStringArg(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __inout LPCBYTE* ppbArgs,
+    __inout DWORD* pcbArgs
+    );
+
 // Hook to allow redirecting LogStringWorkRaw function calls
 static PFN_LOGSTRINGWORKRAW s_vpfLogStringWorkRaw = NULL;
 static LPVOID s_vpvLogStringWorkRawContext = NULL;
@@ -96,7 +536,11 @@ extern "C" void DAPI LogInitialize(
     LogUtil_fDisabled = FALSE;
 
     ::InitializeCriticalSection(&LogUtil_csLog);
+    ::InitializeCriticalSection(&LogUtil_csBinary);
     LogUtil_fInitializedCriticalSection = TRUE;
+
+    // Without an index, lines are formatted in buffers allocated for each call.
+    LogUtil_dwFlsIndex = ::FlsAlloc(LogFreeLineBuffers);
 }
 
 
@@ -119,9 +563,16 @@ extern "C" HRESULT DAPI LogOpen(
     BOOL fEnteredCriticalSection = FALSE;
     LPWSTR sczLogDirectory = NULL;
 
+    // Anything still queued belongs ahead of the pre-init data.
+    LogFlush();
+
     ::EnterCriticalSection(&LogUtil_csLog);
     fEnteredCriticalSection = TRUE;
 
+    // The writer thread needs the lock, so the header and pre-init data cannot go through the
+    // queue while this thread holds it.
+    LogUtil_dwDirectThreadId = ::GetCurrentThreadId();
+
     if (wzExt && *wzExt)
     {
         hr = PathCreateTimeBasedTempFile(wzDirectory, wzLog, wzPostfix, wzExt, &LogUtil_sczLogPath, &LogUtil_hLog);
@@ -152,18 +603,28 @@ extern "C" HRESULT DAPI LogOpen(
 
     LogUtil_fDisabled = FALSE;
 
-    if (fHeader)
+    if (LogUtil_pRotation)
     {
-        LogHeader();
+        LogRotationReset(LogUtil_pRotation);
     }
 
-    if (NULL != LogUtil_sczPreInitBuffer)
+    if (LOG_FORMAT_BINARY == LogUtil_format)
     {
-        // Log anything that was logged before LogOpen() was called.
-        LogStringWorkRaw(LogUtil_sczPreInitBuffer);
-        ReleaseNullStr(LogUtil_sczPreInitBuffer);
+        // A new session forgets every id, so define them again as they are used.
+        LogBinaryResetIds();
+
+        hr = LogBinaryWriteSession();
+        LoguExitOnFailure(hr, "Failed to start binary log: %ls", LogUtil_sczLogPath);
+    }
+
+    if (fHeader)
+    {
+        LogHeader();
     }
 
+    // Log anything that was logged before LogOpen() was called.
+    LogPreInitFlush();
+
     if (psczLogPath)
     {
         hr = StrAllocString(psczLogPath, LogUtil_sczLogPath, 0);
@@ -173,6 +634,7 @@ extern "C" HRESULT DAPI LogOpen(
 LExit:
     if (fEnteredCriticalSection)
     {
+        LogUtil_dwDirectThreadId = 0;
         ::LeaveCriticalSection(&LogUtil_csLog);
     }
 
@@ -188,13 +650,17 @@ LExit:
 ********************************************************************/
 void DAPI LogDisable()
 {
+    // The writer thread takes the lock to write, so drain it first.
+    LogDisableAsync();
+    LogDisableRotation();
+
     ::EnterCriticalSection(&LogUtil_csLog);
 
     LogUtil_fDisabled = TRUE;
 
     ReleaseFileHandle(LogUtil_hLog);
     ReleaseNullStr(LogUtil_sczLogPath);
-    ReleaseNullStr(LogUtil_sczPreInitBuffer);
+    LogPreInitFree();
 
     ::LeaveCriticalSection(&LogUtil_csLog);
 }
@@ -246,6 +712,11 @@ HRESULT DAPI LogRename(
     // Enable "append" mode by moving file pointer to the end
     ::SetFilePointer(LogUtil_hLog, 0, 0, FILE_END);
 
+    if (LogUtil_pRotation)
+    {
+        LogRotationReset(LogUtil_pRotation);
+    }
+
 LExit:
     if (fEnteredCriticalSection)
     {
@@ -265,9 +736,12 @@ extern "C" void DAPI LogClose(
         LogFooter();
     }
 
+    LogDisableAsync();
+    LogDisableRotation();
+
     ReleaseFileHandle(LogUtil_hLog);
     ReleaseNullStr(LogUtil_sczLogPath);
-    ReleaseNullStr(LogUtil_sczPreInitBuffer);
+    LogPreInitFree();
 }
 
 
@@ -280,9 +754,21 @@ extern "C" void DAPI LogUninitialize(
     if (LogUtil_fInitializedCriticalSection)
     {
         ::DeleteCriticalSection(&LogUtil_csLog);
+        ::DeleteCriticalSection(&LogUtil_csBinary);
         LogUtil_fInitializedCriticalSection = FALSE;
     }
 
+    LogBinaryFreeIds();
+    LogUtil_format = LOG_FORMAT_TEXT;
+    LogUtil_cbPreInitLimit = LOGUTIL_PREINIT_DEFAULT_LIMIT;
+
+    // Frees the line buffers of every thread that logged.
+    if (FLS_OUT_OF_INDEXES != LogUtil_dwFlsIndex)
+    {
+        ::FlsFree(LogUtil_dwFlsIndex);
+        LogUtil_dwFlsIndex = FLS_OUT_OF_INDEXES;
+    }
+
     LogUtil_hModule = NULL;
     LogUtil_fDisabled = FALSE;
 
@@ -303,155 +789,577 @@ extern "C" BOOL DAPI LogIsOpen()
 
 
 /********************************************************************
- LogSetSpecialParams - sets a special beginline string, endline
-                       string, post-timestamp string, etc.
+ LogEnableAsync - queues log lines for a background thread that
+                  writes them in batches, so logging threads do not
+                  wait on the disk or on each other
+
+ NOTE: call while no other thread is logging. Errors are flushed
+       before they return; call LogFlush() to wait for anything else.
+       cbQueue of zero uses a 1 MB queue.
 ********************************************************************/
-HRESULT DAPI LogSetSpecialParams(
-    __in_z_opt LPCWSTR wzSpecialBeginLine,
-    __in_z_opt LPCWSTR wzSpecialAfterTimeStamp,
-    __in_z_opt LPCWSTR wzSpecialEndLine
+extern "C" HRESULT DAPI LogEnableAsync(
+    __in DWORD cbQueue,
+    __in LOG_ASYNC_POLICY policy
     )
 {
     HRESULT hr = S_OK;
+    LOGUTIL_ASYNC* pAsync = NULL;
+    DWORD cbRing = LOGUTIL_ASYNC_MIN_QUEUE_SIZE;
 
-    // Handle special string to be prepended before every full line
-    if (NULL == wzSpecialBeginLine)
+    if (!LogUtil_fInitializedCriticalSection)
     {
-        ReleaseNullStr(LogUtil_sczSpecialBeginLine);
+        hr = E_UNEXPECTED;
+        LoguExitOnRootFailure(hr, "LogInitialize() must be called before LogEnableAsync().");
     }
-    else
+
+    if (LogUtil_pAsync)
     {
-        hr = StrAllocConcat(&LogUtil_sczSpecialBeginLine, wzSpecialBeginLine, 0);
-        LoguExitOnFailure(hr, "Failed to allocate copy of special beginline string");
+        ExitFunction1(hr = S_FALSE);
     }
 
-    // Handle special string to be appended to every time stamp
-    if (NULL == wzSpecialAfterTimeStamp)
+    if (!cbQueue)
     {
-        ReleaseNullStr(LogUtil_sczSpecialAfterTimeStamp);
+        cbQueue = LOGUTIL_ASYNC_DEFAULT_QUEUE_SIZE;
     }
-    else
+    else if (LOGUTIL_ASYNC_MAX_QUEUE_SIZE < cbQueue)
     {
-        hr = StrAllocConcat(&LogUtil_sczSpecialAfterTimeStamp, wzSpecialAfterTimeStamp, 0);
-        LoguExitOnFailure(hr, "Failed to allocate copy of special post-timestamp string");
+        hr = E_INVALIDARG;
+        LoguExitOnRootFailure(hr, "Log queue size is too large: %u", cbQueue);
     }
 
-    // Handle special string to be appended before every full line
-    if (NULL == wzSpecialEndLine)
+    while (cbRing < cbQueue)
     {
-        ReleaseNullStr(LogUtil_sczSpecialEndLine);
+        cbRing <<= 1;
     }
-    else
+
+    pAsync = static_cast<LOGUTIL_ASYNC*>(MemAlloc(sizeof(LOGUTIL_ASYNC), TRUE));
+    LoguExitOnNull(pAsync, hr, E_OUTOFMEMORY, "Failed to allocate async log.");
+
+    // The ring must start zeroed so unused space reads as empty records.
+    pAsync->pbRing = static_cast<LPBYTE>(MemAlloc(cbRing, TRUE));
+    LoguExitOnNull(pAsync->pbRing, hr, E_OUTOFMEMORY, "Failed to allocate async log queue.");
+
+    pAsync->pchBatch = static_cast<LPSTR>(MemAlloc(cbRing / 2, FALSE));
+    LoguExitOnNull(pAsync->pchBatch, hr, E_OUTOFMEMORY, "Failed to allocate async log batch.");
+
+    pAsync->cbRing = cbRing;
+    pAsync->policy = policy;
+
+    pAsync->hWakeEvent = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+    LoguExitOnNullWithLastError(pAsync->hWakeEvent, hr, "Failed to create async log wake event.");
+
+    pAsync->hDrainedEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+    LoguExitOnNullWithLastError(pAsync->hDrainedEvent, hr, "Failed to create async log drained event.");
+
+    pAsync->hThread = ::CreateThread(NULL, 0, LogAsyncWriterThread, pAsync, 0, NULL);
+    LoguExitOnNullWithLastError(pAsync->hThread, hr, "Failed to create async log writer thread.");
+
+    LogUtil_pAsync = pAsync;
+    pAsync = NULL;
+
+LExit:
+    if (pAsync)
     {
-        hr = StrAllocConcat(&LogUtil_sczSpecialEndLine, wzSpecialEndLine, 0);
-        LoguExitOnFailure(hr, "Failed to allocate copy of special endline string");
+        LogAsyncFree(pAsync);
     }
 
-LExit:
     return hr;
 }
 
+
 /********************************************************************
- LogSetLevel - sets the logging level
+ LogDisableAsync - writes everything queued and goes back to writing
+                   each line as it is logged
 
- NOTE: returns previous logging level
+ NOTE: call while no other thread is logging.
 ********************************************************************/
-extern "C" REPORT_LEVEL DAPI LogSetLevel(
-    __in REPORT_LEVEL rl,
-    __in BOOL fLogChange
-    )
+extern "C" void DAPI LogDisableAsync()
 {
-    AssertSz(REPORT_ERROR != rl, "REPORT_ERROR is not a valid logging level to set");
-
-    REPORT_LEVEL rlPrev = LogUtil_rlCurrent;
+    LOGUTIL_ASYNC* pAsync = LogUtil_pAsync;
 
-    if (LogUtil_rlCurrent != rl)
+    if (!pAsync)
     {
-        LogUtil_rlCurrent = rl;
+        return;
+    }
 
-        if (fLogChange)
-        {
-            LPCSTR szLevel = LOGUTIL_UNKNOWN;
-            switch (LogUtil_rlCurrent)
-            {
-            case REPORT_WARNING:
-                szLevel = LOGUTIL_WARNING;
-                break;
-            case REPORT_STANDARD:
-                szLevel = LOGUTIL_STANDARD;
-                break;
-            case REPORT_VERBOSE:
-                szLevel = LOGUTIL_VERBOSE;
-                break;
-            case REPORT_DEBUG:
-                szLevel = LOGUTIL_DEBUG;
-                break;
-            case REPORT_NONE:
-                szLevel = LOGUTIL_NONE;
-                break;
-            }
+    LogUtil_pAsync = NULL;
 
-            LogStringLine(REPORT_STANDARD, "--- logging level: %hs ---", szLevel);
-        }
-    }
+    // The writer thread drains the ring before it exits.
+    pAsync->fStop = TRUE;
+    ::SetEvent(pAsync->hWakeEvent);
+    ::WaitForSingleObject(pAsync->hThread, INFINITE);
 
-    return rlPrev;
+    LogAsyncFree(pAsync);
 }
 
 
 /********************************************************************
- LogGetLevel - gets the current logging level
+ LogFlush - waits until everything logged so far has been written
 
 ********************************************************************/
-extern "C" REPORT_LEVEL DAPI LogGetLevel()
+extern "C" HRESULT DAPI LogFlush()
 {
-    return LogUtil_rlCurrent;
+    HRESULT hr = S_OK;
+    LOGUTIL_ASYNC* pAsync = LogUtil_pAsync;
+    DWORD dwTarget = 0;
+
+    if (!pAsync)
+    {
+        ExitFunction();
+    }
+
+    dwTarget = static_cast<DWORD>(pAsync->dwHead);
+
+    // Lines reserved before this point may still be being copied in, so wait until the writer
+    // thread has gone past all of them.
+    while (0 < static_cast<LONG>(dwTarget - static_cast<DWORD>(pAsync->dwTail)))
+    {
+        ::ResetEvent(pAsync->hDrainedEvent);
+        ::SetEvent(pAsync->hWakeEvent);
+
+        if (0 >= static_cast<LONG>(dwTarget - static_cast<DWORD>(pAsync->dwTail)))
+        {
+            break;
+        }
+
+        ::WaitForSingleObject(pAsync->hDrainedEvent, LOGUTIL_ASYNC_WAIT_MS);
+    }
+
+LExit:
+    return hr;
 }
 
 
 /********************************************************************
- LogGetPath - gets the current log path
-
+ LogEnableRotation - starts a new log file whenever the current one
+                     grows past cbMaxSize bytes or has been written
+                     for dwMaxAgeSeconds, keeping the newest cKeep of
+                     the files moved aside
+
+ NOTE: zero turns off each limit. Files moved aside are named after the
+       log and the time they were rotated, like
+       Setup.20240101120000.0001.log, and are NTFS compressed on a
+       background thread when fCompress is set. Limits are checked
+       after each write, so a file ends with the write that passed
+       them. Calling again changes the limits. LogClose() turns
+       rotation off.
 ********************************************************************/
-extern "C" HRESULT DAPI LogGetPath(
-    __out_ecount_z(cchLogPath) LPWSTR pwzLogPath,
-    __in DWORD cchLogPath
+extern "C" HRESULT DAPI LogEnableRotation(
+    __in DWORD64 cbMaxSize,
+    __in DWORD dwMaxAgeSeconds,
+    __in DWORD cKeep,
+    __in BOOL fCompress
     )
 {
-    Assert(pwzLogPath);
-
     HRESULT hr = S_OK;
+    BOOL fEnteredCriticalSection = FALSE;
+    LOGUTIL_ROTATION* pRotation = NULL;
 
-    if (NULL == LogUtil_sczLogPath)        // they can't have a path if there isn't one!
+    if (!LogUtil_fInitializedCriticalSection)
     {
-        ExitFunction1(hr = E_UNEXPECTED);
+        hr = E_UNEXPECTED;
+        LoguExitOnRootFailure(hr, "LogInitialize() must be called before LogEnableRotation().");
     }
 
-    hr = ::StringCchCopyW(pwzLogPath, cchLogPath, LogUtil_sczLogPath);
+    ::EnterCriticalSection(&LogUtil_csLog);
+    fEnteredCriticalSection = TRUE;
+
+    if (!LogUtil_pRotation)
+    {
+        pRotation = static_cast<LOGUTIL_ROTATION*>(MemAlloc(sizeof(LOGUTIL_ROTATION), TRUE));
+        LoguExitOnNull(pRotation, hr, E_OUTOFMEMORY, "Failed to allocate log rotation.");
+
+        ::InitializeCriticalSection(&pRotation->csPending);
+
+        pRotation->hWorkEvent = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+        LoguExitOnNullWithLastError(pRotation->hWorkEvent, hr, "Failed to create log rotation work event.");
+
+        pRotation->hThread = ::CreateThread(NULL, 0, LogRotationThread, pRotation, 0, NULL);
+        LoguExitOnNullWithLastError(pRotation->hThread, hr, "Failed to create log rotation thread.");
+
+        LogRotationReset(pRotation);
+
+        LogUtil_pRotation = pRotation;
+        pRotation = NULL;
+    }
+
+    LogUtil_pRotation->cbMaxSize = cbMaxSize;
+    LogUtil_pRotation->dwMaxAgeSeconds = dwMaxAgeSeconds;
+    LogUtil_pRotation->cKeep = cKeep;
+    LogUtil_pRotation->fCompress = fCompress;
 
 LExit:
+    if (fEnteredCriticalSection)
+    {
+        ::LeaveCriticalSection(&LogUtil_csLog);
+    }
+
+    if (pRotation)
+    {
+        LogRotationFree(pRotation);
+    }
+
     return hr;
 }
 
 
 /********************************************************************
- LogGetHandle - gets the current log file handle
+ LogDisableRotation - keeps writing the current log file however large
+                      or old it gets
 
+ NOTE: waits for files already rotated to be compressed and pruned.
 ********************************************************************/
-extern "C" HANDLE DAPI LogGetHandle()
+extern "C" void DAPI LogDisableRotation()
 {
-    return LogUtil_hLog;
+    LOGUTIL_ROTATION* pRotation = NULL;
+
+    if (!LogUtil_fInitializedCriticalSection)
+    {
+        return;
+    }
+
+    ::EnterCriticalSection(&LogUtil_csLog);
+
+    pRotation = LogUtil_pRotation;
+    LogUtil_pRotation = NULL;
+
+    ::LeaveCriticalSection(&LogUtil_csLog);
+
+    if (pRotation)
+    {
+        LogRotationFree(pRotation);
+    }
 }
 
 
 /********************************************************************
- LogString - write a string to the log
+ LogSetRotationOpenCallback - calls pfnOpen each time the log is about
+                              to be created again after rotating
 
- NOTE: use printf formatting ("%ls", "%d", etc.)
+ NOTE: a failure from pfnOpen is handled as if the file could not be
+       created, which lets tests cover a log lost while rotating.
 ********************************************************************/
-extern "C" HRESULT DAPIV LogString(
-    __in REPORT_LEVEL rl,
-    __in_z __format_string LPCSTR szFormat,
+extern "C" void DAPI LogSetRotationOpenCallback(
+    __in_opt PFN_LOGROTATIONOPEN pfnOpen,
+    __in_opt LPVOID pvContext
+    )
+{
+    if (LogUtil_fInitializedCriticalSection)
+    {
+        ::EnterCriticalSection(&LogUtil_csLog);
+    }
+
+    LogUtil_pfnRotationOpen = pfnOpen;
+    LogUtil_pvRotationOpenContext = pvContext;
+
+    if (LogUtil_fInitializedCriticalSection)
+    {
+        ::LeaveCriticalSection(&LogUtil_csLog);
+    }
+}
+
+
+/********************************************************************
+ LogSetPreInitLimit - caps the memory kept for lines logged before
+                      LogOpen()
+
+ NOTE: past the limit the oldest lines are dropped, and LogOpen()
+       writes how many ahead of the rest. Zero restores the 1 MB
+       default.
+********************************************************************/
+extern "C" HRESULT DAPI LogSetPreInitLimit(
+    __in DWORD cbLimit
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (!LogUtil_fInitializedCriticalSection)
+    {
+        hr = E_UNEXPECTED;
+        LoguExitOnRootFailure(hr, "LogInitialize() must be called before LogSetPreInitLimit().");
+    }
+
+    ::EnterCriticalSection(&LogUtil_csLog);
+
+    // Anything kept past a lower limit is dropped by the next line.
+    LogUtil_cbPreInitLimit = cbLimit ? cbLimit : LOGUTIL_PREINIT_DEFAULT_LIMIT;
+
+    ::LeaveCriticalSection(&LogUtil_csLog);
+
+LExit:
+    return hr;
+}
+
+
+/********************************************************************
+ LogSetFormat - chooses between text and binary log files
+
+ NOTE: call before LogOpen(). Binary logs hold each format string once
+       and the arguments of every line, and LogDecodeBinary() renders
+       them as text. Redirected logging always gets text.
+********************************************************************/
+extern "C" HRESULT DAPI LogSetFormat(
+    __in LOG_FORMAT format
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (!LogUtil_fInitializedCriticalSection || INVALID_HANDLE_VALUE != LogUtil_hLog)
+    {
+        hr = E_UNEXPECTED;
+        LoguExitOnRootFailure(hr, "LogSetFormat() must be called after LogInitialize() and before LogOpen().");
+    }
+
+    if (LOG_FORMAT_BINARY == format && !LogUtil_sdBinaryTemplates)
+    {
+        hr = DictCreateWithEmbeddedKeyConcurrent(&LogUtil_sdBinaryTemplates, 0, offsetof(LOGUTIL_BINARY_ID, sczKey), DICT_FLAG_NONE);
+        LoguExitOnFailure(hr, "Failed to create log template dictionary.");
+    }
+
+    LogUtil_format = format;
+
+LExit:
+    return hr;
+}
+
+
+/********************************************************************
+ LogDecodeBinary - renders a binary log as the text LogOpen() would
+                   have written, passing the text to pfnWrite one
+                   line at a time
+
+ NOTE: lines use the strings set with LogSetSpecialParams().
+********************************************************************/
+extern "C" HRESULT DAPI LogDecodeBinary(
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in SIZE_T cbData,
+    __in PFN_LOGSTRINGWORKRAW pfnWrite,
+    __in_opt LPVOID pvContext
+    )
+{
+    HRESULT hr = S_OK;
+    LOGUTIL_BINARY_DECODER decoder = { };
+    const LOG_BINARY_RECORD* pRecord = NULL;
+    SIZE_T iData = 0;
+
+    while (iData < cbData)
+    {
+        if (cbData - iData < sizeof(LOG_BINARY_RECORD))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            LoguExitOnRootFailure(hr, "Binary log ends inside a record header.");
+        }
+
+        pRecord = reinterpret_cast<const LOG_BINARY_RECORD*>(pbData + iData);
+        iData += sizeof(LOG_BINARY_RECORD);
+
+        if (cbData - iData < pRecord->cbData)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            LoguExitOnRootFailure(hr, "Binary log ends inside a record.");
+        }
+
+        if (!decoder.fSession && LOG_BINARY_RECORD_TYPE_SESSION != pRecord->bType)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            LoguExitOnRootFailure(hr, "Binary log does not start with a session.");
+        }
+
+        hr = LogBinaryDecodeRecord(&decoder, static_cast<LOG_BINARY_RECORD_TYPE>(pRecord->bType), pbData + iData, pRecord->cbData, pfnWrite, pvContext);
+        LoguExitOnFailure(hr, "Failed to decode binary log record.");
+
+        iData += pRecord->cbData;
+    }
+
+LExit:
+    for (DWORD i = 0; i < decoder.cTemplates; ++i)
+    {
+        ReleaseStr(decoder.rgsczTemplates[i]);
+    }
+    ReleaseMem(decoder.rgsczTemplates);
+    LogReleaseLineBuffers(&decoder.buffers, &decoder.buffers);
+
+    return hr;
+}
+
+
+/********************************************************************
+ LogDecodeBinaryFile - renders a binary log file as text
+
+********************************************************************/
+extern "C" HRESULT DAPI LogDecodeBinaryFile(
+    __in_z LPCWSTR wzPath,
+    __in PFN_LOGSTRINGWORKRAW pfnWrite,
+    __in_opt LPVOID pvContext
+    )
+{
+    HRESULT hr = S_OK;
+    LPBYTE pbData = NULL;
+    SIZE_T cbData = 0;
+
+    hr = FileRead(&pbData, &cbData, wzPath);
+    LoguExitOnFailure(hr, "Failed to read binary log: %ls", wzPath);
+
+    hr = LogDecodeBinary(pbData, cbData, pfnWrite, pvContext);
+    LoguExitOnFailure(hr, "Failed to decode binary log: %ls", wzPath);
+
+LExit:
+    ReleaseMem(pbData);
+
+    return hr;
+}
+
+
+/********************************************************************
+ LogSetSpecialParams - sets a special beginline string, endline
+                       string, post-timestamp string, etc.
+********************************************************************/
+HRESULT DAPI LogSetSpecialParams(
+    __in_z_opt LPCWSTR wzSpecialBeginLine,
+    __in_z_opt LPCWSTR wzSpecialAfterTimeStamp,
+    __in_z_opt LPCWSTR wzSpecialEndLine
+    )
+{
+    HRESULT hr = S_OK;
+
+    // Handle special string to be prepended before every full line
+    if (NULL == wzSpecialBeginLine)
+    {
+        ReleaseNullStr(LogUtil_sczSpecialBeginLine);
+    }
+    else
+    {
+        hr = StrAllocConcat(&LogUtil_sczSpecialBeginLine, wzSpecialBeginLine, 0);
+        LoguExitOnFailure(hr, "Failed to allocate copy of special beginline string");
+    }
+
+    // Handle special string to be appended to every time stamp
+    if (NULL == wzSpecialAfterTimeStamp)
+    {
+        ReleaseNullStr(LogUtil_sczSpecialAfterTimeStamp);
+    }
+    else
+    {
+        hr = StrAllocConcat(&LogUtil_sczSpecialAfterTimeStamp, wzSpecialAfterTimeStamp, 0);
+        LoguExitOnFailure(hr, "Failed to allocate copy of special post-timestamp string");
+    }
+
+    // Handle special string to be appended before every full line
+    if (NULL == wzSpecialEndLine)
+    {
+        ReleaseNullStr(LogUtil_sczSpecialEndLine);
+    }
+    else
+    {
+        hr = StrAllocConcat(&LogUtil_sczSpecialEndLine, wzSpecialEndLine, 0);
+        LoguExitOnFailure(hr, "Failed to allocate copy of special endline string");
+    }
+
+LExit:
+    return hr;
+}
+
+/********************************************************************
+ LogSetLevel - sets the logging level
+
+ NOTE: returns previous logging level
+********************************************************************/
+extern "C" REPORT_LEVEL DAPI LogSetLevel(
+    __in REPORT_LEVEL rl,
+    __in BOOL fLogChange
+    )
+{
+    AssertSz(REPORT_ERROR != rl, "REPORT_ERROR is not a valid logging level to set");
+
+    REPORT_LEVEL rlPrev = LogUtil_rlCurrent;
+
+    if (LogUtil_rlCurrent != rl)
+    {
+        LogUtil_rlCurrent = rl;
+
+        if (fLogChange)
+        {
+            LPCSTR szLevel = LOGUTIL_UNKNOWN;
+            switch (LogUtil_rlCurrent)
+            {
+            case REPORT_WARNING:
+                szLevel = LOGUTIL_WARNING;
+                break;
+            case REPORT_STANDARD:
+                szLevel = LOGUTIL_STANDARD;
+                break;
+            case REPORT_VERBOSE:
+                szLevel = LOGUTIL_VERBOSE;
+                break;
+            case REPORT_DEBUG:
+                szLevel = LOGUTIL_DEBUG;
+                break;
+            case REPORT_NONE:
+                szLevel = LOGUTIL_NONE;
+                break;
+            }
+
+            LogStringLine(REPORT_STANDARD, "--- logging level: %hs ---", szLevel);
+        }
+    }
+
+    return rlPrev;
+}
+
+
+/********************************************************************
+ LogGetLevel - gets the current logging level
+
+********************************************************************/
+extern "C" REPORT_LEVEL DAPI LogGetLevel()
+{
+    return LogUtil_rlCurrent;
+}
+
+
+/********************************************************************
+ LogGetPath - gets the current log path
+
+********************************************************************/
+extern "C" HRESULT DAPI LogGetPath(
+    __out_ecount_z(cchLogPath) LPWSTR pwzLogPath,
+    __in DWORD cchLogPath
+    )
+{
+    Assert(pwzLogPath);
+
+    HRESULT hr = S_OK;
+
+    if (NULL == LogUtil_sczLogPath)        // they can't have a path if there isn't one!
+    {
+        ExitFunction1(hr = E_UNEXPECTED);
+    }
+
+    hr = ::StringCchCopyW(pwzLogPath, cchLogPath, LogUtil_sczLogPath);
+
+LExit:
+    return hr;
+}
+
+
+/********************************************************************
+ LogGetHandle - gets the current log file handle
+
+********************************************************************/
+extern "C" HANDLE DAPI LogGetHandle()
+{
+    return LogUtil_hLog;
+}
+
+
+/********************************************************************
+ LogString - write a string to the log
+
+ NOTE: use printf formatting ("%ls", "%d", etc.)
+********************************************************************/
+extern "C" HRESULT DAPIV LogString(
+    __in REPORT_LEVEL rl,
+    __in_z __format_string LPCSTR szFormat,
     ...
     )
 {
@@ -474,12 +1382,12 @@ extern "C" HRESULT DAPI LogStringArgs(
     AssertSz(REPORT_NONE != rl, "REPORT_NONE is not a valid logging level");
     HRESULT hr = S_OK;
 
-    if (REPORT_ERROR != rl && LogUtil_rlCurrent < rl)
+    if (LogUtil_fDisabled || (REPORT_ERROR != rl && LogUtil_rlCurrent < rl))
     {
         ExitFunction1(hr = S_FALSE);
     }
 
-    hr = LogStringWorkArgs(rl, szFormat, args, FALSE);
+    hr = LogStringWorkArgs(rl, FALSE, S_OK, szFormat, args, FALSE);
 
 LExit:
     return hr;
@@ -515,12 +1423,12 @@ extern "C" HRESULT DAPI LogStringLineArgs(
     AssertSz(REPORT_NONE != rl, "REPORT_NONE is not a valid logging level");
     HRESULT hr = S_OK;
 
-    if (REPORT_ERROR != rl && LogUtil_rlCurrent < rl)
+    if (LogUtil_fDisabled || (REPORT_ERROR != rl && LogUtil_rlCurrent < rl))
     {
         ExitFunction1(hr = S_FALSE);
     }
 
-    hr = LogStringWorkArgs(rl, szFormat, args, TRUE);
+    hr = LogStringWorkArgs(rl, FALSE, S_OK, szFormat, args, TRUE);
 
 LExit:
     return hr;
@@ -542,7 +1450,7 @@ extern "C" HRESULT DAPI LogIdModuleArgs(
     AssertSz(REPORT_NONE != rl, "REPORT_NONE is not a valid logging level");
     HRESULT hr = S_OK;
 
-    if (REPORT_ERROR != rl && LogUtil_rlCurrent < rl)
+    if (LogUtil_fDisabled || (REPORT_ERROR != rl && LogUtil_rlCurrent < rl))
     {
         ExitFunction1(hr = S_FALSE);
     }
@@ -564,7 +1472,7 @@ extern "C" HRESULT DAPI LogIdModule(
     HRESULT hr = S_OK;
     va_list args;
 
-    if (REPORT_ERROR != rl && LogUtil_rlCurrent < rl)
+    if (LogUtil_fDisabled || (REPORT_ERROR != rl && LogUtil_rlCurrent < rl))
     {
         ExitFunction1(hr = S_FALSE);
     }
@@ -608,25 +1516,19 @@ extern "C" HRESULT DAPI LogErrorStringArgs(
     )
 {
     HRESULT hr  = S_OK;
-    LPWSTR sczFormat = NULL;
-    LPWSTR sczMessage = NULL;
 
-    hr = StrAllocStringAnsi(&sczFormat, szFormat, 0, CP_ACP);
-    LoguExitOnFailure(hr, "Failed to convert format string to wide character string");
+    if (LogUtil_fDisabled)
+    {
+        ExitFunction1(hr = S_FALSE);
+    }
 
     // format the string as a unicode string - this is necessary to be able to include
     // international characters in our output string. This does have the counterintuitive effect
     // that the caller's "%s" is interpreted differently
     // (so callers should use %hs for LPSTR and %ls for LPWSTR)
-    hr = StrAllocFormattedArgs(&sczMessage, sczFormat, args);
-    LoguExitOnFailure(hr, "Failed to format error message: \"%ls\"", sczFormat);
-
-    hr = LogStringLine(REPORT_ERROR, "Error 0x%x: %ls", hrError, sczMessage);
+    hr = LogStringWorkArgs(REPORT_ERROR, TRUE, hrError, szFormat, args, TRUE);
 
 LExit:
-    ReleaseStr(sczFormat);
-    ReleaseStr(sczMessage);
-
     return hr;
 }
 
@@ -749,7 +1651,7 @@ static HRESULT LogFooterWork(
 
     va_list args;
     va_start(args, szFormat);
-    hr = LogStringWorkArgs(REPORT_STANDARD, szFormat, args, TRUE);
+    hr = LogStringWorkArgs(REPORT_STANDARD, FALSE, S_OK, szFormat, args, TRUE);
     va_end(args);
 
     return hr;
@@ -765,6 +1667,50 @@ extern "C" HRESULT DAPI LogFooter()
     return hr;
 }
 
+/********************************************************************
+ LogMemoryTelemetry - Write the counts collected since
+                      MemTelemetryEnable() to the log, one line per
+                      source that allocated anything
+
+********************************************************************/
+extern "C" HRESULT DAPI LogMemoryTelemetry(
+    __in REPORT_LEVEL rl
+    )
+{
+    HRESULT hr = S_OK;
+    MEM_TELEMETRY telemetry = { };
+    MEM_SOURCE_TELEMETRY sourceTelemetry = { };
+    LPWSTR sczSizeClasses = NULL;
+
+    MemGetTelemetry(&telemetry);
+    LogStringLine(rl, "--- memory: %I64d bytes live, %I64d bytes peak, %I64u frees ---", telemetry.cbLive, telemetry.cbPeak, telemetry.cFrees);
+
+    for (UINT source = DUTIL_SOURCE_UNKNOWN; source <= DUTIL_SOURCE_EXTERNAL; ++source)
+    {
+        hr = MemGetSourceTelemetry(source, &sourceTelemetry);
+        LoguExitOnFailure(hr, "Failed to get memory telemetry for source: %u", source);
+
+        if (!sourceTelemetry.cAllocations && !sourceTelemetry.cReAllocations)
+        {
+            continue;
+        }
+
+        ReleaseNullStr(sczSizeClasses);
+        for (DWORD i = 0; i < MEM_TELEMETRY_SIZE_CLASSES; ++i)
+        {
+            hr = StrAllocConcatFormatted(&sczSizeClasses, i ? L" %I64u" : L"%I64u", sourceTelemetry.rgcSizeClasses[i]);
+            LoguExitOnFailure(hr, "Failed to format memory size classes.");
+        }
+
+        LogStringLine(rl, "source %u: %I64u allocations, %I64u reallocations, %I64u bytes, size classes: %ls", source, sourceTelemetry.cAllocations, sourceTelemetry.cReAllocations, sourceTelemetry.cbAllocated, sczSizeClasses);
+    }
+
+LExit:
+    ReleaseStr(sczSizeClasses);
+
+    return hr;
+}
+
 /********************************************************************
  LogStringWorkRaw - Write a raw, unformatted string to the log
 
@@ -776,33 +1722,29 @@ extern "C" HRESULT LogStringWorkRaw(
     Assert(szLogData && *szLogData);
 
     HRESULT hr = S_OK;
-    DWORD cbLogData = 0;
-    DWORD cbTotal = 0;
-    DWORD cbWrote = 0;
-
-    cbLogData = lstrlenA(szLogData);
+    DWORD cbLogData = lstrlenA(szLogData);
+    LOG_BINARY_RECORD* pRecord = NULL;
 
-    // If the log hasn't been initialized yet, store it in a buffer
-    if (INVALID_HANDLE_VALUE == LogUtil_hLog)
+    // Raw text has no level, and goes through the queue and lock like any line so it can't race a
+    // rotation. It is never dropped since callers don't expect S_FALSE.
+    if (!LogBinaryFormatting())
     {
-        hr = StrAnsiAllocConcat(&LogUtil_sczPreInitBuffer, szLogData, 0);
-        LoguExitOnFailure(hr, "Failed to concatenate string to pre-init buffer");
-
-        ExitFunction1(hr = S_OK);
+        ExitFunction1(hr = LogWriteBytes(REPORT_STANDARD, szLogData, cbLogData, TRUE));
     }
 
-    // write the string
-    while (cbTotal < cbLogData)
-    {
-        if (!::WriteFile(LogUtil_hLog, reinterpret_cast<const BYTE*>(szLogData) + cbTotal, cbLogData - cbTotal, &cbWrote, NULL))
-        {
-            LoguExitOnLastError(hr, "Failed to write output to log: %ls - %hs", LogUtil_sczLogPath, szLogData);
-        }
+    // Raw text in a binary log gets a record of its own that decoders pass through.
+    pRecord = static_cast<LOG_BINARY_RECORD*>(MemAlloc(sizeof(LOG_BINARY_RECORD) + cbLogData, FALSE));
+    LoguExitOnNull(pRecord, hr, E_OUTOFMEMORY, "Failed to allocate binary log text record.");
 
-        cbTotal += cbWrote;
-    }
+    pRecord->bType = LOG_BINARY_RECORD_TYPE_TEXT;
+    pRecord->cbData = cbLogData;
+    memcpy(pRecord + 1, szLogData, cbLogData);
+
+    hr = LogWriteBytes(REPORT_STANDARD, reinterpret_cast<LPCSTR>(pRecord), sizeof(LOG_BINARY_RECORD) + cbLogData, TRUE);
 
 LExit:
+    ReleaseMem(pRecord);
+
     return hr;
 }
 
@@ -839,7 +1781,7 @@ static HRESULT LogIdWork(
         pwz[cch-2] = L'\0'; // remove newline from message table
     }
 
-    LogStringWork(rl, dwLogId, pwz, fLOGUTIL_NEWLINE);
+    LogStringWork(rl, dwLogId, hModule, pwz, fLOGUTIL_NEWLINE);
 
 LExit:
     if (pwz)
@@ -853,6 +1795,8 @@ LExit:
 
 static HRESULT LogStringWorkArgs(
     __in REPORT_LEVEL rl,
+    __in BOOL fError,
+    __in HRESULT hrError,
     __in_z __format_string LPCSTR szFormat,
     __in va_list args,
     __in BOOL fLOGUTIL_NEWLINE
@@ -861,22 +1805,75 @@ static HRESULT LogStringWorkArgs(
     Assert(szFormat && *szFormat);
 
     HRESULT hr = S_OK;
-    LPWSTR sczFormat = NULL;
-    LPWSTR sczMessage = NULL;
+    LOGUTIL_LINE_BUFFERS localBuffers = { };
+    LOGUTIL_LINE_BUFFERS* pBuffers = NULL;
+    WCHAR wzError[20] = { };
+    DWORD cchError = 0;
+    DWORD cchFormat = 0;
+
+    // If logging is disabled, just bail.
+    if (LogUtil_fDisabled)
+    {
+        ExitFunction();
+    }
+
+    pBuffers = LogAcquireLineBuffers(&localBuffers);
+
+    // The error code goes in front of the format itself, so the message is formatted once,
+    // straight onto the line or into binary records like any other.
+    if (fError)
+    {
+        hr = ::StringCchPrintfW(wzError, countof(wzError), L"Error 0x%x: ", hrError);
+        LoguExitOnFailure(hr, "Failed to format error code: 0x%x", hrError);
+
+        cchError = lstrlenW(wzError);
+    }
+
+    // Every ANSI character converts to a single wide character.
+    cchFormat = lstrlenA(szFormat) + 1;
+
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pBuffers->pwzFormat), cchError + cchFormat, sizeof(WCHAR), LOGUTIL_LINE_BUFFER_INCREMENT);
+    LoguExitOnFailure(hr, "Failed to grow log format buffer.");
+
+    memcpy(pBuffers->pwzFormat, wzError, cchError * sizeof(WCHAR));
+
+    if (!::MultiByteToWideChar(CP_ACP, 0, szFormat, cchFormat, pBuffers->pwzFormat + cchError, cchFormat))
+    {
+        LoguExitWithLastError(hr, "Failed to convert format string to wide character string");
+    }
+
+    if (!s_vpfLogStringWorkRaw && LogBinaryFormatting())
+    {
+        hr = LogBinaryStringWorkArgs(rl, pBuffers, args, fLOGUTIL_NEWLINE);
+        LoguExitOnFailure(hr, "Failed to write binary line to log: \"%ls\"", pBuffers->pwzFormat);
+
+        ExitFunction();
+    }
+
+    if (fLOGUTIL_NEWLINE)
+    {
+        hr = LogAppendLinePrefix(&pBuffers->line, rl, 0);
+        LoguExitOnFailure(hr, "Failed to format line prefix.");
+    }
 
-    hr = StrAllocStringAnsi(&sczFormat, szFormat, 0, CP_ACP);
-    LoguExitOnFailure(hr, "Failed to convert format string to wide character string");
+    // format the string as a unicode string, straight onto the line
+    hr = StrBuilderAppendFormattedArgs(&pBuffers->line, pBuffers->pwzFormat, args);
+    LoguExitOnFailure(hr, "Failed to format message: \"%ls\"", pBuffers->pwzFormat);
 
-    // format the string as a unicode string
-    hr = StrAllocFormattedArgs(&sczMessage, sczFormat, args);
-    LoguExitOnFailure(hr, "Failed to format message: \"%ls\"", sczFormat);
+    if (fLOGUTIL_NEWLINE)
+    {
+        hr = StrBuilderAppend(&pBuffers->line, LogUtil_sczSpecialEndLine ? LogUtil_sczSpecialEndLine : L"\r\n");
+        LoguExitOnFailure(hr, "Failed to add line ending.");
+    }
 
-    hr = LogStringWork(rl, 0, sczMessage, fLOGUTIL_NEWLINE);
-    LoguExitOnFailure(hr, "Failed to write formatted string to log:%ls", sczMessage);
+    hr = LogWriteLine(rl, pBuffers);
+    LoguExitOnFailure(hr, "Failed to write formatted string to log:%ls", pBuffers->line.sczString);
 
 LExit:
-    ReleaseStr(sczFormat);
-    ReleaseStr(sczMessage);
+    if (pBuffers)
+    {
+        LogReleaseLineBuffers(pBuffers, &localBuffers);
+    }
 
     return hr;
 }
@@ -885,6 +1882,7 @@ LExit:
 static HRESULT LogStringWork(
     __in REPORT_LEVEL rl,
     __in DWORD dwLogId,
+    __in_opt HMODULE hModule,
     __in_z LPCWSTR sczString,
     __in BOOL fLOGUTIL_NEWLINE
     )
@@ -892,10 +1890,8 @@ static HRESULT LogStringWork(
     Assert(sczString && *sczString);
 
     HRESULT hr = S_OK;
-    BOOL fEnteredCriticalSection = FALSE;
-    LPWSTR scz = NULL;
-    LPCWSTR wzLogData = NULL;
-    LPSTR sczMultiByte = NULL;
+    LOGUTIL_LINE_BUFFERS localBuffers = { };
+    LOGUTIL_LINE_BUFFERS* pBuffers = NULL;
 
     // If logging is disabled, just bail.
     if (LogUtil_fDisabled)
@@ -903,55 +1899,2526 @@ static HRESULT LogStringWork(
         ExitFunction();
     }
 
+    pBuffers = LogAcquireLineBuffers(&localBuffers);
+
+    if (!s_vpfLogStringWorkRaw && LogBinaryFormatting())
+    {
+        hr = LogBinaryStringWork(rl, dwLogId, hModule, sczString, fLOGUTIL_NEWLINE, pBuffers);
+        LoguExitOnFailure(hr, "Failed to write binary string to log: %ls", sczString);
+
+        ExitFunction();
+    }
+
+    if (fLOGUTIL_NEWLINE)
+    {
+        hr = LogAppendLinePrefix(&pBuffers->line, rl, dwLogId);
+        LoguExitOnFailure(hr, "Failed to format line prefix.");
+    }
+
+    hr = StrBuilderAppend(&pBuffers->line, sczString);
+    LoguExitOnFailure(hr, "Failed to add string to line.");
+
+    if (fLOGUTIL_NEWLINE)
+    {
+        hr = StrBuilderAppend(&pBuffers->line, LogUtil_sczSpecialEndLine ? LogUtil_sczSpecialEndLine : L"\r\n");
+        LoguExitOnFailure(hr, "Failed to add line ending.");
+    }
+
+    hr = LogWriteLine(rl, pBuffers);
+    LoguExitOnFailure(hr, "Failed to write string to log: %ls", sczString);
+
+LExit:
+    if (pBuffers)
+    {
+        LogReleaseLineBuffers(pBuffers, &localBuffers);
+    }
+
+    return hr;
+}
+
+
+static HRESULT LogAppendLinePrefix(
+    __in STR_BUILDER* pLine,
+    __in REPORT_LEVEL rl,
+    __in DWORD dwLogId
+    )
+{
+    // get the process and thread id.
+    DWORD dwProcessId = ::GetCurrentProcessId();
+    DWORD dwThreadId = ::GetCurrentThreadId();
+
+    // get the time relative to GMT.
+    SYSTEMTIME st = { };
+    ::GetLocalTime(&st);
+
+    return LogFormatLinePrefix(pLine, rl, dwLogId, dwProcessId, dwThreadId, &st);
+}
+
+
+static HRESULT LogFormatLinePrefix(
+    __in STR_BUILDER* pLine,
+    __in REPORT_LEVEL rl,
+    __in DWORD dwLogId,
+    __in DWORD dwProcessId,
+    __in DWORD dwThreadId,
+    __in const SYSTEMTIME* pst
+    )
+{
+    HRESULT hr = S_OK;
+
+    DWORD dwId = dwLogId & 0xFFFFFFF;
+    DWORD dwType = dwLogId & 0xF0000000;
+    LPSTR szType = (0xE0000000 == dwType || REPORT_ERROR == rl) ? "e" : (0xA0000000 == dwType || REPORT_WARNING == rl) ? "w" : "i";
+
+    hr = StrBuilderAppendFormatted(pLine, L"%ls[%04X:%04X][%04hu-%02hu-%02huT%02hu:%02hu:%02hu]%hs%03d:%ls ", LogUtil_sczSpecialBeginLine ? LogUtil_sczSpecialBeginLine : L"",
+        dwProcessId, dwThreadId, pst->wYear, pst->wMonth, pst->wDay, pst->wHour, pst->wMinute, pst->wSecond, szType, dwId,
+        LogUtil_sczSpecialAfterTimeStamp ? LogUtil_sczSpecialAfterTimeStamp : L"");
+    LoguExitOnFailure(hr, "Failed to format line prefix.");
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogWriteLine(
+    __in REPORT_LEVEL rl,
+    __in LOGUTIL_LINE_BUFFERS* pBuffers
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fEnteredCriticalSection = FALSE;
+    DWORD cbUtf8 = 0;
+
+    if (!pBuffers->line.cch)
+    {
+        ExitFunction();
+    }
+
+    hr = LogLineToUtf8(pBuffers, &cbUtf8);
+    LoguExitOnFailure(hr, "Failed to convert log line to UTF-8.");
+
+    if (!s_vpfLogStringWorkRaw)
+    {
+        hr = LogWriteBytes(rl, pBuffers->pszUtf8, cbUtf8, FALSE);
+        LoguExitOnFailure(hr, "Failed to write string to log using default function.");
+
+        ExitFunction();
+    }
+
     ::EnterCriticalSection(&LogUtil_csLog);
     fEnteredCriticalSection = TRUE;
 
-    if (fLOGUTIL_NEWLINE)
+    hr = s_vpfLogStringWorkRaw(pBuffers->pszUtf8, s_vpvLogStringWorkRawContext);
+    LoguExitOnFailure(hr, "Failed to write string to log using redirected function.");
+
+LExit:
+    if (fEnteredCriticalSection)
     {
-        // get the process and thread id.
-        DWORD dwProcessId = ::GetCurrentProcessId();
-        DWORD dwThreadId = ::GetCurrentThreadId();
+        ::LeaveCriticalSection(&LogUtil_csLog);
+    }
+
+    return hr;
+}
 
-        // get the time relative to GMT.
-        SYSTEMTIME st = { };
-        ::GetLocalTime(&st);
 
-        DWORD dwId = dwLogId & 0xFFFFFFF;
-        DWORD dwType = dwLogId & 0xF0000000;
-        LPSTR szType = (0xE0000000 == dwType || REPORT_ERROR == rl) ? "e" : (0xA0000000 == dwType || REPORT_WARNING == rl) ? "w" : "i";
+static HRESULT LogLineToUtf8(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __out DWORD* pcbUtf8
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cbUtf8 = 0;
 
-        // add line prefix and trailing newline
-        hr = StrAllocFormatted(&scz, L"%ls[%04X:%04X][%04hu-%02hu-%02huT%02hu:%02hu:%02hu]%hs%03d:%ls %ls%ls", LogUtil_sczSpecialBeginLine ? LogUtil_sczSpecialBeginLine : L"",
-            dwProcessId, dwThreadId, st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, szType, dwId,
-            LogUtil_sczSpecialAfterTimeStamp ? LogUtil_sczSpecialAfterTimeStamp : L"", sczString, LogUtil_sczSpecialEndLine ? LogUtil_sczSpecialEndLine : L"\r\n");
-        LoguExitOnFailure(hr, "Failed to format line prefix.");
+    // Each UTF-16 character needs at most three bytes, so size for that and convert in one pass.
+    if (DWORD_MAX / 3 <= pBuffers->line.cch)
+    {
+        hr = E_INVALIDARG;
+        LoguExitOnRootFailure(hr, "Log line is too long.");
     }
 
-    wzLogData = scz ? scz : sczString;
+    cbUtf8 = static_cast<DWORD>(pBuffers->line.cch * 3 + 1);
 
-    // Convert to UTF-8 before writing out to the log file
-    hr = StrAnsiAllocString(&sczMultiByte, wzLogData, 0, CP_UTF8);
-    LoguExitOnFailure(hr, "Failed to convert log string to UTF-8");
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pBuffers->pszUtf8), cbUtf8, sizeof(CHAR), LOGUTIL_LINE_BUFFER_INCREMENT);
+    LoguExitOnFailure(hr, "Failed to grow UTF-8 log buffer.");
 
-    if (s_vpfLogStringWorkRaw)
+    cbUtf8 = ::WideCharToMultiByte(CP_UTF8, 0, pBuffers->line.sczString, static_cast<int>(pBuffers->line.cch + 1), pBuffers->pszUtf8, cbUtf8, NULL, NULL);
+    if (!cbUtf8)
     {
-        hr = s_vpfLogStringWorkRaw(sczMultiByte, s_vpvLogStringWorkRawContext);
-        LoguExitOnFailure(hr, "Failed to write string to log using redirected function: %ls", sczString);
+        LoguExitWithLastError(hr, "Failed to convert log string to UTF-8");
     }
-    else
+
+    // Not counting the null terminator.
+    *pcbUtf8 = cbUtf8 - 1;
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogWriteBytes(
+    __in REPORT_LEVEL rl,
+    __in_bcount(cbData) LPCSTR pchData,
+    __in DWORD cbData,
+    __in BOOL fNeverDrop
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fEnteredCriticalSection = FALSE;
+    LOGUTIL_ASYNC* pAsync = (LogUtil_dwDirectThreadId == ::GetCurrentThreadId()) ? NULL : LogUtil_pAsync;
+
+    // Records are limited to half the ring so one always fits, even after padding, once the
+    // writer thread catches up.
+    if (pAsync && cbData <= pAsync->cbRing / 2 - sizeof(LOGUTIL_ASYNC_RECORD))
+    {
+        // Errors are never dropped since they are flushed to the log right after.
+        hr = LogAsyncEnqueue(pAsync, pchData, cbData, fNeverDrop || REPORT_ERROR == rl);
+        LoguExitOnFailure(hr, "Failed to queue string for log.");
+
+        // Make sure errors reach the log even if the process goes down next.
+        if (REPORT_ERROR == rl)
+        {
+            LogFlush();
+        }
+
+        ExitFunction();
+    }
+    else if (pAsync)
     {
-        hr = LogStringWorkRaw(sczMultiByte);
-        LoguExitOnFailure(hr, "Failed to write string to log using default function: %ls", sczString);
+        // The line is too large to queue, so write it directly after everything before it.
+        LogFlush();
     }
 
+    ::EnterCriticalSection(&LogUtil_csLog);
+    fEnteredCriticalSection = TRUE;
+
+    hr = LogWriteData(pchData, cbData);
+
 LExit:
     if (fEnteredCriticalSection)
     {
         ::LeaveCriticalSection(&LogUtil_csLog);
     }
 
-    ReleaseStr(scz);
-    ReleaseStr(sczMultiByte);
+    return hr;
+}
+
+
+static LOGUTIL_LINE_BUFFERS* LogAcquireLineBuffers(
+    __in LOGUTIL_LINE_BUFFERS* pLocalBuffers
+    )
+{
+    LOGUTIL_LINE_BUFFERS* pBuffers = NULL;
+
+    if (FLS_OUT_OF_INDEXES != LogUtil_dwFlsIndex)
+    {
+        pBuffers = static_cast<LOGUTIL_LINE_BUFFERS*>(::FlsGetValue(LogUtil_dwFlsIndex));
+        if (!pBuffers)
+        {
+            pBuffers = static_cast<LOGUTIL_LINE_BUFFERS*>(MemAlloc(sizeof(LOGUTIL_LINE_BUFFERS), TRUE));
+            if (pBuffers && !::FlsSetValue(LogUtil_dwFlsIndex, pBuffers))
+            {
+                ReleaseNullMem(pBuffers);
+            }
+        }
+    }
+
+    // A redirected writer that logs again gets its own buffers for the nested line.
+    if (!pBuffers || pBuffers->fInUse)
+    {
+        return pLocalBuffers;
+    }
+
+    pBuffers->fInUse = TRUE;
+    return pBuffers;
+}
+
+
+static void LogReleaseLineBuffers(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in LOGUTIL_LINE_BUFFERS* pLocalBuffers
+    )
+{
+    if (pBuffers == pLocalBuffers)
+    {
+        ReleaseMem(pBuffers->pwzFormat);
+        ReleaseMem(pBuffers->pszUtf8);
+        ReleaseMem(pBuffers->pbRecord);
+        ReleaseMem(pBuffers->pwzArg);
+        StrBuilderUninitialize(&pBuffers->line);
+
+        return;
+    }
+
+    // Keep the memory for the next line on this thread.
+    pBuffers->cbRecord = 0;
+    pBuffers->line.cch = 0;
+    if (pBuffers->line.sczString)
+    {
+        *pBuffers->line.sczString = L'\0';
+    }
+
+    pBuffers->fInUse = FALSE;
+}
+
+
+static void WINAPI LogFreeLineBuffers(
+    __in_opt LPVOID pvBuffers
+    )
+{
+    LOGUTIL_LINE_BUFFERS* pBuffers = static_cast<LOGUTIL_LINE_BUFFERS*>(pvBuffers);
+
+    if (pBuffers)
+    {
+        ReleaseMem(pBuffers->pwzFormat);
+        ReleaseMem(pBuffers->pszUtf8);
+        ReleaseMem(pBuffers->pbRecord);
+        ReleaseMem(pBuffers->pwzArg);
+        StrBuilderUninitialize(&pBuffers->line);
+        MemFree(pBuffers);
+    }
+}
+
+
+static HRESULT LogAsyncEnqueue(
+    __in LOGUTIL_ASYNC* pAsync,
+    __in_bcount(cbLogData) LPCSTR pchLogData,
+    __in DWORD cbLogData,
+    __in BOOL fNeverDrop
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cbRecord = 0;
+    DWORD cbPadding = 0;
+    DWORD dwHead = 0;
+    DWORD dwOffset = 0;
+    LOGUTIL_ASYNC_RECORD* pRecord = NULL;
+
+    cbRecord = (sizeof(LOGUTIL_ASYNC_RECORD) + cbLogData + sizeof(LOGUTIL_ASYNC_RECORD) - 1) & ~(sizeof(LOGUTIL_ASYNC_RECORD) - 1);
+
+    for (;;)
+    {
+        dwHead = static_cast<DWORD>(pAsync->dwHead);
+        dwOffset = dwHead & (pAsync->cbRing - 1);
+        cbPadding = (pAsync->cbRing - dwOffset < cbRecord) ? pAsync->cbRing - dwOffset : 0;
+
+        if (pAsync->cbRing < dwHead + cbPadding + cbRecord - static_cast<DWORD>(pAsync->dwTail))
+        {
+            // Later lines depend on records that define ids, so those wait for room like any
+            // other line would without the drop policy.
+            if (LOG_ASYNC_POLICY_DROP == pAsync->policy && !fNeverDrop)
+            {
+                // The writer thread reports how many lines were dropped.
+                ::InterlockedIncrement(&pAsync->cDropped);
+                ExitFunction1(hr = S_FALSE);
+            }
+
+            ::ResetEvent(pAsync->hDrainedEvent);
+            ::SetEvent(pAsync->hWakeEvent);
+
+            if (pAsync->cbRing < dwHead + cbPadding + cbRecord - static_cast<DWORD>(pAsync->dwTail))
+            {
+                ::WaitForSingleObject(pAsync->hDrainedEvent, LOGUTIL_ASYNC_WAIT_MS);
+            }
+        }
+        else if (static_cast<LONG>(dwHead) == ::InterlockedCompareExchange(&pAsync->dwHead, static_cast<LONG>(dwHead + cbPadding + cbRecord), static_cast<LONG>(dwHead)))
+        {
+            break;
+        }
+    }
+
+    if (cbPadding)
+    {
+        pRecord = reinterpret_cast<LOGUTIL_ASYNC_RECORD*>(pAsync->pbRing + dwOffset);
+        pRecord->cbData = cbPadding - sizeof(LOGUTIL_ASYNC_RECORD);
+        ::InterlockedExchange(&pRecord->lState, LOGUTIL_ASYNC_RECORD_STATE_PADDING);
+
+        dwOffset = 0;
+    }
+
+    pRecord = reinterpret_cast<LOGUTIL_ASYNC_RECORD*>(pAsync->pbRing + dwOffset);
+    pRecord->cbData = cbLogData;
+    memcpy(pRecord + 1, pchLogData, cbLogData);
+    ::InterlockedExchange(&pRecord->lState, LOGUTIL_ASYNC_RECORD_STATE_DATA);
+
+    // Wake the writer thread early once the ring is half full rather than at its next interval.
+    if (pAsync->cbRing / 2 < dwHead + cbPadding + cbRecord - static_cast<DWORD>(pAsync->dwTail))
+    {
+        ::SetEvent(pAsync->hWakeEvent);
+    }
+
+LExit:
+    return hr;
+}
+
+
+static DWORD WINAPI LogAsyncWriterThread(
+    __in LPVOID pvContext
+    )
+{
+    LOGUTIL_ASYNC* pAsync = static_cast<LOGUTIL_ASYNC*>(pvContext);
+    BOOL fStop = FALSE;
+
+    do
+    {
+        ::WaitForSingleObject(pAsync->hWakeEvent, LOGUTIL_ASYNC_INTERVAL_MS);
+
+        // Read the flag before draining so everything logged before the stop is written.
+        fStop = pAsync->fStop;
+
+        LogAsyncDrain(pAsync);
+        ::SetEvent(pAsync->hDrainedEvent);
+    } while (!fStop);
+
+    return 0;
+}
+
 
+static HRESULT LogAsyncDrain(
+    __in LOGUTIL_ASYNC* pAsync
+    )
+{
+    HRESULT hr = S_OK;
+    HRESULT hrWrite = S_OK;
+    DWORD dwTail = static_cast<DWORD>(pAsync->dwTail);
+    DWORD cbBatch = 0;
+    DWORD cbRecord = 0;
+    DWORD cbHeader = 0;
+    LONG lState = LOGUTIL_ASYNC_RECORD_STATE_EMPTY;
+    LONG cDropped = ::InterlockedExchange(&pAsync->cDropped, 0);
+    LOGUTIL_ASYNC_RECORD* pRecord = NULL;
+
+    if (cDropped)
+    {
+        // Binary logs get the count as a text record.
+        cbHeader = (LOG_FORMAT_BINARY == LogUtil_format) ? sizeof(LOG_BINARY_RECORD) : 0;
+
+        hr = ::StringCchPrintfA(pAsync->pchBatch + cbHeader, pAsync->cbRing / 2 - cbHeader, "=== Logging dropped %d lines ===\r\n", cDropped);
+        LoguExitOnFailure(hr, "Failed to format dropped line count.");
+
+        cbBatch = cbHeader + lstrlenA(pAsync->pchBatch + cbHeader);
+
+        if (cbHeader)
+        {
+            reinterpret_cast<LOG_BINARY_RECORD*>(pAsync->pchBatch)->bType = LOG_BINARY_RECORD_TYPE_TEXT;
+            reinterpret_cast<LOG_BINARY_RECORD*>(pAsync->pchBatch)->cbData = cbBatch - cbHeader;
+        }
+    }
+
+    for (;;)
+    {
+        pRecord = reinterpret_cast<LOGUTIL_ASYNC_RECORD*>(pAsync->pbRing + (dwTail & (pAsync->cbRing - 1)));
+
+        lState = ::InterlockedCompareExchange(&pRecord->lState, LOGUTIL_ASYNC_RECORD_STATE_EMPTY, LOGUTIL_ASYNC_RECORD_STATE_EMPTY);
+        if (LOGUTIL_ASYNC_RECORD_STATE_EMPTY == lState)
+        {
+            break;
+        }
+
+        cbRecord = (sizeof(LOGUTIL_ASYNC_RECORD) + pRecord->cbData + sizeof(LOGUTIL_ASYNC_RECORD) - 1) & ~(sizeof(LOGUTIL_ASYNC_RECORD) - 1);
+
+        if (LOGUTIL_ASYNC_RECORD_STATE_DATA == lState)
+        {
+            if (pAsync->cbRing / 2 - cbBatch < pRecord->cbData)
+            {
+                hrWrite = LogAsyncWriteBatch(pAsync, cbBatch);
+                hr = SUCCEEDED(hr) ? hrWrite : hr;
+                cbBatch = 0;
+            }
+
+            memcpy(pAsync->pchBatch + cbBatch, pRecord + 1, pRecord->cbData);
+            cbBatch += pRecord->cbData;
+        }
+
+        // Clear the whole record so stale text never looks like a header when the space is reused.
+        memset(pRecord, 0, cbRecord);
+
+        dwTail += cbRecord;
+        ::InterlockedExchange(&pAsync->dwTail, static_cast<LONG>(dwTail));
+    }
+
+    if (cbBatch)
+    {
+        hrWrite = LogAsyncWriteBatch(pAsync, cbBatch);
+        hr = SUCCEEDED(hr) ? hrWrite : hr;
+    }
+    LoguExitOnFailure(hr, "Failed to write queued log lines.");
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogAsyncWriteBatch(
+    __in LOGUTIL_ASYNC* pAsync,
+    __in DWORD cbBatch
+    )
+{
+    HRESULT hr = S_OK;
+
+    // The lock keeps batches in order with LogRename() and anything written synchronously.
+    ::EnterCriticalSection(&LogUtil_csLog);
+
+    hr = LogWriteData(pAsync->pchBatch, cbBatch);
+
+    ::LeaveCriticalSection(&LogUtil_csLog);
+
+    return hr;
+}
+
+
+static HRESULT LogWriteData(
+    __in_bcount(cbLogData) LPCSTR pchLogData,
+    __in DWORD cbLogData
+    )
+{
+    HRESULT hr = S_OK;
+
+    // A log that could not be created again after rotating is retried by each write until it can be.
+    if (INVALID_HANDLE_VALUE == LogUtil_hLog && LogUtil_pRotation && LogUtil_pRotation->fLost)
+    {
+        LogRotationRecover(LogUtil_pRotation);
+    }
+
+    // If the log hasn't been initialized yet, store it in a buffer
+    if (INVALID_HANDLE_VALUE == LogUtil_hLog)
+    {
+        hr = LogPreInitAppend(pchLogData, cbLogData);
+        LoguExitOnFailure(hr, "Failed to add string to pre-init buffer");
+
+        ExitFunction1(hr = S_OK);
+    }
+
+    hr = LogWriteFileData(pchLogData, cbLogData);
+    LoguExitOnFailure(hr, "Failed to write to log.");
+
+    if (LogUtil_pRotation && LogRotationDue(LogUtil_pRotation))
+    {
+        // The data is in the log even if rotating fails, so the next limit tries again.
+        LogRotate(LogUtil_pRotation);
+    }
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogWriteFileData(
+    __in_bcount(cbLogData) LPCSTR pchLogData,
+    __in DWORD cbLogData
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cbTotal = 0;
+    DWORD cbWrote = 0;
+
+    // write the string
+    while (cbTotal < cbLogData)
+    {
+        if (!::WriteFile(LogUtil_hLog, reinterpret_cast<const BYTE*>(pchLogData) + cbTotal, cbLogData - cbTotal, &cbWrote, NULL))
+        {
+            LoguExitOnLastError(hr, "Failed to write output to log: %ls - %.*hs", LogUtil_sczLogPath, cbLogData, pchLogData);
+        }
+
+        cbTotal += cbWrote;
+    }
+
+    if (LogUtil_pRotation)
+    {
+        LogUtil_pRotation->cbLog += cbLogData;
+    }
+
+LExit:
+    return hr;
+}
+
+
+static void LogAsyncFree(
+    __in LOGUTIL_ASYNC* pAsync
+    )
+{
+    ReleaseHandle(pAsync->hThread);
+    ReleaseHandle(pAsync->hWakeEvent);
+    ReleaseHandle(pAsync->hDrainedEvent);
+    ReleaseMem(pAsync->pchBatch);
+    ReleaseMem(pAsync->pbRing);
+    MemFree(pAsync);
+}
+
+
+static HRESULT LogPreInitAppend(
+    __in_bcount(cbLogData) LPCSTR pchLogData,
+    __in DWORD cbLogData
+    )
+{
+    HRESULT hr = S_OK;
+    LOGUTIL_PREINIT_CHUNK* pChunk = LogUtil_pPreInitTail;
+    LOGUTIL_PREINIT_CHUNK* pDropped = NULL;
+    DWORD cbChunk = max(min(LogUtil_cbPreInitLimit, LOGUTIL_PREINIT_CHUNK_SIZE), cbLogData);
+
+    // The last chunk is only filled while everything kept is within the limit, which may have
+    // been lowered since it was allocated.
+    if (pChunk && cbLogData <= pChunk->cbAllocated - pChunk->cbData && LogUtil_cbPreInit <= LogUtil_cbPreInitLimit)
+    {
+        memcpy(reinterpret_cast<LPBYTE>(pChunk + 1) + pChunk->cbData, pchLogData, cbLogData);
+        pChunk->cbData += cbLogData;
+
+        ExitFunction();
+    }
+
+    // Data that could never fit is dropped on its own.
+    if (LogUtil_cbPreInitLimit < cbLogData)
+    {
+        LogUtil_cPreInitDroppedLines += LogPreInitCountLines(pchLogData, cbLogData);
+        ExitFunction();
+    }
+
+    // Drop the oldest chunks to make room, reusing the last one dropped when it is big enough.
+    while (LogUtil_pPreInitHead && LogUtil_cbPreInitLimit - cbChunk < LogUtil_cbPreInit)
+    {
+        ReleaseMem(pDropped);
+
+        pDropped = LogUtil_pPreInitHead;
+        LogUtil_pPreInitHead = pDropped->pNext;
+        LogUtil_cbPreInit -= pDropped->cbAllocated;
+        LogUtil_cPreInitDroppedLines += LogPreInitCountLines(reinterpret_cast<LPCSTR>(pDropped + 1), pDropped->cbData);
+    }
+
+    if (!LogUtil_pPreInitHead)
+    {
+        LogUtil_pPreInitTail = NULL;
+    }
+
+    // A chunk allocated under a higher limit is only reused if it still fits.
+    if (pDropped && cbChunk <= pDropped->cbAllocated && pDropped->cbAllocated <= LogUtil_cbPreInitLimit - LogUtil_cbPreInit)
+    {
+        pChunk = pDropped;
+        pDropped = NULL;
+    }
+    else
+    {
+        pChunk = static_cast<LOGUTIL_PREINIT_CHUNK*>(MemAlloc(sizeof(LOGUTIL_PREINIT_CHUNK) + cbChunk, FALSE));
+        LoguExitOnNull(pChunk, hr, E_OUTOFMEMORY, "Failed to allocate pre-init log buffer.");
+
+        pChunk->cbAllocated = cbChunk;
+    }
+
+    memcpy(pChunk + 1, pchLogData, cbLogData);
+    pChunk->cbData = cbLogData;
+    pChunk->pNext = NULL;
+
+    if (LogUtil_pPreInitTail)
+    {
+        LogUtil_pPreInitTail->pNext = pChunk;
+    }
+    else
+    {
+        LogUtil_pPreInitHead = pChunk;
+    }
+
+    LogUtil_pPreInitTail = pChunk;
+    LogUtil_cbPreInit += pChunk->cbAllocated;
+
+LExit:
+    ReleaseMem(pDropped);
+
+    return hr;
+}
+
+
+static DWORD LogPreInitCountLines(
+    __in_bcount(cbData) LPCSTR pchData,
+    __in DWORD cbData
+    )
+{
+    DWORD cLines = 0;
+    const LOG_BINARY_RECORD* pRecord = NULL;
+
+    // A binary log lost rotating buffers its records, which only count when they are lines.
+    if (LogBinaryFormatting())
+    {
+        for (DWORD i = 0; i < cbData && sizeof(LOG_BINARY_RECORD) <= cbData - i; i += sizeof(LOG_BINARY_RECORD) + pRecord->cbData)
+        {
+            pRecord = reinterpret_cast<const LOG_BINARY_RECORD*>(pchData + i);
+            if (LOG_BINARY_RECORD_TYPE_LINE == pRecord->bType || LOG_BINARY_RECORD_TYPE_TEXT == pRecord->bType)
+            {
+                ++cLines;
+            }
+        }
+
+        return cLines;
+    }
+
+    for (DWORD i = 0; i < cbData; ++i)
+    {
+        if ('\n' == pchData[i])
+        {
+            ++cLines;
+        }
+    }
+
+    return cLines;
+}
+
+
+static HRESULT LogPreInitFlush()
+{
+    HRESULT hr = S_OK;
+    LPSTR sczData = NULL;
+    DWORD cchData = 0;
+    DWORD cbTotal = 0;
+    CHAR szDropped[64] = { };
+
+    if (LogUtil_cPreInitDroppedLines)
+    {
+        hr = ::StringCchPrintfA(szDropped, countof(szDropped), "=== Logging dropped %u lines ===\r\n", LogUtil_cPreInitDroppedLines);
+        LoguExitOnFailure(hr, "Failed to format dropped line count.");
+
+        cbTotal = lstrlenA(szDropped);
+    }
+
+    for (LOGUTIL_PREINIT_CHUNK* pChunk = LogUtil_pPreInitHead; pChunk; pChunk = pChunk->pNext)
+    {
+        cbTotal += pChunk->cbData;
+    }
+
+    if (!cbTotal)
+    {
+        ExitFunction();
+    }
+
+    // Gather everything so it reaches the log in one write.
+    hr = StrAnsiAlloc(&sczData, cbTotal + 1);
+    LoguExitOnFailure(hr, "Failed to allocate pre-init log data.");
+
+    cchData = lstrlenA(szDropped);
+    memcpy(sczData, szDropped, cchData);
+
+    for (LOGUTIL_PREINIT_CHUNK* pChunk = LogUtil_pPreInitHead; pChunk; pChunk = pChunk->pNext)
+    {
+        memcpy(sczData + cchData, pChunk + 1, pChunk->cbData);
+        cchData += pChunk->cbData;
+    }
+
+    sczData[cchData] = '\0';
+
+    // Anything logged while writing it goes straight to the log.
+    LogPreInitFree();
+
+    hr = LogStringWorkRaw(sczData);
+    LoguExitOnFailure(hr, "Failed to write pre-init log data.");
+
+LExit:
+    ReleaseStr(sczData);
+
+    return hr;
+}
+
+
+static void LogPreInitFree()
+{
+    LOGUTIL_PREINIT_CHUNK* pChunk = LogUtil_pPreInitHead;
+
+    while (pChunk)
+    {
+        LOGUTIL_PREINIT_CHUNK* pNext = pChunk->pNext;
+
+        MemFree(pChunk);
+        pChunk = pNext;
+    }
+
+    LogUtil_pPreInitHead = NULL;
+    LogUtil_pPreInitTail = NULL;
+    LogUtil_cbPreInit = 0;
+    LogUtil_cPreInitDroppedLines = 0;
+}
+
+
+static void LogRotationReset(
+    __in LOGUTIL_ROTATION* pRotation
+    )
+{
+    LONGLONG llSize = 0;
+
+    if (INVALID_HANDLE_VALUE != LogUtil_hLog && SUCCEEDED(FileSizeByHandle(LogUtil_hLog, &llSize)))
+    {
+        pRotation->cbLog = static_cast<DWORD64>(llSize);
+    }
+    else
+    {
+        pRotation->cbLog = 0;
+    }
+
+    pRotation->ullStarted = ::GetTickCount64();
+    pRotation->fLost = FALSE;
+}
+
+
+static BOOL LogRotationDue(
+    __in LOGUTIL_ROTATION* pRotation
+    )
+{
+    if (pRotation->cbMaxSize && pRotation->cbMaxSize <= pRotation->cbLog)
+    {
+        return TRUE;
+    }
+
+    return pRotation->dwMaxAgeSeconds && 1000ULL * pRotation->dwMaxAgeSeconds <= ::GetTickCount64() - pRotation->ullStarted;
+}
+
+
+static HRESULT LogRotate(
+    __in LOGUTIL_ROTATION* pRotation
+    )
+{
+    HRESULT hr = S_OK;
+    HRESULT hrMove = S_OK;
+    HRESULT hrQueue = S_OK;
+    BOOL fMoved = FALSE;
+    LPWSTR sczSegment = NULL;
+
+    pRotation->dwSequence = (pRotation->dwSequence + 1) % LOGUTIL_ROTATION_SEQUENCE_LIMIT;
+
+    hr = LogRotationSegmentPath(LogUtil_sczLogPath, pRotation->dwSequence, &sczSegment);
+    LoguExitOnFailure(hr, "Failed to get path for rotated log.");
+
+    ReleaseFileHandle(LogUtil_hLog);
+
+    hrMove = FileEnsureMove(LogUtil_sczLogPath, sczSegment, FALSE, FALSE);
+    fMoved = SUCCEEDED(hrMove);
+
+    hr = LogRotationOpenLog();
+    if (FAILED(hr) && fMoved && SUCCEEDED(FileEnsureMove(sczSegment, LogUtil_sczLogPath, FALSE, FALSE)))
+    {
+        // Without a new log, put the segment back and keep appending to it rather than losing the log.
+        fMoved = FALSE;
+        hrMove = hr;
+
+        hr = LogRotationOpenLog();
+    }
+
+    if (fMoved)
+    {
+        // The segment is finished whatever happens to the new log, so it is always compressed and pruned.
+        hrQueue = LogRotationQueueSegment(pRotation, sczSegment);
+    }
+
+    pRotation->fLost = FAILED(hr);
+    LoguExitOnFailure(hr, "Failed to open log file after rotating: %ls", LogUtil_sczLogPath);
+
+    if (!fMoved)
+    {
+        // Keep appending to the file that could not be moved until the next limit.
+        pRotation->cbLog = 0;
+        pRotation->ullStarted = ::GetTickCount64();
+
+        hr = hrMove;
+        LoguExitOnFailure(hr, "Failed to move log to: %ls", sczSegment);
+    }
+
+    hr = LogRotationStartLog(pRotation);
+    LoguExitOnFailure(hr, "Failed to start rotated log: %ls", LogUtil_sczLogPath);
+
+    hr = hrQueue;
+    LoguExitOnFailure(hr, "Failed to queue rotated log: %ls", sczSegment);
+
+LExit:
+    ReleaseStr(sczSegment);
+
+    return hr;
+}
+
+
+static HRESULT LogRotationOpenLog()
+{
+    HRESULT hr = S_OK;
+
+    if (LogUtil_pfnRotationOpen)
+    {
+        hr = LogUtil_pfnRotationOpen(LogUtil_sczLogPath, LogUtil_pvRotationOpenContext);
+        LoguExitOnFailure(hr, "Log rotation open callback failed for: %ls", LogUtil_sczLogPath);
+    }
+
+    LogUtil_hLog = ::CreateFileW(LogUtil_sczLogPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == LogUtil_hLog)
+    {
+        LoguExitWithLastError(hr, "failed to create log file: %ls", LogUtil_sczLogPath);
+    }
+
+    // A log that could not be rotated away is appended to.
+    if (INVALID_SET_FILE_POINTER == ::SetFilePointer(LogUtil_hLog, 0, NULL, FILE_END))
+    {
+        LoguExitWithLastError(hr, "failed to seek to end of log file: %ls", LogUtil_sczLogPath);
+    }
+
+LExit:
+    if (FAILED(hr))
+    {
+        ReleaseFileHandle(LogUtil_hLog);
+    }
+
+    return hr;
+}
+
+
+// Lines are formatted as binary records once a binary log is open, and still while a rotated one
+// is lost so the records buffered meanwhile can be written to it as they are.
+static BOOL LogBinaryFormatting()
+{
+    return LOG_FORMAT_BINARY == LogUtil_format && (INVALID_HANDLE_VALUE != LogUtil_hLog || (LogUtil_pRotation && LogUtil_pRotation->fLost));
+}
+
+
+static HRESULT LogRotationStartLog(
+    __in LOGUTIL_ROTATION* pRotation
+    )
+{
+    HRESULT hr = S_OK;
+
+    LogRotationReset(pRotation);
+
+    if (LOG_FORMAT_BINARY == LogUtil_format)
+    {
+        // Lines already formatted may use any id, so every segment starts with all of them.
+        hr = LogBinaryWriteSession();
+        LoguExitOnFailure(hr, "Failed to start rotated binary log: %ls", LogUtil_sczLogPath);
+
+        hr = LogBinaryWriteIds();
+        LoguExitOnFailure(hr, "Failed to write ids to rotated binary log: %ls", LogUtil_sczLogPath);
+    }
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogRotationRecover(
+    __in LOGUTIL_ROTATION* pRotation
+    )
+{
+    HRESULT hr = S_OK;
+    CHAR rgchDropped[sizeof(LOG_BINARY_RECORD) + 64] = { };
+    DWORD cbHeader = 0;
+    DWORD cbDropped = 0;
+
+    hr = LogRotationOpenLog();
+    LoguExitOnFailure(hr, "Failed to open log file lost rotating: %ls", LogUtil_sczLogPath);
+
+    hr = LogRotationStartLog(pRotation);
+    LoguExitOnFailure(hr, "Failed to start log file lost rotating: %ls", LogUtil_sczLogPath);
+
+    // What was logged while there was no log file goes in first, straight to the file since this
+    // may be the thread that drains the queue. Binary logs kept formatting records meanwhile, so
+    // only the count of lines that did not fit needs a text record of its own.
+    if (LogUtil_cPreInitDroppedLines)
+    {
+        cbHeader = (LOG_FORMAT_BINARY == LogUtil_format) ? sizeof(LOG_BINARY_RECORD) : 0;
+
+        hr = ::StringCchPrintfA(rgchDropped + cbHeader, countof(rgchDropped) - cbHeader, "=== Logging dropped %u lines ===\r\n", LogUtil_cPreInitDroppedLines);
+        LoguExitOnFailure(hr, "Failed to format dropped line count.");
+
+        cbDropped = cbHeader + lstrlenA(rgchDropped + cbHeader);
+
+        if (cbHeader)
+        {
+            reinterpret_cast<LOG_BINARY_RECORD*>(rgchDropped)->bType = LOG_BINARY_RECORD_TYPE_TEXT;
+            reinterpret_cast<LOG_BINARY_RECORD*>(rgchDropped)->cbData = cbDropped - cbHeader;
+        }
+
+        hr = LogWriteFileData(rgchDropped, cbDropped);
+        LoguExitOnFailure(hr, "Failed to write count of lines dropped while the log was lost.");
+    }
+
+    for (LOGUTIL_PREINIT_CHUNK* pChunk = LogUtil_pPreInitHead; pChunk; pChunk = pChunk->pNext)
+    {
+        hr = LogWriteFileData(reinterpret_cast<LPCSTR>(pChunk + 1), pChunk->cbData);
+        LoguExitOnFailure(hr, "Failed to write lines logged while the log was lost.");
+    }
+
+    LogPreInitFree();
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogRotationSegmentPath(
+    __in_z LPCWSTR wzLogPath,
+    __in DWORD dwSequence,
+    __deref_out_z LPWSTR* psczSegment
+    )
+{
+    HRESULT hr = S_OK;
+    LPCWSTR wzExtension = PathExtension(PathFile(wzLogPath));
+    SYSTEMTIME st = { };
+
+    if (!wzExtension)
+    {
+        wzExtension = wzLogPath + lstrlenW(wzLogPath);
+    }
+
+    ::GetLocalTime(&st);
+
+    // Names sort in the order the segments were rotated.
+    hr = StrAllocFormatted(psczSegment, L"%.*ls.%04u%02u%02u%02u%02u%02u.%04u%ls", static_cast<int>(wzExtension - wzLogPath), wzLogPath, st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, dwSequence, wzExtension);
+    LoguExitOnFailure(hr, "Failed to format rotated log path.");
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogRotationQueueSegment(
+    __in LOGUTIL_ROTATION* pRotation,
+    __in_z LPCWSTR wzSegment
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fEnteredCriticalSection = FALSE;
+    LOGUTIL_ROTATED_SEGMENT segment = { };
+
+    hr = StrAllocString(&segment.sczSegment, wzSegment, 0);
+    LoguExitOnFailure(hr, "Failed to copy rotated log path.");
+
+    hr = StrAllocString(&segment.sczLogPath, LogUtil_sczLogPath, 0);
+    LoguExitOnFailure(hr, "Failed to copy log path.");
+
+    segment.cKeep = pRotation->cKeep;
+    segment.fCompress = pRotation->fCompress;
+
+    ::EnterCriticalSection(&pRotation->csPending);
+    fEnteredCriticalSection = TRUE;
+
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pRotation->rgPending), pRotation->cPending + 1, sizeof(LOGUTIL_ROTATED_SEGMENT), 4);
+    LoguExitOnFailure(hr, "Failed to grow pending rotated logs.");
+
+    pRotation->rgPending[pRotation->cPending] = segment;
+    ++pRotation->cPending;
+
+    segment.sczSegment = NULL;
+    segment.sczLogPath = NULL;
+
+    ::SetEvent(pRotation->hWorkEvent);
+
+LExit:
+    if (fEnteredCriticalSection)
+    {
+        ::LeaveCriticalSection(&pRotation->csPending);
+    }
+
+    ReleaseStr(segment.sczSegment);
+    ReleaseStr(segment.sczLogPath);
+
+    return hr;
+}
+
+
+static DWORD WINAPI LogRotationThread(
+    __in LPVOID pvContext
+    )
+{
+    LOGUTIL_ROTATION* pRotation = static_cast<LOGUTIL_ROTATION*>(pvContext);
+    LOGUTIL_ROTATED_SEGMENT* rgSegments = NULL;
+    DWORD cSegments = 0;
+    BOOL fStop = FALSE;
+
+    do
+    {
+        ::WaitForSingleObject(pRotation->hWorkEvent, INFINITE);
+
+        // Read the flag before taking the pending segments so everything rotated before the stop is finished.
+        fStop = pRotation->fStop;
+
+        ::EnterCriticalSection(&pRotation->csPending);
+
+        rgSegments = pRotation->rgPending;
+        cSegments = pRotation->cPending;
+        pRotation->rgPending = NULL;
+        pRotation->cPending = 0;
+
+        ::LeaveCriticalSection(&pRotation->csPending);
+
+        for (DWORD i = 0; i < cSegments; ++i)
+        {
+            LogRotationFinishSegment(rgSegments + i);
+        }
+
+        LogRotationFreeSegments(rgSegments, cSegments);
+        rgSegments = NULL;
+    } while (!fStop);
+
+    return 0;
+}
+
+
+static HRESULT LogRotationFinishSegment(
+    __in LOGUTIL_ROTATED_SEGMENT* pSegment
+    )
+{
+    HRESULT hr = S_OK;
+
+    // Pruning after an earlier segment may already have deleted this one when more than cKeep
+    // rotated at once.
+    if (pSegment->fCompress && FileExistsEx(pSegment->sczSegment, NULL))
+    {
+        hr = PathCompress(pSegment->sczSegment);
+        LoguExitOnFailure(hr, "Failed to compress rotated log: %ls", pSegment->sczSegment);
+    }
+
+    hr = LogRotationPrune(pSegment->sczLogPath, pSegment->cKeep);
+    LoguExitOnFailure(hr, "Failed to delete old logs of: %ls", pSegment->sczLogPath);
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogRotationPrune(
+    __in_z LPCWSTR wzLogPath,
+    __in DWORD cKeep
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD er = ERROR_SUCCESS;
+    LPCWSTR wzFile = PathFile(wzLogPath);
+    LPCWSTR wzExtension = PathExtension(wzFile);
+    LPWSTR sczDirectory = NULL;
+    LPWSTR sczFind = NULL;
+    LPWSTR sczPath = NULL;
+    LPWSTR* rgsczSegments = NULL;
+    UINT cSegments = 0;
+    HANDLE hFind = INVALID_HANDLE_VALUE;
+    WIN32_FIND_DATAW wfd = { };
+
+    if (!cKeep)
+    {
+        ExitFunction();
+    }
+
+    if (!wzExtension)
+    {
+        wzExtension = wzFile + lstrlenW(wzFile);
+    }
+
+    hr = PathGetDirectory(wzLogPath, &sczDirectory);
+    LoguExitOnFailure(hr, "Failed to get log directory.");
+
+    hr = StrAllocFormatted(&sczFind, L"%.*ls.*", static_cast<int>(wzExtension - wzLogPath), wzLogPath);
+    LoguExitOnFailure(hr, "Failed to format rotated log search.");
+
+    hFind = ::FindFirstFileW(sczFind, &wfd);
+    if (INVALID_HANDLE_VALUE == hFind)
+    {
+        er = ::GetLastError();
+        if (ERROR_FILE_NOT_FOUND == er)
+        {
+            ExitFunction();
+        }
+
+        LoguExitOnWin32Error(er, hr, "Failed to find rotated logs: %ls", sczFind);
+    }
+
+    do
+    {
+        if (!(FILE_ATTRIBUTE_DIRECTORY & wfd.dwFileAttributes) && LogRotationIsSegment(wfd.cFileName, wzFile, static_cast<DWORD>(wzExtension - wzFile), wzExtension))
+        {
+            hr = StrArrayAllocString(&rgsczSegments, &cSegments, wfd.cFileName, 0);
+            LoguExitOnFailure(hr, "Failed to remember rotated log: %ls", wfd.cFileName);
+        }
+    } while (::FindNextFileW(hFind, &wfd));
+
+    if (cKeep < cSegments)
+    {
+        qsort_s(rgsczSegments, cSegments, sizeof(LPWSTR), LogRotationCompareSegments, NULL);
+
+        for (UINT i = 0; i < cSegments - cKeep; ++i)
+        {
+            hr = PathConcat(sczDirectory, rgsczSegments[i], &sczPath);
+            LoguExitOnFailure(hr, "Failed to combine rotated log path.");
+
+            hr = FileEnsureDelete(sczPath);
+            LoguExitOnFailure(hr, "Failed to delete rotated log: %ls", sczPath);
+        }
+    }
+
+LExit:
+    ReleaseFileFindHandle(hFind);
+    ReleaseStrArray(rgsczSegments, cSegments);
+    ReleaseStr(sczPath);
+    ReleaseStr(sczFind);
+    ReleaseStr(sczDirectory);
+
+    return hr;
+}
+
+
+// Matches the names LogRotationSegmentPath() gives: the stem, a dot and 14 digits of time, a dot
+// and 4 digits of sequence, then the extension.
+static BOOL LogRotationIsSegment(
+    __in_z LPCWSTR wzFile,
+    __in_ecount(cchStem) LPCWSTR wzStem,
+    __in DWORD cchStem,
+    __in_z LPCWSTR wzExtension
+    )
+{
+    LPCWSTR wz = wzFile + cchStem;
+
+    if (static_cast<DWORD>(lstrlenW(wzFile)) != cchStem + 20 + static_cast<DWORD>(lstrlenW(wzExtension)) ||
+        CSTR_EQUAL != ::CompareStringW(LOCALE_INVARIANT, NORM_IGNORECASE, wzFile, cchStem, wzStem, cchStem))
+    {
+        return FALSE;
+    }
+
+    for (DWORD i = 0; i < 20; ++i)
+    {
+        if ((0 == i || 15 == i) ? L'.' != wz[i] : (L'0' > wz[i] || L'9' < wz[i]))
+        {
+            return FALSE;
+        }
+    }
+
+    return CSTR_EQUAL == ::CompareStringW(LOCALE_INVARIANT, NORM_IGNORECASE, wz + 20, -1, wzExtension, -1);
+}
+
+
+static __callback int __cdecl LogRotationCompareSegments(
+    void* /*pvContext*/,
+    const void* pvLeft,
+    const void* pvRight
+    )
+{
+    return ::CompareStringW(LOCALE_INVARIANT, NORM_IGNORECASE, *static_cast<const LPCWSTR*>(pvLeft), -1, *static_cast<const LPCWSTR*>(pvRight), -1) - CSTR_EQUAL;
+}
+
+
+static void LogRotationFreeSegments(
+    __in_ecount_opt(cSegments) LOGUTIL_ROTATED_SEGMENT* rgSegments,
+    __in DWORD cSegments
+    )
+{
+    for (DWORD i = 0; i < cSegments; ++i)
+    {
+        ReleaseStr(rgSegments[i].sczSegment);
+        ReleaseStr(rgSegments[i].sczLogPath);
+    }
+
+    ReleaseMem(rgSegments);
+}
+
+
+static void LogRotationFree(
+    __in LOGUTIL_ROTATION* pRotation
+    )
+{
+    if (pRotation->hThread)
+    {
+        // The rotation thread finishes the pending segments before it exits.
+        pRotation->fStop = TRUE;
+        ::SetEvent(pRotation->hWorkEvent);
+        ::WaitForSingleObject(pRotation->hThread, INFINITE);
+    }
+
+    LogRotationFreeSegments(pRotation->rgPending, pRotation->cPending);
+    ReleaseHandle(pRotation->hThread);
+    ReleaseHandle(pRotation->hWorkEvent);
+    ::DeleteCriticalSection(&pRotation->csPending);
+    MemFree(pRotation);
+}
+
+
+static HRESULT LogBinaryWriteSession()
+{
+    HRESULT hr = S_OK;
+    BYTE rgbRecord[sizeof(LOG_BINARY_RECORD) + sizeof(LOG_BINARY_SESSION)] = { };
+    LOG_BINARY_RECORD* pRecord = reinterpret_cast<LOG_BINARY_RECORD*>(rgbRecord);
+    LOG_BINARY_SESSION* pSession = reinterpret_cast<LOG_BINARY_SESSION*>(pRecord + 1);
+    FILETIME ft = { };
+    FILETIME ftLocal = { };
+    ULARGE_INTEGER uli = { };
+    ULARGE_INTEGER uliLocal = { };
+
+    ::GetSystemTimeAsFileTime(&ft);
+    if (!::FileTimeToLocalFileTime(&ft, &ftLocal))
+    {
+        LoguExitWithLastError(hr, "Failed to get local time for binary log.");
+    }
+
+    uli.LowPart = ft.dwLowDateTime;
+    uli.HighPart = ft.dwHighDateTime;
+    uliLocal.LowPart = ftLocal.dwLowDateTime;
+    uliLocal.HighPart = ftLocal.dwHighDateTime;
+
+    pRecord->bType = LOG_BINARY_RECORD_TYPE_SESSION;
+    pRecord->cbData = sizeof(LOG_BINARY_SESSION);
+    pSession->dwMagic = LOG_BINARY_MAGIC;
+    pSession->wVersion = LOG_BINARY_VERSION;
+    pSession->dwProcessId = ::GetCurrentProcessId();
+
+    // Lines keep this bias if daylight saving time starts or ends while the log is open.
+    pSession->llLocalTimeBias = static_cast<LONGLONG>(uliLocal.QuadPart - uli.QuadPart);
+
+    hr = LogWriteFileData(reinterpret_cast<LPCSTR>(rgbRecord), sizeof(rgbRecord));
+    LoguExitOnFailure(hr, "Failed to write binary log session.");
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryWriteIds()
+{
+    HRESULT hr = S_OK;
+    LOGUTIL_LINE_BUFFERS localBuffers = { };
+    LOGUTIL_LINE_BUFFERS* pBuffers = LogAcquireLineBuffers(&localBuffers);
+
+    ::EnterCriticalSection(&LogUtil_csBinary);
+
+    for (DWORD i = 0; SUCCEEDED(hr) && i < LogUtil_cBinaryTemplates; ++i)
+    {
+        if (!LogUtil_rgpBinaryTemplates[i]->fText)
+        {
+            hr = LogBinaryAppendIdRecord(pBuffers, LOG_BINARY_RECORD_TYPE_TEMPLATE, LogUtil_rgpBinaryTemplates[i]);
+        }
+    }
+
+    for (DWORD i = 0; SUCCEEDED(hr) && i < LogUtil_cBinaryModules; ++i)
+    {
+        if (LogUtil_rgpBinaryModules[i]->dwId)
+        {
+            hr = LogBinaryAppendIdRecord(pBuffers, LOG_BINARY_RECORD_TYPE_MODULE, LogUtil_rgpBinaryModules[i]);
+        }
+    }
+
+    ::LeaveCriticalSection(&LogUtil_csBinary);
+    LoguExitOnFailure(hr, "Failed to add binary log ids.");
+
+    if (pBuffers->cbRecord)
+    {
+        hr = LogWriteFileData(reinterpret_cast<LPCSTR>(pBuffers->pbRecord), pBuffers->cbRecord);
+        LoguExitOnFailure(hr, "Failed to write binary log ids.");
+    }
+
+LExit:
+    LogReleaseLineBuffers(pBuffers, &localBuffers);
+
+    return hr;
+}
+
+
+static void LogBinaryResetIds()
+{
+    ::EnterCriticalSection(&LogUtil_csBinary);
+
+    for (DWORD i = 0; i < LogUtil_cBinaryTemplates; ++i)
+    {
+        ::InterlockedExchange(&LogUtil_rgpBinaryTemplates[i]->fWritten, FALSE);
+    }
+
+    for (DWORD i = 0; i < LogUtil_cBinaryModules; ++i)
+    {
+        ::InterlockedExchange(&LogUtil_rgpBinaryModules[i]->fWritten, FALSE);
+    }
+
+    ::LeaveCriticalSection(&LogUtil_csBinary);
+}
+
+
+static void LogBinaryFreeIds()
+{
+    if (LogUtil_sdBinaryTemplates)
+    {
+        DictDestroy(LogUtil_sdBinaryTemplates);
+        LogUtil_sdBinaryTemplates = NULL;
+    }
+
+    for (DWORD i = 0; i < LogUtil_cBinaryTemplates; ++i)
+    {
+        ReleaseStr(LogUtil_rgpBinaryTemplates[i]->sczKey);
+        MemFree(LogUtil_rgpBinaryTemplates[i]);
+    }
+
+    for (DWORD i = 0; i < LogUtil_cBinaryModules; ++i)
+    {
+        ReleaseStr(LogUtil_rgpBinaryModules[i]->sczKey);
+        MemFree(LogUtil_rgpBinaryModules[i]);
+    }
+
+    ReleaseNullMem(LogUtil_rgpBinaryTemplates);
+    ReleaseNullMem(LogUtil_rgpBinaryModules);
+    LogUtil_cBinaryTemplates = 0;
+    LogUtil_cBinaryModules = 0;
+    LogUtil_dwBinaryLastId = 0;
+}
+
+
+static HRESULT LogBinaryGetTemplate(
+    __in_z LPCWSTR wzFormat,
+    __out LOGUTIL_BINARY_ID** ppTemplate
+    )
+{
+    HRESULT hr = S_OK;
+    BOOL fEnteredCriticalSection = FALSE;
+    LOGUTIL_BINARY_ID* pTemplate = NULL;
+    LOGUTIL_FORMAT_SPEC spec = { };
+
+    hr = DictGetValue(LogUtil_sdBinaryTemplates, wzFormat, reinterpret_cast<void**>(ppTemplate));
+    if (E_NOTFOUND != hr)
+    {
+        LoguExitOnFailure(hr, "Failed to find log template.");
+        ExitFunction();
+    }
+
+    ::EnterCriticalSection(&LogUtil_csBinary);
+    fEnteredCriticalSection = TRUE;
+
+    // Another thread may have added it while this one waited.
+    hr = DictGetValue(LogUtil_sdBinaryTemplates, wzFormat, reinterpret_cast<void**>(ppTemplate));
+    if (E_NOTFOUND != hr)
+    {
+        LoguExitOnFailure(hr, "Failed to find log template.");
+        ExitFunction();
+    }
+
+    pTemplate = static_cast<LOGUTIL_BINARY_ID*>(MemAlloc(sizeof(LOGUTIL_BINARY_ID), TRUE));
+    LoguExitOnNull(pTemplate, hr, E_OUTOFMEMORY, "Failed to allocate log template.");
+
+    hr = StrAllocString(&pTemplate->sczKey, wzFormat, 0);
+    LoguExitOnFailure(hr, "Failed to copy log template.");
+
+    // Formats with a conversion the encoder does not handle, and any past the last id, are
+    // logged as text.
+    if (LOGUTIL_BINARY_MAX_ID <= LogUtil_dwBinaryLastId)
+    {
+        pTemplate->fText = TRUE;
+    }
+
+    for (LPCWSTR wz = wcschr(wzFormat, L'%'); wz && !pTemplate->fText; wz = wcschr(wz + spec.cch, L'%'))
+    {
+        pTemplate->fText = FAILED(LogParseFormatSpec(wz, &spec));
+    }
+
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&LogUtil_rgpBinaryTemplates), LogUtil_cBinaryTemplates + 1, sizeof(LOGUTIL_BINARY_ID*), LOGUTIL_LINE_BUFFER_INCREMENT);
+    LoguExitOnFailure(hr, "Failed to grow log template array.");
+
+    if (!pTemplate->fText)
+    {
+        pTemplate->dwId = ++LogUtil_dwBinaryLastId;
+    }
+
+    hr = DictAddValue(LogUtil_sdBinaryTemplates, pTemplate);
+    LoguExitOnFailure(hr, "Failed to add log template.");
+
+    LogUtil_rgpBinaryTemplates[LogUtil_cBinaryTemplates] = pTemplate;
+    ++LogUtil_cBinaryTemplates;
+
+    *ppTemplate = pTemplate;
+    pTemplate = NULL;
+
+LExit:
+    if (fEnteredCriticalSection)
+    {
+        ::LeaveCriticalSection(&LogUtil_csBinary);
+    }
+
+    if (pTemplate)
+    {
+        ReleaseStr(pTemplate->sczKey);
+        MemFree(pTemplate);
+    }
+
+    return hr;
+}
+
+
+static HRESULT LogBinaryGetModule(
+    __in HMODULE hModule,
+    __out LOGUTIL_BINARY_ID** ppModule
+    )
+{
+    HRESULT hr = S_OK;
+    WCHAR wzPath[MAX_PATH];
+    LOGUTIL_BINARY_ID* pModule = NULL;
+
+    ::EnterCriticalSection(&LogUtil_csBinary);
+
+    for (DWORD i = 0; i < LogUtil_cBinaryModules; ++i)
+    {
+        if (hModule == LogUtil_rgpBinaryModules[i]->hModule)
+        {
+            *ppModule = LogUtil_rgpBinaryModules[i];
+            ExitFunction();
+        }
+    }
+
+    if (!::GetModuleFileNameW(hModule, wzPath, countof(wzPath)))
+    {
+        LoguExitWithLastError(hr, "Failed to get path of log module.");
+    }
+
+    pModule = static_cast<LOGUTIL_BINARY_ID*>(MemAlloc(sizeof(LOGUTIL_BINARY_ID), TRUE));
+    LoguExitOnNull(pModule, hr, E_OUTOFMEMORY, "Failed to allocate log module.");
+
+    hr = StrAllocString(&pModule->sczKey, wzPath, 0);
+    LoguExitOnFailure(hr, "Failed to copy log module path.");
+
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&LogUtil_rgpBinaryModules), LogUtil_cBinaryModules + 1, sizeof(LOGUTIL_BINARY_ID*), LOGUTIL_LINE_BUFFER_INCREMENT);
+    LoguExitOnFailure(hr, "Failed to grow log module array.");
+
+    // Modules past the last id are logged without one.
+    pModule->hModule = hModule;
+    pModule->dwId = (LOGUTIL_BINARY_MAX_ID > LogUtil_dwBinaryLastId) ? ++LogUtil_dwBinaryLastId : 0;
+
+    LogUtil_rgpBinaryModules[LogUtil_cBinaryModules] = pModule;
+    ++LogUtil_cBinaryModules;
+
+    *ppModule = pModule;
+    pModule = NULL;
+
+LExit:
+    ::LeaveCriticalSection(&LogUtil_csBinary);
+
+    if (pModule)
+    {
+        ReleaseStr(pModule->sczKey);
+        MemFree(pModule);
+    }
+
+    return hr;
+}
+
+
+static HRESULT LogBinaryStringWorkArgs(
+    __in REPORT_LEVEL rl,
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in va_list args,
+    __in BOOL fLOGUTIL_NEWLINE
+    )
+{
+    HRESULT hr = S_OK;
+    LOGUTIL_BINARY_ID* pTemplate = NULL;
+    LOGUTIL_BINARY_ID* pDefinedId = NULL;
+    DWORD iLine = 0;
+
+    hr = LogBinaryGetTemplate(pBuffers->pwzFormat, &pTemplate);
+    LoguExitOnFailure(hr, "Failed to get log template.");
+
+    if (pTemplate->fText)
+    {
+        hr = StrBuilderAppendFormattedArgs(&pBuffers->line, pBuffers->pwzFormat, args);
+        LoguExitOnFailure(hr, "Failed to format message: \"%ls\"", pBuffers->pwzFormat);
+
+        hr = LogBinaryBeginLine(pBuffers, rl, 0, 0, 0, fLOGUTIL_NEWLINE, &iLine);
+        LoguExitOnFailure(hr, "Failed to add binary log line.");
+
+        hr = LogBinaryAppendString(pBuffers, pBuffers->line.sczString, pBuffers->line.cch);
+        LoguExitOnFailure(hr, "Failed to add message to binary log line.");
+    }
+    else
+    {
+        // Another thread may be defining the same template, decoders keep whichever comes last.
+        if (!pTemplate->fWritten)
+        {
+            hr = LogBinaryAppendIdRecord(pBuffers, LOG_BINARY_RECORD_TYPE_TEMPLATE, pTemplate);
+            LoguExitOnFailure(hr, "Failed to add binary log template.");
+
+            pDefinedId = pTemplate;
+        }
+
+        hr = LogBinaryBeginLine(pBuffers, rl, 0, 0, pTemplate->dwId, fLOGUTIL_NEWLINE, &iLine);
+        LoguExitOnFailure(hr, "Failed to add binary log line.");
+
+        hr = LogBinaryAppendArgs(pBuffers, pBuffers->pwzFormat, args);
+        LoguExitOnFailure(hr, "Failed to add arguments to binary log line.");
+    }
+
+    hr = LogBinaryWriteRecords(rl, pBuffers, iLine, pDefinedId);
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryStringWork(
+    __in REPORT_LEVEL rl,
+    __in DWORD dwLogId,
+    __in_opt HMODULE hModule,
+    __in_z LPCWSTR wzString,
+    __in BOOL fLOGUTIL_NEWLINE,
+    __in LOGUTIL_LINE_BUFFERS* pBuffers
+    )
+{
+    HRESULT hr = S_OK;
+    LOGUTIL_BINARY_ID* pModule = NULL;
+    LOGUTIL_BINARY_ID* pDefinedId = NULL;
+    DWORD iLine = 0;
+
+    if (hModule)
+    {
+        hr = LogBinaryGetModule(hModule, &pModule);
+        LoguExitOnFailure(hr, "Failed to get log module.");
+
+        if (pModule->dwId && !pModule->fWritten)
+        {
+            hr = LogBinaryAppendIdRecord(pBuffers, LOG_BINARY_RECORD_TYPE_MODULE, pModule);
+            LoguExitOnFailure(hr, "Failed to add binary log module.");
+
+            pDefinedId = pModule;
+        }
+    }
+
+    hr = LogBinaryBeginLine(pBuffers, rl, dwLogId, pModule ? pModule->dwId : 0, 0, fLOGUTIL_NEWLINE, &iLine);
+    LoguExitOnFailure(hr, "Failed to add binary log line.");
+
+    hr = LogBinaryAppendString(pBuffers, wzString, lstrlenW(wzString));
+    LoguExitOnFailure(hr, "Failed to add message to binary log line.");
+
+    hr = LogBinaryWriteRecords(rl, pBuffers, iLine, pDefinedId);
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryWriteRecords(
+    __in REPORT_LEVEL rl,
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in DWORD iLine,
+    __in_opt LOGUTIL_BINARY_ID* pDefinedId
+    )
+{
+    HRESULT hr = S_OK;
+
+    LogBinaryEndRecord(pBuffers, iLine);
+
+    hr = LogWriteBytes(rl, reinterpret_cast<LPCSTR>(pBuffers->pbRecord), pBuffers->cbRecord, NULL != pDefinedId);
+    LoguExitOnFailure(hr, "Failed to write binary log records.");
+
+    // Lines from other threads can use the id now that its definition is ahead of them.
+    if (pDefinedId && S_OK == hr)
+    {
+        ::InterlockedExchange(&pDefinedId->fWritten, TRUE);
+    }
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryAppend(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in_bcount(cbData) const void* pvData,
+    __in DWORD cbData
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cbRecord = 0;
+
+    hr = ::DWordAdd(pBuffers->cbRecord, cbData, &cbRecord);
+    LoguExitOnRootFailure(hr, "Binary log line is too long.");
+
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pBuffers->pbRecord), cbRecord, sizeof(BYTE), LOGUTIL_LINE_BUFFER_INCREMENT);
+    LoguExitOnFailure(hr, "Failed to grow binary log buffer.");
+
+    memcpy(pBuffers->pbRecord + pBuffers->cbRecord, pvData, cbData);
+    pBuffers->cbRecord = cbRecord;
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryAppendValue(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in LOG_BINARY_ARG_TYPE type,
+    __in_bcount(cbValue) const void* pvValue,
+    __in DWORD cbValue
+    )
+{
+    HRESULT hr = S_OK;
+    BYTE bType = static_cast<BYTE>(type);
+
+    hr = LogBinaryAppend(pBuffers, &bType, sizeof(bType));
+    LoguExitOnFailure(hr, "Failed to add binary log argument type.");
+
+    hr = LogBinaryAppend(pBuffers, pvValue, cbValue);
+    LoguExitOnFailure(hr, "Failed to add binary log argument.");
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryBeginRecord(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in LOG_BINARY_RECORD_TYPE type,
+    __out DWORD* piRecord
+    )
+{
+    LOG_BINARY_RECORD record = { static_cast<BYTE>(type), 0 };
+
+    *piRecord = pBuffers->cbRecord;
+
+    return LogBinaryAppend(pBuffers, &record, sizeof(record));
+}
+
+
+static void LogBinaryEndRecord(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in DWORD iRecord
+    )
+{
+    LOG_BINARY_RECORD* pRecord = reinterpret_cast<LOG_BINARY_RECORD*>(pBuffers->pbRecord + iRecord);
+
+    pRecord->cbData = pBuffers->cbRecord - iRecord - sizeof(LOG_BINARY_RECORD);
+}
+
+
+static HRESULT LogBinaryAppendIdRecord(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in LOG_BINARY_RECORD_TYPE type,
+    __in LOGUTIL_BINARY_ID* pId
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD iRecord = 0;
+    DWORD cbUtf8 = 0;
+
+    hr = LogBinaryBeginRecord(pBuffers, type, &iRecord);
+    LoguExitOnFailure(hr, "Failed to add binary log record.");
+
+    hr = LogBinaryAppend(pBuffers, &pId->dwId, sizeof(pId->dwId));
+    LoguExitOnFailure(hr, "Failed to add binary log id.");
+
+    hr = LogBinaryAppendUtf8(pBuffers, pId->sczKey, lstrlenW(pId->sczKey), &cbUtf8);
+    LoguExitOnFailure(hr, "Failed to add binary log id definition.");
+
+    LogBinaryEndRecord(pBuffers, iRecord);
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryBeginLine(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in REPORT_LEVEL rl,
+    __in DWORD dwLogId,
+    __in DWORD dwModuleId,
+    __in DWORD dwTemplateId,
+    __in BOOL fLOGUTIL_NEWLINE,
+    __out DWORD* piLine
+    )
+{
+    HRESULT hr = S_OK;
+    LOG_BINARY_LINE line = { };
+    FILETIME ft = { };
+
+    ::GetSystemTimeAsFileTime(&ft);
+
+    line.ullTime = (static_cast<ULONGLONG>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    line.dwThreadId = ::GetCurrentThreadId();
+    line.bLevel = static_cast<BYTE>(rl);
+    line.bFlags = static_cast<BYTE>(fLOGUTIL_NEWLINE ? LOG_BINARY_LINE_FLAG_NEWLINE : LOG_BINARY_LINE_FLAG_NONE);
+    line.dwLogId = dwLogId;
+    line.dwModuleId = dwModuleId;
+    line.dwTemplateId = dwTemplateId;
+
+    hr = LogBinaryBeginRecord(pBuffers, LOG_BINARY_RECORD_TYPE_LINE, piLine);
+    LoguExitOnFailure(hr, "Failed to add binary log record.");
+
+    hr = LogBinaryAppend(pBuffers, &line, sizeof(line));
+    LoguExitOnFailure(hr, "Failed to add binary log line.");
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryAppendUtf8(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch,
+    __out DWORD* pcbUtf8
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cbMax = 0;
+    DWORD cbUtf8 = 0;
+
+    *pcbUtf8 = 0;
+
+    if (!cch)
+    {
+        ExitFunction();
+    }
+
+    // Each UTF-16 character needs at most three bytes, so size for that and convert in one pass.
+    if ((DWORD_MAX - pBuffers->cbRecord) / 3 <= cch)
+    {
+        hr = E_INVALIDARG;
+        LoguExitOnRootFailure(hr, "Binary log string is too long.");
+    }
+
+    cbMax = static_cast<DWORD>(cch * 3);
+
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pBuffers->pbRecord), pBuffers->cbRecord + cbMax, sizeof(BYTE), LOGUTIL_LINE_BUFFER_INCREMENT);
+    LoguExitOnFailure(hr, "Failed to grow binary log buffer.");
+
+    cbUtf8 = ::WideCharToMultiByte(CP_UTF8, 0, wz, static_cast<int>(cch), reinterpret_cast<LPSTR>(pBuffers->pbRecord + pBuffers->cbRecord), cbMax, NULL, NULL);
+    if (!cbUtf8)
+    {
+        LoguExitWithLastError(hr, "Failed to convert binary log string to UTF-8.");
+    }
+
+    pBuffers->cbRecord += cbUtf8;
+    *pcbUtf8 = cbUtf8;
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryAppendString(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in_ecount(cch) LPCWSTR wz,
+    __in SIZE_T cch
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cbUtf8 = 0;
+    DWORD iLength = 0;
+
+    hr = LogBinaryAppendValue(pBuffers, LOG_BINARY_ARG_TYPE_STRING, &cbUtf8, sizeof(cbUtf8));
+    LoguExitOnFailure(hr, "Failed to add binary log string length.");
+
+    iLength = pBuffers->cbRecord - sizeof(cbUtf8);
+
+    hr = LogBinaryAppendUtf8(pBuffers, wz, cch, &cbUtf8);
+    LoguExitOnFailure(hr, "Failed to add binary log string.");
+
+    memcpy(pBuffers->pbRecord + iLength, &cbUtf8, sizeof(cbUtf8));
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryAppendArgs(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in_z LPCWSTR wzFormat,
+    __in va_list args
+    )
+{
+    HRESULT hr = S_OK;
+    LOGUTIL_FORMAT_SPEC spec = { };
+    LPCWSTR wz = wcschr(wzFormat, L'%');
+    int nValue = 0;
+    LONGLONG llValue = 0;
+    double dValue = 0;
+    LPCWSTR wzValue = NULL;
+    LPCSTR szValue = NULL;
+    SIZE_T cchValue = 0;
+    int cchWide = 0;
+
+    while (wz)
+    {
+        hr = LogParseFormatSpec(wz, &spec);
+        LoguExitOnFailure(hr, "Failed to parse log format: %ls", wzFormat);
+
+        wz = wcschr(wz + spec.cch, L'%');
+
+        if (spec.fWidthStar)
+        {
+            nValue = va_arg(args, int);
+
+            hr = LogBinaryAppendValue(pBuffers, LOG_BINARY_ARG_TYPE_INT32, &nValue, sizeof(nValue));
+            LoguExitOnFailure(hr, "Failed to add log width.");
+        }
+
+        if (spec.fPrecisionStar)
+        {
+            nValue = va_arg(args, int);
+
+            hr = LogBinaryAppendValue(pBuffers, LOG_BINARY_ARG_TYPE_INT32, &nValue, sizeof(nValue));
+            LoguExitOnFailure(hr, "Failed to add log precision.");
+
+            // A negative precision is the same as none.
+            spec.fPrecision = 0 <= nValue;
+            spec.dwPrecision = static_cast<DWORD>(nValue);
+        }
+
+        switch (spec.arg)
+        {
+        case LOGUTIL_FORMAT_ARG_NONE:
+            break;
+
+        case LOGUTIL_FORMAT_ARG_INTEGER:
+            if (LOGUTIL_FORMAT_LENGTH_LONGLONG == spec.length || LOGUTIL_FORMAT_LENGTH_SIZE == spec.length)
+            {
+                if (LOGUTIL_FORMAT_LENGTH_LONGLONG == spec.length)
+                {
+                    llValue = va_arg(args, LONGLONG);
+                }
+                else
+                {
+                    llValue = spec.fSigned ? va_arg(args, INT_PTR) : static_cast<LONGLONG>(va_arg(args, UINT_PTR));
+                }
+
+                hr = LogBinaryAppendValue(pBuffers, LOG_BINARY_ARG_TYPE_INT64, &llValue, sizeof(llValue));
+            }
+            else
+            {
+                nValue = va_arg(args, int);
+
+                // Truncate the way printf does, so the value renders the same without the length.
+                if (LOGUTIL_FORMAT_LENGTH_CHAR == spec.length)
+                {
+                    nValue = spec.fSigned ? static_cast<signed char>(nValue) : static_cast<BYTE>(nValue);
+                }
+                else if (LOGUTIL_FORMAT_LENGTH_SHORT == spec.length)
+                {
+                    nValue = spec.fSigned ? static_cast<SHORT>(nValue) : static_cast<USHORT>(nValue);
+                }
+
+                hr = LogBinaryAppendValue(pBuffers, LOG_BINARY_ARG_TYPE_INT32, &nValue, sizeof(nValue));
+            }
+            break;
+
+        case LOGUTIL_FORMAT_ARG_CHARACTER:
+            nValue = va_arg(args, int);
+
+            hr = LogBinaryAppendValue(pBuffers, LOG_BINARY_ARG_TYPE_INT32, &nValue, sizeof(nValue));
+            break;
+
+        case LOGUTIL_FORMAT_ARG_FLOAT:
+            dValue = va_arg(args, double);
+
+            hr = LogBinaryAppendValue(pBuffers, LOG_BINARY_ARG_TYPE_DOUBLE, &dValue, sizeof(dValue));
+            break;
+
+        case LOGUTIL_FORMAT_ARG_STRING:
+            // Stop at the precision, the string does not have to be terminated before it.
+            if (spec.fWide)
+            {
+                wzValue = va_arg(args, LPCWSTR);
+                wzValue = wzValue ? wzValue : L"(null)";
+                cchValue = spec.fPrecision ? wcsnlen(wzValue, spec.dwPrecision) : wcslen(wzValue);
+            }
+            else
+            {
+                szValue = va_arg(args, LPCSTR);
+                szValue = szValue ? szValue : "(null)";
+                cchValue = spec.fPrecision ? strnlen(szValue, spec.dwPrecision) : strlen(szValue);
+
+                if (INT_MAX <= cchValue)
+                {
+                    hr = E_INVALIDARG;
+                    LoguExitOnRootFailure(hr, "Log string argument is too long.");
+                }
+
+                hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pBuffers->pwzArg), static_cast<DWORD>(cchValue + 1), sizeof(WCHAR), LOGUTIL_LINE_BUFFER_INCREMENT);
+                LoguExitOnFailure(hr, "Failed to grow log argument buffer.");
+
+                cchWide = cchValue ? ::MultiByteToWideChar(CP_ACP, 0, szValue, static_cast<int>(cchValue), pBuffers->pwzArg, static_cast<int>(cchValue + 1)) : 0;
+                if (cchValue && !cchWide)
+                {
+                    LoguExitWithLastError(hr, "Failed to convert log string argument to wide character string");
+                }
+
+                wzValue = pBuffers->pwzArg;
+                cchValue = cchWide;
+            }
+
+            hr = LogBinaryAppendString(pBuffers, wzValue, cchValue);
+            break;
+        }
+        LoguExitOnFailure(hr, "Failed to add log argument.");
+    }
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogParseFormatSpec(
+    __in_z LPCWSTR wzSpec,
+    __out LOGUTIL_FORMAT_SPEC* pSpec
+    )
+{
+    HRESULT hr = S_OK;
+    LPCWSTR wz = wzSpec + 1;
+
+    memset(pSpec, 0, sizeof(LOGUTIL_FORMAT_SPEC));
+
+    pSpec->wzFlags = wz;
+    while (L'-' == *wz || L'+' == *wz || L' ' == *wz || L'#' == *wz || L'0' == *wz)
+    {
+        ++wz;
+    }
+    pSpec->cchFlags = static_cast<DWORD>(wz - pSpec->wzFlags);
+
+    if (L'*' == *wz)
+    {
+        pSpec->fWidth = TRUE;
+        pSpec->fWidthStar = TRUE;
+        ++wz;
+    }
+    else
+    {
+        for (; L'0' <= *wz && L'9' >= *wz && LOGUTIL_FORMAT_MAX_WIDTH >= pSpec->dwWidth; ++wz)
+        {
+            pSpec->fWidth = TRUE;
+            pSpec->dwWidth = pSpec->dwWidth * 10 + (*wz - L'0');
+        }
+    }
+
+    if (L'.' == *wz)
+    {
+        pSpec->fPrecision = TRUE;
+        ++wz;
+
+        if (L'*' == *wz)
+        {
+            pSpec->fPrecisionStar = TRUE;
+            ++wz;
+        }
+        else
+        {
+            for (; L'0' <= *wz && L'9' >= *wz && LOGUTIL_FORMAT_MAX_WIDTH >= pSpec->dwPrecision; ++wz)
+            {
+                pSpec->dwPrecision = pSpec->dwPrecision * 10 + (*wz - L'0');
+            }
+        }
+    }
+
+    if (LOGUTIL_FORMAT_MAX_FLAGS < pSpec->cchFlags || LOGUTIL_FORMAT_MAX_WIDTH < pSpec->dwWidth || LOGUTIL_FORMAT_MAX_WIDTH < pSpec->dwPrecision)
+    {
+        ExitFunction1(hr = E_NOTIMPL);
+    }
+
+    switch (*wz)
+    {
+    case L'h':
+        ++wz;
+        if (L'h' == *wz)
+        {
+            ++wz;
+            pSpec->length = LOGUTIL_FORMAT_LENGTH_CHAR;
+        }
+        else
+        {
+            pSpec->length = LOGUTIL_FORMAT_LENGTH_SHORT;
+        }
+        break;
+    case L'l':
+        ++wz;
+        if (L'l' == *wz)
+        {
+            ++wz;
+            pSpec->length = LOGUTIL_FORMAT_LENGTH_LONGLONG;
+        }
+        else
+        {
+            pSpec->length = LOGUTIL_FORMAT_LENGTH_LONG;
+        }
+        break;
+    case L'w':
+        ++wz;
+        pSpec->length = LOGUTIL_FORMAT_LENGTH_LONG;
+        break;
+    case L'L':
+        ++wz;
+        pSpec->length = LOGUTIL_FORMAT_LENGTH_DOUBLE;
+        break;
+    case L'j':
+        ++wz;
+        pSpec->length = LOGUTIL_FORMAT_LENGTH_LONGLONG;
+        break;
+    case L'z': __fallthrough;
+    case L't':
+        ++wz;
+        pSpec->length = LOGUTIL_FORMAT_LENGTH_SIZE;
+        break;
+    case L'I':
+        ++wz;
+        if (L'6' == wz[0] && L'4' == wz[1])
+        {
+            wz += 2;
+            pSpec->length = LOGUTIL_FORMAT_LENGTH_LONGLONG;
+        }
+        else if (L'3' == wz[0] && L'2' == wz[1])
+        {
+            wz += 2;
+            pSpec->length = LOGUTIL_FORMAT_LENGTH_LONG;
+        }
+        else
+        {
+            pSpec->length = LOGUTIL_FORMAT_LENGTH_SIZE;
+        }
+        break;
+    }
+
+    pSpec->wchConversion = *wz;
+
+    switch (*wz)
+    {
+    case L'%':
+        // Only a bare "%%".
+        if (wz != wzSpec + 1)
+        {
+            ExitFunction1(hr = E_NOTIMPL);
+        }
+
+        pSpec->arg = LOGUTIL_FORMAT_ARG_NONE;
+        break;
+    case L'd': __fallthrough;
+    case L'i':
+        pSpec->fSigned = TRUE;
+        __fallthrough;
+    case L'o': __fallthrough;
+    case L'u': __fallthrough;
+    case L'x': __fallthrough;
+    case L'X':
+        if (LOGUTIL_FORMAT_LENGTH_DOUBLE == pSpec->length)
+        {
+            ExitFunction1(hr = E_NOTIMPL);
+        }
+
+        pSpec->arg = LOGUTIL_FORMAT_ARG_INTEGER;
+        break;
+    case L'c': __fallthrough;
+    case L'C': __fallthrough;
+    case L's': __fallthrough;
+    case L'S':
+        if (LOGUTIL_FORMAT_LENGTH_DEFAULT != pSpec->length && LOGUTIL_FORMAT_LENGTH_SHORT != pSpec->length && LOGUTIL_FORMAT_LENGTH_LONG != pSpec->length)
+        {
+            ExitFunction1(hr = E_NOTIMPL);
+        }
+
+        // Lines are formatted with the wide printf functions, where a lowercase conversion is wide by default.
+        pSpec->arg = (L'c' == *wz || L'C' == *wz) ? LOGUTIL_FORMAT_ARG_CHARACTER : LOGUTIL_FORMAT_ARG_STRING;
+        pSpec->fWide = LOGUTIL_FORMAT_LENGTH_LONG == pSpec->length || (LOGUTIL_FORMAT_LENGTH_DEFAULT == pSpec->length && (L'c' == *wz || L's' == *wz));
+        break;
+    case L'e': __fallthrough;
+    case L'E': __fallthrough;
+    case L'f': __fallthrough;
+    case L'F': __fallthrough;
+    case L'g': __fallthrough;
+    case L'G': __fallthrough;
+    case L'a': __fallthrough;
+    case L'A':
+        if (LOGUTIL_FORMAT_LENGTH_DEFAULT != pSpec->length && LOGUTIL_FORMAT_LENGTH_LONG != pSpec->length && LOGUTIL_FORMAT_LENGTH_DOUBLE != pSpec->length)
+        {
+            ExitFunction1(hr = E_NOTIMPL);
+        }
+
+        pSpec->arg = LOGUTIL_FORMAT_ARG_FLOAT;
+        break;
+    default:
+        // Pointers, "%n", counted strings and anything else are left to printf.
+        ExitFunction1(hr = E_NOTIMPL);
+    }
+
+    pSpec->cch = static_cast<DWORD>(wz + 1 - wzSpec);
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryDecodeRecord(
+    __in LOGUTIL_BINARY_DECODER* pDecoder,
+    __in LOG_BINARY_RECORD_TYPE type,
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in DWORD cbData,
+    __in PFN_LOGSTRINGWORKRAW pfnWrite,
+    __in_opt LPVOID pvContext
+    )
+{
+    HRESULT hr = S_OK;
+    LOGUTIL_LINE_BUFFERS* pBuffers = &pDecoder->buffers;
+    LOG_BINARY_SESSION session = { };
+    DWORD dwId = 0;
+    DWORD cbUtf8 = 0;
+
+    switch (type)
+    {
+    case LOG_BINARY_RECORD_TYPE_SESSION:
+        if (sizeof(session) > cbData)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            LoguExitOnRootFailure(hr, "Binary log session is too short.");
+        }
+
+        memcpy(&session, pbData, sizeof(session));
+
+        if (LOG_BINARY_MAGIC != session.dwMagic || LOG_BINARY_VERSION < session.wVersion)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            LoguExitOnRootFailure(hr, "Not a binary log, or a later version: %u", session.wVersion);
+        }
+
+        pDecoder->fSession = TRUE;
+        pDecoder->dwProcessId = session.dwProcessId;
+        pDecoder->llLocalTimeBias = session.llLocalTimeBias;
+
+        // Ids from an earlier session mean something else in this one.
+        for (DWORD i = 0; i < pDecoder->cTemplates; ++i)
+        {
+            ReleaseNullStr(pDecoder->rgsczTemplates[i]);
+        }
+        break;
+
+    case LOG_BINARY_RECORD_TYPE_TEMPLATE:
+        if (sizeof(dwId) >= cbData)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            LoguExitOnRootFailure(hr, "Binary log template is too short.");
+        }
+
+        memcpy(&dwId, pbData, sizeof(dwId));
+
+        if (!dwId || LOGUTIL_BINARY_MAX_ID < dwId)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            LoguExitOnRootFailure(hr, "Binary log template id is out of range: %u", dwId);
+        }
+
+        if (pDecoder->cTemplates <= dwId)
+        {
+            hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pDecoder->rgsczTemplates), dwId + 1, sizeof(LPWSTR), LOGUTIL_LINE_BUFFER_INCREMENT);
+            LoguExitOnFailure(hr, "Failed to grow binary log template array.");
+
+            pDecoder->cTemplates = dwId + 1;
+        }
+
+        hr = StrAllocStringAnsi(&pDecoder->rgsczTemplates[dwId], reinterpret_cast<LPCSTR>(pbData + sizeof(dwId)), cbData - sizeof(dwId), CP_UTF8);
+        LoguExitOnFailure(hr, "Failed to copy binary log template.");
+        break;
+
+    case LOG_BINARY_RECORD_TYPE_LINE:
+        hr = LogBinaryDecodeLine(pDecoder, pbData, cbData);
+        LoguExitOnFailure(hr, "Failed to decode binary log line.");
+
+        if (pBuffers->line.cch)
+        {
+            hr = LogLineToUtf8(pBuffers, &cbUtf8);
+            LoguExitOnFailure(hr, "Failed to convert decoded log line to UTF-8.");
+
+            hr = pfnWrite(pBuffers->pszUtf8, pvContext);
+            LoguExitOnFailure(hr, "Failed to write decoded log line.");
+        }
+        break;
+
+    case LOG_BINARY_RECORD_TYPE_TEXT:
+        if (cbData)
+        {
+            hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pBuffers->pszUtf8), cbData + 1, sizeof(CHAR), LOGUTIL_LINE_BUFFER_INCREMENT);
+            LoguExitOnFailure(hr, "Failed to grow UTF-8 log buffer.");
+
+            memcpy(pBuffers->pszUtf8, pbData, cbData);
+            pBuffers->pszUtf8[cbData] = '\0';
+
+            hr = pfnWrite(pBuffers->pszUtf8, pvContext);
+            LoguExitOnFailure(hr, "Failed to write decoded log text.");
+        }
+        break;
+
+    default:
+        // Module paths are not part of the text format, and later versions may add record types.
+        break;
+    }
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryDecodeLine(
+    __in LOGUTIL_BINARY_DECODER* pDecoder,
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in DWORD cbData
+    )
+{
+    HRESULT hr = S_OK;
+    LOGUTIL_LINE_BUFFERS* pBuffers = &pDecoder->buffers;
+    LOG_BINARY_LINE line = { };
+    ULARGE_INTEGER uli = { };
+    FILETIME ft = { };
+    SYSTEMTIME st = { };
+
+    pBuffers->line.cch = 0;
+    if (pBuffers->line.sczString)
+    {
+        *pBuffers->line.sczString = L'\0';
+    }
+
+    if (sizeof(line) > cbData)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        LoguExitOnRootFailure(hr, "Binary log line is too short.");
+    }
+
+    memcpy(&line, pbData, sizeof(line));
+    pbData += sizeof(line);
+    cbData -= sizeof(line);
+
+    if (LOG_BINARY_LINE_FLAG_NEWLINE & line.bFlags)
+    {
+        uli.QuadPart = line.ullTime + pDecoder->llLocalTimeBias;
+        ft.dwLowDateTime = uli.LowPart;
+        ft.dwHighDateTime = uli.HighPart;
+
+        if (!::FileTimeToSystemTime(&ft, &st))
+        {
+            LoguExitWithLastError(hr, "Failed to convert binary log line time.");
+        }
+
+        hr = LogFormatLinePrefix(&pBuffers->line, static_cast<REPORT_LEVEL>(line.bLevel), line.dwLogId, pDecoder->dwProcessId, line.dwThreadId, &st);
+        LoguExitOnFailure(hr, "Failed to format line prefix.");
+    }
+
+    if (!line.dwTemplateId)
+    {
+        hr = LogBinaryReadStringArg(pBuffers, &pbData, &cbData);
+        LoguExitOnFailure(hr, "Failed to read binary log message.");
+
+        hr = StrBuilderAppend(&pBuffers->line, pBuffers->pwzArg);
+        LoguExitOnFailure(hr, "Failed to add message to line.");
+    }
+    else
+    {
+        if (pDecoder->cTemplates <= line.dwTemplateId || !pDecoder->rgsczTemplates[line.dwTemplateId])
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            LoguExitOnRootFailure(hr, "Binary log line uses an undefined template: %u", line.dwTemplateId);
+        }
+
+        hr = LogBinaryRenderTemplate(pBuffers, pDecoder->rgsczTemplates[line.dwTemplateId], &pbData, &cbData);
+        LoguExitOnFailure(hr, "Failed to render binary log line.");
+    }
+
+    if (cbData)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        LoguExitOnRootFailure(hr, "Binary log line has more arguments than its template.");
+    }
+
+    if (LOG_BINARY_LINE_FLAG_NEWLINE & line.bFlags)
+    {
+        hr = StrBuilderAppend(&pBuffers->line, LogUtil_sczSpecialEndLine ? LogUtil_sczSpecialEndLine : L"\r\n");
+        LoguExitOnFailure(hr, "Failed to add line ending.");
+    }
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryRenderTemplate(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __in_z LPCWSTR wzTemplate,
+    __inout LPCBYTE* ppbArgs,
+    __inout DWORD* pcbArgs
+    )
+{
+    HRESULT hr = S_OK;
+    LOGUTIL_FORMAT_SPEC spec = { };
+    LPCWSTR wzLiteral = wzTemplate;
+    LPCWSTR wz = wcschr(wzTemplate, L'%');
+    LONG lWidth = 0;
+    LONG lPrecision = 0;
+    LONG lValue = 0;
+    LONGLONG llValue = 0;
+    double dValue = 0;
+    BOOL fInt64 = FALSE;
+    LPCWSTR wzLength = NULL;
+    WCHAR wchConversion = L'\0';
+    WCHAR wzWidth[12];
+    WCHAR wzPrecision[13];
+    WCHAR wzSpec[64];
+
+    while (wz)
+    {
+        hr = StrBuilderAppendN(&pBuffers->line, wzLiteral, wz - wzLiteral);
+        LoguExitOnFailure(hr, "Failed to add template text to line.");
+
+        hr = LogParseFormatSpec(wz, &spec);
+        if (FAILED(hr))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            LoguExitOnRootFailure(hr, "Binary log template has a conversion that is not encoded: %ls", wzTemplate);
+        }
+
+        wzLiteral = wz + spec.cch;
+        wz = wcschr(wzLiteral, L'%');
+
+        if (LOGUTIL_FORMAT_ARG_NONE == spec.arg)
+        {
+            hr = StrBuilderAppend(&pBuffers->line, L"%");
+            LoguExitOnFailure(hr, "Failed to add percent sign to line.");
+
+            continue;
+        }
+
+        lWidth = static_cast<LONG>(spec.dwWidth);
+        lPrecision = spec.fPrecision ? static_cast<LONG>(spec.dwPrecision) : -1;
+
+        if (spec.fWidthStar)
+        {
+            hr = LogBinaryReadArg(ppbArgs, pcbArgs, LOG_BINARY_ARG_TYPE_INT32, &lWidth, sizeof(lWidth));
+            LoguExitOnFailure(hr, "Failed to read binary log width.");
+        }
+
+        if (spec.fPrecisionStar)
+        {
+            hr = LogBinaryReadArg(ppbArgs, pcbArgs, LOG_BINARY_ARG_TYPE_INT32, &lPrecision, sizeof(lPrecision));
+            LoguExitOnFailure(hr, "Failed to read binary log precision.");
+
+            lPrecision = (0 > lPrecision) ? -1 : lPrecision;
+        }
+
+        // Rebuild the conversion with the widths resolved and a length that matches the argument as
+        // it was written.
+        wzWidth[0] = L'\0';
+        wzPrecision[0] = L'\0';
+
+        if (spec.fWidth)
+        {
+            hr = ::StringCchPrintfW(wzWidth, countof(wzWidth), L"%u", (0 > lWidth) ? 0U - static_cast<DWORD>(lWidth) : static_cast<DWORD>(lWidth));
+            LoguExitOnFailure(hr, "Failed to format log width.");
+        }
+
+        if (0 <= lPrecision)
+        {
+            hr = ::StringCchPrintfW(wzPrecision, countof(wzPrecision), L".%d", lPrecision);
+            LoguExitOnFailure(hr, "Failed to format log precision.");
+        }
+
+        fInt64 = LOGUTIL_FORMAT_ARG_INTEGER == spec.arg && (LOGUTIL_FORMAT_LENGTH_LONGLONG == spec.length || LOGUTIL_FORMAT_LENGTH_SIZE == spec.length);
+        wzLength = fInt64 ? L"I64" : L"";
+        wchConversion = spec.wchConversion;
+
+        if (LOGUTIL_FORMAT_ARG_CHARACTER == spec.arg)
+        {
+            wzLength = spec.fWide ? L"l" : L"h";
+            wchConversion = L'c';
+        }
+        else if (LOGUTIL_FORMAT_ARG_STRING == spec.arg)
+        {
+            wzLength = L"l";
+            wchConversion = L's';
+        }
+
+        hr = ::StringCchPrintfW(wzSpec, countof(wzSpec), L"%%%ls%.*ls%ls%ls%ls%lc", (0 > lWidth) ? L"-" : L"", static_cast<int>(spec.cchFlags), spec.wzFlags, wzWidth, wzPrecision, wzLength, wchConversion);
+        LoguExitOnFailure(hr, "Failed to rebuild log conversion.");
+
+        switch (spec.arg)
+        {
+        case LOGUTIL_FORMAT_ARG_INTEGER:
+            if (fInt64)
+            {
+                hr = LogBinaryReadArg(ppbArgs, pcbArgs, LOG_BINARY_ARG_TYPE_INT64, &llValue, sizeof(llValue));
+                LoguExitOnFailure(hr, "Failed to read binary log argument.");
+
+                hr = StrBuilderAppendFormatted(&pBuffers->line, wzSpec, llValue);
+                break;
+            }
+            __fallthrough;
+        case LOGUTIL_FORMAT_ARG_CHARACTER:
+            hr = LogBinaryReadArg(ppbArgs, pcbArgs, LOG_BINARY_ARG_TYPE_INT32, &lValue, sizeof(lValue));
+            LoguExitOnFailure(hr, "Failed to read binary log argument.");
+
+            hr = StrBuilderAppendFormatted(&pBuffers->line, wzSpec, lValue);
+            break;
+
+        case LOGUTIL_FORMAT_ARG_FLOAT:
+            hr = LogBinaryReadArg(ppbArgs, pcbArgs, LOG_BINARY_ARG_TYPE_DOUBLE, &dValue, sizeof(dValue));
+            LoguExitOnFailure(hr, "Failed to read binary log argument.");
+
+            hr = StrBuilderAppendFormatted(&pBuffers->line, wzSpec, dValue);
+            break;
+
+        case LOGUTIL_FORMAT_ARG_STRING:
+            hr = LogBinaryReadStringArg(pBuffers, ppbArgs, pcbArgs);
+            LoguExitOnFailure(hr, "Failed to read binary log argument.");
+
+            hr = StrBuilderAppendFormatted(&pBuffers->line, wzSpec, pBuffers->pwzArg);
+            break;
+        }
+        LoguExitOnFailure(hr, "Failed to format binary log argument with: %ls", wzSpec);
+    }
+
+    hr = StrBuilderAppend(&pBuffers->line, wzLiteral);
+    LoguExitOnFailure(hr, "Failed to add template text to line.");
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryReadArg(
+    __inout LPCBYTE* ppbArgs,
+    __inout DWORD* pcbArgs,
+    __in LOG_BINARY_ARG_TYPE type,
+    __out_bcount(cbValue) void* pvValue,
+    __in DWORD cbValue
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (sizeof(BYTE) + cbValue > *pcbArgs || static_cast<BYTE>(type) != **ppbArgs)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        LoguExitOnRootFailure(hr, "Binary log argument does not match its template.");
+    }
+
+    memcpy(pvValue, *ppbArgs + sizeof(BYTE), cbValue);
+
+    *ppbArgs += sizeof(BYTE) + cbValue;
+    *pcbArgs -= sizeof(BYTE) + cbValue;
+
+LExit:
+    return hr;
+}
+
+
+static HRESULT LogBinaryReadStringArg(
+    __in LOGUTIL_LINE_BUFFERS* pBuffers,
+    __inout LPCBYTE* ppbArgs,
+    __inout DWORD* pcbArgs
+    )
+{
+    HRESULT hr = S_OK;
+    DWORD cbString = 0;
+    int cchArg = 0;
+
+    hr = LogBinaryReadArg(ppbArgs, pcbArgs, LOG_BINARY_ARG_TYPE_STRING, &cbString, sizeof(cbString));
+    LoguExitOnFailure(hr, "Failed to read binary log string length.");
+
+    if (cbString > *pcbArgs)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        LoguExitOnRootFailure(hr, "Binary log string is longer than its line.");
+    }
+
+    // UTF-8 never needs more characters than bytes.
+    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&pBuffers->pwzArg), cbString + 1, sizeof(WCHAR), LOGUTIL_LINE_BUFFER_INCREMENT);
+    LoguExitOnFailure(hr, "Failed to grow log argument buffer.");
+
+    if (cbString)
+    {
+        cchArg = ::MultiByteToWideChar(CP_UTF8, 0, reinterpret_cast<LPCSTR>(*ppbArgs), cbString, pBuffers->pwzArg, cbString);
+        if (!cchArg)
+        {
+            LoguExitWithLastError(hr, "Failed to convert binary log string from UTF-8.");
+        }
+    }
+
+    pBuffers->pwzArg[cchArg] = L'\0';
+
+    *ppbArgs += cbString;
+    *pcbArgs -= cbString;
+
+LExit:
     return hr;
 }
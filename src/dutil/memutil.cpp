@@ -17,11 +17,94 @@
 #define MemExitOnWin32Error(e, x, s, ...) ExitOnWin32ErrorSource(DUTIL_SOURCE_MEMUTIL, e, x, s, __VA_ARGS__)
 #define MemExitOnGdipFailure(g, x, s, ...) ExitOnGdipFailureSource(DUTIL_SOURCE_MEMUTIL, g, x, s, __VA_ARGS__)
 
+// Arena allocations are rounded up to the same alignment the process heap guarantees
+#define MEM_ARENA_ALIGN(cb) (((cb) + (MEMORY_ALLOCATION_ALIGNMENT - 1)) & ~static_cast<SIZE_T>(MEMORY_ALLOCATION_ALIGNMENT - 1))
+#define MEM_ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+// Allocations bigger than this fraction of the block size get a block of their own, so they
+// don't waste what is left of the current block
+#define MEM_ARENA_OVERSIZE_DIVISOR 4
+
+struct MEM_ARENA_BLOCK
+{
+    MEM_ARENA_BLOCK* pNext;
+
+    // The data follows the (aligned) block header
+};
+
+struct MEM_ARENA
+{
+    // Size of the data in a regular block
+    SIZE_T cbBlock;
+
+    // The block allocations are currently carved out of, followed by all other blocks
+    MEM_ARENA_BLOCK* pBlocks;
+
+    // Unused part of the current block
+    BYTE* pbNext;
+    BYTE* pbEnd;
+};
+
+static MEM_ARENA_BLOCK* AllocateArenaBlock(
+    __in SIZE_T cbData
+    );
+static BYTE* GetArenaBlockData(
+    __in MEM_ARENA_BLOCK* pBlock
+    );
+
+// Arrays that need to grow get at least half their current size added, so appending one item at a
+// time costs amortized constant copying. The geometric part of each growth is capped so huge arrays
+// don't double their memory just to add a few more items.
+#define MEM_ARRAY_GROWTH_DIVISOR 2
+#define MEM_ARRAY_MAX_GEOMETRIC_GROWTH_BYTES (16 * 1024 * 1024)
+
+static HRESULT GetArrayGrowthSize(
+    __in DWORD cArray,
+    __in SIZE_T cbCurrent,
+    __in SIZE_T cbArrayType,
+    __in DWORD dwGrowthCount,
+    __out SIZE_T* pcbNew
+    );
+
+
+static LPVOID DAPI DefaultAlloc(
+    __in_opt LPVOID pvContext,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    );
+static LPVOID DAPI DefaultReAlloc(
+    __in_opt LPVOID pvContext,
+    __in LPVOID pv,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    );
+static HRESULT DAPI DefaultFree(
+    __in_opt LPVOID pvContext,
+    __in LPVOID pv
+    );
+static SIZE_T DAPI DefaultSize(
+    __in_opt LPVOID pvContext,
+    __in LPCVOID pv
+    );
+static void RecordAllocation(
+    __in UINT source,
+    __in SIZE_T cbSize,
+    __in BOOL fReAllocation,
+    __in LONG64 cbLiveDelta
+    );
+
 
 #if DEBUG
 static BOOL vfMemInitialized = FALSE;
 #endif
 
+static MEM_ALLOCATOR vAllocator = { DefaultAlloc, DefaultReAlloc, DefaultFree, DefaultSize, NULL };
+
+// Telemetry for all sources at or above DUTIL_SOURCE_EXTERNAL is combined in the last entry
+static volatile BOOL vfMemTelemetryEnabled = FALSE;
+static MEM_SOURCE_TELEMETRY vrgSourceTelemetry[DUTIL_SOURCE_EXTERNAL + 1];
+static MEM_TELEMETRY vTelemetry;
+
 extern "C" HRESULT DAPI MemInitialize()
 {
 #if DEBUG
@@ -37,18 +120,128 @@ extern "C" void DAPI MemUninitialize()
 #endif
 }
 
+
+/********************************************************************
+MemSetAllocator - replaces the functions all memutil allocations go
+                  through. Pass NULL to go back to the process heap.
+
+NOTE: memory can only be freed by the allocator that allocated it, so
+      this must be called before anything is allocated (or after
+      everything has been freed).
+********************************************************************/
+extern "C" HRESULT DAPI MemSetAllocator(
+    __in_opt const MEM_ALLOCATOR* pAllocator
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (!pAllocator)
+    {
+        vAllocator.pfnAlloc = DefaultAlloc;
+        vAllocator.pfnReAlloc = DefaultReAlloc;
+        vAllocator.pfnFree = DefaultFree;
+        vAllocator.pfnSize = DefaultSize;
+        vAllocator.pvContext = NULL;
+    }
+    else if (!pAllocator->pfnAlloc || !pAllocator->pfnReAlloc || !pAllocator->pfnFree || !pAllocator->pfnSize)
+    {
+        MemExitOnRootFailure(hr = E_INVALIDARG, "Allocator must provide alloc, realloc, free and size functions");
+    }
+    else
+    {
+        vAllocator = *pAllocator;
+    }
+
+LExit:
+    return hr;
+}
+
+
+/********************************************************************
+MemTelemetryEnable - starts or stops counting allocations. Enabling
+                     clears the counts from any previous run.
+
+NOTE: frees are only counted in total, since the source that allocated
+      a block isn't known when it is freed.
+********************************************************************/
+extern "C" void DAPI MemTelemetryEnable(
+    __in BOOL fEnable
+    )
+{
+    if (fEnable)
+    {
+        memset(vrgSourceTelemetry, 0, sizeof(vrgSourceTelemetry));
+        memset(&vTelemetry, 0, sizeof(vTelemetry));
+    }
+
+    ::InterlockedExchange(reinterpret_cast<volatile LONG*>(&vfMemTelemetryEnabled), fEnable);
+}
+
+
+extern "C" HRESULT DAPI MemGetSourceTelemetry(
+    __in UINT source,
+    __out MEM_SOURCE_TELEMETRY* pTelemetry
+    )
+{
+    HRESULT hr = S_OK;
+
+    MemExitOnNull(pTelemetry, hr, E_INVALIDARG, "Telemetry not specified");
+
+    *pTelemetry = vrgSourceTelemetry[source < DUTIL_SOURCE_EXTERNAL ? source : DUTIL_SOURCE_EXTERNAL];
+
+LExit:
+    return hr;
+}
+
+
+extern "C" void DAPI MemGetTelemetry(
+    __out MEM_TELEMETRY* pTelemetry
+    )
+{
+    *pTelemetry = vTelemetry;
+}
+
+
 extern "C" LPVOID DAPI MemAlloc(
     __in SIZE_T cbSize,
     __in BOOL fZero
     )
+{
+    return MemAllocSource(DUTIL_SOURCE_UNKNOWN, cbSize, fZero);
+}
+
+
+extern "C" LPVOID DAPI MemReAlloc(
+    __in LPVOID pv,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    )
+{
+    return MemReAllocSource(DUTIL_SOURCE_UNKNOWN, pv, cbSize, fZero);
+}
+
+
+extern "C" LPVOID DAPI MemAllocSource(
+    __in UINT source,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    )
 {
 //    AssertSz(vfMemInitialized, "MemInitialize() not called, this would normally crash");
     AssertSz(0 < cbSize, "MemAlloc() called with invalid size");
-    return ::HeapAlloc(::GetProcessHeap(), fZero ? HEAP_ZERO_MEMORY : 0, cbSize);
+    LPVOID pv = vAllocator.pfnAlloc(vAllocator.pvContext, cbSize, fZero);
+
+    if (vfMemTelemetryEnabled && pv)
+    {
+        RecordAllocation(source, cbSize, FALSE, cbSize);
+    }
+
+    return pv;
 }
 
 
-extern "C" LPVOID DAPI MemReAlloc(
+extern "C" LPVOID DAPI MemReAllocSource(
+    __in UINT source,
     __in LPVOID pv,
     __in SIZE_T cbSize,
     __in BOOL fZero
@@ -56,7 +249,22 @@ extern "C" LPVOID DAPI MemReAlloc(
 {
 //    AssertSz(vfMemInitialized, "MemInitialize() not called, this would normally crash");
     AssertSz(0 < cbSize, "MemReAlloc() called with invalid size");
-    return ::HeapReAlloc(::GetProcessHeap(), fZero ? HEAP_ZERO_MEMORY : 0, pv, cbSize);
+    SIZE_T cbOld = 0;
+    LPVOID pvNew = NULL;
+
+    if (vfMemTelemetryEnabled)
+    {
+        cbOld = vAllocator.pfnSize(vAllocator.pvContext, pv);
+    }
+
+    pvNew = vAllocator.pfnReAlloc(vAllocator.pvContext, pv, cbSize, fZero);
+
+    if (vfMemTelemetryEnabled && pvNew && -1 != cbOld)
+    {
+        RecordAllocation(source, cbSize, TRUE, static_cast<LONG64>(cbSize) - static_cast<LONG64>(cbOld));
+    }
+
+    return pvNew;
 }
 
 
@@ -75,8 +283,13 @@ extern "C" HRESULT DAPI MemReAllocSecure(
     DWORD dwFlags = HEAP_REALLOC_IN_PLACE_ONLY;
     LPVOID pvNew = NULL;
 
-    dwFlags |= fZero ? HEAP_ZERO_MEMORY : 0;
-    pvNew = ::HeapReAlloc(::GetProcessHeap(), dwFlags, pv, cbSize);
+    // Only the process heap can grow a block without moving it
+    if (DefaultReAlloc == vAllocator.pfnReAlloc)
+    {
+        dwFlags |= fZero ? HEAP_ZERO_MEMORY : 0;
+        pvNew = ::HeapReAlloc(::GetProcessHeap(), dwFlags, pv, cbSize);
+    }
+
     if (!pvNew)
     {
         pvNew = MemAlloc(cbSize, fZero);
@@ -152,7 +365,7 @@ extern "C" HRESULT DAPI MemReAllocArray(
         SIZE_T cbCurrent = MemSize(*ppvArray);
         if (cbCurrent < cbNew)
         {
-            pvNew = MemReAlloc(*ppvArray, cbNew, TRUE);
+            pvNew = MemReAllocSource(DUTIL_SOURCE_MEMUTIL, *ppvArray, cbNew, TRUE);
             MemExitOnNull(pvNew, hr, E_OUTOFMEMORY, "Failed to allocate larger array.");
 
             *ppvArray = pvNew;
@@ -160,7 +373,7 @@ extern "C" HRESULT DAPI MemReAllocArray(
     }
     else
     {
-        pvNew = MemAlloc(cbNew, TRUE);
+        pvNew = MemAllocSource(DUTIL_SOURCE_MEMUTIL, cbNew, TRUE);
         MemExitOnNull(pvNew, hr, E_OUTOFMEMORY, "Failed to allocate new array.");
 
         *ppvArray = pvNew;
@@ -171,6 +384,14 @@ LExit:
 }
 
 
+/********************************************************************
+MemEnsureArraySize - makes sure the array has room for at least cArray
+                     items.
+
+NOTE: when the array has to grow, it grows by at least dwGrowthCount
+      items past cArray and by at least half its current size (up to
+      a cap), whichever is bigger.
+********************************************************************/
 extern "C" HRESULT DAPI MemEnsureArraySize(
     __deref_inout_bcount(cArray * cbArrayType) LPVOID* ppvArray,
     __in DWORD cArray,
@@ -179,23 +400,28 @@ extern "C" HRESULT DAPI MemEnsureArraySize(
     )
 {
     HRESULT hr = S_OK;
-    DWORD cNew = 0;
     LPVOID pvNew = NULL;
+    SIZE_T cbUsed = 0;
+    SIZE_T cbCurrent = 0;
     SIZE_T cbNew = 0;
 
-    hr = ::DWordAdd(cArray, dwGrowthCount, &cNew);
-    MemExitOnFailure(hr, "Integer overflow when calculating new element count.");
-
-    hr = ::SIZETMult(cNew, cbArrayType, &cbNew);
-    MemExitOnFailure(hr, "Integer overflow when calculating new block size.");
+    hr = ::SIZETMult(cArray, cbArrayType, &cbUsed);
+    MemExitOnFailure(hr, "Integer overflow when calculating used block size.");
 
     if (*ppvArray)
     {
-        SIZE_T cbUsed = cArray * cbArrayType;
-        SIZE_T cbCurrent = MemSize(*ppvArray);
+        cbCurrent = MemSize(*ppvArray);
+        if (-1 == cbCurrent)
+        {
+            MemExitOnRootFailure(hr = E_INVALIDARG, "Failed to get memory size");
+        }
+
         if (cbCurrent < cbUsed)
         {
-            pvNew = MemReAlloc(*ppvArray, cbNew, TRUE);
+            hr = GetArrayGrowthSize(cArray, cbCurrent, cbArrayType, dwGrowthCount, &cbNew);
+            MemExitOnFailure(hr, "Failed to calculate new array size.");
+
+            pvNew = MemReAllocSource(DUTIL_SOURCE_MEMUTIL, *ppvArray, cbNew, TRUE);
             MemExitOnNull(pvNew, hr, E_OUTOFMEMORY, "Failed to allocate array larger.");
 
             *ppvArray = pvNew;
@@ -203,7 +429,10 @@ extern "C" HRESULT DAPI MemEnsureArraySize(
     }
     else
     {
-        pvNew = MemAlloc(cbNew, TRUE);
+        hr = GetArrayGrowthSize(cArray, 0, cbArrayType, dwGrowthCount, &cbNew);
+        MemExitOnFailure(hr, "Failed to calculate new array size.");
+
+        pvNew = MemAllocSource(DUTIL_SOURCE_MEMUTIL, cbNew, TRUE);
         MemExitOnNull(pvNew, hr, E_OUTOFMEMORY, "Failed to allocate new array.");
 
         *ppvArray = pvNew;
@@ -224,7 +453,7 @@ extern "C" HRESULT DAPI MemInsertIntoArray(
     )
 {
     HRESULT hr = S_OK;
-    DWORD i;
+    DWORD cNew = 0;
     BYTE *pbArray = NULL;
 
     if (0 == cInsertItems)
@@ -232,13 +461,17 @@ extern "C" HRESULT DAPI MemInsertIntoArray(
         ExitFunction1(hr = S_OK);
     }
 
-    hr = MemEnsureArraySize(ppvArray, cExistingArray + cInsertItems, cbArrayType, dwGrowthCount);
+    hr = ::DWordAdd(cExistingArray, cInsertItems, &cNew);
+    MemExitOnFailure(hr, "Integer overflow when calculating new element count.");
+
+    hr = MemEnsureArraySize(ppvArray, cNew, cbArrayType, dwGrowthCount);
     MemExitOnFailure(hr, "Failed to resize array while inserting items");
 
+    // Shift everything after the insert point up in a single move
     pbArray = reinterpret_cast<BYTE *>(*ppvArray);
-    for (i = cExistingArray + cInsertItems - 1; i > dwInsertIndex; --i)
+    if (dwInsertIndex < cExistingArray)
     {
-        memcpy_s(pbArray + i * cbArrayType, cbArrayType, pbArray + (i - 1) * cbArrayType, cbArrayType);
+        memmove(pbArray + (dwInsertIndex + cInsertItems) * cbArrayType, pbArray + dwInsertIndex * cbArrayType, (cExistingArray - dwInsertIndex) * cbArrayType);
     }
 
     // Zero out the newly-inserted items
@@ -323,7 +556,17 @@ extern "C" HRESULT DAPI MemFree(
     )
 {
 //    AssertSz(vfMemInitialized, "MemInitialize() not called, this would normally crash");
-    return ::HeapFree(::GetProcessHeap(), 0, pv) ? S_OK : HRESULT_FROM_WIN32(::GetLastError());
+    if (vfMemTelemetryEnabled && pv)
+    {
+        SIZE_T cbSize = vAllocator.pfnSize(vAllocator.pvContext, pv);
+        if (-1 != cbSize)
+        {
+            ::InterlockedIncrement64(reinterpret_cast<volatile LONG64*>(&vTelemetry.cFrees));
+            ::InterlockedExchangeAdd64(&vTelemetry.cbLive, -static_cast<LONG64>(cbSize));
+        }
+    }
+
+    return vAllocator.pfnFree(vAllocator.pvContext, pv);
 }
 
 
@@ -332,5 +575,298 @@ extern "C" SIZE_T DAPI MemSize(
     )
 {
 //    AssertSz(vfMemInitialized, "MemInitialize() not called, this would normally crash");
+    return vAllocator.pfnSize(vAllocator.pvContext, pv);
+}
+
+
+/********************************************************************
+MemArenaCreate - creates an arena that hands out memory by bumping a pointer
+                 through large blocks.
+
+NOTE: cbBlock is the size of each block, 0 picks a default. Memory from
+      an arena can't be freed or reallocated individually - it is all
+      released at once by MemArenaReset() or MemArenaDestroy().
+      An arena must only be used by one thread at a time.
+********************************************************************/
+extern "C" HRESULT DAPI MemArenaCreate(
+    __in SIZE_T cbBlock,
+    __out MEM_ARENA_HANDLE* phArena
+    )
+{
+    HRESULT hr = S_OK;
+    MEM_ARENA* pArena = NULL;
+
+    MemExitOnNull(phArena, hr, E_INVALIDARG, "Handle not specified while creating arena");
+
+    pArena = static_cast<MEM_ARENA*>(MemAllocSource(DUTIL_SOURCE_MEMUTIL, sizeof(MEM_ARENA), TRUE));
+    MemExitOnNull(pArena, hr, E_OUTOFMEMORY, "Failed to allocate arena");
+
+    pArena->cbBlock = MEM_ARENA_ALIGN(cbBlock ? cbBlock : MEM_ARENA_DEFAULT_BLOCK_SIZE);
+
+    pArena->pBlocks = AllocateArenaBlock(pArena->cbBlock);
+    MemExitOnNull(pArena->pBlocks, hr, E_OUTOFMEMORY, "Failed to allocate first arena block");
+
+    pArena->pbNext = GetArenaBlockData(pArena->pBlocks);
+    pArena->pbEnd = pArena->pbNext + pArena->cbBlock;
+
+    *phArena = pArena;
+    pArena = NULL;
+
+LExit:
+    ReleaseMemArena(pArena);
+
+    return hr;
+}
+
+
+extern "C" LPVOID DAPI MemArenaAlloc(
+    __in MEM_ARENA_HANDLE hArena,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    )
+{
+    AssertSz(hArena, "MemArenaAlloc() called without an arena");
+    AssertSz(0 < cbSize, "MemArenaAlloc() called with invalid size");
+
+    MEM_ARENA* pArena = static_cast<MEM_ARENA*>(hArena);
+    MEM_ARENA_BLOCK* pBlock = NULL;
+    LPVOID pv = NULL;
+    SIZE_T cbAligned = 0;
+
+    if (cbSize > static_cast<SIZE_T>(-1) - MEMORY_ALLOCATION_ALIGNMENT)
+    {
+        return NULL;
+    }
+
+    cbAligned = MEM_ARENA_ALIGN(cbSize);
+
+    if (cbAligned > static_cast<SIZE_T>(pArena->pbEnd - pArena->pbNext))
+    {
+        if (cbAligned > pArena->cbBlock / MEM_ARENA_OVERSIZE_DIVISOR)
+        {
+            // Keep the current block first, so its remaining space is still used
+            pBlock = AllocateArenaBlock(cbAligned);
+            if (!pBlock)
+            {
+                return NULL;
+            }
+
+            pBlock->pNext = pArena->pBlocks->pNext;
+            pArena->pBlocks->pNext = pBlock;
+
+            pv = GetArenaBlockData(pBlock);
+            if (fZero)
+            {
+                memset(pv, 0, cbSize);
+            }
+
+            return pv;
+        }
+
+        pBlock = AllocateArenaBlock(pArena->cbBlock);
+        if (!pBlock)
+        {
+            return NULL;
+        }
+
+        pBlock->pNext = pArena->pBlocks;
+        pArena->pBlocks = pBlock;
+        pArena->pbNext = GetArenaBlockData(pBlock);
+        pArena->pbEnd = pArena->pbNext + pArena->cbBlock;
+    }
+
+    pv = pArena->pbNext;
+    pArena->pbNext += cbAligned;
+
+    // Blocks are reused after a reset, so zero on every allocation rather than when the block is allocated
+    if (fZero)
+    {
+        memset(pv, 0, cbSize);
+    }
+
+    return pv;
+}
+
+
+/********************************************************************
+MemArenaReset - releases everything allocated from the arena, keeping
+                one block to allocate from again.
+
+********************************************************************/
+extern "C" void DAPI MemArenaReset(
+    __in MEM_ARENA_HANDLE hArena
+    )
+{
+    MEM_ARENA* pArena = static_cast<MEM_ARENA*>(hArena);
+    MEM_ARENA_BLOCK* pBlock = pArena->pBlocks->pNext;
+
+    while (pBlock)
+    {
+        MEM_ARENA_BLOCK* pNext = pBlock->pNext;
+
+        MemFree(pBlock);
+        pBlock = pNext;
+    }
+
+    // The first block is always a regular block - oversized ones are only ever linked in behind it
+    pArena->pBlocks->pNext = NULL;
+    pArena->pbNext = GetArenaBlockData(pArena->pBlocks);
+    pArena->pbEnd = pArena->pbNext + pArena->cbBlock;
+}
+
+
+extern "C" void DAPI MemArenaDestroy(
+    __in MEM_ARENA_HANDLE hArena
+    )
+{
+    MEM_ARENA* pArena = static_cast<MEM_ARENA*>(hArena);
+    MEM_ARENA_BLOCK* pBlock = pArena->pBlocks;
+
+    while (pBlock)
+    {
+        MEM_ARENA_BLOCK* pNext = pBlock->pNext;
+
+        MemFree(pBlock);
+        pBlock = pNext;
+    }
+
+    MemFree(pArena);
+}
+
+
+static MEM_ARENA_BLOCK* AllocateArenaBlock(
+    __in SIZE_T cbData
+    )
+{
+    MEM_ARENA_BLOCK* pBlock = NULL;
+    SIZE_T cbAllocSize = 0;
+
+    if (FAILED(::SIZETAdd(MEM_ARENA_ALIGN(sizeof(MEM_ARENA_BLOCK)), cbData, &cbAllocSize)))
+    {
+        return NULL;
+    }
+
+    pBlock = static_cast<MEM_ARENA_BLOCK*>(MemAllocSource(DUTIL_SOURCE_MEMUTIL, cbAllocSize, FALSE));
+    if (pBlock)
+    {
+        pBlock->pNext = NULL;
+    }
+
+    return pBlock;
+}
+
+
+static BYTE* GetArenaBlockData(
+    __in MEM_ARENA_BLOCK* pBlock
+    )
+{
+    return reinterpret_cast<BYTE*>(pBlock) + MEM_ARENA_ALIGN(sizeof(MEM_ARENA_BLOCK));
+}
+
+
+static LPVOID DAPI DefaultAlloc(
+    __in_opt LPVOID /*pvContext*/,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    )
+{
+    return ::HeapAlloc(::GetProcessHeap(), fZero ? HEAP_ZERO_MEMORY : 0, cbSize);
+}
+
+
+static LPVOID DAPI DefaultReAlloc(
+    __in_opt LPVOID /*pvContext*/,
+    __in LPVOID pv,
+    __in SIZE_T cbSize,
+    __in BOOL fZero
+    )
+{
+    return ::HeapReAlloc(::GetProcessHeap(), fZero ? HEAP_ZERO_MEMORY : 0, pv, cbSize);
+}
+
+
+static HRESULT DAPI DefaultFree(
+    __in_opt LPVOID /*pvContext*/,
+    __in LPVOID pv
+    )
+{
+    return ::HeapFree(::GetProcessHeap(), 0, pv) ? S_OK : HRESULT_FROM_WIN32(::GetLastError());
+}
+
+
+static SIZE_T DAPI DefaultSize(
+    __in_opt LPVOID /*pvContext*/,
+    __in LPCVOID pv
+    )
+{
     return ::HeapSize(::GetProcessHeap(), 0, pv);
 }
+
+
+static void RecordAllocation(
+    __in UINT source,
+    __in SIZE_T cbSize,
+    __in BOOL fReAllocation,
+    __in LONG64 cbLiveDelta
+    )
+{
+    MEM_SOURCE_TELEMETRY* pTelemetry = vrgSourceTelemetry + (source < DUTIL_SOURCE_EXTERNAL ? source : DUTIL_SOURCE_EXTERNAL);
+    DWORD dwSizeClass = 0;
+    LONG64 cbLive = 0;
+    LONG64 cbPeak = 0;
+
+    while (dwSizeClass < MEM_TELEMETRY_SIZE_CLASSES - 1 && cbSize > (static_cast<SIZE_T>(16) << dwSizeClass))
+    {
+        ++dwSizeClass;
+    }
+
+    ::InterlockedIncrement64(reinterpret_cast<volatile LONG64*>(fReAllocation ? &pTelemetry->cReAllocations : &pTelemetry->cAllocations));
+    ::InterlockedExchangeAdd64(reinterpret_cast<volatile LONG64*>(&pTelemetry->cbAllocated), cbSize);
+    ::InterlockedIncrement64(reinterpret_cast<volatile LONG64*>(pTelemetry->rgcSizeClasses + dwSizeClass));
+
+    cbLive = ::InterlockedExchangeAdd64(&vTelemetry.cbLive, cbLiveDelta) + cbLiveDelta;
+
+    // Raise the peak unless another thread already raised it past this value
+    do
+    {
+        cbPeak = vTelemetry.cbPeak;
+    } while (cbLive > cbPeak && cbPeak != ::InterlockedCompareExchange64(&vTelemetry.cbPeak, cbLive, cbPeak));
+}
+
+
+static HRESULT GetArrayGrowthSize(
+    __in DWORD cArray,
+    __in SIZE_T cbCurrent,
+    __in SIZE_T cbArrayType,
+    __in DWORD dwGrowthCount,
+    __out SIZE_T* pcbNew
+    )
+{
+    HRESULT hr = S_OK;
+    SIZE_T cbGeometric = cbCurrent / MEM_ARRAY_GROWTH_DIVISOR;
+    DWORD cNew = 0;
+    SIZE_T cbNew = 0;
+
+    hr = ::DWordAdd(cArray, dwGrowthCount, &cNew);
+    MemExitOnFailure(hr, "Integer overflow when calculating new element count.");
+
+    hr = ::SIZETMult(cNew, cbArrayType, &cbNew);
+    MemExitOnFailure(hr, "Integer overflow when calculating new block size.");
+
+    if (cbGeometric > MEM_ARRAY_MAX_GEOMETRIC_GROWTH_BYTES)
+    {
+        cbGeometric = MEM_ARRAY_MAX_GEOMETRIC_GROWTH_BYTES;
+    }
+
+    // Only use the geometric size if it doesn't overflow, the requested size is enough otherwise
+    if (cbCurrent + cbGeometric > cbNew && cbCurrent + cbGeometric > cbCurrent)
+    {
+        // Keep the new size a whole number of items
+        cbNew = (cbCurrent + cbGeometric) / cbArrayType * cbArrayType;
+    }
+
+    *pcbNew = cbNew;
+
+LExit:
+    return hr;
+}
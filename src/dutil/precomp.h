@@ -30,6 +30,7 @@
 #include <activeds.h>
 #include <richedit.h>
 #include <stddef.h>
+#include <locale.h>
 #include <esent.h>
 #include <ahadmin.h>
 #include <SRRestorePtAPI.h>
@@ -2,6 +2,10 @@
 
 #include "precomp.h"
 
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define STR_HEX_SSE2
+#endif
 
 // Exit macros
 #define StrExitOnLastError(x, s, ...) ExitOnLastErrorSource(DUTIL_SOURCE_STRUTIL, x, s, __VA_ARGS__)
@@ -19,6 +23,9 @@
 
 #define ARRAY_GROWTH_SIZE 5
 
+// Smallest allocation a string builder makes, so short strings don't regrow on every append
+#define STR_BUILDER_MIN_CAPACITY 64
+
 // Forward declarations.
 static HRESULT AllocHelper(
     __deref_out_ecount_part(cch, 0) LPWSTR* ppwz,
@@ -49,6 +56,22 @@ static HRESULT StrAllocStringMapInvariant(
     __in int cchSource,
     __in DWORD dwMapFlags
     );
+static HRESULT EnsureBuilderCapacity(
+    __in STR_BUILDER* pBuilder,
+    __in SIZE_T cchAppend
+    );
+#ifdef STR_HEX_SSE2
+static SIZE_T HexEncodeSse2(
+    __in_ecount(cbSource) const BYTE* pbSource,
+    __in SIZE_T cbSource,
+    __out_ecount(cbSource * 2) LPWSTR wzDest
+    );
+static SIZE_T HexDecodeSse2(
+    __in_ecount(cbDest * 2) LPCWSTR wzSource,
+    __out_bcount(cbDest) BYTE* pbDest,
+    __in SIZE_T cbDest
+    );
+#endif
 
 /********************************************************************
 StrAlloc - allocates or reuses dynamic string memory
@@ -113,12 +136,12 @@ static HRESULT AllocHelper(
         }
         else
         {
-            pwz = static_cast<LPWSTR>(MemReAlloc(*ppwz, sizeof(WCHAR)* cch, FALSE));
+            pwz = static_cast<LPWSTR>(MemReAllocSource(DUTIL_SOURCE_STRUTIL, *ppwz, sizeof(WCHAR)* cch, FALSE));
         }
     }
     else
     {
-        pwz = static_cast<LPWSTR>(MemAlloc(sizeof(WCHAR) * cch, TRUE));
+        pwz = static_cast<LPWSTR>(MemAllocSource(DUTIL_SOURCE_STRUTIL, sizeof(WCHAR) * cch, TRUE));
     }
 
     StrExitOnNull(pwz, hr, E_OUTOFMEMORY, "failed to allocate string, len: %u", cch);
@@ -232,11 +255,11 @@ extern "C" HRESULT DAPI StrAnsiAlloc(
 
     if (*ppsz)
     {
-        psz = static_cast<LPSTR>(MemReAlloc(*ppsz, sizeof(CHAR) * cch, FALSE));
+        psz = static_cast<LPSTR>(MemReAllocSource(DUTIL_SOURCE_STRUTIL, *ppsz, sizeof(CHAR) * cch, FALSE));
     }
     else
     {
-        psz = static_cast<LPSTR>(MemAlloc(sizeof(CHAR) * cch, TRUE));
+        psz = static_cast<LPSTR>(MemAllocSource(DUTIL_SOURCE_STRUTIL, sizeof(CHAR) * cch, TRUE));
     }
 
     StrExitOnNull(psz, hr, E_OUTOFMEMORY, "failed to allocate string, len: %u", cch);
@@ -477,11 +500,11 @@ extern "C" HRESULT DAPI StrAnsiAllocString(
 
         if (*ppsz)
         {
-            psz = static_cast<LPSTR>(MemReAlloc(*ppsz, sizeof(CHAR) * cch, TRUE));
+            psz = static_cast<LPSTR>(MemReAllocSource(DUTIL_SOURCE_STRUTIL, *ppsz, sizeof(CHAR) * cch, TRUE));
         }
         else
         {
-            psz = static_cast<LPSTR>(MemAlloc(sizeof(CHAR) * cch, TRUE));
+            psz = static_cast<LPSTR>(MemAllocSource(DUTIL_SOURCE_STRUTIL, sizeof(CHAR) * cch, TRUE));
         }
         StrExitOnNull(psz, hr, E_OUTOFMEMORY, "failed to allocate string, len: %u", cch);
 
@@ -557,11 +580,11 @@ extern "C" HRESULT DAPI StrAllocStringAnsi(
 
         if (*ppwz)
         {
-            pwz = static_cast<LPWSTR>(MemReAlloc(*ppwz, sizeof(WCHAR) * cch, TRUE));
+            pwz = static_cast<LPWSTR>(MemReAllocSource(DUTIL_SOURCE_STRUTIL, *ppwz, sizeof(WCHAR) * cch, TRUE));
         }
         else
         {
-            pwz = static_cast<LPWSTR>(MemAlloc(sizeof(WCHAR) * cch, TRUE));
+            pwz = static_cast<LPWSTR>(MemAllocSource(DUTIL_SOURCE_STRUTIL, sizeof(WCHAR) * cch, TRUE));
         }
 
         StrExitOnNull(pwz, hr, E_OUTOFMEMORY, "failed to allocate string, len: %u", cch);
@@ -1453,7 +1476,7 @@ extern "C" HRESULT DAPI StrHexEncode(
     Assert(pbSource && wzDest);
 
     HRESULT hr = S_OK;
-    DWORD i;
+    SIZE_T i = 0;
     BYTE b;
 
     if (cchDest < 2 * cbSource + 1)
@@ -1461,7 +1484,16 @@ extern "C" HRESULT DAPI StrHexEncode(
         ExitFunction1(hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
     }
 
-    for (i = 0; i < cbSource; ++i)
+#ifdef STR_HEX_SSE2
+    if (::IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE))
+    {
+        i = HexEncodeSse2(pbSource, cbSource, wzDest);
+        pbSource += i;
+        wzDest += 2 * i;
+    }
+#endif
+
+    for (/* i already initialized */; i < cbSource; ++i)
     {
         b = (*pbSource) >> 4;
         *(wzDest++) = (WCHAR)(L'0' + b + ((b < 10) ? 0 : L'A'-L'9'-1));
@@ -1517,7 +1549,7 @@ extern "C" HRESULT DAPI StrHexDecode(
 
     HRESULT hr = S_OK;
     DWORD cchSource = lstrlenW(wzSource);
-    DWORD i;
+    SIZE_T i = 0;
     BYTE b;
 
     Assert(0 == cchSource % 2);
@@ -1527,7 +1559,17 @@ extern "C" HRESULT DAPI StrHexDecode(
         StrExitOnRootFailure(hr, "Insufficient buffer to decode string '%ls' len: %u into %u bytes.", wzSource, cchSource, cbDest);
     }
 
-    for (i = 0; i < cchSource / 2; ++i)
+#ifdef STR_HEX_SSE2
+    // The vector path stops at the first block with a non-hex character, the loop below handles the rest.
+    if (::IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE))
+    {
+        i = HexDecodeSse2(wzSource, pbDest, cchSource / 2);
+        wzSource += 2 * i;
+        pbDest += i;
+    }
+#endif
+
+    for (/* i already initialized */; i < cchSource / 2; ++i)
     {
         b = HexCharToByte(*wzSource++);
         (*pbDest) = b << 4;
@@ -1571,7 +1613,7 @@ extern "C" HRESULT DAPI StrAllocHexDecode(
     }
 
     cb = static_cast<DWORD>(cch / 2);
-    pb = static_cast<BYTE*>(MemAlloc(cb, TRUE));
+    pb = static_cast<BYTE*>(MemAllocSource(DUTIL_SOURCE_STRUTIL, cb, TRUE));
     StrExitOnNull(pb, hr, E_OUTOFMEMORY, "Failed to allocate memory for hex decode.");
 
     hr = StrHexDecode(wzSource, pb, cb);
@@ -1620,6 +1662,14 @@ const BYTE Base85DecodeTable[256] =
 
 const UINT Base85PowerTable[4] = { 1, 85, 85*85, 85*85*85 };
 
+static inline DWORD Base85DecodeChar(
+    __in WCHAR wc
+    )
+{
+    // anything outside the table is as illegal as the symbols it marks with 85
+    return wc < countof(Base85DecodeTable) ? Base85DecodeTable[wc] : 85;
+}
+
 
 /****************************************************************************
 StrAllocBase85Encode - converts an array of bytes into an XML compatible string
@@ -1728,8 +1778,10 @@ extern "C" HRESULT DAPI StrAllocBase85Decode(
     )
 {
     HRESULT hr = S_OK;
-    SIZE_T cchSource = lstrlenW(wzSource);
-    DWORD_PTR i, n, k;
+    SIZE_T cchSource = 0;
+    DWORD_PTR i, k;
+    DWORD64 n;
+    DWORD rgk[5];
 
     BYTE* pbDest;
     SIZE_T cbDest;
@@ -1739,6 +1791,8 @@ extern "C" HRESULT DAPI StrAllocBase85Decode(
         return E_INVALIDARG;
     }
 
+    cchSource = lstrlenW(wzSource);
+
     // evaluate size of output and check it
     k = cchSource / 5;
     cbDest = k << 2;
@@ -1754,7 +1808,7 @@ extern "C" HRESULT DAPI StrAllocBase85Decode(
         cbDest += k - 1;
     }
 
-    *ppbDest = static_cast<BYTE*>(MemAlloc(cbDest, FALSE));
+    *ppbDest = static_cast<BYTE*>(MemAllocSource(DUTIL_SOURCE_STRUTIL, cbDest, FALSE));
     StrExitOnNull(*ppbDest, hr, E_OUTOFMEMORY, "failed allocate memory to decode the string");
 
     pbDest = *ppbDest;
@@ -1763,55 +1817,25 @@ extern "C" HRESULT DAPI StrAllocBase85Decode(
     // decode full words first
     while (5 <= cchSource)
     {
-        k = Base85DecodeTable[wzSource[0]];
-        if (85 == k)
+        for (i = 0; i < 5; ++i)
         {
-            // illegal symbol
-            return E_UNEXPECTED;
+            rgk[i] = Base85DecodeChar(wzSource[i]);
         }
-        n = k;
 
-        k = Base85DecodeTable[wzSource[1]];
-        if (85 == k)
+        // legal symbols decode to 0-84, so adding 43 sets bit 7 only for the illegal marker (85)
+        if ((rgk[0] + 43 | rgk[1] + 43 | rgk[2] + 43 | rgk[3] + 43 | rgk[4] + 43) & 0x80)
         {
             // illegal symbol
-            return E_UNEXPECTED;
+            ExitFunction1(hr = E_UNEXPECTED);
         }
-        n += k * 85;
 
-        k = Base85DecodeTable[wzSource[2]];
-        if (85 == k)
-        {
-            // illegal symbol
-            return E_UNEXPECTED;
-        }
-        n += k * (85 * 85);
-
-        k = Base85DecodeTable[wzSource[3]];
-        if (85 == k)
-        {
-            // illegal symbol
-            return E_UNEXPECTED;
-        }
-        n += k * (85 * 85 * 85);
-
-        k = Base85DecodeTable[wzSource[4]];
-        if (85 == k)
-        {
-            // illegal symbol
-            return E_UNEXPECTED;
-        }
-        k *= (85 * 85 * 85 * 85);
-
-        // if (k + n > (1u << 32)) <=> (k > ~n) then decode error
-        if (k > ~n)
+        n = rgk[0] + rgk[1] * 85 + rgk[2] * (85 * 85) + rgk[3] * (85 * 85 * 85) + rgk[4] * static_cast<DWORD64>(85 * 85 * 85 * 85);
+        if (n > DWORD_MAX)
         {
             // overflow
-            return E_UNEXPECTED;
+            ExitFunction1(hr = E_UNEXPECTED);
         }
 
-        n += k;
-
         pbDest[0] = (BYTE) n;
         pbDest[1] = (BYTE) (n >> 8);
         pbDest[2] = (BYTE) (n >> 16);
@@ -1827,11 +1851,11 @@ extern "C" HRESULT DAPI StrAllocBase85Decode(
         n = 0;
         for (i = 0; i < cchSource; ++i)
         {
-            k = Base85DecodeTable[wzSource[i]];
+            k = Base85DecodeChar(wzSource[i]);
             if (85 == k)
             {
                 // illegal symbol
-                return E_UNEXPECTED;
+                ExitFunction1(hr = E_UNEXPECTED);
             }
 
             n += k * Base85PowerTable[i];
@@ -1846,13 +1870,19 @@ extern "C" HRESULT DAPI StrAllocBase85Decode(
         if (0 != n)
         {
             // decode error
-            return E_UNEXPECTED;
+            ExitFunction1(hr = E_UNEXPECTED);
         }
     }
 
     hr = S_OK;
 
 LExit:
+    if (FAILED(hr))
+    {
+        ReleaseNullMem(*ppbDest);
+        *pcbDest = 0;
+    }
+
     return hr;
 }
 
@@ -1992,35 +2022,22 @@ extern "C" HRESULT DAPI MultiSzFindSubstring(
     Assert(pwzMultiSz && *pwzMultiSz && pwzSubstring && *pwzSubstring);
 
     HRESULT hr = S_FALSE; // Assume we won't find it (the glass is half empty)
-    LPCWSTR wz = pwzMultiSz;
+    STR_TOKENIZER tokenizer = { };
+    STR_VIEW string = { };
     DWORD_PTR dwIndex = 0;
-    SIZE_T cchMultiSz = 0;
-    SIZE_T cchProgress = 0;
 
-    hr = MultiSzLen(pwzMultiSz, &cchMultiSz);
+    hr = StrTokenizerInitializeMultiSz(&tokenizer, pwzMultiSz, 0);
     StrExitOnFailure(hr, "failed to get the length of a MULTISZ string");
 
-    // Find the string containing the sub string
-    hr = S_OK;
-    while (NULL == wcsistr(wz, pwzSubstring))
+    // Find the string containing the sub string, every string in a MULTISZ is null terminated
+    hr = S_FALSE;
+    for (; StrTokenizerNext(&tokenizer, &string); ++dwIndex)
     {
-        // Slide through to the end of the current string
-        while (L'\0' != *wz && cchProgress < cchMultiSz)
-        {
-            ++wz;
-            ++cchProgress;
-        }
-
-        // If we're done, we're done
-        if (L'\0' == *(wz + 1) || cchProgress >= cchMultiSz)
+        if (wcsistr(string.wz, pwzSubstring))
         {
-            hr = S_FALSE;
+            hr = S_OK;
             break;
         }
-
-        // Move on to the next string
-        ++wz;
-        ++dwIndex;
     }
     Assert(S_OK == hr || S_FALSE == hr);
 
@@ -2034,7 +2051,7 @@ extern "C" HRESULT DAPI MultiSzFindSubstring(
 
         if (ppwzFoundIn)
         {
-            *ppwzFoundIn = wz;
+            *ppwzFoundIn = string.wz;
         }
     }
 
@@ -2058,35 +2075,22 @@ extern "C" HRESULT DAPI MultiSzFindString(
     Assert(pwzMultiSz && *pwzMultiSz && pwzString && *pwzString && (pdwIndex || ppwzFound));
 
     HRESULT hr = S_FALSE; // Assume we won't find it
-    LPCWSTR wz = pwzMultiSz;
+    STR_TOKENIZER tokenizer = { };
+    STR_VIEW string = { };
     DWORD_PTR dwIndex = 0;
-    SIZE_T cchMutliSz = 0;
-    SIZE_T cchProgress = 0;
 
-    hr = MultiSzLen(pwzMultiSz, &cchMutliSz);
+    hr = StrTokenizerInitializeMultiSz(&tokenizer, pwzMultiSz, 0);
     StrExitOnFailure(hr, "failed to get the length of a MULTISZ string");
 
-    // Find the string
-    hr = S_OK;
-    while (0 != lstrcmpW(wz, pwzString))
+    // Find the string, every string in a MULTISZ is null terminated
+    hr = S_FALSE;
+    for (; StrTokenizerNext(&tokenizer, &string); ++dwIndex)
     {
-        // Slide through to the end of the current string
-        while (L'\0' != *wz && cchProgress < cchMutliSz)
+        if (0 == lstrcmpW(string.wz, pwzString))
         {
-            ++wz;
-            ++cchProgress;
-        }
-
-        // If we're done, we're done
-        if (L'\0' == *(wz + 1) || cchProgress >= cchMutliSz)
-        {
-            hr = S_FALSE;
+            hr = S_OK;
             break;
         }
-
-        // Move on to the next string
-        ++wz;
-        ++dwIndex;
     }
     Assert(S_OK == hr || S_FALSE == hr);
 
@@ -2100,7 +2104,7 @@ extern "C" HRESULT DAPI MultiSzFindString(
 
         if (ppwzFound)
         {
-            *ppwzFound = wz;
+            *ppwzFound = string.wz;
         }
     }
 
@@ -2677,25 +2681,227 @@ extern "C" HRESULT DAPI StrSplitAllocArray(
     )
 {
     HRESULT hr = S_OK;
-    LPWSTR sczCopy = NULL;
-    LPWSTR wzContext = NULL;
+    STR_TOKENIZER tokenizer = { };
+    STR_VIEW token = { };
 
-    // Copy wzSource so it is not modified.
-    hr = StrAllocString(&sczCopy, wzSource, 0);
-    StrExitOnFailure(hr, "Failed to copy the source string.");
+    StrTokenizerInitialize(&tokenizer, wzSource, 0, wzDelim, TRUE);
 
-    for (LPCWSTR wzToken = ::wcstok_s(sczCopy, wzDelim, &wzContext); wzToken; wzToken = ::wcstok_s(NULL, wzDelim, &wzContext))
+    while (StrTokenizerNext(&tokenizer, &token))
     {
-        hr = StrArrayAllocString(prgsczStrArray, pcStrArray, wzToken, 0);
+        hr = StrArrayAllocString(prgsczStrArray, pcStrArray, token.wz, token.cch);
         StrExitOnFailure(hr, "Failed to add the string to the string array.");
     }
 
 LExit:
-    ReleaseStr(sczCopy);
+    return hr;
+}
+
+/****************************************************************************
+StrTokenizerInitialize - prepares to split wzSource into tokens separated by
+any of the characters in wzDelimiters.
+
+NOTE: cchSource of 0 tokenizes the whole null terminated wzSource.
+      Neither wzSource nor wzDelimiters are copied, so both must outlive
+      the tokenizer.
+****************************************************************************/
+extern "C" void DAPI StrTokenizerInitialize(
+    __out STR_TOKENIZER* pTokenizer,
+    __in_ecount(cchSource) LPCWSTR wzSource,
+    __in SIZE_T cchSource,
+    __in_z LPCWSTR wzDelimiters,
+    __in BOOL fSkipEmpty
+    )
+{
+    Assert(pTokenizer && wzSource && wzDelimiters);
+
+    if (0 == cchSource)
+    {
+        cchSource = wcslen(wzSource);
+    }
+
+    pTokenizer->wzNext = wzSource;
+    pTokenizer->wzEnd = wzSource + cchSource;
+    pTokenizer->wzDelimiters = wzDelimiters;
+    pTokenizer->fSkipEmpty = fSkipEmpty;
+}
 
+/****************************************************************************
+StrTokenizerInitializeMultiSz - prepares to enumerate the strings in a
+MULTISZ as tokens.
+
+NOTE: cchMultiSz of 0 calculates the length with MultiSzLen()
+****************************************************************************/
+extern "C" HRESULT DAPI StrTokenizerInitializeMultiSz(
+    __out STR_TOKENIZER* pTokenizer,
+    __in __nullnullterminated LPCWSTR pwzMultiSz,
+    __in SIZE_T cchMultiSz
+    )
+{
+    Assert(pTokenizer && pwzMultiSz);
+
+    HRESULT hr = S_OK;
+
+    if (0 == cchMultiSz)
+    {
+        hr = MultiSzLen(pwzMultiSz, &cchMultiSz);
+        StrExitOnFailure(hr, "failed to get the length of a MULTISZ string");
+    }
+
+    pTokenizer->wzNext = pwzMultiSz;
+    pTokenizer->wzEnd = pwzMultiSz + cchMultiSz;
+    pTokenizer->wzDelimiters = NULL;
+    pTokenizer->fSkipEmpty = TRUE;
+
+LExit:
     return hr;
 }
 
+/****************************************************************************
+StrTokenizerNext - returns a view of the next token, or FALSE when there are
+no more tokens.
+
+****************************************************************************/
+extern "C" BOOL DAPI StrTokenizerNext(
+    __inout STR_TOKENIZER* pTokenizer,
+    __out STR_VIEW* pToken
+    )
+{
+    Assert(pTokenizer && pToken);
+
+    LPCWSTR wz = pTokenizer->wzNext;
+    LPCWSTR wzEnd = pTokenizer->wzEnd;
+    LPCWSTR wzDelimiters = pTokenizer->wzDelimiters;
+    LPCWSTR wzToken = NULL;
+
+    do
+    {
+        // A NULL wzNext means the last token was taken, possibly an empty one after a trailing delimiter
+        if (!wz || (wz == wzEnd && pTokenizer->fSkipEmpty))
+        {
+            pTokenizer->wzNext = NULL;
+            return FALSE;
+        }
+
+        wzToken = wz;
+
+        if (!wzDelimiters || (wzDelimiters[0] && !wzDelimiters[1]))
+        {
+            // A single delimiter is the common case, let wmemchr() scan for it
+            wz = wmemchr(wz, wzDelimiters ? wzDelimiters[0] : L'\0', wzEnd - wz);
+        }
+        else
+        {
+            while (wz < wzEnd && (L'\0' == *wz || !wcschr(wzDelimiters, *wz)))
+            {
+                ++wz;
+            }
+
+            if (wz == wzEnd)
+            {
+                wz = NULL;
+            }
+        }
+
+        pToken->wz = wzToken;
+        pToken->cch = (wz ? wz : wzEnd) - wzToken;
+
+        // Step over the delimiter, NULL tells the next call the end was reached
+        wz = wz ? wz + 1 : NULL;
+    } while (0 == pToken->cch && pTokenizer->fSkipEmpty);
+
+    pTokenizer->wzNext = wz;
+    return TRUE;
+}
+
+/****************************************************************************
+StrViewTrimWhitespace - shrinks a view to exclude leading and trailing
+spaces and tabs, the same whitespace StrTrimWhitespace() removes.
+
+****************************************************************************/
+extern "C" void DAPI StrViewTrimWhitespace(
+    __inout STR_VIEW* pView
+    )
+{
+    Assert(pView);
+
+    while (pView->cch && (L' ' == *pView->wz || L'\t' == *pView->wz))
+    {
+        ++pView->wz;
+        --pView->cch;
+    }
+
+    while (pView->cch && (L' ' == pView->wz[pView->cch - 1] || L'\t' == pView->wz[pView->cch - 1]))
+    {
+        --pView->cch;
+    }
+}
+
+/****************************************************************************
+StrViewCompare - compares two views with ::CompareStringW() in the invariant
+locale.
+
+NOTE: *pnResult is CSTR_LESS_THAN, CSTR_EQUAL or CSTR_GREATER_THAN
+****************************************************************************/
+extern "C" HRESULT DAPI StrViewCompare(
+    __in const STR_VIEW* pView1,
+    __in const STR_VIEW* pView2,
+    __in DWORD dwCompareFlags,
+    __out int* pnResult
+    )
+{
+    Assert(pView1 && pView2 && pnResult);
+
+    HRESULT hr = S_OK;
+
+    if (INT_MAX < pView1->cch || INT_MAX < pView2->cch)
+    {
+        hr = E_INVALIDARG;
+        StrExitOnRootFailure(hr, "String views are too long to compare.");
+    }
+
+    *pnResult = ::CompareStringW(LOCALE_INVARIANT, dwCompareFlags, pView1->wz, static_cast<int>(pView1->cch), pView2->wz, static_cast<int>(pView2->cch));
+    if (0 == *pnResult)
+    {
+        StrExitWithLastError(hr, "Failed to compare string views.");
+    }
+
+LExit:
+    return hr;
+}
+
+/****************************************************************************
+StrAllocStringView - allocates or reuses dynamic string memory and copies in
+the characters of a view, which may be empty.
+
+NOTE: caller is responsible for freeing ppwz even if function fails
+****************************************************************************/
+extern "C" HRESULT DAPI StrAllocStringView(
+    __deref_out_z LPWSTR* ppwz,
+    __in const STR_VIEW* pView
+    )
+{
+    Assert(pView);
+
+    // StrAllocString() treats a length of 0 as "the whole string", which is not what an empty view means
+    return AllocStringHelper(ppwz, pView->cch ? pView->wz : L"", pView->cch, FALSE);
+}
+
+/****************************************************************************
+StrAllocConcatView - allocates or reuses dynamic string memory and adds the
+characters of a view, which may be empty.
+
+NOTE: caller is responsible for freeing ppwz even if function fails
+****************************************************************************/
+extern "C" HRESULT DAPI StrAllocConcatView(
+    __deref_out_z LPWSTR* ppwz,
+    __in const STR_VIEW* pView
+    )
+{
+    Assert(pView);
+
+    return AllocConcatHelper(ppwz, pView->cch ? pView->wz : L"", pView->cch, FALSE);
+}
+
 /****************************************************************************
 StrAllocStringMapInvariant - helper function for the ToUpper and ToLower.
 
@@ -2731,6 +2937,185 @@ LExit:
     return hr;
 }
 
+/****************************************************************************
+StrBuilderInitialize - prepares a string builder, optionally allocating room
+for cchReserve characters up front.
+
+****************************************************************************/
+extern "C" HRESULT DAPI StrBuilderInitialize(
+    __out STR_BUILDER* pBuilder,
+    __in SIZE_T cchReserve
+    )
+{
+    HRESULT hr = S_OK;
+
+    memset(pBuilder, 0, sizeof(STR_BUILDER));
+
+    if (cchReserve)
+    {
+        hr = EnsureBuilderCapacity(pBuilder, cchReserve);
+        StrExitOnFailure(hr, "Failed to reserve string builder capacity: %u", cchReserve);
+    }
+
+LExit:
+    return hr;
+}
+
+extern "C" void DAPI StrBuilderUninitialize(
+    __in STR_BUILDER* pBuilder
+    )
+{
+    ReleaseStr(pBuilder->sczString);
+    memset(pBuilder, 0, sizeof(STR_BUILDER));
+}
+
+extern "C" HRESULT DAPI StrBuilderAppend(
+    __in STR_BUILDER* pBuilder,
+    __in_z LPCWSTR wzSource
+    )
+{
+    return StrBuilderAppendN(pBuilder, wzSource, lstrlenW(wzSource));
+}
+
+/****************************************************************************
+StrBuilderAppendN - appends cchSource characters from wzSource, which does
+not need to be null terminated.
+
+NOTE: wzSource must not point into the builder's own string, which may move
+      while growing.
+****************************************************************************/
+extern "C" HRESULT DAPI StrBuilderAppendN(
+    __in STR_BUILDER* pBuilder,
+    __in_ecount(cchSource) LPCWSTR wzSource,
+    __in SIZE_T cchSource
+    )
+{
+    HRESULT hr = S_OK;
+
+    hr = EnsureBuilderCapacity(pBuilder, cchSource);
+    StrExitOnFailure(hr, "Failed to grow string builder by: %u", cchSource);
+
+    memcpy_s(pBuilder->sczString + pBuilder->cch, (pBuilder->cchCapacity - pBuilder->cch) * sizeof(WCHAR), wzSource, cchSource * sizeof(WCHAR));
+    pBuilder->cch += cchSource;
+    pBuilder->sczString[pBuilder->cch] = L'\0';
+
+LExit:
+    return hr;
+}
+
+extern "C" HRESULT DAPI StrBuilderAppendChar(
+    __in STR_BUILDER* pBuilder,
+    __in WCHAR wch
+    )
+{
+    HRESULT hr = S_OK;
+
+    hr = EnsureBuilderCapacity(pBuilder, 1);
+    StrExitOnFailure(hr, "Failed to grow string builder.");
+
+    pBuilder->sczString[pBuilder->cch] = wch;
+    ++pBuilder->cch;
+    pBuilder->sczString[pBuilder->cch] = L'\0';
+
+LExit:
+    return hr;
+}
+
+extern "C" HRESULT __cdecl StrBuilderAppendFormatted(
+    __in STR_BUILDER* pBuilder,
+    __in __format_string LPCWSTR wzFormat,
+    ...
+    )
+{
+    Assert(pBuilder && wzFormat && *wzFormat);
+
+    HRESULT hr = S_OK;
+    va_list args;
+
+    va_start(args, wzFormat);
+    hr = StrBuilderAppendFormattedArgs(pBuilder, wzFormat, args);
+    va_end(args);
+
+    return hr;
+}
+
+/****************************************************************************
+StrBuilderAppendFormattedArgs - formats directly onto the end of the string,
+growing it until the formatted text fits.
+
+NOTE: unlike StrAllocConcatFormatted(), the builder's own string can't be
+      passed as a formatting argument since it may move while growing.
+****************************************************************************/
+extern "C" HRESULT DAPI StrBuilderAppendFormattedArgs(
+    __in STR_BUILDER* pBuilder,
+    __in __format_string LPCWSTR wzFormat,
+    __in va_list args
+    )
+{
+    Assert(pBuilder && wzFormat && *wzFormat);
+
+    HRESULT hr = S_OK;
+    SIZE_T cchAppend = 0;
+    LPWSTR pwzEnd = NULL;
+
+    // Start by guessing the formatted text is about as long as the format
+    cchAppend = lstrlenW(wzFormat) + 1;
+
+    for (;;)
+    {
+        hr = EnsureBuilderCapacity(pBuilder, cchAppend);
+        StrExitOnFailure(hr, "Failed to grow string builder to format: %ls", wzFormat);
+
+        hr = ::StringCchVPrintfExW(pBuilder->sczString + pBuilder->cch, pBuilder->cchCapacity - pBuilder->cch, &pwzEnd, NULL, 0, wzFormat, args);
+        if (STRSAFE_E_INSUFFICIENT_BUFFER != hr)
+        {
+            break;
+        }
+
+        // Double the whole string rather than what was tried, so repeated appends stay linear
+        cchAppend = pBuilder->cchCapacity;
+    }
+
+    if (FAILED(hr))
+    {
+        // Drop anything a failed format left behind
+        pBuilder->sczString[pBuilder->cch] = L'\0';
+        StrExitOnFailure(hr, "Failed to format string: %ls", wzFormat);
+    }
+
+    pBuilder->cch = static_cast<SIZE_T>(pwzEnd - pBuilder->sczString);
+
+LExit:
+    return hr;
+}
+
+/****************************************************************************
+StrBuilderDetach - hands the built string to the caller and resets the
+builder. An empty builder produces an empty string.
+
+NOTE: caller is responsible for freeing psczString even if function fails
+****************************************************************************/
+extern "C" HRESULT DAPI StrBuilderDetach(
+    __in STR_BUILDER* pBuilder,
+    __deref_out_z LPWSTR* psczString
+    )
+{
+    HRESULT hr = S_OK;
+
+    if (!pBuilder->sczString)
+    {
+        hr = EnsureBuilderCapacity(pBuilder, 0);
+        StrExitOnFailure(hr, "Failed to allocate empty string.");
+    }
+
+    ReleaseStr(*psczString);
+    *psczString = pBuilder->sczString;
+    memset(pBuilder, 0, sizeof(STR_BUILDER));
+
+LExit:
+    return hr;
+}
+
 /****************************************************************************
 StrSecureZeroString - zeroes out string to the make sure the contents
 don't remain in memory.
@@ -2777,3 +3162,154 @@ extern "C" DAPI_(HRESULT) StrSecureZeroFreeString(
 
     return hr;
 }
+
+/****************************************************************************
+EnsureBuilderCapacity - makes room for cchAppend more characters plus the
+null terminator, at least doubling the capacity when it has to grow.
+
+****************************************************************************/
+static HRESULT EnsureBuilderCapacity(
+    __in STR_BUILDER* pBuilder,
+    __in SIZE_T cchAppend
+    )
+{
+    HRESULT hr = S_OK;
+    SIZE_T cchNeeded = 0;
+    SIZE_T cchNew = 0;
+
+    hr = ::SIZETAdd(pBuilder->cch, cchAppend, &cchNeeded);
+    StrExitOnFailure(hr, "Overflow while calculating string builder size.");
+
+    hr = ::SIZETAdd(cchNeeded, 1, &cchNeeded);
+    StrExitOnFailure(hr, "Overflow while calculating string builder size.");
+
+    if (cchNeeded > pBuilder->cchCapacity)
+    {
+        cchNew = pBuilder->cchCapacity < STR_BUILDER_MIN_CAPACITY ? STR_BUILDER_MIN_CAPACITY : pBuilder->cchCapacity;
+        while (cchNew < cchNeeded && cchNew < MAXDWORD / sizeof(WCHAR) / 2)
+        {
+            cchNew *= 2;
+        }
+
+        if (cchNew < cchNeeded)
+        {
+            cchNew = cchNeeded;
+        }
+
+        // AllocHelper() zeroes a new string, so the empty builder string is already terminated
+        hr = AllocHelper(&pBuilder->sczString, cchNew, FALSE);
+        StrExitOnFailure(hr, "Failed to grow string builder to: %u", cchNew);
+
+        pBuilder->cchCapacity = cchNew;
+    }
+
+LExit:
+    return hr;
+}
+
+#ifdef STR_HEX_SSE2
+/****************************************************************************
+HexEncodeSse2 - encodes whole 16 byte blocks of pbSource as uppercase hex,
+returning how many bytes were encoded. No null terminator is written.
+
+****************************************************************************/
+static SIZE_T HexEncodeSse2(
+    __in_ecount(cbSource) const BYTE* pbSource,
+    __in SIZE_T cbSource,
+    __out_ecount(cbSource * 2) LPWSTR wzDest
+    )
+{
+    const __m128i vLowNibble = _mm_set1_epi8(0x0F);
+    const __m128i vNine = _mm_set1_epi8(9);
+    const __m128i vDigitBase = _mm_set1_epi8('0');
+    const __m128i vLetterGap = _mm_set1_epi8('A' - '9' - 1);
+    const __m128i vZero = _mm_setzero_si128();
+    SIZE_T cbEncoded = 0;
+
+    for (; cbEncoded + 16 <= cbSource; cbEncoded += 16)
+    {
+        __m128i vBytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pbSource + cbEncoded));
+        __m128i vHigh = _mm_and_si128(_mm_srli_epi16(vBytes, 4), vLowNibble);
+        __m128i vLow = _mm_and_si128(vBytes, vLowNibble);
+
+        // interleave so every byte's high nibble comes before its low nibble
+        __m128i vChars0 = _mm_unpacklo_epi8(vHigh, vLow);
+        __m128i vChars1 = _mm_unpackhi_epi8(vHigh, vLow);
+
+        vChars0 = _mm_add_epi8(_mm_add_epi8(vChars0, vDigitBase), _mm_and_si128(_mm_cmpgt_epi8(vChars0, vNine), vLetterGap));
+        vChars1 = _mm_add_epi8(_mm_add_epi8(vChars1, vDigitBase), _mm_and_si128(_mm_cmpgt_epi8(vChars1, vNine), vLetterGap));
+
+        // widen to WCHARs
+        __m128i* pvDest = reinterpret_cast<__m128i*>(wzDest + cbEncoded * 2);
+        _mm_storeu_si128(pvDest, _mm_unpacklo_epi8(vChars0, vZero));
+        _mm_storeu_si128(pvDest + 1, _mm_unpackhi_epi8(vChars0, vZero));
+        _mm_storeu_si128(pvDest + 2, _mm_unpacklo_epi8(vChars1, vZero));
+        _mm_storeu_si128(pvDest + 3, _mm_unpackhi_epi8(vChars1, vZero));
+    }
+
+    return cbEncoded;
+}
+
+static inline BOOL HexCharsToNibblesSse2(
+    __in __m128i vChars,
+    __out __m128i* pvNibbles
+    )
+{
+    const __m128i vNine = _mm_set1_epi8(9);
+    const __m128i vFive = _mm_set1_epi8(5);
+    __m128i vDigit = _mm_sub_epi8(vChars, _mm_set1_epi8('0'));
+    __m128i vLetter = _mm_sub_epi8(_mm_or_si128(vChars, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+
+    // unsigned x <= n <=> max(x, n) == n, characters below '0' or 'a' wrap around to large values
+    __m128i vIsDigit = _mm_cmpeq_epi8(_mm_max_epu8(vDigit, vNine), vNine);
+    __m128i vIsLetter = _mm_cmpeq_epi8(_mm_max_epu8(vLetter, vFive), vFive);
+
+    if (0xFFFF != _mm_movemask_epi8(_mm_or_si128(vIsDigit, vIsLetter)))
+    {
+        return FALSE;
+    }
+
+    *pvNibbles = _mm_or_si128(_mm_and_si128(vIsDigit, vDigit), _mm_andnot_si128(vIsDigit, _mm_add_epi8(vLetter, _mm_set1_epi8(10))));
+    return TRUE;
+}
+
+/****************************************************************************
+HexDecodeSse2 - decodes whole 32 character blocks of wzSource into pbDest,
+returning how many bytes were decoded.
+
+NOTE: stops early at the first block that contains a non-hex character
+****************************************************************************/
+static SIZE_T HexDecodeSse2(
+    __in_ecount(cbDest * 2) LPCWSTR wzSource,
+    __out_bcount(cbDest) BYTE* pbDest,
+    __in SIZE_T cbDest
+    )
+{
+    const __m128i vLowByte = _mm_set1_epi16(0x00FF);
+    SIZE_T cbDecoded = 0;
+    __m128i vNibbles0;
+    __m128i vNibbles1;
+
+    for (; cbDecoded + 16 <= cbDest; cbDecoded += 16)
+    {
+        const __m128i* pvSource = reinterpret_cast<const __m128i*>(wzSource + cbDecoded * 2);
+
+        // narrow to bytes, characters above 0xFF saturate to values that fail the hex check
+        __m128i vChars0 = _mm_packus_epi16(_mm_loadu_si128(pvSource), _mm_loadu_si128(pvSource + 1));
+        __m128i vChars1 = _mm_packus_epi16(_mm_loadu_si128(pvSource + 2), _mm_loadu_si128(pvSource + 3));
+
+        if (!HexCharsToNibblesSse2(vChars0, &vNibbles0) || !HexCharsToNibblesSse2(vChars1, &vNibbles1))
+        {
+            break;
+        }
+
+        // each 16-bit lane holds a high nibble in its low byte and the low nibble in its high byte
+        __m128i vBytes0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(vNibbles0, vLowByte), 4), _mm_srli_epi16(vNibbles0, 8));
+        __m128i vBytes1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(vNibbles1, vLowByte), 4), _mm_srli_epi16(vNibbles1, 8));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pbDest + cbDecoded), _mm_packus_epi16(vBytes0, vBytes1));
+    }
+
+    return cbDecoded;
+}
+#endif
@@ -7,6 +7,10 @@ using namespace Xunit;
 using namespace WixBuildTools::TestSupport;
 
 const DWORD numIterations = 100000;
+const DWORD numConcurrentReaders = 4;
+
+static volatile LONG vcConcurrentKeysAdded = 0;
+static volatile LONG vfConcurrentAddsDone = FALSE;
 
 namespace DutilTests
 {
@@ -16,6 +20,63 @@ namespace DutilTests
         LPWSTR sczKey;
     };
 
+    ref class ConcurrentDictReader
+    {
+    public:
+        STRINGDICT_HANDLE sdValues;
+        DWORD cMissingKeys;
+        DWORD cUnexpectedKeys;
+
+        ConcurrentDictReader(STRINGDICT_HANDLE sd)
+        {
+            sdValues = sd;
+        }
+
+        void Run()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczKey = NULL;
+            DWORD dwSeed = static_cast<DWORD>(::GetCurrentThreadId());
+
+            try
+            {
+                while (!vfConcurrentAddsDone)
+                {
+                    LONG cKeysAdded = vcConcurrentKeysAdded;
+                    if (0 == cKeysAdded)
+                    {
+                        continue;
+                    }
+
+                    dwSeed = dwSeed * 1103515245 + 12345;
+                    DWORD i = dwSeed % cKeysAdded;
+
+                    hr = StrAllocFormatted(&sczKey, L"%u_A_%u", i, i);
+                    NativeAssert::Succeeded(hr, "Failed to allocate expected key {0}", i);
+
+                    hr = DictKeyExists(sdValues, sczKey);
+                    if (S_OK != hr)
+                    {
+                        ++cMissingKeys;
+                    }
+
+                    hr = StrAllocFormatted(&sczKey, L"%u_b_%u", i, i);
+                    NativeAssert::Succeeded(hr, "Failed to allocate unexpected key {0}", i);
+
+                    hr = DictKeyExists(sdValues, sczKey);
+                    if (E_NOTFOUND != hr)
+                    {
+                        ++cUnexpectedKeys;
+                    }
+                }
+            }
+            finally
+            {
+                ReleaseStr(sczKey);
+            }
+        }
+    };
+
     public ref class DictUtil
     {
     public:
@@ -35,6 +96,164 @@ namespace DutilTests
             DutilUninitialize();
         }
 
+        [Fact]
+        void DictUtilIncrementalResizeTest()
+        {
+            DutilInitialize(&DutilTestTraceError);
+
+            EmbeddedKeyTestHelper(DICT_FLAG_INCREMENTAL_RESIZE, numIterations);
+
+            EmbeddedKeyTestHelper(static_cast<DICT_FLAG>(DICT_FLAG_CASEINSENSITIVE | DICT_FLAG_INCREMENTAL_RESIZE), numIterations);
+
+            StringListTestHelper(DICT_FLAG_INCREMENTAL_RESIZE, numIterations);
+
+            StringListTestHelper(static_cast<DICT_FLAG>(DICT_FLAG_CASEINSENSITIVE | DICT_FLAG_INCREMENTAL_RESIZE), numIterations);
+
+            DutilUninitialize();
+        }
+
+        [Fact]
+        void DictUtilPrefixKeysTest()
+        {
+            HRESULT hr = S_OK;
+            STRINGDICT_HANDLE sdValues = NULL;
+            LPCWSTR rgwzKeys[] = { L"", L"a", L"aa", L"aaa", L"ab", L"ba" };
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = DictCreateStringList(&sdValues, countof(rgwzKeys), DICT_FLAG_CASEINSENSITIVE);
+                NativeAssert::Succeeded(hr, "Failed to create dictionary of keys");
+
+                for (DWORD i = 0; i < countof(rgwzKeys); ++i)
+                {
+                    hr = DictKeyExists(sdValues, rgwzKeys[i]);
+                    NativeAssert::ValidReturnCode(hr, E_NOTFOUND);
+
+                    hr = DictAddKey(sdValues, rgwzKeys[i]);
+                    NativeAssert::Succeeded(hr, "Failed to add key {0} to dict", gcnew String(rgwzKeys[i]));
+                }
+
+                for (DWORD i = 0; i < countof(rgwzKeys); ++i)
+                {
+                    hr = DictKeyExists(sdValues, rgwzKeys[i]);
+                    NativeAssert::Succeeded(hr, "Failed to find key {0}", gcnew String(rgwzKeys[i]));
+                }
+
+                hr = DictKeyExists(sdValues, L"AAAA");
+                NativeAssert::ValidReturnCode(hr, E_NOTFOUND);
+
+                hr = DictKeyExists(sdValues, L"AB");
+                NativeAssert::Succeeded(hr, "Failed to find key case insensitively");
+            }
+            finally
+            {
+                ReleaseDict(sdValues);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void DictUtilNonAsciiCaseInsensitiveTest()
+        {
+            HRESULT hr = S_OK;
+            STRINGDICT_HANDLE sdValues = NULL;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = DictCreateStringList(&sdValues, 0, DICT_FLAG_CASEINSENSITIVE);
+                NativeAssert::Succeeded(hr, "Failed to create dictionary of keys");
+
+                hr = DictAddKey(sdValues, L"\u00E9cole");
+                NativeAssert::Succeeded(hr, "Failed to add accented key to dict");
+
+                hr = DictAddKey(sdValues, L"\u03B1\u03B2\u03B3");
+                NativeAssert::Succeeded(hr, "Failed to add greek key to dict");
+
+                hr = DictKeyExists(sdValues, L"\u00C9COLE");
+                NativeAssert::Succeeded(hr, "Failed to find upper-case accented key");
+
+                hr = DictKeyExists(sdValues, L"\u0391\u0392\u0393");
+                NativeAssert::Succeeded(hr, "Failed to find upper-case greek key");
+
+                hr = DictKeyExists(sdValues, L"ECOLE");
+                NativeAssert::ValidReturnCode(hr, E_NOTFOUND);
+            }
+            finally
+            {
+                ReleaseDict(sdValues);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void DictUtilConcurrentTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczKey = NULL;
+            STRINGDICT_HANDLE sdValues = NULL;
+            array<ConcurrentDictReader^>^ rgReaders = gcnew array<ConcurrentDictReader^>(numConcurrentReaders);
+            array<Threading::Thread^>^ rgThreads = gcnew array<Threading::Thread^>(numConcurrentReaders);
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = DictCreateStringListConcurrent(&sdValues, 0, DICT_FLAG_INCREMENTAL_RESIZE);
+                NativeAssert::ValidReturnCode(hr, E_INVALIDARG);
+
+                // Start from an empty dictionary so it grows many times while the readers are running
+                hr = DictCreateStringListConcurrent(&sdValues, 0, DICT_FLAG_CASEINSENSITIVE);
+                NativeAssert::Succeeded(hr, "Failed to create concurrent dictionary of keys");
+
+                vcConcurrentKeysAdded = 0;
+                vfConcurrentAddsDone = FALSE;
+
+                for (DWORD i = 0; i < numConcurrentReaders; ++i)
+                {
+                    rgReaders[i] = gcnew ConcurrentDictReader(sdValues);
+                    rgThreads[i] = gcnew Threading::Thread(gcnew Threading::ThreadStart(rgReaders[i], &ConcurrentDictReader::Run));
+                    rgThreads[i]->Start();
+                }
+
+                for (DWORD i = 0; i < numIterations; ++i)
+                {
+                    hr = StrAllocFormatted(&sczKey, L"%u_a_%u", i, i);
+                    NativeAssert::Succeeded(hr, "Failed to allocate key for value {0}", i);
+
+                    hr = DictAddKey(sdValues, sczKey);
+                    NativeAssert::Succeeded(hr, "Failed to add key {0} to dict", i);
+
+                    ::InterlockedExchange(&vcConcurrentKeysAdded, i + 1);
+                }
+            }
+            finally
+            {
+                ::InterlockedExchange(&vfConcurrentAddsDone, TRUE);
+
+                for (DWORD i = 0; i < numConcurrentReaders; ++i)
+                {
+                    if (rgThreads[i])
+                    {
+                        rgThreads[i]->Join();
+                    }
+                }
+
+                ReleaseStr(sczKey);
+                ReleaseDict(sdValues);
+                DutilUninitialize();
+            }
+
+            for (DWORD i = 0; i < numConcurrentReaders; ++i)
+            {
+                Assert::Equal<DWORD>(0, rgReaders[i]->cMissingKeys);
+                Assert::Equal<DWORD>(0, rgReaders[i]->cUnexpectedKeys);
+            }
+        }
+
     private:
         void EmbeddedKeyTestHelper(DICT_FLAG dfFlags, DWORD dwNumIterations)
         {
@@ -8,6 +8,33 @@ using namespace WixBuildTools::TestSupport;
 
 namespace DutilTests
 {
+    struct PipeWriter
+    {
+        HANDLE hPipe;
+        const BYTE* pbData;
+        DWORD cbData;
+    };
+
+    // Writes the data to the first client of the pipe, then closes it so the client sees the pipe end.
+    static DWORD WINAPI WritePipe(LPVOID pvContext)
+    {
+        PipeWriter* pWriter = static_cast<PipeWriter*>(pvContext);
+        DWORD cbTotalWritten = 0;
+        DWORD cbWritten = 0;
+
+        if (::ConnectNamedPipe(pWriter->hPipe, NULL) || ERROR_PIPE_CONNECTED == ::GetLastError())
+        {
+            // Writes fail once a reader that hit its limit closes its end, which is expected.
+            while (cbTotalWritten < pWriter->cbData && ::WriteFile(pWriter->hPipe, pWriter->pbData + cbTotalWritten, pWriter->cbData - cbTotalWritten, &cbWritten, NULL))
+            {
+                cbTotalWritten += cbWritten;
+            }
+        }
+
+        ReleaseFileHandle(pWriter->hPipe);
+        return 0;
+    }
+
     public ref class FileUtil
     {
     public:
@@ -49,7 +76,401 @@ namespace DutilTests
             }
         }
 
+        [Fact]
+        void FileUtilMapTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempDir = NULL;
+            LPWSTR sczFilePath = NULL;
+            LPWSTR sczEmptyFilePath = NULL;
+            BYTE* pbExpected = NULL;
+            BYTE* pbFile = NULL;
+            SIZE_T cbFile = 0;
+            FILE_MAP map = { };
+            LPBYTE pbData = NULL;
+            SIZE_T cbData = 0;
+            DWORD64 qwOffset = 0;
+            DWORD cViews = 0;
+            const SIZE_T cbExpected = 200000;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = PathExpand(&sczTempDir, L"%TEMP%\\FileUtilTest\\", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get temp dir");
+
+                hr = DirEnsureExists(sczTempDir, NULL);
+                NativeAssert::Succeeded(hr, "Failed to ensure directory exists: {0}", sczTempDir);
+
+                hr = PathConcat(sczTempDir, L"Map.bin", &sczFilePath);
+                NativeAssert::Succeeded(hr, "Failed to get path to mapped file");
+
+                hr = PathConcat(sczTempDir, L"MapEmpty.bin", &sczEmptyFilePath);
+                NativeAssert::Succeeded(hr, "Failed to get path to empty mapped file");
+
+                pbExpected = static_cast<BYTE*>(MemAlloc(cbExpected, FALSE));
+                NativeAssert::True(NULL != pbExpected);
+
+                for (SIZE_T i = 0; i < cbExpected; ++i)
+                {
+                    pbExpected[i] = static_cast<BYTE>(i * 7 + (i >> 9));
+                }
+
+                hr = FileWrite(sczFilePath, 0, pbExpected, cbExpected, NULL);
+                NativeAssert::Succeeded(hr, "Failed to write file to map");
+
+                // Without a window the whole file is in view.
+                hr = FileMap(sczFilePath, FALSE, 0, &map);
+                NativeAssert::Succeeded(hr, "Failed to map file");
+
+                NativeAssert::Equal<DWORD64>(cbExpected, map.cbFile);
+                NativeAssert::Equal<SIZE_T>(cbExpected, map.cbView);
+                NativeAssert::True(0 == memcmp(pbExpected, map.pbView, cbExpected));
+
+                FileUnmap(&map);
+
+                // A one byte window is rounded up to the allocation granularity and slides over the file.
+                hr = FileMap(sczFilePath, FALSE, 1, &map);
+                NativeAssert::Succeeded(hr, "Failed to map file with a window");
+
+                while (qwOffset < map.cbFile)
+                {
+                    hr = FileMapView(&map, qwOffset, &pbData, &cbData);
+                    NativeAssert::Succeeded(hr, "Failed to map view of file");
+
+                    NativeAssert::True(0 < cbData && cbData <= map.cbWindow);
+                    NativeAssert::True(0 == memcmp(pbExpected + qwOffset, pbData, cbData));
+
+                    qwOffset += cbData;
+                    ++cViews;
+                }
+
+                NativeAssert::True(1 < cViews);
+
+                hr = FileMapView(&map, cbExpected - 1, &pbData, &cbData);
+                NativeAssert::Succeeded(hr, "Failed to map view of last byte");
+                NativeAssert::Equal<SIZE_T>(1, cbData);
+                NativeAssert::Equal<BYTE>(pbExpected[cbExpected - 1], *pbData);
+
+                hr = FileMapView(&map, cbExpected, &pbData, &cbData);
+                NativeAssert::Succeeded(hr, "Failed to map view at end of file");
+                NativeAssert::Equal<SIZE_T>(0, cbData);
+
+                hr = FileMapView(&map, cbExpected + 1, &pbData, &cbData);
+                NativeAssert::ValidReturnCode(hr, E_INVALIDARG);
+
+                FileUnmap(&map);
+
+                // Changes through a writable view end up in the file.
+                hr = FileMap(sczFilePath, TRUE, 1, &map);
+                NativeAssert::Succeeded(hr, "Failed to map file for writing");
+
+                hr = FileMapView(&map, cbExpected - 10, &pbData, &cbData);
+                NativeAssert::Succeeded(hr, "Failed to map view to write");
+
+                pbData[0] = pbExpected[cbExpected - 10] = 0xAB;
+
+                hr = FileMapView(&map, 10, &pbData, &cbData);
+                NativeAssert::Succeeded(hr, "Failed to map view to write");
+
+                pbData[0] = pbExpected[10] = 0xCD;
+
+                FileUnmap(&map);
+
+                hr = FileRead(&pbFile, &cbFile, sczFilePath);
+                NativeAssert::Succeeded(hr, "Failed to read mapped file");
+
+                NativeAssert::Equal<SIZE_T>(cbExpected, cbFile);
+                NativeAssert::True(0 == memcmp(pbExpected, pbFile, cbExpected));
+
+                // Empty files have nothing to map but still open.
+                hr = FileWrite(sczEmptyFilePath, 0, NULL, 0, NULL);
+                NativeAssert::Succeeded(hr, "Failed to write empty file");
+
+                hr = FileMap(sczEmptyFilePath, FALSE, 0, &map);
+                NativeAssert::Succeeded(hr, "Failed to map empty file");
+
+                NativeAssert::Equal<DWORD64>(0, map.cbFile);
+                NativeAssert::True(NULL == map.pbView);
+
+                FileUnmap(&map);
+
+                hr = DirEnsureDelete(sczTempDir, TRUE, TRUE);
+            }
+            finally
+            {
+                FileUnmap(&map);
+                ReleaseMem(pbFile);
+                ReleaseMem(pbExpected);
+                ReleaseStr(sczEmptyFilePath);
+                ReleaseStr(sczFilePath);
+                ReleaseStr(sczTempDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void FileUtilReadPartialTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempDir = NULL;
+            LPWSTR sczFilePath = NULL;
+            BYTE* pbExpected = NULL;
+            BYTE* pbFile = NULL;
+            SIZE_T cbFile = 0;
+            const SIZE_T cbExpected = 200000;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = PathExpand(&sczTempDir, L"%TEMP%\\FileUtilTest\\", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get temp dir");
+
+                hr = DirEnsureExists(sczTempDir, NULL);
+                NativeAssert::Succeeded(hr, "Failed to ensure directory exists: {0}", sczTempDir);
+
+                hr = PathConcat(sczTempDir, L"Read.bin", &sczFilePath);
+                NativeAssert::Succeeded(hr, "Failed to get path to file to read");
+
+                pbExpected = static_cast<BYTE*>(MemAlloc(cbExpected, FALSE));
+                NativeAssert::True(NULL != pbExpected);
+
+                for (SIZE_T i = 0; i < cbExpected; ++i)
+                {
+                    pbExpected[i] = static_cast<BYTE>(i * 13 + (i >> 11));
+                }
+
+                hr = FileWrite(sczFilePath, 0, pbExpected, cbExpected, NULL);
+                NativeAssert::Succeeded(hr, "Failed to write file to read");
+
+                hr = FileRead(&pbFile, &cbFile, sczFilePath);
+                NativeAssert::Succeeded(hr, "Failed to read file");
+
+                NativeAssert::Equal<SIZE_T>(cbExpected, cbFile);
+                NativeAssert::True(0 == memcmp(pbExpected, pbFile, cbExpected));
+
+                // Reading into the existing buffer reallocates it to fit.
+                hr = FileReadPartial(&pbFile, &cbFile, sczFilePath, TRUE, 1000, 5000, TRUE);
+                NativeAssert::Succeeded(hr, "Failed to read part of file");
+
+                NativeAssert::Equal<SIZE_T>(5000, cbFile);
+                NativeAssert::True(0 == memcmp(pbExpected + 1000, pbFile, cbFile));
+
+                // A partial read past the end of the file gets what is there.
+                hr = FileReadPartial(&pbFile, &cbFile, sczFilePath, TRUE, cbExpected - 1000, 5000, TRUE);
+                NativeAssert::Succeeded(hr, "Failed to read end of file");
+
+                NativeAssert::Equal<SIZE_T>(1000, cbFile);
+                NativeAssert::True(0 == memcmp(pbExpected + cbExpected - 1000, pbFile, cbFile));
+
+                ReleaseNullMem(pbFile);
+
+                hr = FileReadUntil(&pbFile, &cbFile, sczFilePath, 100);
+                NativeAssert::ValidReturnCode(hr, HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+                NativeAssert::True(NULL == pbFile);
+
+                hr = DirEnsureDelete(sczTempDir, TRUE, TRUE);
+            }
+            finally
+            {
+                ReleaseMem(pbFile);
+                ReleaseMem(pbExpected);
+                ReleaseStr(sczFilePath);
+                ReleaseStr(sczTempDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void FileUtilReadLargeTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempDir = NULL;
+            LPWSTR sczFilePath = NULL;
+            BYTE* pbExpected = NULL;
+            BYTE* pbFile = NULL;
+            SIZE_T cbFile = 0;
+            IO_COUNTERS ioBefore = { };
+            IO_COUNTERS ioAfter = { };
+            ULONGLONG cReads = 0;
+            ULONGLONG cFewestReads = ULLONG_MAX;
+            const DWORD cbChunk = 8 * 1024 * 1024;
+            const SIZE_T cbExpected = 2 * cbChunk + 12345;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = PathExpand(&sczTempDir, L"%TEMP%\\FileUtilTest\\", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get temp dir");
+
+                hr = DirEnsureExists(sczTempDir, NULL);
+                NativeAssert::Succeeded(hr, "Failed to ensure directory exists: {0}", sczTempDir);
+
+                hr = PathConcat(sczTempDir, L"ReadLarge.bin", &sczFilePath);
+                NativeAssert::Succeeded(hr, "Failed to get path to file to read");
+
+                pbExpected = static_cast<BYTE*>(MemAlloc(cbExpected, FALSE));
+                NativeAssert::True(NULL != pbExpected);
+
+                for (SIZE_T i = 0; i < cbExpected; ++i)
+                {
+                    pbExpected[i] = static_cast<BYTE>(i * 31 + (i >> 13));
+                }
+
+                hr = FileWrite(sczFilePath, 0, pbExpected, cbExpected, NULL);
+                NativeAssert::Succeeded(hr, "Failed to write file to read");
+
+                // The file is read in several chunks, the last one short.
+                hr = FileRead(&pbFile, &cbFile, sczFilePath);
+                NativeAssert::Succeeded(hr, "Failed to read large file");
+
+                NativeAssert::Equal<SIZE_T>(cbExpected, cbFile);
+                NativeAssert::True(0 == memcmp(pbExpected, pbFile, cbExpected));
+
+                // Each chunk takes one ReadFile(). The I/O counters are for the whole process, so the fewest reads
+                // seen over a few tries leaves out reads by tests running at the same time.
+                for (DWORD i = 0; i < 5; ++i)
+                {
+                    NativeAssert::True(::GetProcessIoCounters(::GetCurrentProcess(), &ioBefore));
+
+                    hr = FileRead(&pbFile, &cbFile, sczFilePath);
+                    NativeAssert::Succeeded(hr, "Failed to read large file");
+
+                    NativeAssert::True(::GetProcessIoCounters(::GetCurrentProcess(), &ioAfter));
+
+                    cReads = ioAfter.ReadOperationCount - ioBefore.ReadOperationCount;
+                    if (cReads < cFewestReads)
+                    {
+                        cFewestReads = cReads;
+                    }
+                }
+
+                NativeAssert::Equal<ULONGLONG>(3, cFewestReads);
+
+                // A read that starts just before a chunk boundary and ends just after the next one.
+                hr = FileReadPartial(&pbFile, &cbFile, sczFilePath, TRUE, cbChunk - 100, cbChunk + 200, FALSE);
+                NativeAssert::Succeeded(hr, "Failed to read across chunks of large file");
+
+                NativeAssert::Equal<SIZE_T>(cbChunk + 200, cbFile);
+                NativeAssert::True(0 == memcmp(pbExpected + cbChunk - 100, pbFile, cbFile));
+
+                hr = DirEnsureDelete(sczTempDir, TRUE, TRUE);
+            }
+            finally
+            {
+                ReleaseMem(pbFile);
+                ReleaseMem(pbExpected);
+                ReleaseStr(sczFilePath);
+                ReleaseStr(sczTempDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void FileUtilReadPipeTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczPipe = NULL;
+            BYTE* pbExpected = NULL;
+            BYTE* pbRead = NULL;
+            SIZE_T cbRead = 0;
+            const DWORD cbExpected = 200000;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = StrAllocFormatted(&sczPipe, L"\\\\.\\pipe\\FileUtilTest.%u", ::GetCurrentProcessId());
+                NativeAssert::Succeeded(hr, "Failed to format pipe name");
+
+                pbExpected = static_cast<BYTE*>(MemAlloc(cbExpected, FALSE));
+                NativeAssert::True(NULL != pbExpected);
+
+                for (DWORD i = 0; i < cbExpected; ++i)
+                {
+                    pbExpected[i] = static_cast<BYTE>(i * 11 + (i >> 10));
+                }
+
+                // Pipes have no size, so the buffer grows until the pipe ends.
+                hr = ReadPipe(sczPipe, pbExpected, cbExpected, cbExpected + 1000, FALSE, &pbRead, &cbRead);
+                NativeAssert::Succeeded(hr, "Failed to read pipe smaller than the limit");
+
+                NativeAssert::Equal<SIZE_T>(cbExpected, cbRead);
+                NativeAssert::True(0 == memcmp(pbExpected, pbRead, cbRead));
+
+                ReleaseNullMem(pbRead);
+
+                // Filling the first buffer exactly still waits for the end of the pipe.
+                hr = ReadPipe(sczPipe, pbExpected, 64 * 1024, cbExpected, FALSE, &pbRead, &cbRead);
+                NativeAssert::Succeeded(hr, "Failed to read pipe the size of the first buffer");
+
+                NativeAssert::Equal<SIZE_T>(64 * 1024, cbRead);
+                NativeAssert::True(0 == memcmp(pbExpected, pbRead, cbRead));
+
+                ReleaseNullMem(pbRead);
+
+                // Exactly the limit is not too large when the pipe ends there.
+                hr = ReadPipe(sczPipe, pbExpected, cbExpected, cbExpected, FALSE, &pbRead, &cbRead);
+                NativeAssert::Succeeded(hr, "Failed to read pipe exactly the size of the limit");
+
+                NativeAssert::Equal<SIZE_T>(cbExpected, cbRead);
+                NativeAssert::True(0 == memcmp(pbExpected, pbRead, cbRead));
+
+                ReleaseNullMem(pbRead);
+
+                hr = ReadPipe(sczPipe, pbExpected, cbExpected, cbExpected - 1000, FALSE, &pbRead, &cbRead);
+                NativeAssert::ValidReturnCode(hr, HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER));
+                NativeAssert::True(NULL == pbRead);
+
+                hr = ReadPipe(sczPipe, pbExpected, cbExpected, cbExpected - 1000, TRUE, &pbRead, &cbRead);
+                NativeAssert::Succeeded(hr, "Failed to read part of pipe");
+
+                NativeAssert::Equal<SIZE_T>(cbExpected - 1000, cbRead);
+                NativeAssert::True(0 == memcmp(pbExpected, pbRead, cbRead));
+            }
+            finally
+            {
+                ReleaseMem(pbRead);
+                ReleaseMem(pbExpected);
+                ReleaseStr(sczPipe);
+                DutilUninitialize();
+            }
+        }
+
     private:
+        HRESULT ReadPipe(LPCWSTR wzPipe, const BYTE* pbData, DWORD cbData, DWORD cbMaxRead, BOOL fPartialOK, BYTE** ppbRead, SIZE_T* pcbRead)
+        {
+            HRESULT hr = S_OK;
+            PipeWriter writer = { INVALID_HANDLE_VALUE, pbData, cbData };
+            HANDLE hThread = NULL;
+
+            try
+            {
+                writer.hPipe = ::CreateNamedPipeW(wzPipe, PIPE_ACCESS_OUTBOUND, PIPE_TYPE_BYTE | PIPE_WAIT, 1, 4096, 4096, 0, NULL);
+                NativeAssert::True(INVALID_HANDLE_VALUE != writer.hPipe);
+
+                hThread = ::CreateThread(NULL, 0, WritePipe, &writer, 0, NULL);
+                if (!hThread)
+                {
+                    ReleaseFileHandle(writer.hPipe);
+                }
+                NativeAssert::True(NULL != hThread);
+
+                hr = FileReadPartial(ppbRead, pcbRead, wzPipe, FALSE, 0, cbMaxRead, fPartialOK);
+
+                ::WaitForSingleObject(hThread, INFINITE);
+            }
+            finally
+            {
+                ReleaseHandle(hThread);
+            }
+
+            return hr;
+        }
+
         void TestFile(LPWSTR wzDir, LPCWSTR wzTempDir, LPWSTR wzFileName, DWORD dwExpectedStringLength, FILE_ENCODING feExpectedEncoding)
         {
             HRESULT hr = S_OK;
@@ -64,6 +64,698 @@ namespace DutilTests
             }
         }
 
+        [Fact]
+        void IniUtilLargeFileTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempIniFilePath = NULL;
+            LPWSTR sczTempIniFileDir = NULL;
+            LPWSTR sczName = NULL;
+            LPWSTR sczValue = NULL;
+            STR_BUILDER contents = { };
+            INI_HANDLE iniHandle = NULL;
+            INI_VALUE *rgValues = NULL;
+            DWORD cValues = 0;
+            DWORD iValue = 0;
+            const DWORD cSections = 100;
+            const DWORD cValuesPerSection = 500;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = PathExpand(&sczTempIniFilePath, L"%TEMP%\\IniUtilTest\\Large.ini", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get path to temp INI file");
+
+                hr = PathGetDirectory(sczTempIniFilePath, &sczTempIniFileDir);
+                NativeAssert::Succeeded(hr, "Failed to get directory to temp INI file");
+
+                hr = DirEnsureExists(sczTempIniFileDir, NULL);
+                NativeAssert::Succeeded(hr, "Failed to ensure temp directory exists: {0}", sczTempIniFileDir);
+
+                hr = StrBuilderAppend(&contents, L";Comment\r\n");
+                NativeAssert::Succeeded(hr, "Failed to start INI contents");
+
+                for (DWORD s = 0; s < cSections; ++s)
+                {
+                    hr = StrBuilderAppendFormatted(&contents, L"[Section%u]\r\n", s);
+                    NativeAssert::Succeeded(hr, "Failed to add section");
+
+                    for (DWORD i = 0; i < cValuesPerSection; ++i)
+                    {
+                        hr = StrBuilderAppendFormatted(&contents, L"Name%u=Value%u_%u\r\n", i, s, i);
+                        NativeAssert::Succeeded(hr, "Failed to add value");
+                    }
+
+                    // A second value with the same name never shadows the first.
+                    if (1 == s)
+                    {
+                        hr = StrBuilderAppend(&contents, L"Name0=Duplicate\r\n");
+                        NativeAssert::Succeeded(hr, "Failed to add duplicate value");
+                    }
+                }
+
+                hr = FileWrite(sczTempIniFilePath, 0, reinterpret_cast<LPCBYTE>(contents.sczString), static_cast<DWORD>(contents.cch * sizeof(WCHAR)), NULL);
+                NativeAssert::Succeeded(hr, "Failed to write out INI file");
+
+                hr = IniInitialize(&iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                hr = StandardIniFormat(iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                hr = IniParse(iniHandle, sczTempIniFilePath, NULL);
+                NativeAssert::Succeeded(hr, "Failed to parse INI file");
+
+                // Patch every value, add one to a section in the middle and delete the first.
+                for (DWORD s = 0; s < cSections; ++s)
+                {
+                    for (DWORD i = 0; i < cValuesPerSection; ++i)
+                    {
+                        hr = StrAllocFormatted(&sczName, L"Section%u\\Name%u", s, i);
+                        NativeAssert::Succeeded(hr, "Failed to format name");
+
+                        hr = StrAllocFormatted(&sczValue, L"Value%u_%u", s, i);
+                        NativeAssert::Succeeded(hr, "Failed to format value");
+
+                        AssertValue(iniHandle, sczName, sczValue);
+
+                        hr = StrAllocFormatted(&sczValue, L"Patched%u_%u", s, i);
+                        NativeAssert::Succeeded(hr, "Failed to format value");
+
+                        hr = IniSetValue(iniHandle, sczName, sczValue);
+                        NativeAssert::Succeeded(hr, "Failed to set value in INI");
+                    }
+                }
+
+                hr = IniSetValue(iniHandle, L"Section50\\Added", L"New");
+                NativeAssert::Succeeded(hr, "Failed to add value to INI");
+
+                hr = IniSetValue(iniHandle, L"Section0\\Name0", NULL);
+                NativeAssert::Succeeded(hr, "Failed to kill value in INI");
+
+                AssertValue(iniHandle, L"Section1\\Name0", L"Patched1_0");
+                AssertValue(iniHandle, L"Section50\\Added", L"New");
+                AssertValue(iniHandle, L"Section51\\Name0", L"Patched51_0");
+                AssertNoValue(iniHandle, L"Section0\\Name0");
+
+                hr = IniWriteFile(iniHandle, NULL, FILE_ENCODING_UNSPECIFIED);
+                NativeAssert::Succeeded(hr, "Failed to write ini file back out to disk");
+
+                ReleaseNullIni(iniHandle);
+
+                hr = IniInitialize(&iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                hr = StandardIniFormat(iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                hr = IniParse(iniHandle, sczTempIniFilePath, NULL);
+                NativeAssert::Succeeded(hr, "Failed to parse INI file");
+
+                hr = IniGetValueList(iniHandle, &rgValues, &cValues);
+                NativeAssert::Succeeded(hr, "Failed to get list of values in INI");
+
+                NativeAssert::Equal<DWORD>(cSections * cValuesPerSection + 1, cValues);
+
+                // The values are written back in their original order. A new value goes in front of
+                // the last one in its section.
+                for (DWORD s = 0; s < cSections; ++s)
+                {
+                    for (DWORD i = (0 == s) ? 1 : 0; i < cValuesPerSection; ++i)
+                    {
+                        if (50 == s && cValuesPerSection - 1 == i)
+                        {
+                            NativeAssert::StringEqual(L"Section50\\Added", rgValues[iValue].wzName);
+                            ++iValue;
+                        }
+
+                        hr = StrAllocFormatted(&sczName, L"Section%u\\Name%u", s, i);
+                        NativeAssert::Succeeded(hr, "Failed to format name");
+
+                        NativeAssert::StringEqual(sczName, rgValues[iValue].wzName);
+                        ++iValue;
+                    }
+
+                    if (1 == s)
+                    {
+                        NativeAssert::StringEqual(L"Duplicate", rgValues[iValue].wzValue);
+                        ++iValue;
+                    }
+                }
+            }
+            finally
+            {
+                ReleaseIni(iniHandle);
+                StrBuilderUninitialize(&contents);
+                ReleaseStr(sczValue);
+                ReleaseStr(sczName);
+                ReleaseStr(sczTempIniFilePath);
+                ReleaseStr(sczTempIniFileDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void IniUtilEncodingParityTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempIniFilePath = NULL;
+            LPWSTR sczTempIniFileDir = NULL;
+            INI_HANDLE iniHandle = NULL;
+            INI_VALUE *rgValues = NULL;
+            DWORD cValues = 0;
+            FILE_ENCODING feEncoding = FILE_ENCODING_UNSPECIFIED;
+            LPCWSTR wzIniContents =
+                L"; leading comment\r\n"
+                L"TopLevel = top\r\n"
+                L"\r\n"
+                L"[ Section One]\r\n"
+                L"  Indented  =  spaced value \t\r\n"
+                L"Array[0]=first\r\n"
+                L"\u00e9;comment after one character\r\n"
+                L"\u00dcn\u00efc\u00f6d\u00e9=v\u00e4lue \U0001F600\r\n"
+                L"NoSeparator\r\n"
+                L"Equals=in=value\r\n"
+                L"Commented=value;comment\r\n"
+                L"[Second]\n"
+                L"Bare=lf only\n"
+                L"\n"
+                L"Last=no newline";
+            const INI_VALUE rgExpected[] =
+            {
+                { L"TopLevel", L"top", 2 },
+                { L"Section One\\  Indented", L"spaced value", 5 },
+                { L"Section One\\Array[0]", L"first", 6 },
+                { L"Section One\\\u00dcn\u00efc\u00f6d\u00e9", L"v\u00e4lue \U0001F600", 8 },
+                { L"Section One\\Equals", L"in=value", 10 },
+                { L"Section One\\Commented", L"value;comment", 11 },
+                { L"Second\\Bare", L"lf only", 13 },
+                { L"Second\\Last", L"no newline", 14 },
+            };
+            const FILE_ENCODING rgEncodings[] = { FILE_ENCODING_UTF8, FILE_ENCODING_UTF8_WITH_BOM, FILE_ENCODING_UTF16, FILE_ENCODING_UTF16_WITH_BOM };
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = PathExpand(&sczTempIniFilePath, L"%TEMP%\\IniUtilTest\\Encoding.ini", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get path to temp INI file");
+
+                hr = PathGetDirectory(sczTempIniFilePath, &sczTempIniFileDir);
+                NativeAssert::Succeeded(hr, "Failed to get directory to temp INI file");
+
+                hr = DirEnsureExists(sczTempIniFileDir, NULL);
+                NativeAssert::Succeeded(hr, "Failed to ensure temp directory exists: {0}", sczTempIniFileDir);
+
+                // Every encoding is parsed where it is mapped, and all of them must give the same values.
+                for (DWORD i = 0; i < countof(rgEncodings); ++i)
+                {
+                    hr = FileFromString(sczTempIniFilePath, 0, wzIniContents, rgEncodings[i]);
+                    NativeAssert::Succeeded(hr, "Failed to write out INI file");
+
+                    hr = IniInitialize(&iniHandle);
+                    NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                    hr = StandardIniFormat(iniHandle);
+                    NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                    hr = IniParse(iniHandle, sczTempIniFilePath, &feEncoding);
+                    NativeAssert::Succeeded(hr, "Failed to parse INI file");
+
+                    NativeAssert::Equal<DWORD>(rgEncodings[i], feEncoding);
+
+                    hr = IniGetValueList(iniHandle, &rgValues, &cValues);
+                    NativeAssert::Succeeded(hr, "Failed to get list of values in INI");
+
+                    NativeAssert::Equal<DWORD>(countof(rgExpected), cValues);
+
+                    for (DWORD j = 0; j < cValues; ++j)
+                    {
+                        NativeAssert::StringEqual(rgExpected[j].wzName, rgValues[j].wzName);
+                        NativeAssert::StringEqual(rgExpected[j].wzValue, rgValues[j].wzValue);
+                        NativeAssert::Equal<DWORD>(rgExpected[j].dwLineNumber, rgValues[j].dwLineNumber);
+                    }
+
+                    ReleaseNullIni(iniHandle);
+                }
+
+                // An empty file has no values and no encoding to report.
+                hr = FileWrite(sczTempIniFilePath, 0, NULL, 0, NULL);
+                NativeAssert::Succeeded(hr, "Failed to write out empty INI file");
+
+                hr = IniInitialize(&iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                hr = StandardIniFormat(iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                feEncoding = FILE_ENCODING_UNSPECIFIED;
+                hr = IniParse(iniHandle, sczTempIniFilePath, &feEncoding);
+                NativeAssert::Succeeded(hr, "Failed to parse empty INI file");
+
+                NativeAssert::Equal<DWORD>(FILE_ENCODING_UNSPECIFIED, feEncoding);
+
+                hr = IniGetValueList(iniHandle, &rgValues, &cValues);
+                NativeAssert::Succeeded(hr, "Failed to get list of values in INI");
+
+                NativeAssert::Equal<DWORD>(0, cValues);
+            }
+            finally
+            {
+                ReleaseIni(iniHandle);
+                ReleaseStr(sczTempIniFilePath);
+                ReleaseStr(sczTempIniFileDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void IniUtilWriteBackTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempIniFilePath = NULL;
+            LPWSTR sczTempIniFileDir = NULL;
+            LPWSTR sczTempFile = NULL;
+            LPWSTR sczContents = NULL;
+            INI_HANDLE iniHandle = NULL;
+            FILE_ENCODING feEncoding = FILE_ENCODING_UNSPECIFIED;
+            LPCWSTR wzIniContents =
+                L"; leading comment\r\n"
+                L"Top = 1\r\n"
+                L"[ One ]\r\n"
+                L"  a  =  x  \r\n"
+                L"[Two]\r\n"
+                L"b = y\r\n"
+                L"c=z\r\n"
+                L"[Three]\r\n"
+                L"d =  w";
+            LPCWSTR wzExpectedContents =
+                L"; leading comment\r\n"
+                L"Top = 1\r\n"
+                L"[ One ]\r\n"
+                L"  a  =  x  \r\n"
+                L"[Two]\r\n"
+                L"b=changed\r\n"
+                L"c=z\r\n"
+                L"[Three]\r\n"
+                L"d =  w\r\n"
+                L"[Four]\r\n"
+                L"e=new\r\n";
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = PathExpand(&sczTempIniFilePath, L"%TEMP%\\IniUtilTest\\WriteBack.ini", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get path to temp INI file");
+
+                hr = PathGetDirectory(sczTempIniFilePath, &sczTempIniFileDir);
+                NativeAssert::Succeeded(hr, "Failed to get directory to temp INI file");
+
+                hr = DirEnsureExists(sczTempIniFileDir, NULL);
+                NativeAssert::Succeeded(hr, "Failed to ensure temp directory exists: {0}", sczTempIniFileDir);
+
+                hr = FileFromString(sczTempIniFilePath, 0, wzIniContents, FILE_ENCODING_UTF8);
+                NativeAssert::Succeeded(hr, "Failed to write out INI file");
+
+                hr = IniInitialize(&iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                hr = StandardIniFormat(iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                hr = IniParse(iniHandle, sczTempIniFilePath, NULL);
+                NativeAssert::Succeeded(hr, "Failed to parse INI file");
+
+                hr = IniSetValue(iniHandle, L"Two\\b", L"changed");
+                NativeAssert::Succeeded(hr, "Failed to set value in INI");
+
+                hr = IniSetValue(iniHandle, L"Four\\e", L"new");
+                NativeAssert::Succeeded(hr, "Failed to set value in INI");
+
+                hr = IniWriteFile(iniHandle, NULL, FILE_ENCODING_UNSPECIFIED);
+                NativeAssert::Succeeded(hr, "Failed to write ini file back out to disk");
+
+                ReleaseNullIni(iniHandle);
+
+                // Only the section that changed is regenerated, the rest is written back exactly as it was read.
+                hr = FileToString(sczTempIniFilePath, &sczContents, &feEncoding);
+                NativeAssert::Succeeded(hr, "Failed to read INI file");
+
+                NativeAssert::Equal<DWORD>(FILE_ENCODING_UTF8, feEncoding);
+                NativeAssert::StringEqual(wzExpectedContents, sczContents);
+
+                // The file is written next to the target and then moved over it.
+                hr = StrAllocFormatted(&sczTempFile, L"%ls.000.tmp", sczTempIniFilePath);
+                NativeAssert::Succeeded(hr, "Failed to format temporary file path");
+
+                NativeAssert::True(!FileExistsEx(sczTempFile, NULL));
+
+                hr = IniInitialize(&iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                hr = StandardIniFormat(iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                hr = IniParse(iniHandle, sczTempIniFilePath, NULL);
+                NativeAssert::Succeeded(hr, "Failed to parse INI file");
+
+                AssertValue(iniHandle, L"Top", L"1");
+                AssertValue(iniHandle, L"One \\  a", L"x");
+                AssertValue(iniHandle, L"Two\\b", L"changed");
+                AssertValue(iniHandle, L"Two\\c", L"z");
+                AssertValue(iniHandle, L"Three\\d", L"w");
+                AssertValue(iniHandle, L"Four\\e", L"new");
+            }
+            finally
+            {
+                ReleaseIni(iniHandle);
+                ReleaseStr(sczContents);
+                ReleaseStr(sczTempFile);
+                ReleaseStr(sczTempIniFilePath);
+                ReleaseStr(sczTempIniFileDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void IniUtilWriteTempFilesTakenTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempIniFilePath = NULL;
+            LPWSTR sczTempIniFileDir = NULL;
+            LPWSTR sczTempFile = NULL;
+            INI_HANDLE iniHandle = NULL;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = PathExpand(&sczTempIniFilePath, L"%TEMP%\\IniUtilTest\\TempFilesTaken\\Test.ini", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get path to temp INI file");
+
+                hr = PathGetDirectory(sczTempIniFilePath, &sczTempIniFileDir);
+                NativeAssert::Succeeded(hr, "Failed to get directory to temp INI file");
+
+                hr = DirEnsureExists(sczTempIniFileDir, NULL);
+                NativeAssert::Succeeded(hr, "Failed to ensure temp directory exists: {0}", sczTempIniFileDir);
+
+                hr = FileFromString(sczTempIniFilePath, 0, L"[One]\r\na=x\r\n", FILE_ENCODING_UTF8);
+                NativeAssert::Succeeded(hr, "Failed to write out INI file");
+
+                // Every temporary name is already taken by another writer.
+                for (DWORD i = 0; i < 1000; ++i)
+                {
+                    hr = StrAllocFormatted(&sczTempFile, L"%ls.%03u.tmp", sczTempIniFilePath, i);
+                    NativeAssert::Succeeded(hr, "Failed to format temporary file path");
+
+                    hr = FileWrite(sczTempFile, 0, NULL, 0, NULL);
+                    NativeAssert::Succeeded(hr, "Failed to create temporary file: {0}", sczTempFile);
+                }
+
+                hr = IniInitialize(&iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                hr = StandardIniFormat(iniHandle);
+                NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                hr = IniParse(iniHandle, sczTempIniFilePath, NULL);
+                NativeAssert::Succeeded(hr, "Failed to parse INI file");
+
+                hr = IniSetValue(iniHandle, L"One\\a", L"changed");
+                NativeAssert::Succeeded(hr, "Failed to set value in INI");
+
+                hr = IniWriteFile(iniHandle, NULL, FILE_ENCODING_UNSPECIFIED);
+                NativeAssert::ValidReturnCode(hr, HRESULT_FROM_WIN32(ERROR_FILE_EXISTS));
+
+                // The failed write leaves the other writers' files alone.
+                for (DWORD i = 0; i < 1000; ++i)
+                {
+                    hr = StrAllocFormatted(&sczTempFile, L"%ls.%03u.tmp", sczTempIniFilePath, i);
+                    NativeAssert::Succeeded(hr, "Failed to format temporary file path");
+
+                    NativeAssert::True(FileExistsEx(sczTempFile, NULL));
+                }
+
+                ReleaseNullIni(iniHandle);
+
+                hr = DirEnsureDelete(sczTempIniFileDir, TRUE, TRUE);
+                NativeAssert::Succeeded(hr, "Failed to delete directory: {0}", sczTempIniFileDir);
+            }
+            finally
+            {
+                ReleaseIni(iniHandle);
+                ReleaseStr(sczTempFile);
+                ReleaseStr(sczTempIniFilePath);
+                ReleaseStr(sczTempIniFileDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void IniUtilPatchTimingTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempIniFilePath = NULL;
+            LPWSTR sczTempIniFileDir = NULL;
+            LPWSTR sczName = NULL;
+            LPWSTR sczValue = NULL;
+            INI_HANDLE iniHandle = NULL;
+            const DWORD cValuesPerSection = 500;
+            const DWORD rgcValues[] = { 1000, 50000, 500000 };
+            array<Double>^ rgdMilliseconds = gcnew array<Double>(countof(rgcValues));
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = PathExpand(&sczTempIniFilePath, L"%TEMP%\\IniUtilTest\\PatchTiming.ini", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get path to temp INI file");
+
+                hr = PathGetDirectory(sczTempIniFilePath, &sczTempIniFileDir);
+                NativeAssert::Succeeded(hr, "Failed to get directory to temp INI file");
+
+                hr = DirEnsureExists(sczTempIniFileDir, NULL);
+                NativeAssert::Succeeded(hr, "Failed to ensure temp directory exists: {0}", sczTempIniFileDir);
+
+                // Time parsing each file and patching every value in it.
+                for (DWORD c = 0; c < countof(rgcValues); ++c)
+                {
+                    DWORD cSections = rgcValues[c] / cValuesPerSection;
+
+                    WriteLargeIni(sczTempIniFilePath, cSections, cValuesPerSection, FILE_ENCODING_UTF16_WITH_BOM);
+
+                    Diagnostics::Stopwatch^ stopwatch = Diagnostics::Stopwatch::StartNew();
+
+                    hr = IniInitialize(&iniHandle);
+                    NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                    hr = StandardIniFormat(iniHandle);
+                    NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                    hr = IniParse(iniHandle, sczTempIniFilePath, NULL);
+                    NativeAssert::Succeeded(hr, "Failed to parse INI file");
+
+                    for (DWORD s = 0; s < cSections; ++s)
+                    {
+                        for (DWORD i = 0; i < cValuesPerSection; ++i)
+                        {
+                            hr = StrAllocFormatted(&sczName, L"Section%u\\Name%u", s, i);
+                            NativeAssert::Succeeded(hr, "Failed to format name");
+
+                            hr = StrAllocFormatted(&sczValue, L"Patched%u_%u", s, i);
+                            NativeAssert::Succeeded(hr, "Failed to format value");
+
+                            hr = IniSetValue(iniHandle, sczName, sczValue);
+                            NativeAssert::Succeeded(hr, "Failed to set value in INI");
+                        }
+                    }
+
+                    stopwatch->Stop();
+                    rgdMilliseconds[c] = stopwatch->Elapsed.TotalMilliseconds;
+
+                    AssertValue(iniHandle, L"Section1\\Name1", L"Patched1_1");
+
+                    ReleaseNullIni(iniHandle);
+                }
+
+                // Ten times the values should take about ten times as long, where a linear lookup per value took a hundred.
+                Assert::True(rgdMilliseconds[2] < 40 * Math::Max(rgdMilliseconds[1], 1.0), String::Format("Patching 1K, 50K and 500K values took {0:F0} ms, {1:F0} ms and {2:F0} ms.", rgdMilliseconds[0], rgdMilliseconds[1], rgdMilliseconds[2]));
+            }
+            finally
+            {
+                ReleaseIni(iniHandle);
+                ReleaseStr(sczValue);
+                ReleaseStr(sczName);
+                ReleaseStr(sczTempIniFilePath);
+                ReleaseStr(sczTempIniFileDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void IniUtilParseThroughputTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempIniFilePath = NULL;
+            LPWSTR sczTempIniFileDir = NULL;
+            INI_HANDLE iniHandle = NULL;
+            INI_VALUE *rgValues = NULL;
+            DWORD cValues = 0;
+            LONGLONG llSize = 0;
+            const DWORD cSections = 1000;
+            const DWORD cValuesPerSection = 500;
+            const FILE_ENCODING rgEncodings[] = { FILE_ENCODING_UTF8, FILE_ENCODING_UTF16_WITH_BOM };
+            array<Double>^ rgdMegabytesPerSecond = gcnew array<Double>(countof(rgEncodings));
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = PathExpand(&sczTempIniFilePath, L"%TEMP%\\IniUtilTest\\Throughput.ini", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get path to temp INI file");
+
+                hr = PathGetDirectory(sczTempIniFilePath, &sczTempIniFileDir);
+                NativeAssert::Succeeded(hr, "Failed to get directory to temp INI file");
+
+                hr = DirEnsureExists(sczTempIniFileDir, NULL);
+                NativeAssert::Succeeded(hr, "Failed to ensure temp directory exists: {0}", sczTempIniFileDir);
+
+                // Time parsing a file of half a million values, about 10 MB as UTF-8 and 20 MB as UTF-16.
+                for (DWORD i = 0; i < countof(rgEncodings); ++i)
+                {
+                    WriteLargeIni(sczTempIniFilePath, cSections, cValuesPerSection, rgEncodings[i]);
+
+                    hr = FileSize(sczTempIniFilePath, &llSize);
+                    NativeAssert::Succeeded(hr, "Failed to get size of INI file");
+
+                    Diagnostics::Stopwatch^ stopwatch = Diagnostics::Stopwatch::StartNew();
+
+                    hr = IniInitialize(&iniHandle);
+                    NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                    hr = StandardIniFormat(iniHandle);
+                    NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                    hr = IniParse(iniHandle, sczTempIniFilePath, NULL);
+                    NativeAssert::Succeeded(hr, "Failed to parse INI file");
+
+                    stopwatch->Stop();
+                    rgdMegabytesPerSecond[i] = llSize / (1024.0 * 1024.0) / Math::Max(stopwatch->Elapsed.TotalSeconds, 0.001);
+
+                    hr = IniGetValueList(iniHandle, &rgValues, &cValues);
+                    NativeAssert::Succeeded(hr, "Failed to get list of values in INI");
+
+                    NativeAssert::Equal<DWORD>(cSections * cValuesPerSection, cValues);
+
+                    ReleaseNullIni(iniHandle);
+                }
+
+                // The floor is far below what a single pass over the mapped file manages. It only catches a parse that
+                // stops being linear in the size of the file.
+                String^ message = String::Format("Parsed UTF-8 at {0:F1} MB/s and UTF-16 at {1:F1} MB/s.", rgdMegabytesPerSecond[0], rgdMegabytesPerSecond[1]);
+                Assert::True(2.0 < rgdMegabytesPerSecond[0], message);
+                Assert::True(2.0 < rgdMegabytesPerSecond[1], message);
+            }
+            finally
+            {
+                ReleaseIni(iniHandle);
+                ReleaseStr(sczTempIniFilePath);
+                ReleaseStr(sczTempIniFileDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void IniUtilWriteTimingTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempIniFilePath = NULL;
+            LPWSTR sczTempIniFileDir = NULL;
+            LPWSTR sczName = NULL;
+            INI_HANDLE iniHandle = NULL;
+            const DWORD cSections = 1000;
+            const DWORD cValuesPerSection = 500;
+            array<Double>^ rgdMilliseconds = gcnew array<Double>(2);
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = PathExpand(&sczTempIniFilePath, L"%TEMP%\\IniUtilTest\\WriteTiming.ini", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get path to temp INI file");
+
+                hr = PathGetDirectory(sczTempIniFilePath, &sczTempIniFileDir);
+                NativeAssert::Succeeded(hr, "Failed to get directory to temp INI file");
+
+                hr = DirEnsureExists(sczTempIniFileDir, NULL);
+                NativeAssert::Succeeded(hr, "Failed to ensure temp directory exists: {0}", sczTempIniFileDir);
+
+                // Time writing back a 10 MB file after changing one value, then after changing one value in every section.
+                for (DWORD c = 0; c < 2; ++c)
+                {
+                    WriteLargeIni(sczTempIniFilePath, cSections, cValuesPerSection, FILE_ENCODING_UTF8);
+
+                    hr = IniInitialize(&iniHandle);
+                    NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                    hr = StandardIniFormat(iniHandle);
+                    NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                    hr = IniParse(iniHandle, sczTempIniFilePath, NULL);
+                    NativeAssert::Succeeded(hr, "Failed to parse INI file");
+
+                    DWORD sFirst = (0 == c) ? cSections / 2 : 0;
+                    DWORD sLast = (0 == c) ? cSections / 2 : cSections - 1;
+
+                    for (DWORD s = sFirst; s <= sLast; ++s)
+                    {
+                        hr = StrAllocFormatted(&sczName, L"Section%u\\Name250", s);
+                        NativeAssert::Succeeded(hr, "Failed to format name");
+
+                        hr = IniSetValue(iniHandle, sczName, L"Changed");
+                        NativeAssert::Succeeded(hr, "Failed to set value in INI");
+                    }
+
+                    Diagnostics::Stopwatch^ stopwatch = Diagnostics::Stopwatch::StartNew();
+
+                    hr = IniWriteFile(iniHandle, NULL, FILE_ENCODING_UNSPECIFIED);
+                    NativeAssert::Succeeded(hr, "Failed to write ini file back out to disk");
+
+                    stopwatch->Stop();
+                    rgdMilliseconds[c] = stopwatch->Elapsed.TotalMilliseconds;
+
+                    ReleaseNullIni(iniHandle);
+
+                    hr = IniInitialize(&iniHandle);
+                    NativeAssert::Succeeded(hr, "Failed to initialize INI object");
+
+                    hr = StandardIniFormat(iniHandle);
+                    NativeAssert::Succeeded(hr, "Failed to set parameters for INI file");
+
+                    hr = IniParse(iniHandle, sczTempIniFilePath, NULL);
+                    NativeAssert::Succeeded(hr, "Failed to parse INI file");
+
+                    AssertValue(iniHandle, L"Section500\\Name250", L"Changed");
+                    AssertValue(iniHandle, L"Section500\\Name251", L"Value500_251");
+
+                    ReleaseNullIni(iniHandle);
+                }
+
+                // Unchanged sections are copied as they were read, so one change costs a fraction of regenerating them all.
+                Assert::True(rgdMilliseconds[0] < rgdMilliseconds[1] / 2, String::Format("Writing one changed value took {0:F0} ms and one in every section took {1:F0} ms.", rgdMilliseconds[0], rgdMilliseconds[1]));
+            }
+            finally
+            {
+                ReleaseIni(iniHandle);
+                ReleaseStr(sczName);
+                ReleaseStr(sczTempIniFilePath);
+                ReleaseStr(sczTempIniFileDir);
+                DutilUninitialize();
+            }
+        }
+
     private:
         void AssertValue(INI_HANDLE iniHandle, LPCWSTR wzValueName, LPCWSTR wzValue)
         {
@@ -116,6 +808,34 @@ namespace DutilTests
             return;
         }
 
+        void WriteLargeIni(LPCWSTR wzIniFilePath, DWORD cSections, DWORD cValuesPerSection, FILE_ENCODING feEncoding)
+        {
+            HRESULT hr = S_OK;
+            STR_BUILDER contents = { };
+
+            try
+            {
+                for (DWORD s = 0; s < cSections; ++s)
+                {
+                    hr = StrBuilderAppendFormatted(&contents, L"[Section%u]\r\n", s);
+                    NativeAssert::Succeeded(hr, "Failed to add section");
+
+                    for (DWORD i = 0; i < cValuesPerSection; ++i)
+                    {
+                        hr = StrBuilderAppendFormatted(&contents, L"Name%u=Value%u_%u\r\n", i, s, i);
+                        NativeAssert::Succeeded(hr, "Failed to add value");
+                    }
+                }
+
+                hr = FileFromString(wzIniFilePath, 0, contents.sczString, feEncoding);
+                NativeAssert::Succeeded(hr, "Failed to write out INI file: {0}", wzIniFilePath);
+            }
+            finally
+            {
+                StrBuilderUninitialize(&contents);
+            }
+        }
+
         static HRESULT StandardIniFormat(__inout INI_HANDLE iniHandle)
         {
             HRESULT hr = S_OK;
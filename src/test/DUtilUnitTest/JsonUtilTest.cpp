@@ -0,0 +1,694 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved. Licensed under the Microsoft Reciprocal License. See LICENSE.TXT file in the project root for full license information.
+
+#include "precomp.h"
+
+using namespace System;
+using namespace Xunit;
+using namespace WixBuildTools::TestSupport;
+
+const DWORD numJsonReaderThreads = 4;
+const DWORD numJsonReaderIterations = 1000;
+
+typedef struct _JSON_STREAM_OUTPUT
+{
+    LPBYTE pbData;
+    SIZE_T cbData;
+    DWORD cWrites;
+} JSON_STREAM_OUTPUT;
+
+static HRESULT CALLBACK CollectJsonStream(
+    __in_bcount(cbData) LPCBYTE pbData,
+    __in SIZE_T cbData,
+    __in_opt LPVOID pvContext
+    )
+{
+    JSON_STREAM_OUTPUT* pOutput = static_cast<JSON_STREAM_OUTPUT*>(pvContext);
+    LPVOID pv = pOutput->pbData ? MemReAlloc(pOutput->pbData, pOutput->cbData + cbData, FALSE) : MemAlloc(cbData, FALSE);
+
+    if (!pv)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    pOutput->pbData = static_cast<LPBYTE>(pv);
+    memcpy(pOutput->pbData + pOutput->cbData, pbData, cbData);
+    pOutput->cbData += cbData;
+    ++pOutput->cWrites;
+
+    return S_OK;
+}
+
+namespace DutilTests
+{
+    ref class JsonDocumentReader
+    {
+    public:
+        DWORD cTokens;
+        DWORD cFailures;
+
+        void Run()
+        {
+            HRESULT hr = S_OK;
+            JSON_READER reader = { };
+            JSON_TOKEN token = JSON_TOKEN_NONE;
+            JSON_VALUE value = { };
+
+            // Each thread owns its reader so none of them take a lock.
+            for (DWORD i = 0; i < numJsonReaderIterations; ++i)
+            {
+                hr = JsonInitializeReaderEx(L"{\"a\":[1,2.5,0.30000000000000004,\"x\\ty\"],\"b\":{\"c\":null}}", JSON_READER_FLAG_UNSYNCHRONIZED, &reader);
+                if (FAILED(hr))
+                {
+                    ++cFailures;
+                    continue;
+                }
+
+                do
+                {
+                    hr = JsonReadNext(&reader, &token, &value);
+                    if (SUCCEEDED(hr))
+                    {
+                        ++cTokens;
+
+                        if (JSON_VALUE_TYPE_DOUBLE == value.type && 2.5 != value.dValue && 0.30000000000000004 != value.dValue)
+                        {
+                            ++cFailures;
+                        }
+                    }
+                } while (SUCCEEDED(hr));
+
+                if (E_NOMOREITEMS != hr)
+                {
+                    ++cFailures;
+                }
+
+                JsonUninitializeReader(&reader);
+            }
+        }
+    };
+
+    public ref class JsonUtil
+    {
+    public:
+        [Fact]
+        void JsonUtilReadTokensTest()
+        {
+            HRESULT hr = S_OK;
+            JSON_READER reader = { };
+            JSON_TOKEN token = JSON_TOKEN_NONE;
+            JSON_VALUE value = { };
+            JSON_TOKEN rgExpected[] =
+            {
+                JSON_TOKEN_OBJECT_START,
+                JSON_TOKEN_OBJECT_KEY, JSON_TOKEN_VALUE,
+                JSON_TOKEN_OBJECT_KEY, JSON_TOKEN_ARRAY_START, JSON_TOKEN_VALUE, JSON_TOKEN_VALUE, JSON_TOKEN_VALUE, JSON_TOKEN_ARRAY_END,
+                JSON_TOKEN_OBJECT_KEY, JSON_TOKEN_OBJECT_START, JSON_TOKEN_OBJECT_END,
+                JSON_TOKEN_OBJECT_END,
+            };
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = JsonInitializeReader(L" {\"name\" : \"value\",\r\n\t\"list\": [true, false, null], \"empty\":{} } ", &reader);
+                NativeAssert::Succeeded(hr, "Failed to initialize JSON reader.");
+
+                for (DWORD i = 0; i < countof(rgExpected); ++i)
+                {
+                    hr = JsonReadNext(&reader, &token, &value);
+                    NativeAssert::Succeeded(hr, "Failed to read JSON token {0}.", i);
+                    NativeAssert::Equal<int>(rgExpected[i], token);
+                    NativeAssert::Equal<int>(token, reader.token);
+                }
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::ValidReturnCode(hr, E_NOMOREITEMS);
+                NativeAssert::Equal<DWORD>(0, reader.dwDepth);
+
+                JsonUninitializeReader(&reader);
+
+                hr = JsonInitializeReader(L"[\"a\", {}]", &reader);
+                NativeAssert::Succeeded(hr, "Failed to initialize JSON reader.");
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::Succeeded(hr, "Failed to read array start.");
+
+                hr = JsonReadValue(&reader, &value);
+                NativeAssert::Succeeded(hr, "Failed to read string value.");
+                NativeAssert::StringEqual(L"a", value.wzValue);
+
+                // JsonReadValue() only accepts scalars.
+                hr = JsonReadValue(&reader, &value);
+                NativeAssert::ValidReturnCode(hr, E_UNEXPECTED);
+            }
+            finally
+            {
+                JsonUninitializeReader(&reader);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void JsonUtilReadValuesTest()
+        {
+            HRESULT hr = S_OK;
+            JSON_READER reader = { };
+            JSON_TOKEN token = JSON_TOKEN_NONE;
+            JSON_VALUE value = { };
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = JsonInitializeReader(L"[\"plain\", \"a\\\"b\\\\c\\/d\\b\\f\\n\\r\\t\", \"\\u00e9\\ud83d\\ude00\", \"x\\u0000y\", 0, -42, 9223372036854775807, -9223372036854775808, 1.5, -2.5e-3, 1E2, 12345678901234567890, 0.1, true, false, null]", &reader);
+                NativeAssert::Succeeded(hr, "Failed to initialize JSON reader.");
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::Succeeded(hr, "Failed to read array start.");
+                NativeAssert::Equal<int>(JSON_TOKEN_ARRAY_START, token);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_STRING, &value);
+                NativeAssert::StringEqual(L"plain", value.wzValue);
+                NativeAssert::Equal<SIZE_T>(5, value.cchValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_STRING, &value);
+                NativeAssert::StringEqual(L"a\"b\\c/d\b\f\n\r\t", value.wzValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_STRING, &value);
+                NativeAssert::StringEqual(L"\x00e9\xd83d\xde00", value.wzValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_STRING, &value);
+                NativeAssert::Equal<SIZE_T>(3, value.cchValue);
+                NativeAssert::Equal<WCHAR>(L'\0', value.wzValue[1]);
+                NativeAssert::Equal<WCHAR>(L'y', value.wzValue[2]);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_INTEGER, &value);
+                NativeAssert::Equal<LONGLONG>(0, value.llValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_INTEGER, &value);
+                NativeAssert::Equal<LONGLONG>(-42, value.llValue);
+                NativeAssert::Equal<double>(-42.0, value.dValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_INTEGER, &value);
+                NativeAssert::Equal<LONGLONG>(LONGLONG_MAX, value.llValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_INTEGER, &value);
+                NativeAssert::Equal<LONGLONG>(LONGLONG_MIN, value.llValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_DOUBLE, &value);
+                NativeAssert::Equal<double>(1.5, value.dValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_DOUBLE, &value);
+                NativeAssert::Equal<double>(-2.5e-3, value.dValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_DOUBLE, &value);
+                NativeAssert::Equal<double>(100.0, value.dValue);
+
+                // Too large for an integer so it falls back to the slow conversion.
+                ReadValue(&reader, JSON_VALUE_TYPE_DOUBLE, &value);
+                NativeAssert::Equal<double>(12345678901234567890.0, value.dValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_DOUBLE, &value);
+                NativeAssert::Equal<double>(0.1, value.dValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_BOOL, &value);
+                Assert::True(value.fValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_BOOL, &value);
+                Assert::False(value.fValue);
+
+                ReadValue(&reader, JSON_VALUE_TYPE_NULL, &value);
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::Succeeded(hr, "Failed to read array end.");
+                NativeAssert::Equal<int>(JSON_TOKEN_ARRAY_END, token);
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::ValidReturnCode(hr, E_NOMOREITEMS);
+            }
+            finally
+            {
+                JsonUninitializeReader(&reader);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void JsonUtilUtf8Test()
+        {
+            HRESULT hr = S_OK;
+            JSON_READER reader = { };
+            JSON_WRITER writer = { };
+            JSON_TOKEN token = JSON_TOKEN_NONE;
+            JSON_VALUE value = { };
+            LPWSTR sczValue = NULL;
+            // BOM, then a key with a raw two byte character and a value with an escaped surrogate pair.
+            LPCSTR szJson = "\xEF\xBB\xBF{\"caf\xC3\xA9\":\"\\ud83d\\ude00!\", \"n\": 1.25}";
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = JsonInitializeReaderUtf8(szJson, lstrlenA(szJson), JSON_READER_FLAG_UNSYNCHRONIZED, &reader);
+                NativeAssert::Succeeded(hr, "Failed to initialize UTF-8 JSON reader.");
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::Succeeded(hr, "Failed to read object start.");
+                NativeAssert::Equal<int>(JSON_TOKEN_OBJECT_START, token);
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::Succeeded(hr, "Failed to read object key.");
+                NativeAssert::Equal<int>(JSON_TOKEN_OBJECT_KEY, token);
+                Assert::True(NULL == value.wzValue);
+                NativeAssert::Equal<SIZE_T>(5, value.cchValue);
+                Assert::True(0 == memcmp("caf\xC3\xA9", value.szValue, 5));
+
+                hr = JsonAllocValueString(&sczValue, &value);
+                NativeAssert::Succeeded(hr, "Failed to convert UTF-8 key.");
+                NativeAssert::StringEqual(L"caf\x00e9", sczValue);
+
+                hr = JsonReadValue(&reader, &value);
+                NativeAssert::Succeeded(hr, "Failed to read string value.");
+                NativeAssert::Equal<SIZE_T>(5, value.cchValue);
+                Assert::True(0 == memcmp("\xF0\x9F\x98\x80!", value.szValue, 5));
+
+                hr = JsonAllocValueString(&sczValue, &value);
+                NativeAssert::Succeeded(hr, "Failed to convert UTF-8 value.");
+                NativeAssert::StringEqual(L"\xd83d\xde00!", sczValue);
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::Succeeded(hr, "Failed to read second key.");
+
+                hr = JsonReadValue(&reader, &value);
+                NativeAssert::Succeeded(hr, "Failed to read number value.");
+                NativeAssert::Equal<double>(1.25, value.dValue);
+
+                hr = JsonAllocValueString(&sczValue, &value);
+                NativeAssert::ValidReturnCode(hr, E_INVALIDARG);
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::Succeeded(hr, "Failed to read object end.");
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::ValidReturnCode(hr, E_NOMOREITEMS);
+
+                // The writer produces the same document shape as UTF-8.
+                hr = JsonInitializeWriterEx(&writer, JSON_WRITER_FLAG_UTF8);
+                NativeAssert::Succeeded(hr, "Failed to initialize UTF-8 JSON writer.");
+
+                hr = JsonWriteArrayStart(&writer);
+                NativeAssert::Succeeded(hr, "Failed to start array.");
+
+                hr = JsonWriteString(&writer, L"caf\x00e9\xd83d\xde00");
+                NativeAssert::Succeeded(hr, "Failed to write string.");
+
+                hr = JsonWriteBool(&writer, TRUE);
+                NativeAssert::Succeeded(hr, "Failed to write bool.");
+
+                hr = JsonWriteArrayEnd(&writer);
+                NativeAssert::Succeeded(hr, "Failed to end array.");
+
+                Assert::True(NULL == writer.sczJson);
+                NativeAssert::Equal<DWORD>(lstrlenA(writer.sczJsonUtf8), writer.cchJsonUtf8);
+                Assert::True(0 == strcmp("[\"caf\xC3\xA9\xF0\x9F\x98\x80\",true]", writer.sczJsonUtf8));
+            }
+            finally
+            {
+                ReleaseStr(sczValue);
+                JsonUninitializeWriter(&writer);
+                JsonUninitializeReader(&reader);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void JsonUtilConformanceTest()
+        {
+            LPCWSTR rgwzValid[] =
+            {
+                L"[]", L"{}", L"0", L"-0", L"-0.0e-0", L"\"\"", L"true", L" null ", L"[1e400]",
+                L"[[[[]]]]", L"{\"\":\"\"}", L"{\"a\":[1,{\"b\":null}],\"c\":\"\\u0041\"}", L"\t\r\n[1]\n",
+            };
+            LPCWSTR rgwzInvalid[] =
+            {
+                L"", L" ", L"[", L"]", L"{", L"[1,]", L"[,1]", L"[1,,2]", L"[1 2]", L"[1}", L"{\"a\":1]",
+                L"{,}", L"{\"a\":1,}", L"{\"a\"}", L"{\"a\" 1}", L"{1:1}", L"{\"a\":}", L"{'a':1}",
+                L"01", L"-", L"[-]", L"1.", L".1", L"1e", L"1e+", L"+1", L"0x1", L"NaN", L"[Infinity]",
+                L"tru", L"truex", L"[true false]", L"[1][2]", L"1 2",
+                L"\"abc", L"\"\\x\"", L"\"\\u12\"", L"\"\\ud83d\"", L"\"\\ude00\"", L"\"\\ud83d\\u0041\"", L"\"a\tb\"", L"[\"\\",
+            };
+            LPWSTR sczDeep = NULL;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                for (DWORD i = 0; i < countof(rgwzValid); ++i)
+                {
+                    NativeAssert::ValidReturnCode(ReadDocument(rgwzValid[i]), E_NOMOREITEMS);
+                }
+
+                for (DWORD i = 0; i < countof(rgwzInvalid); ++i)
+                {
+                    NativeAssert::ValidReturnCode(ReadDocument(rgwzInvalid[i]), E_INVALIDDATA);
+                }
+
+                // Long strings exercise the vectorized scan across block boundaries.
+                for (DWORD cch = 1; cch < 100; ++cch)
+                {
+                    HRESULT hr = StrAllocString(&sczDeep, L"\"", 0);
+                    NativeAssert::Succeeded(hr, "Failed to start long string.");
+
+                    for (DWORD i = 0; i < cch; ++i)
+                    {
+                        hr = StrAllocConcat(&sczDeep, (i == cch / 2) ? L"\\n" : L"x", 0);
+                        NativeAssert::Succeeded(hr, "Failed to build long string.");
+                    }
+
+                    NativeAssert::ValidReturnCode(ReadDocument(sczDeep), E_INVALIDDATA);
+
+                    hr = StrAllocConcat(&sczDeep, L"\"", 0);
+                    NativeAssert::Succeeded(hr, "Failed to finish long string.");
+
+                    NativeAssert::ValidReturnCode(ReadDocument(sczDeep), E_NOMOREITEMS);
+                }
+
+                // Nesting is limited.
+                ReleaseNullStr(sczDeep);
+                for (DWORD i = 0; i < 2000; ++i)
+                {
+                    HRESULT hr = StrAllocConcat(&sczDeep, L"[", 0);
+                    NativeAssert::Succeeded(hr, "Failed to build deep document.");
+                }
+
+                NativeAssert::ValidReturnCode(ReadDocument(sczDeep), E_INVALIDDATA);
+            }
+            finally
+            {
+                ReleaseStr(sczDeep);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void JsonUtilStreamWriterTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczLong = NULL;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                // Longer than the stream buffer so it is written without being buffered.
+                for (DWORD i = 0; i < 10; ++i)
+                {
+                    hr = StrAllocConcat(&sczLong, L"caf\x00e9/", 0);
+                    NativeAssert::Succeeded(hr, "Failed to build long string.");
+                }
+
+                CompareStreamWriter(JSON_WRITER_FLAG_NONE, sczLong);
+                CompareStreamWriter(JSON_WRITER_FLAG_UTF8, sczLong);
+            }
+            finally
+            {
+                ReleaseStr(sczLong);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void JsonUtilDomTest()
+        {
+            HRESULT hr = S_OK;
+            JSON_DOM_HANDLE hDom = NULL;
+            JSON_READER reader = { };
+            JSON_TOKEN token = JSON_TOKEN_NONE;
+            JSON_VALUE value = { };
+            const JSON_NODE* pRoot = NULL;
+            const JSON_NODE* pNode = NULL;
+            DWORD cChildren = 0;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = JsonDomParse(L"{\"a\":[1,[2,3],{\"b\":\"x\\u0000y\"},true],\"c/d\":null,\"e~f\":2.5,\"\":{}}", &hDom);
+                NativeAssert::Succeeded(hr, "Failed to parse JSON DOM.");
+
+                pRoot = JsonDomGetRoot(hDom);
+                NativeAssert::Equal<int>(JSON_VALUE_TYPE_OBJECT, pRoot->type);
+                NativeAssert::Equal<DWORD>(4, pRoot->cChildren);
+
+                for (pNode = JsonDomGetFirstChild(hDom, pRoot); pNode; pNode = JsonDomGetNextSibling(hDom, pNode))
+                {
+                    ++cChildren;
+                }
+                NativeAssert::Equal<DWORD>(4, cChildren);
+
+                hr = JsonDomQuery(hDom, NULL, L"/a", &pNode);
+                NativeAssert::Succeeded(hr, "Failed to query array.");
+                NativeAssert::Equal<int>(JSON_VALUE_TYPE_ARRAY, pNode->type);
+                NativeAssert::StringEqual(L"a", pNode->wzKey);
+                NativeAssert::Equal<DWORD>(4, pNode->cChildren);
+
+                hr = JsonDomQuery(hDom, NULL, L"/a/2/b", &pNode);
+                NativeAssert::Succeeded(hr, "Failed to query nested string.");
+                NativeAssert::Equal<int>(JSON_VALUE_TYPE_STRING, pNode->type);
+                NativeAssert::Equal<DWORD>(3, pNode->cchValue);
+                Assert::True(0 == memcmp(L"x\0y", pNode->wzValue, 3 * sizeof(WCHAR)));
+
+                hr = JsonDomQuery(hDom, NULL, L"/a/3", &pNode);
+                NativeAssert::Succeeded(hr, "Failed to query past a nested array.");
+                NativeAssert::Equal<int>(JSON_VALUE_TYPE_BOOL, pNode->type);
+                Assert::True(pNode->fValue);
+
+                hr = JsonDomQuery(hDom, NULL, L"/a/1", &pRoot);
+                NativeAssert::Succeeded(hr, "Failed to query inner array.");
+
+                hr = JsonDomQuery(hDom, pRoot, L"/1", &pNode);
+                NativeAssert::Succeeded(hr, "Failed to query relative to a node.");
+                NativeAssert::Equal<LONGLONG>(3, pNode->llValue);
+
+                hr = JsonDomQuery(hDom, NULL, L"/c~1d", &pNode);
+                NativeAssert::Succeeded(hr, "Failed to query escaped '/'.");
+                NativeAssert::Equal<int>(JSON_VALUE_TYPE_NULL, pNode->type);
+
+                hr = JsonDomQuery(hDom, NULL, L"/e~0f", &pNode);
+                NativeAssert::Succeeded(hr, "Failed to query escaped '~'.");
+                NativeAssert::Equal<double>(2.5, pNode->dValue);
+
+                hr = JsonDomQuery(hDom, NULL, L"/", &pNode);
+                NativeAssert::Succeeded(hr, "Failed to query empty key.");
+                NativeAssert::Equal<int>(JSON_VALUE_TYPE_OBJECT, pNode->type);
+                Assert::True(NULL == JsonDomGetFirstChild(hDom, pNode));
+
+                hr = JsonDomQuery(hDom, NULL, L"", &pNode);
+                NativeAssert::Succeeded(hr, "Failed to query root.");
+                Assert::True(JsonDomGetRoot(hDom) == pNode);
+
+                NativeAssert::ValidReturnCode(JsonDomQuery(hDom, NULL, L"/a/4", &pNode), E_NOTFOUND);
+                NativeAssert::ValidReturnCode(JsonDomQuery(hDom, NULL, L"/a/01", &pNode), E_NOTFOUND);
+                NativeAssert::ValidReturnCode(JsonDomQuery(hDom, NULL, L"/a/-", &pNode), E_NOTFOUND);
+                NativeAssert::ValidReturnCode(JsonDomQuery(hDom, NULL, L"/c~1d/x", &pNode), E_NOTFOUND);
+                NativeAssert::ValidReturnCode(JsonDomQuery(hDom, NULL, L"/x", &pNode), E_NOTFOUND);
+                NativeAssert::ValidReturnCode(JsonDomQuery(hDom, NULL, L"a", &pNode), E_INVALIDARG);
+                NativeAssert::ValidReturnCode(JsonDomQuery(hDom, NULL, L"/a~2", &pNode), E_INVALIDARG);
+
+                ReleaseNullJsonDom(hDom);
+
+                hr = JsonDomParseUtf8("[\"caf\xC3\xA9\",-7]", 12, &hDom);
+                NativeAssert::Succeeded(hr, "Failed to parse UTF-8 JSON DOM.");
+
+                hr = JsonDomQuery(hDom, NULL, L"/0", &pNode);
+                NativeAssert::Succeeded(hr, "Failed to query UTF-8 string.");
+                NativeAssert::StringEqual(L"caf\x00e9", pNode->wzValue);
+                NativeAssert::Equal<DWORD>(4, pNode->cchValue);
+
+                ReleaseNullJsonDom(hDom);
+
+                NativeAssert::ValidReturnCode(JsonDomParse(L"[1,2", &hDom), E_INVALIDDATA);
+                NativeAssert::ValidReturnCode(JsonDomParse(L"[1] 2", &hDom), E_INVALIDDATA);
+                Assert::True(NULL == hDom);
+
+                // A DOM can be built from the value a streaming reader is positioned at.
+                hr = JsonInitializeReaderEx(L"{\"skip\":1,\"keep\":[1,{}],\"after\":2}", JSON_READER_FLAG_UNSYNCHRONIZED, &reader);
+                NativeAssert::Succeeded(hr, "Failed to initialize JSON reader.");
+
+                for (DWORD i = 0; i < 4; ++i)
+                {
+                    hr = JsonReadNext(&reader, &token, &value);
+                    NativeAssert::Succeeded(hr, "Failed to skip to the array.");
+                }
+                NativeAssert::Equal<int>(JSON_TOKEN_OBJECT_KEY, token);
+
+                hr = JsonDomCreate(&reader, &hDom);
+                NativeAssert::Succeeded(hr, "Failed to create JSON DOM from reader.");
+                NativeAssert::Equal<DWORD>(2, JsonDomGetRoot(hDom)->cChildren);
+
+                hr = JsonReadNext(&reader, &token, &value);
+                NativeAssert::Succeeded(hr, "Failed to read key after the DOM.");
+                NativeAssert::Equal<int>(JSON_TOKEN_OBJECT_KEY, token);
+                NativeAssert::Equal<SIZE_T>(5, value.cchValue);
+            }
+            finally
+            {
+                ReleaseJsonDom(hDom);
+                JsonUninitializeReader(&reader);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void JsonUtilUnsynchronizedConcurrentTest()
+        {
+            array<JsonDocumentReader^>^ rgReaders = gcnew array<JsonDocumentReader^>(numJsonReaderThreads);
+            array<Threading::Thread^>^ rgThreads = gcnew array<Threading::Thread^>(numJsonReaderThreads);
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                for (DWORD i = 0; i < numJsonReaderThreads; ++i)
+                {
+                    rgReaders[i] = gcnew JsonDocumentReader();
+                    rgThreads[i] = gcnew Threading::Thread(gcnew Threading::ThreadStart(rgReaders[i], &JsonDocumentReader::Run));
+                    rgThreads[i]->Start();
+                }
+            }
+            finally
+            {
+                for (DWORD i = 0; i < numJsonReaderThreads; ++i)
+                {
+                    if (rgThreads[i])
+                    {
+                        rgThreads[i]->Join();
+                    }
+                }
+
+                DutilUninitialize();
+            }
+
+            for (DWORD i = 0; i < numJsonReaderThreads; ++i)
+            {
+                Assert::Equal<DWORD>(0, rgReaders[i]->cFailures);
+                Assert::Equal<DWORD>(14 * numJsonReaderIterations, rgReaders[i]->cTokens);
+            }
+        }
+
+    private:
+        void CompareStreamWriter(JSON_WRITER_FLAG jwfFlags, LPCWSTR wzLong)
+        {
+            HRESULT hr = S_OK;
+            JSON_WRITER writer = { };
+            JSON_WRITER streamWriter = { };
+            JSON_STREAM_OUTPUT output = { };
+            DWORD cWrites = 0;
+
+            try
+            {
+                hr = JsonInitializeWriterEx(&writer, jwfFlags);
+                NativeAssert::Succeeded(hr, "Failed to initialize JSON writer.");
+
+                hr = JsonInitializeStreamWriter(&streamWriter, jwfFlags, 16, CollectJsonStream, &output);
+                NativeAssert::Succeeded(hr, "Failed to initialize streaming JSON writer.");
+
+                WriteSampleDocument(&writer, wzLong);
+                WriteSampleDocument(&streamWriter, wzLong);
+
+                hr = JsonFlushWriter(&streamWriter);
+                NativeAssert::Succeeded(hr, "Failed to flush streaming JSON writer.");
+
+                Assert::True(NULL == streamWriter.sczJson);
+                Assert::True(NULL == streamWriter.sczJsonUtf8);
+                Assert::True(1 < output.cWrites);
+
+                if (JSON_WRITER_FLAG_UTF8 == jwfFlags)
+                {
+                    NativeAssert::Equal<SIZE_T>(writer.cchJsonUtf8, output.cbData);
+                    Assert::True(0 == memcmp(writer.sczJsonUtf8, output.pbData, output.cbData));
+                }
+                else
+                {
+                    NativeAssert::Equal<SIZE_T>(lstrlenW(writer.sczJson) * sizeof(WCHAR), output.cbData);
+                    Assert::True(0 == memcmp(writer.sczJson, output.pbData, output.cbData));
+                }
+
+                // Flushing again writes nothing.
+                cWrites = output.cWrites;
+
+                hr = JsonFlushWriter(&streamWriter);
+                NativeAssert::Succeeded(hr, "Failed to flush empty streaming JSON writer.");
+                NativeAssert::Equal<DWORD>(cWrites, output.cWrites);
+            }
+            finally
+            {
+                ReleaseMem(output.pbData);
+                JsonUninitializeWriter(&streamWriter);
+                JsonUninitializeWriter(&writer);
+            }
+        }
+
+        void WriteSampleDocument(JSON_WRITER* pWriter, LPCWSTR wzLong)
+        {
+            HRESULT hr = JsonWriteObjectStart(pWriter);
+            NativeAssert::Succeeded(hr, "Failed to start object.");
+
+            hr = JsonWriteObjectKey(pWriter, L"list");
+            NativeAssert::Succeeded(hr, "Failed to write key.");
+
+            hr = JsonWriteArrayStart(pWriter);
+            NativeAssert::Succeeded(hr, "Failed to start array.");
+
+            for (DWORD i = 0; i < 20; ++i)
+            {
+                hr = JsonWriteNumber(pWriter, i * 1000);
+                NativeAssert::Succeeded(hr, "Failed to write number.");
+
+                hr = JsonWriteString(pWriter, L"\x00e9\t");
+                NativeAssert::Succeeded(hr, "Failed to write string.");
+            }
+
+            hr = JsonWriteString(pWriter, wzLong);
+            NativeAssert::Succeeded(hr, "Failed to write long string.");
+
+            hr = JsonWriteArrayEnd(pWriter);
+            NativeAssert::Succeeded(hr, "Failed to end array.");
+
+            hr = JsonWriteObjectKey(pWriter, L"done");
+            NativeAssert::Succeeded(hr, "Failed to write key.");
+
+            hr = JsonWriteBool(pWriter, TRUE);
+            NativeAssert::Succeeded(hr, "Failed to write bool.");
+
+            hr = JsonWriteObjectEnd(pWriter);
+            NativeAssert::Succeeded(hr, "Failed to end object.");
+        }
+
+        void ReadValue(JSON_READER* pReader, JSON_VALUE_TYPE expectedType, JSON_VALUE* pValue)
+        {
+            HRESULT hr = JsonReadValue(pReader, pValue);
+            NativeAssert::Succeeded(hr, "Failed to read JSON value.");
+            NativeAssert::Equal<int>(expectedType, pValue->type);
+        }
+
+        HRESULT ReadDocument(LPCWSTR wzJson)
+        {
+            HRESULT hr = S_OK;
+            JSON_READER reader = { };
+            JSON_TOKEN token = JSON_TOKEN_NONE;
+            JSON_VALUE value = { };
+
+            hr = JsonInitializeReader(wzJson, &reader);
+            NativeAssert::Succeeded(hr, "Failed to initialize JSON reader for: {0}", wzJson);
+
+            while (SUCCEEDED(hr))
+            {
+                hr = JsonReadNext(&reader, &token, &value);
+            }
+
+            JsonUninitializeReader(&reader);
+            return hr;
+        }
+    };
+}
@@ -0,0 +1,862 @@
+// Copyright (c) .NET Foundation and contributors. All rights reserved. Licensed under the Microsoft Reciprocal License. See LICENSE.TXT file in the project root for full license information.
+
+#include "precomp.h"
+
+using namespace System;
+using namespace System::Text::RegularExpressions;
+using namespace Xunit;
+using namespace WixBuildTools::TestSupport;
+
+const DWORD numLogThreads = 8;
+const DWORD numLogLinesPerThread = 500;
+const DWORD numLogLinesPerError = 50;
+
+namespace DutilTests
+{
+    struct LogAllocationCounter
+    {
+        DWORD dwThreadId;
+        volatile LONG cCalls;
+    };
+
+    // Forwards to the process heap, counting only the calls made by the logging thread.
+    static LPVOID DAPI LogCountingAlloc(LPVOID pvContext, SIZE_T cbSize, BOOL fZero)
+    {
+        LogAllocationCounter* pCounter = static_cast<LogAllocationCounter*>(pvContext);
+        if (::GetCurrentThreadId() == pCounter->dwThreadId)
+        {
+            ::InterlockedIncrement(&pCounter->cCalls);
+        }
+
+        return ::HeapAlloc(::GetProcessHeap(), fZero ? HEAP_ZERO_MEMORY : 0, cbSize);
+    }
+
+    static LPVOID DAPI LogCountingReAlloc(LPVOID pvContext, LPVOID pv, SIZE_T cbSize, BOOL fZero)
+    {
+        LogAllocationCounter* pCounter = static_cast<LogAllocationCounter*>(pvContext);
+        if (::GetCurrentThreadId() == pCounter->dwThreadId)
+        {
+            ::InterlockedIncrement(&pCounter->cCalls);
+        }
+
+        return ::HeapReAlloc(::GetProcessHeap(), fZero ? HEAP_ZERO_MEMORY : 0, pv, cbSize);
+    }
+
+    static HRESULT DAPI LogCountingFree(LPVOID /*pvContext*/, LPVOID pv)
+    {
+        return ::HeapFree(::GetProcessHeap(), 0, pv) ? S_OK : E_FAIL;
+    }
+
+    static SIZE_T DAPI LogCountingSize(LPVOID /*pvContext*/, LPCVOID pv)
+    {
+        return ::HeapSize(::GetProcessHeap(), 0, pv);
+    }
+
+    static HRESULT DAPI CountLogLine(LPCSTR /*szString*/, LPVOID pvContext)
+    {
+        ++*static_cast<DWORD*>(pvContext);
+        return S_OK;
+    }
+
+    static HRESULT DAPI CollectLogText(LPCSTR szString, LPVOID pvContext)
+    {
+        return StrAnsiAllocConcat(static_cast<LPSTR*>(pvContext), szString, 0);
+    }
+
+    struct LogRotationOpenFailures
+    {
+        DWORD cFailures;
+        DWORD cCalls;
+    };
+
+    // Fails the first cFailures attempts to create the log again after rotating.
+    static HRESULT DAPI FailLogRotationOpen(LPCWSTR /*wzLogPath*/, LPVOID pvContext)
+    {
+        LogRotationOpenFailures* pFailures = static_cast<LogRotationOpenFailures*>(pvContext);
+
+        return (++pFailures->cCalls <= pFailures->cFailures) ? E_ACCESSDENIED : S_OK;
+    }
+
+    ref class LogLineWriter
+    {
+    public:
+        DWORD dwThread;
+        DWORD cFailures;
+        BOOL fBatchTemplates;
+        BOOL fErrors;
+
+        void Run()
+        {
+            CHAR szFormat[64] = "thread %u line %u";
+
+            for (DWORD i = 0; i < numLogLinesPerThread; ++i)
+            {
+                // Every thread starts a new template each batch of lines, so binary logs keep defining them.
+                if (fBatchTemplates && FAILED(::StringCchPrintfA(szFormat, countof(szFormat), "thread %%u line %%u batch %u", i / 10)))
+                {
+                    ++cFailures;
+                }
+
+                if (FAILED(LogStringLine(REPORT_STANDARD, szFormat, dwThread, i)))
+                {
+                    ++cFailures;
+                }
+
+                // Errors are logged even when the queue is full and other lines are dropped.
+                if (fErrors && 0 == i % numLogLinesPerError && S_OK != LogErrorString(E_FAIL, "writer %u error %u", dwThread, i))
+                {
+                    ++cFailures;
+                }
+            }
+        }
+    };
+
+    [Collection("MemAllocator")]
+    public ref class LogUtil
+    {
+    public:
+        [Fact]
+        void LogUtilFilteredAndSteadyStateAllocationTest()
+        {
+            HRESULT hr = S_OK;
+            DWORD cLines = 0;
+            LogAllocationCounter counter = { ::GetCurrentThreadId(), 0 };
+            MEM_ALLOCATOR allocator = { LogCountingAlloc, LogCountingReAlloc, LogCountingFree, LogCountingSize, &counter };
+
+            DutilInitialize(&DutilTestTraceError);
+            LogInitialize(NULL);
+
+            try
+            {
+                LogRedirect(CountLogLine, &cLines);
+                LogSetLevel(REPORT_STANDARD, FALSE);
+
+                // The first line grows this thread's buffers.
+                hr = LogStringLine(REPORT_STANDARD, "warm up with a longer line than the rest %ls %u", L"line", 0);
+                NativeAssert::Succeeded(hr, "Failed to log first line.");
+
+                hr = MemSetAllocator(&allocator);
+                NativeAssert::Succeeded(hr, "Failed to set allocator.");
+
+                for (DWORD i = 0; i < 100; ++i)
+                {
+                    hr = LogStringLine(REPORT_STANDARD, "steady %ls %u", L"line", i);
+                    NativeAssert::Succeeded(hr, "Failed to log line.");
+                }
+
+                // Error lines are formatted in the same buffers.
+                for (DWORD i = 0; i < 10; ++i)
+                {
+                    hr = LogErrorString(E_FAIL, "steady %ls %u", L"error", i);
+                    NativeAssert::Succeeded(hr, "Failed to log error.");
+                }
+
+                // Filtered lines return before formatting anything.
+                hr = LogStringLine(REPORT_VERBOSE, "filtered %ls", L"line");
+                NativeAssert::ValidReturnCode(hr, S_FALSE);
+
+                hr = MemSetAllocator(NULL);
+                NativeAssert::Succeeded(hr, "Failed to restore default allocator.");
+
+                NativeAssert::Equal<DWORD>(111, cLines);
+                NativeAssert::Equal<LONG>(0, counter.cCalls);
+            }
+            finally
+            {
+                MemSetAllocator(NULL);
+                LogRedirect(NULL, NULL);
+                LogUninitialize(FALSE);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void LogUtilAsyncBlockTest()
+        {
+            array<String^>^ rgLines = WriteLogFromThreads(L"LogUtilAsyncBlockTest.log", LOG_ASYNC_POLICY_BLOCK, LOG_FORMAT_TEXT);
+            array<DWORD>^ rgcLinesPerThread = gcnew array<DWORD>(numLogThreads);
+
+            Assert::Equal(static_cast<int>(numLogThreads * numLogLinesPerThread + 1), rgLines->Length);
+
+            // Each thread's lines are written in the order it logged them.
+            for each (String^ line in rgLines)
+            {
+                if (line->Contains("thread "))
+                {
+                    array<String^>^ rgWords = line->Substring(line->IndexOf("thread "))->Split(' ');
+                    DWORD dwThread = UInt32::Parse(rgWords[1]);
+
+                    Assert::Equal<DWORD>(rgcLinesPerThread[dwThread], UInt32::Parse(rgWords[3]));
+                    ++rgcLinesPerThread[dwThread];
+                }
+            }
+
+            for (DWORD i = 0; i < numLogThreads; ++i)
+            {
+                Assert::Equal<DWORD>(numLogLinesPerThread, rgcLinesPerThread[i]);
+            }
+
+            Assert::True(rgLines[rgLines->Length - 1]->Contains("Error 0x80004005: done"));
+        }
+
+        [Fact]
+        void LogUtilAsyncDropTest()
+        {
+            array<String^>^ rgLines = WriteLogFromThreads(L"LogUtilAsyncDropTest.log", LOG_ASYNC_POLICY_DROP, LOG_FORMAT_TEXT);
+            DWORD cLogged = 0;
+            DWORD cDropped = 0;
+            DWORD cErrors = 0;
+
+            // Every line is either written or counted as dropped.
+            for each (String^ line in rgLines)
+            {
+                if (line->StartsWith("=== Logging dropped "))
+                {
+                    cDropped += UInt32::Parse(line->Split(' ')[3]);
+                }
+                else if (line->Contains("Error 0x80004005: writer "))
+                {
+                    ++cErrors;
+                }
+                else if (line->Contains("thread "))
+                {
+                    ++cLogged;
+                }
+            }
+
+            Assert::Equal<DWORD>(numLogThreads * numLogLinesPerThread, cLogged + cDropped);
+            Assert::Equal<DWORD>(numLogThreads * numLogLinesPerThread / numLogLinesPerError, cErrors);
+            Assert::True(rgLines[rgLines->Length - 1]->Contains("Error 0x80004005: done"));
+        }
+
+        [Fact]
+        void LogUtilAsyncDropBinaryTest()
+        {
+            array<String^>^ rgLines = WriteLogFromThreads(L"LogUtilAsyncDropBinaryTest.bin", LOG_ASYNC_POLICY_DROP, LOG_FORMAT_BINARY);
+            DWORD cLogged = 0;
+            DWORD cDropped = 0;
+            DWORD cErrors = 0;
+
+            // Lines may be dropped but never the templates they use, so every line left decodes.
+            for each (String^ line in rgLines)
+            {
+                if (line->StartsWith("=== Logging dropped "))
+                {
+                    cDropped += UInt32::Parse(line->Split(' ')[3]);
+                }
+                else if (line->Contains("Error 0x80004005: writer "))
+                {
+                    ++cErrors;
+                }
+                else if (line->Contains("thread "))
+                {
+                    array<String^>^ rgWords = line->Substring(line->IndexOf("thread "))->Split(' ');
+
+                    Assert::Equal(6, rgWords->Length);
+                    Assert::Equal(UInt32::Parse(rgWords[3]) / 10, UInt32::Parse(rgWords[5]));
+                    ++cLogged;
+                }
+            }
+
+            Assert::Equal<DWORD>(numLogThreads * numLogLinesPerThread, cLogged + cDropped);
+            Assert::Equal<DWORD>(numLogThreads * numLogLinesPerThread / numLogLinesPerError, cErrors);
+            Assert::True(rgLines[rgLines->Length - 1]->Contains("Error 0x80004005: done"));
+        }
+
+        [Fact]
+        void LogUtilAsyncOpenWhileLoggingTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempDir = NULL;
+            LPWSTR sczLogPath = NULL;
+            array<LogLineWriter^>^ rgWriters = gcnew array<LogLineWriter^>(numLogThreads);
+            array<Threading::Thread^>^ rgThreads = gcnew array<Threading::Thread^>(numLogThreads);
+            array<DWORD>^ rgcLinesPerThread = gcnew array<DWORD>(numLogThreads);
+            BOOL fHeader = FALSE;
+
+            DutilInitialize(&DutilTestTraceError);
+            LogInitialize(NULL);
+
+            try
+            {
+                hr = PathExpand(&sczTempDir, L"%TEMP%\\LogUtilTest\\", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get temp directory.");
+
+                hr = LogEnableAsync(4096, LOG_ASYNC_POLICY_BLOCK);
+                NativeAssert::Succeeded(hr, "Failed to enable async logging.");
+
+                for (DWORD i = 0; i < numLogThreads; ++i)
+                {
+                    rgWriters[i] = gcnew LogLineWriter();
+                    rgWriters[i]->dwThread = i;
+                    rgThreads[i] = gcnew Threading::Thread(gcnew Threading::ThreadStart(rgWriters[i], &LogLineWriter::Run));
+                    rgThreads[i]->Start();
+                }
+
+                // The header is written while the queue is full of other threads' lines.
+                hr = LogOpen(sczTempDir, L"LogUtilAsyncOpenWhileLoggingTest.log", NULL, NULL, FALSE, TRUE, &sczLogPath);
+                NativeAssert::Succeeded(hr, "Failed to open log.");
+
+                for (DWORD i = 0; i < numLogThreads; ++i)
+                {
+                    rgThreads[i]->Join();
+                    Assert::Equal<DWORD>(0, rgWriters[i]->cFailures);
+                }
+
+                LogClose(FALSE);
+
+                array<String^>^ rgLines = IO::File::ReadAllLines(gcnew String(sczLogPath));
+
+                // Lines logged before the file was open come after the header, and none are lost or reordered.
+                for each (String^ line in rgLines)
+                {
+                    if (line->Contains("=== Logging started: "))
+                    {
+                        fHeader = TRUE;
+                    }
+                    else if (line->Contains("thread "))
+                    {
+                        array<String^>^ rgWords = line->Substring(line->IndexOf("thread "))->Split(' ');
+                        DWORD dwThread = UInt32::Parse(rgWords[1]);
+
+                        Assert::Equal<DWORD>(rgcLinesPerThread[dwThread], UInt32::Parse(rgWords[3]));
+                        ++rgcLinesPerThread[dwThread];
+                    }
+                }
+
+                Assert::True(fHeader);
+
+                for (DWORD i = 0; i < numLogThreads; ++i)
+                {
+                    Assert::Equal<DWORD>(numLogLinesPerThread, rgcLinesPerThread[i]);
+                }
+            }
+            finally
+            {
+                LogUninitialize(FALSE);
+
+                if (sczLogPath)
+                {
+                    FileEnsureDelete(sczLogPath);
+                }
+
+                ReleaseStr(sczLogPath);
+                ReleaseStr(sczTempDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void LogUtilBinaryRoundTripTest()
+        {
+            HRESULT hr = S_OK;
+            LPSTR sczDecoded = NULL;
+            array<Byte>^ rgbText = WriteSampleLog(L"LogUtilBinaryRoundTripTest.txt", LOG_FORMAT_TEXT);
+            array<Byte>^ rgbBinary = WriteSampleLog(L"LogUtilBinaryRoundTripTest.bin", LOG_FORMAT_BINARY);
+            pin_ptr<Byte> pbBinary = &rgbBinary[0];
+
+            // Most lines share a template, so they are written with just their arguments.
+            Assert::True(rgbBinary->Length < rgbText->Length);
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = LogDecodeBinary(pbBinary, rgbBinary->Length, CollectLogText, &sczDecoded);
+                NativeAssert::Succeeded(hr, "Failed to decode binary log.");
+
+                // The logs were written seconds apart at most, so compare everything but the times.
+                String^ expected = Regex::Replace(Text::Encoding::UTF8->GetString(rgbText), "\\]\\[[-0-9T:]+\\]", "][]");
+                String^ decoded = Regex::Replace(Text::Encoding::UTF8->GetString(reinterpret_cast<BYTE*>(sczDecoded), lstrlenA(sczDecoded)), "\\]\\[[-0-9T:]+\\]", "][]");
+
+                Assert::Equal(expected, decoded);
+            }
+            finally
+            {
+                ReleaseStr(sczDecoded);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void LogUtilBinaryRejectsTextTest()
+        {
+            HRESULT hr = S_OK;
+            LPSTR sczDecoded = NULL;
+            BYTE rgbText[] = "[0E3C:0F10][2026-10-17T10:11:12]i000: not a binary log\r\n";
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = LogDecodeBinary(rgbText, sizeof(rgbText) - 1, CollectLogText, &sczDecoded);
+                NativeAssert::ValidReturnCode(hr, HRESULT_FROM_WIN32(ERROR_INVALID_DATA));
+                Assert::True(NULL == sczDecoded);
+            }
+            finally
+            {
+                ReleaseStr(sczDecoded);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void LogUtilRotationTest()
+        {
+            array<DWORD>^ rgcLinesPerThread = gcnew array<DWORD>(numLogThreads);
+            int cSegments = 0;
+            Collections::Generic::List<String^>^ lines = RotateLogFromThreads(L"LogUtilRotationTest", FALSE, 0, FALSE, cSegments);
+
+            Assert::True(1 < cSegments);
+
+            // Nothing is lost or reordered across segments.
+            for each (String^ line in lines)
+            {
+                if (line->Contains("thread "))
+                {
+                    array<String^>^ rgWords = line->Substring(line->IndexOf("thread "))->Split(' ');
+                    DWORD dwThread = UInt32::Parse(rgWords[1]);
+
+                    Assert::Equal<DWORD>(rgcLinesPerThread[dwThread], UInt32::Parse(rgWords[3]));
+                    ++rgcLinesPerThread[dwThread];
+                }
+            }
+
+            for (DWORD i = 0; i < numLogThreads; ++i)
+            {
+                Assert::Equal<DWORD>(numLogLinesPerThread, rgcLinesPerThread[i]);
+            }
+        }
+
+        [Fact]
+        void LogUtilAsyncRotationKeepTest()
+        {
+            int cSegments = 0;
+            Collections::Generic::List<String^>^ lines = RotateLogFromThreads(L"LogUtilAsyncRotationKeepTest", TRUE, 2, TRUE, cSegments);
+
+            // Older segments are deleted, and the newest lines are always kept.
+            Assert::Equal(2, cSegments);
+            Assert::True(lines[lines->Count - 1]->Contains("Error 0x80004005: done"));
+        }
+
+        [Fact]
+        void LogUtilRotationLostBinaryTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempDir = NULL;
+            LPWSTR sczLogPath = NULL;
+            LPSTR sczDecoded = NULL;
+            LogRotationOpenFailures failures = { 5, 0 };
+            const DWORD cLines = 2000;
+            DWORD cDecoded = 0;
+
+            DutilInitialize(&DutilTestTraceError);
+            LogInitialize(NULL);
+
+            try
+            {
+                hr = PathExpand(&sczTempDir, L"%TEMP%\\LogUtilTest\\LogUtilRotationLostBinaryTest", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get test directory.");
+
+                DirEnsureDelete(sczTempDir, TRUE, TRUE);
+
+                hr = LogSetFormat(LOG_FORMAT_BINARY);
+                NativeAssert::Succeeded(hr, "Failed to set log format.");
+
+                hr = LogOpen(sczTempDir, L"LogUtilRotationLostBinaryTest.log", NULL, NULL, FALSE, FALSE, &sczLogPath);
+                NativeAssert::Succeeded(hr, "Failed to open log.");
+
+                hr = LogEnableRotation(16 * 1024, 0, 0, FALSE);
+                NativeAssert::Succeeded(hr, "Failed to enable log rotation.");
+
+                // The first rotation can neither create a new log nor reopen the old one, and the
+                // next few writes can't either, so their lines wait until the log is back.
+                LogSetRotationOpenCallback(FailLogRotationOpen, &failures);
+
+                for (DWORD i = 0; i < cLines; ++i)
+                {
+                    hr = LogStringLine(REPORT_STANDARD, "line %u of %ls", i, L"LogUtilRotationLostBinaryTest");
+                    NativeAssert::Succeeded(hr, "Failed to log line.");
+                }
+
+                LogClose(FALSE);
+
+                NativeAssert::True(failures.cFailures < failures.cCalls);
+
+                array<String^>^ rgsSegments = IO::Directory::GetFiles(gcnew String(sczTempDir), "LogUtilRotationLostBinaryTest.*.log");
+                Array::Sort(rgsSegments, StringComparer::OrdinalIgnoreCase);
+
+                Collections::Generic::List<String^>^ files = gcnew Collections::Generic::List<String^>(rgsSegments);
+                files->Add(gcnew String(sczLogPath));
+
+                // Every file decodes, and every line is in one of them in order.
+                for each (String^ file in files)
+                {
+                    array<Byte>^ rgbLog = IO::File::ReadAllBytes(file);
+                    pin_ptr<Byte> pbLog = &rgbLog[0];
+
+                    ReleaseNullStr(sczDecoded);
+
+                    hr = LogDecodeBinary(pbLog, rgbLog->Length, CollectLogText, &sczDecoded);
+                    NativeAssert::Succeeded(hr, "Failed to decode binary log.");
+
+                    String^ text = Text::Encoding::UTF8->GetString(reinterpret_cast<BYTE*>(sczDecoded), lstrlenA(sczDecoded));
+                    for each (String^ line in text->Split(gcnew array<String^> { "\r\n" }, StringSplitOptions::RemoveEmptyEntries))
+                    {
+                        Assert::True(line->EndsWith(String::Format("line {0} of LogUtilRotationLostBinaryTest", cDecoded)));
+                        ++cDecoded;
+                    }
+                }
+
+                Assert::Equal<DWORD>(cLines, cDecoded);
+            }
+            finally
+            {
+                LogSetRotationOpenCallback(NULL, NULL);
+                LogUninitialize(FALSE);
+
+                if (sczTempDir)
+                {
+                    DirEnsureDelete(sczTempDir, TRUE, TRUE);
+                }
+
+                ReleaseStr(sczDecoded);
+                ReleaseStr(sczLogPath);
+                ReleaseStr(sczTempDir);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void LogUtilPreInitLimitTest()
+        {
+            LogPreInitLimit(L"LogUtilPreInitLimitTest.log", 32 * 1024, 0);
+        }
+
+        [Fact]
+        void LogUtilPreInitLimitBelowChunkTest()
+        {
+            LogPreInitLimit(L"LogUtilPreInitLimitBelowChunkTest.log", 4096, 0);
+        }
+
+        [Fact]
+        void LogUtilPreInitLimitLoweredTest()
+        {
+            LogPreInitLimit(L"LogUtilPreInitLimitLoweredTest.log", 64 * 1024, 2048);
+        }
+
+    private:
+        // Logs more than the limit before opening the log, lowering the limit halfway if asked, and
+        // checks that the newest lines are kept and the rest counted.
+        void LogPreInitLimit(LPCWSTR wzLog, DWORD cbLimit, DWORD cbLoweredLimit)
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempDir = NULL;
+            LPWSTR sczLogPath = NULL;
+            DWORD cLines = 5000;
+            DWORD cDropped = 0;
+            DWORD cKept = 0;
+
+            DutilInitialize(&DutilTestTraceError);
+            LogInitialize(NULL);
+
+            try
+            {
+                hr = PathExpand(&sczTempDir, L"%TEMP%\\LogUtilTest\\", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get temp directory.");
+
+                hr = LogSetPreInitLimit(cbLimit);
+                NativeAssert::Succeeded(hr, "Failed to set pre-init limit.");
+
+                for (DWORD i = 0; i < cLines; ++i)
+                {
+                    // Lowering the limit drops what was kept past it with the next line.
+                    if (cbLoweredLimit && cLines / 2 == i)
+                    {
+                        hr = LogSetPreInitLimit(cbLoweredLimit);
+                        NativeAssert::Succeeded(hr, "Failed to lower pre-init limit.");
+
+                        cbLimit = cbLoweredLimit;
+                    }
+
+                    hr = LogStringLine(REPORT_STANDARD, "before open %u", i);
+                    NativeAssert::Succeeded(hr, "Failed to log line before open.");
+                }
+
+                hr = LogOpen(sczTempDir, wzLog, NULL, NULL, FALSE, FALSE, &sczLogPath);
+                NativeAssert::Succeeded(hr, "Failed to open log.");
+
+                LogClose(FALSE);
+
+                array<String^>^ rgLines = IO::File::ReadAllLines(gcnew String(sczLogPath));
+
+                // The oldest lines are dropped and counted ahead of the newest, which are all kept.
+                Assert::StartsWith("=== Logging dropped ", rgLines[0]);
+                cDropped = UInt32::Parse(rgLines[0]->Split(' ')[3]);
+
+                for (int i = 1; i < rgLines->Length; ++i)
+                {
+                    Assert::EndsWith(String::Format("before open {0}", cDropped + cKept), rgLines[i]);
+                    ++cKept;
+                }
+
+                Assert::True(0 < cKept);
+                Assert::Equal(cLines, cDropped + cKept);
+                Assert::True((gcnew IO::FileInfo(gcnew String(sczLogPath)))->Length <= cbLimit + 64);
+            }
+            finally
+            {
+                LogUninitialize(FALSE);
+
+                if (sczLogPath)
+                {
+                    FileEnsureDelete(sczLogPath);
+                }
+
+                ReleaseStr(sczLogPath);
+                ReleaseStr(sczTempDir);
+                DutilUninitialize();
+            }
+        }
+
+        array<Byte>^ WriteSampleLog(LPCWSTR wzLog, LOG_FORMAT format)
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempDir = NULL;
+            LPWSTR sczLogPath = NULL;
+            array<Byte>^ rgbLog = nullptr;
+
+            DutilInitialize(&DutilTestTraceError);
+            LogInitialize(NULL);
+
+            try
+            {
+                hr = PathExpand(&sczTempDir, L"%TEMP%\\LogUtilTest\\", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get temp directory.");
+
+                hr = LogSetFormat(format);
+                NativeAssert::Succeeded(hr, "Failed to set log format.");
+
+                hr = LogOpen(sczTempDir, wzLog, NULL, NULL, FALSE, FALSE, &sczLogPath);
+                NativeAssert::Succeeded(hr, "Failed to open log.");
+
+                for (DWORD i = 0; i < 100; ++i)
+                {
+                    LogStringLine(REPORT_STANDARD, "Processing item %u of %u: %ls", i, 100, L"C:\\Program Files\\Example\\payload.cab");
+                }
+
+                LogStringLine(REPORT_STANDARD, "ints %d %i %u %x %X %o %hu %hd %hhx %I64d %llu %Iu [%5d] [%-5d] [%05d] [%*d] [%-*d]", -1, 2, 3u, 0xbeef, 0xBEEF, 8, 70000, 40000, 0x1FF, -5000000000LL, 5000000000ULL, static_cast<SIZE_T>(12345), 42, 42, 42, 6, 42, -6, 42);
+                LogStringLine(REPORT_WARNING, "floats %f %.2f %e %g [%10.3f] [%-8.1f]", 3.14159, 2.71828, 12345.678, 0.0001, -1.5, 2.25);
+                LogStringLine(REPORT_STANDARD, "strings [%ls] [%hs] [%10ls] [%-10hs] [%.3ls] [%.*hs] [%ls]", L"wide", "narrow", L"right", "left", L"truncated", 4, "precision", L"caf\x00e9 \x65e5\x672c");
+                LogStringLine(REPORT_STANDARD, "chars %c %hc %lc 100%%", L'w', 'n', L'\x00e9');
+                LogStringLine(REPORT_STANDARD, "pointer %p", reinterpret_cast<void*>(0x1234));
+                LogString(REPORT_STANDARD, "partial %hs", "line, ");
+                LogStringLine(REPORT_STANDARD, "finished %u", 1);
+                LogErrorString(E_FAIL, "failed %ls", L"here");
+                LogStringWorkRaw("raw text\r\n");
+
+                LogClose(FALSE);
+
+                rgbLog = IO::File::ReadAllBytes(gcnew String(sczLogPath));
+            }
+            finally
+            {
+                LogUninitialize(FALSE);
+
+                if (sczLogPath)
+                {
+                    FileEnsureDelete(sczLogPath);
+                }
+
+                ReleaseStr(sczLogPath);
+                ReleaseStr(sczTempDir);
+                DutilUninitialize();
+            }
+
+            return rgbLog;
+        }
+
+        array<String^>^ WriteLogFromThreads(LPCWSTR wzLog, LOG_ASYNC_POLICY policy, LOG_FORMAT format)
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempDir = NULL;
+            LPWSTR sczLogPath = NULL;
+            LPSTR sczDecoded = NULL;
+            array<LogLineWriter^>^ rgWriters = gcnew array<LogLineWriter^>(numLogThreads);
+            array<Threading::Thread^>^ rgThreads = gcnew array<Threading::Thread^>(numLogThreads);
+            array<String^>^ rgLines = nullptr;
+
+            DutilInitialize(&DutilTestTraceError);
+            LogInitialize(NULL);
+
+            try
+            {
+                hr = PathExpand(&sczTempDir, L"%TEMP%\\LogUtilTest\\", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get temp directory.");
+
+                hr = LogSetFormat(format);
+                NativeAssert::Succeeded(hr, "Failed to set log format.");
+
+                hr = LogOpen(sczTempDir, wzLog, NULL, NULL, FALSE, FALSE, &sczLogPath);
+                NativeAssert::Succeeded(hr, "Failed to open log.");
+
+                // A small queue so the writer thread falls behind.
+                hr = LogEnableAsync(4096, policy);
+                NativeAssert::Succeeded(hr, "Failed to enable async logging.");
+
+                for (DWORD i = 0; i < numLogThreads; ++i)
+                {
+                    rgWriters[i] = gcnew LogLineWriter();
+                    rgWriters[i]->dwThread = i;
+                    rgWriters[i]->fBatchTemplates = (LOG_FORMAT_BINARY == format);
+                    rgWriters[i]->fErrors = (LOG_ASYNC_POLICY_DROP == policy);
+                    rgThreads[i] = gcnew Threading::Thread(gcnew Threading::ThreadStart(rgWriters[i], &LogLineWriter::Run));
+                    rgThreads[i]->Start();
+                }
+
+                for (DWORD i = 0; i < numLogThreads; ++i)
+                {
+                    rgThreads[i]->Join();
+                    Assert::Equal<DWORD>(0, rgWriters[i]->cFailures);
+                }
+
+                hr = LogFlush();
+                NativeAssert::Succeeded(hr, "Failed to flush log.");
+
+                // Errors are flushed before they return, so the file is complete without closing it.
+                LogErrorString(E_FAIL, "done");
+
+                IO::FileStream^ stream = gcnew IO::FileStream(gcnew String(sczLogPath), IO::FileMode::Open, IO::FileAccess::Read, IO::FileShare::ReadWrite);
+                array<Byte>^ rgbLog = gcnew array<Byte>(static_cast<int>(stream->Length));
+                stream->Read(rgbLog, 0, rgbLog->Length);
+                stream->Close();
+
+                String^ text = nullptr;
+                if (LOG_FORMAT_BINARY == format)
+                {
+                    pin_ptr<Byte> pbLog = &rgbLog[0];
+
+                    hr = LogDecodeBinary(pbLog, rgbLog->Length, CollectLogText, &sczDecoded);
+                    NativeAssert::Succeeded(hr, "Failed to decode binary log.");
+
+                    text = Text::Encoding::UTF8->GetString(reinterpret_cast<BYTE*>(sczDecoded), lstrlenA(sczDecoded));
+                }
+                else
+                {
+                    text = Text::Encoding::UTF8->GetString(rgbLog);
+                }
+
+                rgLines = text->Split(gcnew array<String^> { "\r\n" }, StringSplitOptions::RemoveEmptyEntries);
+            }
+            finally
+            {
+                LogUninitialize(FALSE);
+
+                if (sczLogPath)
+                {
+                    FileEnsureDelete(sczLogPath);
+                }
+
+                ReleaseStr(sczDecoded);
+                ReleaseStr(sczLogPath);
+                ReleaseStr(sczTempDir);
+                DutilUninitialize();
+            }
+
+            return rgLines;
+        }
+
+        // Logs from several threads into a log that rotates every few KB, and returns the lines of
+        // every segment left, oldest first, followed by the lines of the log itself.
+        Collections::Generic::List<String^>^ RotateLogFromThreads(LPCWSTR wzName, BOOL fAsync, DWORD cKeep, BOOL fCompress, int% cSegments)
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczTempDir = NULL;
+            LPWSTR sczLogName = NULL;
+            LPWSTR sczLogPath = NULL;
+            DWORD64 cbMaxSize = 16 * 1024;
+            array<LogLineWriter^>^ rgWriters = gcnew array<LogLineWriter^>(numLogThreads);
+            array<Threading::Thread^>^ rgThreads = gcnew array<Threading::Thread^>(numLogThreads);
+            Collections::Generic::List<String^>^ lines = gcnew Collections::Generic::List<String^>();
+
+            DutilInitialize(&DutilTestTraceError);
+            LogInitialize(NULL);
+
+            try
+            {
+                hr = PathExpand(&sczTempDir, L"%TEMP%\\LogUtilTest\\", PATH_EXPAND_ENVIRONMENT);
+                NativeAssert::Succeeded(hr, "Failed to get temp directory.");
+
+                hr = StrAllocConcat(&sczTempDir, wzName, 0);
+                NativeAssert::Succeeded(hr, "Failed to get test directory.");
+
+                DirEnsureDelete(sczTempDir, TRUE, TRUE);
+
+                hr = StrAllocFormatted(&sczLogName, L"%ls.log", wzName);
+                NativeAssert::Succeeded(hr, "Failed to format log name.");
+
+                hr = LogOpen(sczTempDir, sczLogName, NULL, NULL, FALSE, FALSE, &sczLogPath);
+                NativeAssert::Succeeded(hr, "Failed to open log.");
+
+                hr = LogEnableRotation(cbMaxSize, 0, cKeep, fCompress);
+                NativeAssert::Succeeded(hr, "Failed to enable log rotation.");
+
+                if (fAsync)
+                {
+                    hr = LogEnableAsync(4096, LOG_ASYNC_POLICY_BLOCK);
+                    NativeAssert::Succeeded(hr, "Failed to enable async logging.");
+                }
+
+                for (DWORD i = 0; i < numLogThreads; ++i)
+                {
+                    rgWriters[i] = gcnew LogLineWriter();
+                    rgWriters[i]->dwThread = i;
+                    rgThreads[i] = gcnew Threading::Thread(gcnew Threading::ThreadStart(rgWriters[i], &LogLineWriter::Run));
+                    rgThreads[i]->Start();
+                }
+
+                for (DWORD i = 0; i < numLogThreads; ++i)
+                {
+                    rgThreads[i]->Join();
+                    Assert::Equal<DWORD>(0, rgWriters[i]->cFailures);
+                }
+
+                LogErrorString(E_FAIL, "done");
+
+                // Closing waits for the rotated segments to be compressed and pruned.
+                LogClose(FALSE);
+
+                array<String^>^ rgsSegments = IO::Directory::GetFiles(gcnew String(sczTempDir), String::Concat(gcnew String(wzName), ".*.log"));
+                Array::Sort(rgsSegments, StringComparer::OrdinalIgnoreCase);
+
+                cSegments = rgsSegments->Length;
+
+                for each (String^ segment in rgsSegments)
+                {
+                    // A segment ends with the write that took it past the limit, at most a batch of the 4 KB queue.
+                    Assert::True((gcnew IO::FileInfo(segment))->Length <= static_cast<LONGLONG>(cbMaxSize) + 4096);
+
+                    lines->AddRange(IO::File::ReadAllLines(segment));
+                }
+
+                lines->AddRange(IO::File::ReadAllLines(gcnew String(sczLogPath)));
+            }
+            finally
+            {
+                LogUninitialize(FALSE);
+
+                if (sczTempDir)
+                {
+                    DirEnsureDelete(sczTempDir, TRUE, TRUE);
+                }
+
+                ReleaseStr(sczLogPath);
+                ReleaseStr(sczLogName);
+                ReleaseStr(sczTempDir);
+                DutilUninitialize();
+            }
+
+            return lines;
+        }
+    };
+}
@@ -16,6 +16,33 @@ namespace DutilTests
         void *pvNull2;
     };
 
+    static volatile LONG vcTestAllocatorCalls = 0;
+
+    static LPVOID DAPI TestAllocatorAlloc(LPVOID /*pvContext*/, SIZE_T cbSize, BOOL fZero)
+    {
+        ::InterlockedIncrement(&vcTestAllocatorCalls);
+        return ::HeapAlloc(::GetProcessHeap(), fZero ? HEAP_ZERO_MEMORY : 0, cbSize);
+    }
+
+    static LPVOID DAPI TestAllocatorReAlloc(LPVOID /*pvContext*/, LPVOID pv, SIZE_T cbSize, BOOL fZero)
+    {
+        ::InterlockedIncrement(&vcTestAllocatorCalls);
+        return ::HeapReAlloc(::GetProcessHeap(), fZero ? HEAP_ZERO_MEMORY : 0, pv, cbSize);
+    }
+
+    static HRESULT DAPI TestAllocatorFree(LPVOID /*pvContext*/, LPVOID pv)
+    {
+        ::InterlockedIncrement(&vcTestAllocatorCalls);
+        return ::HeapFree(::GetProcessHeap(), 0, pv) ? S_OK : E_FAIL;
+    }
+
+    static SIZE_T DAPI TestAllocatorSize(LPVOID /*pvContext*/, LPCVOID pv)
+    {
+        return ::HeapSize(::GetProcessHeap(), 0, pv);
+    }
+
+    // Tests that replace the allocator must not run at the same time.
+    [Collection("MemAllocator")]
     public ref class MemUtil
     {
     public:
@@ -441,6 +468,168 @@ namespace DutilTests
             }
         }
 
+        [Fact]
+        void MemUtilGeometricGrowthTest()
+        {
+            HRESULT hr = S_OK;
+            DWORD *rgValues = NULL;
+            SIZE_T cbPrevious = 0;
+            DWORD cGrows = 0;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                // Even with a growth count of 1, appending must not resize the array for every item
+                for (DWORD i = 0; i < 1000000; ++i)
+                {
+                    hr = MemEnsureArraySize(reinterpret_cast<LPVOID*>(&rgValues), i + 1, sizeof(DWORD), 1);
+                    NativeAssert::Succeeded(hr, "Failed to grow array size to {0}", i + 1);
+
+                    rgValues[i] = i;
+
+                    if (MemSize(rgValues) != cbPrevious)
+                    {
+                        cbPrevious = MemSize(rgValues);
+                        ++cGrows;
+                    }
+                }
+
+                Assert::True(64 > cGrows);
+
+                for (DWORD i = 0; i < 1000000; ++i)
+                {
+                    NativeAssert::Equal(i, rgValues[i]);
+                }
+
+                // Inserting several items at once has to move the existing items past all of them
+                hr = MemInsertIntoArray(reinterpret_cast<LPVOID*>(&rgValues), 1, 3, 1000000, sizeof(DWORD), 1);
+                NativeAssert::Succeeded(hr, "Failed to insert items into array");
+
+                NativeAssert::Equal<DWORD>(0, rgValues[0]);
+                NativeAssert::Equal<DWORD>(0, rgValues[1]);
+                NativeAssert::Equal<DWORD>(0, rgValues[2]);
+                NativeAssert::Equal<DWORD>(0, rgValues[3]);
+                NativeAssert::Equal<DWORD>(1, rgValues[4]);
+                NativeAssert::Equal<DWORD>(999999, rgValues[1000002]);
+            }
+            finally
+            {
+                ReleaseMem(rgValues);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void MemUtilArenaTest()
+        {
+            HRESULT hr = S_OK;
+            MEM_ARENA_HANDLE hArena = NULL;
+            BYTE* rgpbItems[1000] = { };
+            SIZE_T rgcbItems[1000] = { };
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                // Use a small block size so the arena has to add blocks, including oversized ones
+                hr = MemArenaCreate(256, &hArena);
+                NativeAssert::Succeeded(hr, "Failed to create arena");
+
+                for (DWORD dwPass = 0; dwPass < 2; ++dwPass)
+                {
+                    for (DWORD i = 0; i < countof(rgpbItems); ++i)
+                    {
+                        rgcbItems[i] = 1 + (i * 37) % (0 == i % 50 ? 1000 : 70);
+
+                        rgpbItems[i] = static_cast<BYTE*>(MemArenaAlloc(hArena, rgcbItems[i], TRUE));
+                        Assert::True(NULL != rgpbItems[i]);
+                        NativeAssert::Equal<DWORD_PTR>(0, reinterpret_cast<DWORD_PTR>(rgpbItems[i]) % MEMORY_ALLOCATION_ALIGNMENT);
+
+                        for (SIZE_T j = 0; j < rgcbItems[i]; ++j)
+                        {
+                            NativeAssert::Equal<BYTE>(0, rgpbItems[i][j]);
+                        }
+
+                        memset(rgpbItems[i], static_cast<BYTE>(i), rgcbItems[i]);
+                    }
+
+                    // Make sure no allocations overlap
+                    for (DWORD i = 0; i < countof(rgpbItems); ++i)
+                    {
+                        for (SIZE_T j = 0; j < rgcbItems[i]; ++j)
+                        {
+                            NativeAssert::Equal<BYTE>(static_cast<BYTE>(i), rgpbItems[i][j]);
+                        }
+                    }
+
+                    // The second pass reuses the memory, so it checks that zeroing still happens
+                    MemArenaReset(hArena);
+                }
+            }
+            finally
+            {
+                ReleaseMemArena(hArena);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void MemUtilAllocatorTelemetryTest()
+        {
+            HRESULT hr = S_OK;
+            LPWSTR sczValue = NULL;
+            MEM_SOURCE_TELEMETRY sourceTelemetry = { };
+            MEM_TELEMETRY telemetry = { };
+            // Forwards to the process heap, so memory allocated before it was installed can still be freed
+            MEM_ALLOCATOR allocator = { TestAllocatorAlloc, TestAllocatorReAlloc, TestAllocatorFree, TestAllocatorSize, NULL };
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                hr = MemSetAllocator(&allocator);
+                NativeAssert::Succeeded(hr, "Failed to set allocator");
+
+                MemTelemetryEnable(TRUE);
+                vcTestAllocatorCalls = 0;
+
+                hr = StrAllocString(&sczValue, L"small", 0);
+                NativeAssert::Succeeded(hr, "Failed to allocate small string");
+
+                hr = StrAllocConcat(&sczValue, L" string that needs to grow past the first allocation", 0);
+                NativeAssert::Succeeded(hr, "Failed to grow string");
+
+                ReleaseNullStr(sczValue);
+
+                MemTelemetryEnable(FALSE);
+
+                // Other tests may be allocating at the same time, so only check for at least what this test did
+                Assert::True(3 <= vcTestAllocatorCalls);
+
+                hr = MemGetSourceTelemetry(DUTIL_SOURCE_STRUTIL, &sourceTelemetry);
+                NativeAssert::Succeeded(hr, "Failed to get strutil telemetry");
+
+                Assert::True(1 <= sourceTelemetry.cAllocations);
+                Assert::True(1 <= sourceTelemetry.cReAllocations);
+                Assert::True(1 <= sourceTelemetry.rgcSizeClasses[0]);
+
+                MemGetTelemetry(&telemetry);
+                Assert::True(1 <= telemetry.cFrees);
+                Assert::True(0 < telemetry.cbPeak);
+
+                hr = MemSetAllocator(NULL);
+                NativeAssert::Succeeded(hr, "Failed to restore default allocator");
+            }
+            finally
+            {
+                MemTelemetryEnable(FALSE);
+                MemSetAllocator(NULL);
+                ReleaseStr(sczValue);
+                DutilUninitialize();
+            }
+        }
+
     private:
         void SetItem(ArrayValue *pValue, DWORD dwValue)
         {
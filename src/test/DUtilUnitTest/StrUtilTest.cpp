@@ -80,6 +80,231 @@ namespace DutilTests
             TestStrAnsiAllocString(b, 0, "abCd");
         }
 
+        [Fact]
+        void StrUtilBuilderTest()
+        {
+            HRESULT hr = S_OK;
+            STR_BUILDER builder = { };
+            LPWSTR sczText = NULL;
+
+            try
+            {
+                hr = StrBuilderDetach(&builder, &sczText);
+                NativeAssert::Succeeded(hr, "Failed to detach empty builder.");
+                NativeAssert::StringEqual(L"", sczText);
+
+                hr = StrBuilderInitialize(&builder, 4);
+                NativeAssert::Succeeded(hr, "Failed to initialize builder.");
+
+                hr = StrBuilderAppend(&builder, L"ab");
+                NativeAssert::Succeeded(hr, "Failed to append string.");
+
+                hr = StrBuilderAppendChar(&builder, L'c');
+                NativeAssert::Succeeded(hr, "Failed to append character.");
+
+                hr = StrBuilderAppendN(&builder, L"defghi", 3);
+                NativeAssert::Succeeded(hr, "Failed to append partial string.");
+
+                hr = StrBuilderAppendFormatted(&builder, L" - %hs - %ls - %u", "ansi string", L"unicode string", 1234);
+                NativeAssert::Succeeded(hr, "Failed to append formatted string.");
+
+                NativeAssert::StringEqual(L"abcdef - ansi string - unicode string - 1234", builder.sczString);
+                NativeAssert::Equal<SIZE_T>(lstrlenW(builder.sczString), builder.cch);
+
+                // Grow well past the initial capacity, one small append at a time
+                for (DWORD i = 0; i < 10000; ++i)
+                {
+                    hr = StrBuilderAppendFormatted(&builder, L"%u,", i % 10);
+                    NativeAssert::Succeeded(hr, "Failed to append number {0}.", i);
+                }
+
+                NativeAssert::Equal<SIZE_T>(44 + 10000 * 2, builder.cch);
+                NativeAssert::Equal<SIZE_T>(builder.cch, lstrlenW(builder.sczString));
+
+                hr = StrBuilderDetach(&builder, &sczText);
+                NativeAssert::Succeeded(hr, "Failed to detach builder.");
+                NativeAssert::Equal<SIZE_T>(44 + 10000 * 2, lstrlenW(sczText));
+                Assert::True(NULL == builder.sczString);
+            }
+            finally
+            {
+                StrBuilderUninitialize(&builder);
+                ReleaseStr(sczText);
+            }
+        }
+
+        [Fact]
+        void StrUtilTokenizerTest()
+        {
+            HRESULT hr = S_OK;
+            STR_TOKENIZER tokenizer = { };
+            STR_VIEW token = { };
+            STR_VIEW expected = { };
+            LPWSTR sczText = NULL;
+            LPWSTR sczMultiSz = NULL;
+            LPCWSTR wzFound = NULL;
+            DWORD_PTR dwIndex = 0;
+            int nResult = 0;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                // Empty tokens are kept unless asked to skip them
+                StrTokenizerInitialize(&tokenizer, L"a,,bc,", 0, L",", FALSE);
+                for (DWORD i = 0; i < 4; ++i)
+                {
+                    Assert::True(StrTokenizerNext(&tokenizer, &token));
+
+                    hr = StrAllocStringView(&sczText, &token);
+                    NativeAssert::Succeeded(hr, "Failed to copy token {0}.", i);
+                    NativeAssert::StringEqual(0 == i ? L"a" : 2 == i ? L"bc" : L"", sczText);
+                }
+                Assert::False(StrTokenizerNext(&tokenizer, &token));
+
+                StrTokenizerInitialize(&tokenizer, L";;a b;\tc  ", 0, L"; ", TRUE);
+                Assert::True(StrTokenizerNext(&tokenizer, &token));
+                NativeAssert::Equal<SIZE_T>(1, token.cch);
+                Assert::True(L'a' == *token.wz);
+                Assert::True(StrTokenizerNext(&tokenizer, &token));
+                Assert::True(L'b' == *token.wz);
+                Assert::True(StrTokenizerNext(&tokenizer, &token));
+                NativeAssert::Equal<SIZE_T>(2, token.cch);
+                Assert::False(StrTokenizerNext(&tokenizer, &token));
+
+                // Trimming and comparing only look inside the view
+                token.wz = L" \t Value \tTail";
+                token.cch = 10;
+                StrViewTrimWhitespace(&token);
+
+                expected.wz = L"VALUE";
+                expected.cch = 5;
+
+                hr = StrViewCompare(&token, &expected, NORM_IGNORECASE, &nResult);
+                NativeAssert::Succeeded(hr, "Failed to compare views.");
+                NativeAssert::Equal(CSTR_EQUAL, nResult);
+
+                hr = StrViewCompare(&token, &expected, 0, &nResult);
+                NativeAssert::Succeeded(hr, "Failed to compare views.");
+                Assert::NotEqual<int>(CSTR_EQUAL, nResult);
+
+                token.cch = 0;
+                hr = StrAllocConcatView(&sczText, &token);
+                NativeAssert::Succeeded(hr, "Failed to concat empty view.");
+                NativeAssert::StringEqual(L"", sczText);
+
+                // The MULTISZ helpers size the string with MemSize(), so it has to be allocated
+                for (DWORD i = 0; i < 3; ++i)
+                {
+                    hr = MultiSzPrepend(&sczMultiSz, NULL, 0 == i ? L"three" : 1 == i ? L"two" : L"one");
+                    NativeAssert::Succeeded(hr, "Failed to prepend to MULTISZ.");
+                }
+
+                hr = MultiSzFindString(sczMultiSz, L"three", &dwIndex, &wzFound);
+                NativeAssert::Succeeded(hr, "Failed to find string in MULTISZ.");
+                NativeAssert::Equal<DWORD_PTR>(2, dwIndex);
+                NativeAssert::StringEqual(L"three", wzFound);
+
+                hr = MultiSzFindSubstring(sczMultiSz, L"WO", &dwIndex, &wzFound);
+                NativeAssert::Succeeded(hr, "Failed to find substring in MULTISZ.");
+                NativeAssert::Equal<DWORD_PTR>(1, dwIndex);
+
+                hr = MultiSzFindString(sczMultiSz, L"four", &dwIndex, NULL);
+                NativeAssert::ValidReturnCode(hr, S_FALSE);
+            }
+            finally
+            {
+                ReleaseStr(sczText);
+                ReleaseStr(sczMultiSz);
+                DutilUninitialize();
+            }
+        }
+
+        [Fact]
+        void StrUtilHexBase85RoundTripTest()
+        {
+            HRESULT hr = S_OK;
+            Random^ random = gcnew Random(85);
+            BYTE* pbSource = NULL;
+            LPWSTR sczHex = NULL;
+            LPWSTR sczExpected = NULL;
+            LPWSTR sczBase85 = NULL;
+            BYTE* pbDecoded = NULL;
+            DWORD cbDecoded = 0;
+            SIZE_T cbBase85Decoded = 0;
+
+            DutilInitialize(&DutilTestTraceError);
+
+            try
+            {
+                // Cover lengths on both sides of the 16 byte vector blocks, plus some larger inputs
+                for (SIZE_T cbSource = 1; cbSource < 600; cbSource += (cbSource < 70) ? 1 : random->Next(1, 97))
+                {
+                    pbSource = static_cast<BYTE*>(MemAlloc(cbSource, FALSE));
+                    Assert::True(NULL != pbSource);
+
+                    hr = StrAlloc(&sczExpected, cbSource * 2 + 1);
+                    NativeAssert::Succeeded(hr, "Failed to allocate expected hex string.");
+
+                    for (SIZE_T i = 0; i < cbSource; ++i)
+                    {
+                        pbSource[i] = static_cast<BYTE>(random->Next(256));
+                        sczExpected[i * 2] = L"0123456789ABCDEF"[pbSource[i] >> 4];
+                        sczExpected[i * 2 + 1] = L"0123456789ABCDEF"[pbSource[i] & 0xF];
+                    }
+                    sczExpected[cbSource * 2] = L'\0';
+
+                    hr = StrAllocHexEncode(pbSource, cbSource, &sczHex);
+                    NativeAssert::Succeeded(hr, "Failed to hex encode {0} bytes.", cbSource);
+                    NativeAssert::StringEqual(sczExpected, sczHex);
+
+                    // Decoding accepts either case
+                    for (SIZE_T i = 0; i < cbSource * 2; i += 3)
+                    {
+                        if (L'A' <= sczHex[i] && sczHex[i] <= L'F')
+                        {
+                            sczHex[i] += L'a' - L'A';
+                        }
+                    }
+
+                    hr = StrAllocHexDecode(sczHex, &pbDecoded, &cbDecoded);
+                    NativeAssert::Succeeded(hr, "Failed to hex decode {0} bytes.", cbSource);
+                    NativeAssert::Equal<SIZE_T>(cbSource, cbDecoded);
+                    Assert::True(0 == memcmp(pbSource, pbDecoded, cbSource));
+                    ReleaseNullMem(pbDecoded);
+
+                    hr = StrAllocBase85Encode(pbSource, cbSource, &sczBase85);
+                    NativeAssert::Succeeded(hr, "Failed to Base85 encode {0} bytes.", cbSource);
+
+                    hr = StrAllocBase85Decode(sczBase85, &pbDecoded, &cbBase85Decoded);
+                    NativeAssert::Succeeded(hr, "Failed to Base85 decode {0} bytes.", cbSource);
+                    NativeAssert::Equal<SIZE_T>(cbSource, cbBase85Decoded);
+                    Assert::True(0 == memcmp(pbSource, pbDecoded, cbSource));
+
+                    ReleaseNullMem(pbDecoded);
+                    ReleaseNullMem(pbSource);
+                }
+
+                // Characters outside the Base85 alphabet, including ones past the decode table, are rejected
+                hr = StrAllocBase85Decode(L"abcd\x0141", &pbDecoded, &cbBase85Decoded);
+                NativeAssert::ValidReturnCode(hr, E_UNEXPECTED);
+                Assert::True(NULL == pbDecoded);
+
+                hr = StrAllocBase85Decode(L"~~~~~", &pbDecoded, &cbBase85Decoded);
+                NativeAssert::ValidReturnCode(hr, E_UNEXPECTED);
+                Assert::True(NULL == pbDecoded);
+            }
+            finally
+            {
+                ReleaseMem(pbSource);
+                ReleaseMem(pbDecoded);
+                ReleaseStr(sczHex);
+                ReleaseStr(sczExpected);
+                ReleaseStr(sczBase85);
+                DutilUninitialize();
+            }
+        }
+
     private:
         void TestTrim(LPCWSTR wzInput, LPCWSTR wzExpectedResult)
         {
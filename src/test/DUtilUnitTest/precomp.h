@@ -18,6 +18,8 @@
 #include <fileutil.h>
 #include <guidutil.h>
 #include <iniutil.h>
+#include <jsonutil.h>
+#include <logutil.h>
 #include <memutil.h>
 #include <pathutil.h>
 #include <strutil.h>